@@ -0,0 +1,156 @@
+/*
+ * codec.c
+ *
+ * Version 2 stream compression shared by the server and the client.
+ * See codec.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "codec.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+void codec_init(struct codec *c, int deflating, struct codec_stats *stats)
+{
+    memset(c, 0, sizeof(*c));
+    c->deflating = deflating;
+    c->backoff   = CODEC_BACKOFF_MIN;
+    c->stats     = stats;
+}
+
+void codec_end(struct codec *c)
+{
+    if (c->ready) {
+        if (c->deflating)
+            deflateEnd(&c->z);
+        else
+            inflateEnd(&c->z);
+    }
+    free(c->buf);
+    c->buf   = NULL;
+    c->ready = 0;
+}
+
+/*
+ * setup:
+ *   zlib's state and the output buffer, the first time they are needed.
+ */
+static int setup(struct codec *c)
+{
+    int rc;
+
+    if (c->ready)
+        return 0;
+    c->buf = malloc(CODEC_BUF);
+    if (c->buf == NULL)
+        return -1;
+
+    memset(&c->z, 0, sizeof(c->z));
+    if (c->deflating)
+        rc = deflateInit2(&c->z, CODEC_LEVEL, Z_DEFLATED, -CODEC_WINDOW_BITS,
+                          CODEC_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    else
+        rc = inflateInit2(&c->z, -CODEC_WINDOW_BITS);
+    if (rc != Z_OK) {
+        free(c->buf);
+        c->buf = NULL;
+        return -1;
+    }
+    c->ready = 1;
+    return 0;
+}
+
+ssize_t codec_compress(struct codec *c, const void *data, size_t len)
+{
+    unsigned long start;
+    size_t out;
+
+    if (len < CODEC_MIN || len > CODEC_IN_MAX || c->skip > 0) {
+        if (c->skip > 0)
+            c->skip--;
+        c->stats->bypassed += len;
+        return 0;
+    }
+    if (setup(c) < 0)
+        return -1;
+
+    start = now_ns();
+    c->z.next_in   = (unsigned char *)data;
+    c->z.avail_in  = (unsigned)len;
+    c->z.next_out  = c->buf;
+    c->z.avail_out = CODEC_BUF;
+    /* A full buffer would mean output left behind: CODEC_BUF is meant
+     * to hold the worst case */
+    if (deflate(&c->z, Z_SYNC_FLUSH) != Z_OK || c->z.avail_in != 0 || c->z.avail_out == 0)
+        return -1;
+    out = CODEC_BUF - c->z.avail_out;
+    c->stats->ns  += now_ns() - start;
+    c->stats->in  += len;
+    c->stats->out += out;
+
+    /* Already in the stream, so sent compressed anyway; the next few
+     * are not tried */
+    if (out > len - len / CODEC_POOR) {
+        c->skip    = c->backoff;
+        c->backoff = c->backoff * 2 > CODEC_BACKOFF_MAX ? CODEC_BACKOFF_MAX : c->backoff * 2;
+    } else {
+        c->backoff = CODEC_BACKOFF_MIN;
+    }
+    return (ssize_t)out;
+}
+
+int codec_feed(struct codec *c, const void *data, size_t len)
+{
+    if (setup(c) < 0)
+        return -1;
+    c->z.next_in  = (unsigned char *)data;
+    c->z.avail_in = (unsigned)len;
+    return 0;
+}
+
+ssize_t codec_inflate(struct codec *c)
+{
+    unsigned long start;
+    unsigned before;
+    size_t out;
+    int rc;
+
+    if (!codec_pending(c))
+        return 0;
+
+    start = now_ns();
+    do {
+        before = c->z.avail_in;
+        c->z.next_out  = c->buf;
+        c->z.avail_out = CODEC_BUF;
+        rc = inflate(&c->z, Z_SYNC_FLUSH);
+        /* Z_BUF_ERROR: nothing more to do with what was fed */
+        if (rc != Z_OK && rc != Z_BUF_ERROR)
+            return -1;
+        out = CODEC_BUF - c->z.avail_out;
+        c->more = c->z.avail_out == 0;
+        c->stats->in  += before - c->z.avail_in;
+        c->stats->out += out;
+    } while (out == 0 && c->z.avail_in > 0 && c->z.avail_in < before);
+    c->stats->ns += now_ns() - start;
+
+    if (out == 0 && c->z.avail_in > 0)
+        return -1;      /* stuck: not a deflate stream */
+    return (ssize_t)out;
+}
+
+int codec_pending(const struct codec *c)
+{
+    return c->more || (c->ready && c->z.avail_in > 0);
+}
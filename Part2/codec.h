@@ -0,0 +1,86 @@
+/*
+ * codec.h
+ *
+ * Stream compression for version 2 of the ICT374 Remote Shell
+ * protocol (Part 2), shared by the server and the client, on zlib's
+ * raw deflate.
+ *
+ * Each direction that was negotiated (COMPRESS, see protocol.h) is
+ * one deflate stream. Every stream frame's payload is compressed on
+ * its own and ends in a sync flush, so the receiver can decompress
+ * all of it as soon as the frame arrives: output is never held back
+ * waiting for more. Frames that would not shrink are sent as they
+ * are (the FRAME_DEFLATE flag clear) and do not enter the stream:
+ *   - frames shorter than CODEC_MIN, such as echoed keystrokes;
+ *   - after a frame compressed poorly, the next few, backing off
+ *     further while the data stays incompressible.
+ *
+ * Memory is bounded: CODEC_WINDOW_BITS and CODEC_MEM_LEVEL keep a
+ * compressor at about 64 KB and a decompressor at about 15 KB, plus
+ * CODEC_BUF of output each. Nothing is allocated until the direction
+ * carries its first frame.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#define CODEC_LEVEL        1        /* fastest: the link, not the CPU, is slow */
+#define CODEC_WINDOW_BITS  13       /* 8 KB window, raw deflate */
+#define CODEC_MEM_LEVEL    6
+#define CODEC_IN_MAX       16384    /* most bytes compressed as one frame */
+#define CODEC_BUF          (CODEC_IN_MAX + CODEC_IN_MAX / 8 + 64)  /* room for the worst case */
+#define CODEC_MIN          64       /* shorter frames are sent as they are */
+#define CODEC_POOR         8        /* saving less than 1/8 is poor */
+#define CODEC_BACKOFF_MIN  4        /* frames sent as they are after a poor one */
+#define CODEC_BACKOFF_MAX  256
+
+/* What a codec did, in bytes and time spent */
+struct codec_stats {
+    unsigned long in;           /* bytes given to the codec */
+    unsigned long out;          /* bytes it made of them */
+    unsigned long bypassed;     /* bytes sent uncompressed instead */
+    unsigned long ns;           /* time spent in zlib */
+};
+
+struct codec {
+    z_stream z;
+    int      ready;             /* z is set up */
+    int      deflating;         /* compresses, or decompresses */
+    unsigned char *buf;         /* CODEC_BUF bytes of output */
+    int      more;              /* decompressing: buf filled up, more may follow */
+    unsigned skip;              /* compressing: frames still to send as they are */
+    unsigned backoff;           /* frames to skip after the next poor one */
+    struct codec_stats *stats;
+};
+
+/*
+ * Prepare c to compress (deflating) or decompress, counting in stats.
+ * zlib's state is set up when first needed.
+ */
+void codec_init(struct codec *c, int deflating, struct codec_stats *stats);
+void codec_end(struct codec *c);
+
+/*
+ * Compress a frame's payload of len bytes (at most CODEC_IN_MAX) into
+ * c->buf. Returns the compressed length, 0 if the frame should be
+ * sent as it is, or -1 if zlib failed.
+ */
+ssize_t codec_compress(struct codec *c, const void *data, size_t len);
+
+/*
+ * Decompress: codec_feed() hands over a piece of a compressed payload,
+ * which must stay in place until codec_inflate() has used it up.
+ * codec_inflate() then makes the next output into c->buf and returns
+ * its length, 0 once the piece is used up, or -1 for corrupt data.
+ */
+int     codec_feed(struct codec *c, const void *data, size_t len);
+ssize_t codec_inflate(struct codec *c);
+
+/* Whether codec_inflate() has more to give from the piece fed */
+int     codec_pending(const struct codec *c);
+
+#endif /* CODEC_H */
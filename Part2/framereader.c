@@ -0,0 +1,113 @@
+/*
+ * framereader.c
+ *
+ * Version 2 frame reader shared by the server and the client.
+ * See framereader.h.
+ */
+
+#include "framereader.h"
+
+#include <string.h>
+
+void frame_reader_init(struct frame_reader *fr)
+{
+    fr->have = 0;
+    fr->type  = 0;
+    fr->flags = 0;
+    fr->left  = 0;
+}
+
+/*
+ * gather:
+ *   Copy from buf into fr->part until it holds want bytes. Returns
+ *   whether it does.
+ */
+static int gather(struct frame_reader *fr, const unsigned char *buf, size_t *pos, size_t len,
+                  size_t want)
+{
+    size_t n = want - fr->have;
+
+    if (n > len - *pos)
+        n = len - *pos;
+    if (n == 0)
+        return fr->have == want;
+    memcpy(fr->part + fr->have, buf + *pos, n);
+    fr->have += n;
+    *pos     += n;
+    return fr->have == want;
+}
+
+int frame_reader_next(struct frame_reader *fr, const void *buf, size_t *pos, size_t len,
+                      struct frame *f)
+{
+    const unsigned char *in = buf;
+    const unsigned char *h;
+    size_t length;
+    int type, flags;
+
+    for (;;) {
+        if (fr->left > 0) {
+            /* Payload of a stream frame, as far as buf goes */
+            size_t n = len - *pos;
+
+            if (n == 0)
+                return 0;
+            if (n > fr->left)
+                n = fr->left;
+            f->type  = fr->type;
+            f->flags = fr->flags;
+            f->data  = in + *pos;
+            f->len  = n;
+            fr->left -= n;
+            *pos     += n;
+            return 1;
+        }
+
+        /* The header, in place unless a read split it */
+        if (fr->have == 0 && len - *pos >= FRAME_HEADER) {
+            h = in + *pos;
+        } else {
+            if (fr->have < FRAME_HEADER && !gather(fr, in, pos, len, FRAME_HEADER))
+                return 0;
+            h = fr->part;
+        }
+        type   = frame_type(h);
+        flags  = frame_flags(h);
+        length = frame_length(h);
+
+        if (frame_is_small(type)) {
+            if (length > FRAME_SMALL_MAX)
+                return -1;
+            f->type  = type;
+            f->flags = flags;
+            f->len   = length;
+            if (h != fr->part && len - *pos >= FRAME_HEADER + length) {
+                f->data = h + FRAME_HEADER;
+                *pos += FRAME_HEADER + length;
+                return 1;
+            }
+            /* Split by a read: gather header and payload */
+            if (!gather(fr, in, pos, len, FRAME_HEADER + length))
+                return 0;
+            f->data  = fr->part + FRAME_HEADER;
+            fr->have = 0;
+            return 1;
+        }
+
+        /* A stream frame: its payload follows in pieces */
+        if (h == fr->part)
+            fr->have = 0;
+        else
+            *pos += FRAME_HEADER;
+        if (length == 0) {
+            f->type  = type;
+            f->flags = flags;
+            f->data  = h + FRAME_HEADER;
+            f->len   = 0;
+            return 1;
+        }
+        fr->type  = type;
+        fr->flags = flags;
+        fr->left  = length;
+    }
+}
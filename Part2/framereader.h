@@ -0,0 +1,51 @@
+/*
+ * framereader.h
+ *
+ * Frame reader for version 2 of the ICT374 Remote Shell protocol
+ * (Part 2), shared by the server and the client. See protocol.h for
+ * the frame format.
+ *
+ * The caller reads into a buffer of its own, of any size, and the
+ * reader walks the frames in it without copying them: the payload of
+ * a stdin, stdout or stderr frame is handed out in pieces, as much as
+ * the buffer holds at a time, each pointing into the buffer. Only
+ * what a read splits is gathered in the reader: a header, or a small
+ * frame (EXIT, WINSIZE, CONTROL), which is always handed out whole.
+ */
+
+#ifndef FRAMEREADER_H
+#define FRAMEREADER_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+struct frame_reader {
+    unsigned char part[FRAME_HEADER + FRAME_SMALL_MAX];
+    size_t have;                    /* bytes gathered in part */
+    int    type;                    /* frame whose payload is coming */
+    int    flags;                   /* and its flags */
+    size_t left;                    /* bytes of it still to come */
+};
+
+/* A frame, or a piece of a stream frame's payload */
+struct frame {
+    int type;
+    int flags;                      /* FRAME_DEFLATE: data is compressed */
+    const unsigned char *data;      /* in the caller's buffer, or the reader's */
+    size_t len;
+};
+
+void frame_reader_init(struct frame_reader *fr);
+
+/*
+ * The next frame or piece in buf[*pos, len), advancing *pos past it.
+ * An empty stream frame comes as one piece of length 0; other pieces
+ * are never empty. Returns 1 with *f set, 0 when the rest of buf has
+ * been taken in without completing one, or -1 for a small frame
+ * longer than FRAME_SMALL_MAX.
+ */
+int frame_reader_next(struct frame_reader *fr, const void *buf, size_t *pos, size_t len,
+                      struct frame *f);
+
+#endif /* FRAMEREADER_H */
@@ -0,0 +1,130 @@
+/*
+ * linereader.c
+ *
+ * Buffered line reader shared by the server and the client.
+ * See linereader.h.
+ */
+
+#include "linereader.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+void line_reader_init(struct line_reader *lr, int fd)
+{
+    lr->fd    = fd;
+    lr->start = 0;
+    lr->end   = 0;
+}
+
+char *line_reader_space(struct line_reader *lr, size_t *room)
+{
+    /* Keep the unread bytes at the front, so a line always fits */
+    if (lr->start > 0) {
+        memmove(lr->buf, lr->buf + lr->start, lr->end - lr->start);
+        lr->end  -= lr->start;
+        lr->start = 0;
+    }
+    *room = sizeof(lr->buf) - lr->end;
+    return lr->buf + lr->end;
+}
+
+void line_reader_added(struct line_reader *lr, size_t n)
+{
+    lr->end += n;
+}
+
+ssize_t line_reader_fill(struct line_reader *lr)
+{
+    size_t room;
+    char *space = line_reader_space(lr, &room);
+    ssize_t n;
+
+    if (room == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    do {
+        n = read(lr->fd, space, room);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+        line_reader_added(lr, (size_t)n);
+    return n;
+}
+
+char *line_reader_next(struct line_reader *lr, size_t *len)
+{
+    char *line = lr->buf + lr->start;
+    char *nl = memchr(line, '\n', lr->end - lr->start);
+
+    if (nl == NULL)
+        return NULL;
+
+    *nl = '\0';
+    lr->start += (size_t)(nl - line) + 1;
+    if (len != NULL)
+        *len = (size_t)(nl - line);
+    return line;
+}
+
+int line_reader_full(const struct line_reader *lr)
+{
+    return lr->end - lr->start == sizeof(lr->buf) &&
+           memchr(lr->buf + lr->start, '\n', lr->end - lr->start) == NULL;
+}
+
+ssize_t line_reader_read_line(struct line_reader *lr, char *buf, size_t maxlen)
+{
+    size_t n;
+
+    for (;;) {
+        size_t avail = lr->end - lr->start;
+        char *nl = memchr(lr->buf + lr->start, '\n', avail);
+        ssize_t rc;
+
+        /* A whole line, or as much as buf or the buffer holds */
+        if (nl != NULL) {
+            n = (size_t)(nl - (lr->buf + lr->start)) + 1;
+            break;
+        }
+        if (avail >= maxlen - 1 || avail == sizeof(lr->buf)) {
+            n = avail;
+            break;
+        }
+
+        rc = line_reader_fill(lr);
+        if (rc < 0)
+            return -1;
+        if (rc == 0) {
+            /* EOF: whatever is left */
+            n = avail;
+            break;
+        }
+    }
+
+    if (n > maxlen - 1)
+        n = maxlen - 1;
+    memcpy(buf, lr->buf + lr->start, n);
+    buf[n] = '\0';
+    lr->start += n;
+    return (ssize_t)n;
+}
+
+size_t line_reader_pending(const struct line_reader *lr)
+{
+    return lr->end - lr->start;
+}
+
+size_t line_reader_take(struct line_reader *lr, void *dst, size_t max)
+{
+    size_t n = lr->end - lr->start;
+
+    if (n > max)
+        n = max;
+    memcpy(dst, lr->buf + lr->start, n);
+    lr->start += n;
+    return n;
+}
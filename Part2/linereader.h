@@ -0,0 +1,86 @@
+/*
+ * linereader.h
+ *
+ * Buffered line reader for the ICT374 Remote Shell (Part 2),
+ * shared by the server and the client.
+ *
+ * The protocol starts with a few text lines (greeting, USER, PASS,
+ * AUTH-OK ...) and then turns into a raw byte stream. Reading those
+ * lines one byte per read() costs a system call per byte; reading
+ * them in chunks is cheaper but may pull in bytes that come after
+ * the last line. The reader keeps such bytes, so whoever takes over
+ * the stream (the session relay) can pass them on instead of losing
+ * them.
+ *
+ * Lines are found with memchr() and handed out in place, without
+ * copying.
+ */
+
+#ifndef LINEREADER_H
+#define LINEREADER_H
+
+#include <sys/types.h>
+
+#define LINE_READER_SIZE 4096       /* longest line, and largest chunk read */
+
+struct line_reader {
+    int    fd;
+    size_t start;                   /* first byte not yet handed out */
+    size_t end;                     /* one past the last byte read */
+    char   buf[LINE_READER_SIZE];
+};
+
+/*
+ * Start reading from fd, with nothing buffered.
+ */
+void line_reader_init(struct line_reader *lr, int fd);
+
+/*
+ * One read() into the free space, after moving what is left to the
+ * front. Returns the bytes read, 0 at end of file, or -1 with errno
+ * set (EAGAIN on a non-blocking fd with nothing to read, ENOBUFS if
+ * the buffer is full).
+ */
+ssize_t line_reader_fill(struct line_reader *lr);
+
+/*
+ * For callers that read on their own (the server's io_uring loop):
+ * the free space, after moving what is left to the front, with its
+ * size in *room (0 if the buffer is full). Report the bytes stored
+ * there with line_reader_added().
+ */
+char *line_reader_space(struct line_reader *lr, size_t *room);
+void  line_reader_added(struct line_reader *lr, size_t n);
+
+/*
+ * The next complete line in the buffer, with its '\n' replaced by
+ * '\0', or NULL if there is none yet. The line stays valid until the
+ * next line_reader_fill(). If len is not NULL it gets the length.
+ */
+char *line_reader_next(struct line_reader *lr, size_t *len);
+
+/*
+ * Whether the buffer is full without a complete line in it.
+ */
+int line_reader_full(const struct line_reader *lr);
+
+/*
+ * Blocking read of one line into buf, like a read_line() that
+ * reads in chunks: up to maxlen-1 bytes or until '\n' (inclusive),
+ * NUL-terminated. Returns bytes stored (excluding '\0'), 0 on EOF,
+ * or -1 on error.
+ */
+ssize_t line_reader_read_line(struct line_reader *lr, char *buf, size_t maxlen);
+
+/*
+ * Bytes buffered but not handed out as lines.
+ */
+size_t line_reader_pending(const struct line_reader *lr);
+
+/*
+ * Move up to max of the bytes not handed out as lines to dst.
+ * Returns how many were moved.
+ */
+size_t line_reader_take(struct line_reader *lr, void *dst, size_t max);
+
+#endif /* LINEREADER_H */
@@ -19,7 +19,11 @@
  *  Protocol Messages
  * ============================ */
 
-/* Greeting */
+/*
+ * Greeting, unchanged since 1.0 so that version 1 clients, which
+ * compare it exactly, still accept it. Version 2 is the client's to
+ * ask for (VERSION, below).
+ */
 #define PROTO_WELCOME        "RSH-WELCOME 1.0\n"
 
 /* Server requests login */
@@ -52,6 +56,11 @@
  */
 #define IS_GOODBYE(line)     (strncmp((line), PROTO_GOODBYE, strlen(PROTO_GOODBYE)) == 0)
 
+/*
+ * Check if the line accepts VERSION 2
+ */
+#define IS_VERSION_OK_2(line) (strcmp((line), PROTO_VERSION_OK " 2\n") == 0)
+
 /* ============================
  *  Client → Server Commands
  * ============================ */
@@ -63,10 +72,119 @@
 #define PROTO_CMD_USER       "USER"
 #define PROTO_CMD_PASS       "PASS"
 
+/*
+ * VERSION 2\n, optional, before USER: frames after AUTH-OK. The server
+ * answers VERSION-OK 2 at once. A version 1 server takes it for a bad
+ * USER line and refuses the login (AUTH-FAIL PROTOCOL-ERROR), so a
+ * client can tell the two apart and log in again without it.
+ */
+#define PROTO_CMD_VERSION    "VERSION"
+#define PROTO_VERSION_OK     "VERSION-OK"
+#define PARSE_VERSION(line, v)     (sscanf((line), "VERSION %d", &(v)) == 1)
+
+/*
+ * COMPRESS <directions>\n, optional, after VERSION 2: the directions
+ * whose stream frames may be compressed (see FRAME_DEFLATE and
+ * codec.h): "out" for the shell's output, "in" for its input, or
+ * "both". Refused with BAD-COMPRESS outside version 2.
+ */
+#define PROTO_CMD_COMPRESS   "COMPRESS"
+#define PARSE_COMPRESS(line, dirbuf)   (sscanf((line), "COMPRESS %7s", (dirbuf)) == 1)
+#define COMPRESS_IN          1
+#define COMPRESS_OUT         2
+
+/*
+ * EXEC\n, optional, after VERSION 2: batch mode. The client's stdin
+ * frames are a script, which the shell runs once they have all come
+ * (an empty stdin frame ends them), with no prompt or line editor.
+ * Refused with BAD-EXEC outside version 2.
+ */
+#define PROTO_CMD_EXEC       "EXEC"
+#define IS_EXEC(line)        (strncmp((line), PROTO_CMD_EXEC, 4) == 0 && \
+                              ((line)[4] == '\n' || (line)[4] == '\r' || (line)[4] == '\0'))
+
 /* Helpers: parse "USER <name>" or "PASS <pw>" */
 #define PARSE_USER(line, userbuf)  (sscanf((line), "USER %127s",  (userbuf)) == 1)
 #define PARSE_PASS(line, passbuf)  (sscanf((line), "PASS %127s",  (passbuf)) == 1)
 
+/* ============================
+ *  Server → pooled shell handshake
+ * ============================ */
+
+/*
+ * The server starts warm shells before anyone logs in, with
+ * SHELL_HANDSHAKE_ENV set. Such a shell waits on its stdin for
+ *   RSH-ENV <name>=<value>\n   (any number, exported)
+ *   RSH-START\n
+ * before it starts reading commands; end of file means it is not
+ * needed and should exit. See main.c in Part 1.
+ */
+#define SHELL_HANDSHAKE_ENV   "RSH_HANDSHAKE"
+#define SHELL_HANDSHAKE_NAME  "myshell"  /* the shell known to speak it */
+#define SHELL_HANDSHAKE_SET   "RSH-ENV"
+#define SHELL_HANDSHAKE_START "RSH-START"
+
+/*
+ * Warm shells are started with stderr on a pipe of its own, for
+ * version 2 sessions. For a version 1 session the server also sends
+ *   RSH-MERGE-STDERR\n
+ * and the shell sends its stderr to stdout, as a cold-started shell's is.
+ */
+#define SHELL_HANDSHAKE_MERGE "RSH-MERGE-STDERR"
+
+/*
+ * For an EXEC session the server also sends
+ *   RSH-SCRIPT\n
+ * and the shell runs the rest of its stdin as a script. A shell
+ * started cold is given SHELL_SCRIPT_ARG, as a script to run, instead.
+ */
+#define SHELL_HANDSHAKE_SCRIPT "RSH-SCRIPT"
+#define SHELL_SCRIPT_ARG      "/dev/stdin"
+
+/* ============================
+ *  Version 2: frames
+ * ============================ */
+
+/*
+ * After AUTH-OK a version 2 session carries frames both ways instead
+ * of a raw byte stream. Each frame is a fixed header
+ *   byte 0     type (FRAME_*)
+ *   byte 1     flags: FRAME_DEFLATE, or 0
+ *   bytes 2-3  payload length, big-endian
+ * followed by the payload. Headers are read in place (frame_type,
+ * frame_length), never copied into a struct.
+ *
+ *   FRAME_STDIN    client -> server: input for the shell; an empty
+ *                  one closes the shell's stdin
+ *   FRAME_STDOUT   server -> client: the shell's stdout
+ *   FRAME_STDERR   server -> client: the shell's stderr
+ *   FRAME_EXIT     server -> client, last: the shell's exit status,
+ *                  4 bytes big-endian (128 + signal if it was killed)
+ *   FRAME_WINSIZE  client -> server: rows and columns, 2 bytes each
+ *   FRAME_CONTROL  client -> server: a CONTROL_* code and its argument
+ *
+ * A receiver skips frames of a type it does not know. The EXIT,
+ * WINSIZE and CONTROL payloads are at most FRAME_SMALL_MAX bytes.
+ *
+ * FRAME_DEFLATE marks a stdin, stdout or stderr payload compressed in
+ * its direction's deflate stream; only directions that COMPRESS asked
+ * for carry such frames.
+ */
+#define FRAME_HEADER         4
+#define FRAME_MAX            65535      /* longest payload */
+#define FRAME_SMALL_MAX      64
+
+#define FRAME_STDIN          1
+#define FRAME_STDOUT         2
+#define FRAME_STDERR         3
+#define FRAME_EXIT           4
+#define FRAME_WINSIZE        5
+#define FRAME_CONTROL        6
+
+#define CONTROL_SIGNAL       1          /* 1 byte: signal for the shell */
+
+#define FRAME_DEFLATE        0x01
+
 /* ============================
  *  Inline helpers (optional)
  * ============================ */
@@ -85,4 +203,62 @@ static inline int proto_send_line(int fd, const char *line)
     return (write(fd, line, len) == (ssize_t)len) ? 0 : -1;
 }
 
+/*
+ * Frame header fields, read from and written to the bytes in place.
+ */
+static inline int frame_type(const unsigned char *h)
+{
+    return h[0];
+}
+
+static inline size_t frame_length(const unsigned char *h)
+{
+    return ((size_t)h[2] << 8) | h[3];
+}
+
+static inline int frame_flags(const unsigned char *h)
+{
+    return h[1];
+}
+
+static inline void frame_header(unsigned char *h, int type, int flags, size_t len)
+{
+    h[0] = (unsigned char)type;
+    h[1] = (unsigned char)flags;
+    h[2] = (unsigned char)(len >> 8);
+    h[3] = (unsigned char)len;
+}
+
+/* Whether a frame of this type is handed over whole (frame_reader) */
+static inline int frame_is_small(int type)
+{
+    return type == FRAME_EXIT || type == FRAME_WINSIZE || type == FRAME_CONTROL;
+}
+
+/* 4-byte and 2-byte big-endian payload fields */
+static inline unsigned long frame_get32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+           ((unsigned long)p[2] << 8) | p[3];
+}
+
+static inline void frame_put32(unsigned char *p, unsigned long v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static inline unsigned frame_get16(const unsigned char *p)
+{
+    return ((unsigned)p[0] << 8) | p[1];
+}
+
+static inline void frame_put16(unsigned char *p, unsigned v)
+{
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
 #endif  /* PROTOCOL_H */
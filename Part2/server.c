@@ -9,6 +9,7 @@
  *       RSH-WELCOME 1.0
  *       LOGIN-REQUIRED
  *     Client must send:
+ *       VERSION 2\n       (optional; answered with VERSION-OK 2)
  *       USER <username>\n
  *       PASS <password>\n
  *   - Authentication using auth.c (in-memory user database),
@@ -17,37 +18,86 @@
  *       AUTH-OK <username>
  *     Then the server starts a shell process and relays I/O
  *     between the client and the shell (like a minimal telnet).
- *   - Handles multiple clients concurrently using fork().
+ *   - Handles all clients concurrently in event loops (epoll):
+ *     logins and relaying are per-session state machines on
+ *     non-blocking descriptors, and only the shells are forked.
+ *   - Runs one event loop per worker process, each pinned to a CPU
+ *     with its own SO_REUSEPORT listener; a supervisor restarts
+ *     workers that die and prints their statistics on SIGUSR1.
+ *   - Keeps a pool of warm shells per worker, already started and
+ *     waiting for a login, so a session does not wait for exec.
+ *   - Relays with splice(), socket <-> pipe inside the kernel, and
+ *     copies through buffers only where splice cannot be used.
+ *   - Optionally runs each worker on io_uring instead of epoll:
+ *     multishot accept, reads into kernel-chosen provided buffers,
+ *     and each write linked to the next read. Falls back to epoll
+ *     when the kernel lacks support.
+ *   - Sends interactive output at once (TCP_NODELAY) and corks the
+ *     socket while a session's output is bulk, so it goes out in full
+ *     segments.
+ *   - Protocol version 2, for clients that ask for it: typed frames
+ *     (framereader.h) carry stdin, stdout and stderr separately, the
+ *     window size and control messages, and end with the shell's
+ *     exit status. Version 1 clients get the byte stream as before.
+ *   - Compresses version 2 frames in the directions the client asks
+ *     for (codec.h), frame by frame so nothing waits, and skipping
+ *     data that does not compress.
+ *   - Batch mode (EXEC) for version 2 clients: the shell runs what the
+ *     client sends as a script, without its prompt and line editor.
  *
  * Usage:
- *   ./server [-p port] [-s shell_path]
+ *   ./server [-p port] [-s shell_path] [-w workers] [-b backlog]
+ *            [-P pool_size] [-L low_water] [-r splice|copy] [-S pipe_size]
+ *            [-E epoll|uring] [-O adaptive|nodelay|nagle]
  *
  *   -p port       Listening TCP port (default: 50000 – change to your assigned port)
  *   -s shell_path Path to shell executable (default: /bin/bash or your Part 1 shell)
+ *   -w workers    Worker processes (default: one per CPU)
+ *   -b backlog    Listen queue of each worker (default: 1024)
+ *   -P pool_size  Warm shells per worker (default: 4 for myshell, which
+ *                 speaks the pool handshake; 0, none, for any other
+ *                 shell, such as /bin/bash, which cannot be pooled)
+ *   -L low_water  Refill the pool when this few are idle (default: half)
+ *   -r relay      splice (default) or copy
+ *   -S pipe_size  Bytes in each shell's output pipe (default: 256 KB)
+ *   -E loop       epoll (default) or uring
+ *   -O output     adaptive (default), nodelay or nagle
  *
  * For final submission, you will typically run:
  *   ./server -p <your_assigned_port> -s ../Part1/myshell
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE     /* accept4, pipe2, sched_setaffinity, splice */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sched.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/tcp.h>  /* TCP_INFO with tcpi_data_segs_out */
 #include <signal.h>
+#include <time.h>
 
 #include "auth.h"
+#include "codec.h"
+#include "framereader.h"
+#include "linereader.h"
 #include "protocol.h"
+#include "uring.h"
 
 /* ====== Configuration defaults ====== */
 
@@ -57,53 +107,369 @@
 /* Default shell path: for development/testing. For final, use Part 1 shell. */
 #define DEFAULT_SHELL  "./myshell"
 
-#define BACKLOG        10           /* listen queue size */
-#define MAX_LINE       1024         /* maximum length of protocol line */
+#define DEFAULT_BACKLOG 1024        /* listen queue of each worker */
+#define MAX_WORKERS    256
+#define DEFAULT_POOL   4            /* warm shells per worker */
+#define POOL_SPAWN_STEP 2           /* shells started per loop turn */
+#define POOL_IDLE_MS   5            /* quiet time before refilling */
+#define DEFAULT_PIPE_SIZE (256 * 1024)  /* shell output pipe */
+#define SPLICE_CHUNK   (1024 * 1024)    /* most bytes asked of one splice */
+#define RELAY_BUF      16384        /* bytes in flight per direction, at
+                                       least LINE_READER_SIZE */
+#define MAX_EVENTS     256          /* events handled per epoll_wait */
+#define URING_ENTRIES  4096         /* submission ring of each io_uring worker */
+#define URING_BUFFERS  2048         /* provided read buffers, RELAY_BUF each */
+#define BULK_OUTPUT    4096         /* a read of shell output this big is bulk */
+#define CORK_FLUSH_MS  1            /* quiet time before corked output is sent */
+#define SHELL_BUCKETS  1024         /* hash of version 2 sessions by shell pid */
+
+/* ====== Session state ====== */
+
+/*
+ * A session moves through these states:
+ *
+ *   SESSION_USER   waiting for the USER line
+ *   SESSION_PASS   waiting for the PASS line
+ *   SESSION_RELAY  shell running, bytes relayed both ways
+ *
+ * Every descriptor the loop watches is an endpoint, and epoll hands
+ * back a pointer to it, so each event leads straight to its session.
+ * The io_uring loop tags its requests with the endpoint the same way.
+ */
+enum session_state {
+    SESSION_USER,
+    SESSION_PASS,
+    SESSION_RELAY
+};
+
+struct session;
+
+struct endpoint {
+    struct session *session;
+    int fd;                     /* -1 once closed */
+    uint32_t events;            /* events registered, 0 = not in epoll */
+    struct endpoint *next_starved;  /* io_uring: waiting for a free buffer */
+};
+
+/*
+ * One direction of a session. Data is spliced from the source to the
+ * destination inside the kernel; when the destination is full it
+ * stays in the source (blocked). Where splice() cannot be used it is
+ * copied through buf, and what the destination did not take waits
+ * there. Either way the source is only read again once nothing
+ * waits, so a slow reader on one side holds back its writer and
+ * nothing else.
+ *
+ * The io_uring loop always copies, and buf is the provided buffer the
+ * kernel read into (held) until the write of it completes.
+ *
+ * Version 2 sessions always copy. Output goes out as a frame: head is
+ * its header, written together with buf by one writev(). Input is
+ * read in frames, buf[scan, fill) not yet walked, and each piece of
+ * stdin in it becomes buf[start, end) in turn. With compression,
+ * start and end index the codec's output (out) instead.
+ */
+struct relay {
+    char   *buf;                /* RELAY_BUF bytes, only when copying */
+    size_t  start;              /* first byte not yet written */
+    size_t  end;                /* one past the last byte read */
+    int     blocked;            /* spliced data waits in the source */
+    int     copy;               /* copy through buf instead of splicing */
+    int     held;               /* buf is provided buffer bid (io_uring) */
+    unsigned short bid;
+    int     writing;            /* io_uring: buf is being written */
+    char   *out;                /* a codec's output, to write instead of buf */
+    size_t  took;               /* bytes the last splice or read moved */
+    unsigned char head[FRAME_HEADER + 4];   /* a frame header, or a whole EXIT frame */
+    size_t  head_sent;          /* first byte of head not yet written */
+    size_t  head_len;
+    size_t  scan;               /* framed input: first byte not yet walked */
+    size_t  fill;               /* framed input: one past the last byte read */
+    struct iovec iov[2];        /* io_uring: head and buf, being written */
+    unsigned long *spliced;     /* byte counters in the worker's stats */
+    unsigned long *copied;
+};
+
+enum relay_result {
+    RELAY_MOVED,                /* data went on, or some waits */
+    RELAY_IDLE,                 /* nothing to move */
+    RELAY_EOF,                  /* the source is finished */
+    RELAY_ERROR                 /* a side failed, see errno */
+};
+
+struct session {
+    enum session_state state;
+    struct endpoint client;     /* the client's socket */
+    struct endpoint shell_in;   /* write end of the shell's stdin */
+    struct endpoint shell_out;  /* read end of the shell's stdout, and stderr in v1 */
+    struct endpoint shell_err;  /* read end of the shell's stderr, v2 only */
+    pid_t  shell_pid;
+
+    char   addr[INET_ADDRSTRLEN + 8];   /* "a.b.c.d:port", for messages */
+    char   username[128];
+
+    /* Login lines, and whatever the client sends right after them */
+    struct line_reader login;
+
+    struct relay to_shell;      /* client -> shell stdin */
+    struct relay to_client;     /* shell stdout -> client */
+    struct relay err_to_client; /* shell stderr -> client, v2 */
+
+    /* Protocol version 2: frames both ways, and the exit status last */
+    int    framed;
+    struct frame_reader frames; /* of the client's input */
+    struct relay *client_write; /* io_uring: the relay being written to the client */
+    unsigned rows, cols;        /* the client's window; pipes have no use for it */
+    int    watched;             /* in shell_table, waiting for the shell to exit */
+    int    exited;              /* exit_status is known */
+    int    exit_status;         /* 128 + signal if the shell was killed */
+    int    exit_sent;
+    struct session *next_shell;
+    int    compress;            /* COMPRESS_* directions asked for */
+    int    exec;                /* batch mode: stdin is a script */
+    struct codec zip;           /* of stdout and stderr */
+    struct codec unzip;         /* of stdin */
+
+    int    input_done;          /* client sent EOF, or the shell stopped reading */
+    int    closed;              /* freed once the current batch of events is done */
+    int    inflight;            /* io_uring requests not completed; freed at 0 */
+    struct session *next_closed;
+
+    /* Output policy: corked while the shell's output is bulk */
+    int    corked;
+    long long output_us;        /* when output last reached the client */
+    struct session *next_corked;
+};
+
+/* ====== Configuration & statistics ====== */
+
+struct server_config {
+    int  port;
+    char shell_path[256];
+    int  workers;               /* event loops, one process each */
+    int  backlog;               /* listen queue of each worker */
+    int  pool_size;             /* warm shells per worker, 0 = none */
+    int  pool_low;              /* refill when this few are idle */
+    int  copy_relay;            /* copy through buffers, never splice */
+    int  pipe_size;             /* of each shell's output pipe, 0 = default */
+    int  uring;                 /* event loop on io_uring instead of epoll */
+    int  output;                /* OUTPUT_* policy of client sockets */
+};
+
+/*
+ * How shell output is sent. OUTPUT_ADAPTIVE sends small writes at once
+ * and corks the socket while output comes in large reads; the others
+ * are fixed, for comparison.
+ */
+enum output_policy {
+    OUTPUT_ADAPTIVE,            /* TCP_NODELAY, TCP_CORK while bulk */
+    OUTPUT_NODELAY,             /* TCP_NODELAY only */
+    OUTPUT_NAGLE                /* the kernel's default */
+};
+
+/*
+ * Counters of one worker, in memory shared with the supervisor so it
+ * can print them all. Only the worker itself writes its slot.
+ */
+struct worker_stats {
+    pid_t         pid;
+    int           cpu;          /* pinned to, -1 if pinning failed */
+    int           uring;        /* running the io_uring loop */
+    unsigned long accepted;     /* connections accepted */
+    unsigned long logins;       /* logins that got a shell */
+    unsigned long refused;      /* logins refused */
+    unsigned long active;       /* sessions open now */
+    unsigned long pool_hits;    /* logins given a warm shell */
+    unsigned long pool_misses;  /* logins that had to start one */
+    unsigned long pool_idle;    /* warm shells waiting now */
+    unsigned long to_client_spliced;    /* bytes relayed, per path */
+    unsigned long to_client_copied;
+    unsigned long to_shell_spliced;
+    unsigned long to_shell_copied;
+    unsigned long buffer_waits; /* io_uring reads that found no free buffer */
+    unsigned long segments;     /* data segments sent to closed clients */
+    unsigned long corks;        /* times a session's output turned bulk */
+    struct codec_stats compressed;      /* output to clients */
+    struct codec_stats decompressed;    /* input from clients */
+};
+
+/* A shell started ahead of a login, with the server's ends of its pipes */
+struct idle_shell {
+    pid_t pid;
+    int   in_fd;
+    int   out_fd;
+    int   err_fd;                   /* -1 when stderr goes to out_fd */
+};
 
 /* ====== Function declarations ====== */
 
 static void usage(const char *progname);
-static void parse_args(int argc, char *argv[], int *port, char *shell_path, size_t shell_size);
-static int  create_listening_socket(int port);
+static void parse_args(int argc, char *argv[], struct server_config *config);
+static int  speaks_handshake(const char *path);
+static int  create_listening_socket(int port, int backlog);
 static void install_signal_handlers(void);
 static void sigchld_handler(int sig);
-
-static void server_loop(int listen_fd, const char *shell_path);
-static void handle_client(int client_fd, const struct sockaddr_in *client_addr, const char *shell_path);
-
-static ssize_t read_line(int fd, char *buf, size_t maxlen);
-static ssize_t writen(int fd, const void *buf, size_t n);
-
-static int start_shell_session(int client_fd, const char *shell_path, const char *username);
+static void supervisor_signal_handler(int sig);
+
+static int  default_worker_count(void);
+static int  pin_to_cpu(int index);
+static pid_t start_worker(int index, const int *listen_fds, const struct server_config *config);
+static void supervise(const int *listen_fds, const struct server_config *config);
+static void print_stats(const struct server_config *config);
+static void print_codec_stats(const char *what, int worker, const struct codec_stats *zip,
+                              const struct codec_stats *unzip);
+
+static int  pool_create(void);
+static void server_loop(int listen_fd, const struct server_config *config);
+static void accept_clients(int listen_fd);
+static struct session *session_open(int client_fd, const struct sockaddr_in *client_addr);
+static int  uring_loop(int listen_fd, const struct server_config *config);
+
+static void session_login_input(struct session *s);
+static void session_login_lines(struct session *s);
+static void session_login_line(struct session *s, char *line);
+static void session_refuse(struct session *s, const char *reason);
+static int  spawn_shell(struct idle_shell *sh, const char *username, int split_stderr, int script);
+static int  pool_wanted(void);
+static void pool_refill(void);
+static int  pool_take(struct idle_shell *sh, const char *username, int merge_stderr, int script);
+static int  start_shell_session(struct session *s, const char *username);
+static void session_client_event(struct session *s, uint32_t events);
+static void session_shell_out_event(struct session *s, struct endpoint *ep);
+static void session_shell_in_event(struct session *s);
+static void session_update_events(struct session *s);
+static void session_output_end(struct session *s);
+static void session_close(struct session *s);
+static void session_free(struct session *s);
+static void shell_watch(struct session *s);
+static void shell_unwatch(struct session *s);
+static void reap_shells(void);
+
+static int  set_nonblocking(int fd);
+static long long now_us(void);
+static void output_start(struct session *s);
+static void output_sent(struct session *s, size_t n);
+static void output_flush_idle(void);
+static int  output_timeout(int timeout);
+static void output_end(struct session *s);
+static char *relay_buffer(struct relay *r);
+static int  relay_waiting(const struct relay *r);
+
+/* ====== Event loop state ====== */
+
+static int epoll_fd = -1;
+static const struct server_config *settings;
+
+/* The io_uring loop, when it runs instead of epoll */
+static int using_uring;
+static struct uring ring;
+static struct uring_buffers buffers;
+static unsigned buffers_free;           /* lent to the kernel */
+static struct endpoint *starved;        /* reads waiting for a buffer */
+static int uring_listen_fd = -1;
+
+/* Idle shells of this worker, oldest first */
+static struct idle_shell *pool;
+static int pool_idle;
+static int pool_filling;        /* refilling up to pool_size */
+
+/* Sessions closed during the current batch of events; their endpoints
+ * may still appear later in the same batch, so freeing waits */
+static struct session *closed_sessions;
+
+/* Version 2 sessions by shell pid, until the shell's exit is reaped */
+static struct session *shell_table[SHELL_BUCKETS];
+
+/* Signals the worker takes only while it waits for events */
+static sigset_t wait_sigmask;
+
+/* The CPUs the worker could use before pin_to_cpu(); its shells get
+ * them back, so users' commands are not confined to the loop's CPU */
+static cpu_set_t shell_cpus;
+static int shell_cpus_saved;
+
+/* Sessions whose client socket is corked, and when this turn began */
+static struct session *corked_sessions;
+static long long turn_us;
+
+/* One slot per worker, and the running worker's own slot */
+static struct worker_stats *all_stats;
+static struct worker_stats *stats;
+
+/* Set by the supervisor's signal handler */
+static volatile sig_atomic_t got_sigchld;
+static volatile sig_atomic_t got_sigusr1;
+static volatile sig_atomic_t got_shutdown;
 
 /* ====== Main ====== */
 
 int main(int argc, char *argv[])
 {
-    int port = DEFAULT_PORT;
-    char shell_path[256];
-    int listen_fd;
+    struct server_config config;
+    int *listen_fds;
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    config.port    = DEFAULT_PORT;
+    config.workers = default_worker_count();
+    config.backlog = DEFAULT_BACKLOG;
+    config.pool_size = -1;      /* depends on the shell, unless given */
+    config.pool_low  = -1;      /* half the pool, unless given */
+    config.pipe_size = DEFAULT_PIPE_SIZE;
 
     /* Copy default shell path */
-    strncpy(shell_path, DEFAULT_SHELL, sizeof(shell_path) - 1);
-    shell_path[sizeof(shell_path) - 1] = '\0';
-
-    parse_args(argc, argv, &port, shell_path, sizeof(shell_path));
+    strncpy(config.shell_path, DEFAULT_SHELL, sizeof(config.shell_path) - 1);
+
+    parse_args(argc, argv, &config);
+    if (config.pool_size < 0) {
+        config.pool_size = speaks_handshake(config.shell_path) ? DEFAULT_POOL : 0;
+    } else if (config.pool_size > 0 && !speaks_handshake(config.shell_path)) {
+        fprintf(stderr, "Warning: a pool needs a shell that speaks the %s handshake; "
+                "use -P 0 for %s\n", SHELL_HANDSHAKE_NAME, config.shell_path);
+    }
+    if (config.pool_low < 0 || config.pool_low > config.pool_size)
+        config.pool_low = (config.pool_size + 1) / 2;
     install_signal_handlers();
 
-    /* Create TCP listening socket */
-    listen_fd = create_listening_socket(port);
-    if (listen_fd < 0) {
-        fprintf(stderr, "Error: failed to create listening socket\n");
+    /*
+     * One listening socket per worker, all bound to the port with
+     * SO_REUSEPORT: the kernel spreads new connections over them, so
+     * workers never contend for a shared accept queue. They are all
+     * created here so a busy port is reported before anything starts.
+     */
+    listen_fds = calloc((size_t)config.workers, sizeof(int));
+    if (listen_fds == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < config.workers; i++) {
+        listen_fds[i] = create_listening_socket(config.port, config.backlog);
+        if (listen_fds[i] < 0) {
+            fprintf(stderr, "Error: failed to create listening socket\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    all_stats = mmap(NULL, (size_t)config.workers * sizeof(struct worker_stats),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (all_stats == MAP_FAILED) {
+        perror("mmap(stats)");
         exit(EXIT_FAILURE);
     }
 
-    printf("server: listening on port %d, shell = %s\n", port, shell_path);
+    printf("server: listening on port %d, shell = %s, %d worker%s, backlog %d, pool %d, %s, output %s\n",
+           config.port, config.shell_path, config.workers,
+           config.workers == 1 ? "" : "s", config.backlog, config.pool_size,
+           config.uring ? "io_uring" : "epoll",
+           config.output == OUTPUT_ADAPTIVE ? "adaptive" :
+           config.output == OUTPUT_NODELAY ? "nodelay" : "nagle");
     fflush(stdout);
 
-    server_loop(listen_fd, shell_path);
+    for (i = 0; i < config.workers; i++) {
+        all_stats[i].pid = start_worker(i, listen_fds, &config);
+    }
 
-    close(listen_fd);
+    supervise(listen_fds, &config);
     return 0;
 }
 
@@ -112,18 +478,53 @@ int main(int argc, char *argv[])
 static void usage(const char *progname)
 {
     fprintf(stderr,
-            "Usage: %s [-p port] [-s shell_path]\n"
+            "Usage: %s [-p port] [-s shell_path] [-w workers] [-b backlog]\n"
+            "          [-P pool_size] [-L low_water] [-r splice|copy] [-S pipe_size]\n"
+            "          [-E epoll|uring] [-O adaptive|nodelay|nagle]\n"
             "  -p port       Listening TCP port (default: %d)\n"
-            "  -s shell_path Path to shell executable (default: %s)\n",
-            progname, DEFAULT_PORT, DEFAULT_SHELL);
+            "  -s shell_path Path to shell executable (default: %s)\n"
+            "  -w workers    Worker processes, each pinned to a CPU (default: one per CPU)\n"
+            "  -b backlog    Listen queue of each worker (default: %d, capped by\n"
+            "                net.core.somaxconn)\n"
+            "  -P pool_size  Warm shells kept per worker (default: %d for %s, 0 for\n"
+            "                other shells); 0 starts each shell at login. Only %s\n"
+            "                speaks the pool handshake: other shells need -P 0\n"
+            "  -L low_water  Refill the pool when this few are idle (default: half)\n"
+            "  -r relay      splice: move data in the kernel where possible (default)\n"
+            "                copy: always copy through user-space buffers\n"
+            "  -S pipe_size  Bytes in each shell's output pipe (default: %d, 0 for the\n"
+            "                system default; limited by fs.pipe-max-size)\n"
+            "  -E loop       epoll: readiness events (default)\n"
+            "                uring: io_uring completions, always copying; falls\n"
+            "                back to epoll where the kernel lacks it\n"
+            "  -O output     adaptive: send small output at once, cork bulk output\n"
+            "                into full segments (default)\n"
+            "                nodelay: send every write at once; nagle: kernel default\n"
+            "Send SIGUSR1 to print per-worker connection statistics.\n",
+            progname, DEFAULT_PORT, DEFAULT_SHELL, DEFAULT_BACKLOG, DEFAULT_POOL,
+            SHELL_HANDSHAKE_NAME, SHELL_HANDSHAKE_NAME, DEFAULT_PIPE_SIZE);
+}
+
+/*
+ * speaks_handshake:
+ *   Whether the shell at path is one that waits for the pool handshake
+ *   (protocol.h). Any other, run warm, would take the handshake lines
+ *   for commands.
+ */
+static int speaks_handshake(const char *path)
+{
+    const char *name = strrchr(path, '/');
+
+    name = name != NULL ? name + 1 : path;
+    return strcmp(name, SHELL_HANDSHAKE_NAME) == 0;
 }
 
-static void parse_args(int argc, char *argv[], int *port, char *shell_path, size_t shell_size)
+static void parse_args(int argc, char *argv[], struct server_config *config)
 {
     int opt;
 
     opterr = 0;  /* let us control error messages */
-    while ((opt = getopt(argc, argv, "p:s:h")) != -1) {
+    while ((opt = getopt(argc, argv, "p:s:w:b:P:L:r:S:E:O:h")) != -1) {
         switch (opt) {
         case 'p': {
             int p = atoi(optarg);
@@ -132,12 +533,87 @@ static void parse_args(int argc, char *argv[], int *port, char *shell_path, size
                 usage(argv[0]);
                 exit(EXIT_FAILURE);
             }
-            *port = p;
+            config->port = p;
             break;
         }
         case 's':
-            strncpy(shell_path, optarg, shell_size - 1);
-            shell_path[shell_size - 1] = '\0';
+            strncpy(config->shell_path, optarg, sizeof(config->shell_path) - 1);
+            config->shell_path[sizeof(config->shell_path) - 1] = '\0';
+            break;
+        case 'w':
+            config->workers = atoi(optarg);
+            if (config->workers <= 0 || config->workers > MAX_WORKERS) {
+                fprintf(stderr, "Invalid worker count: %s (1 to %d)\n", optarg, MAX_WORKERS);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            config->backlog = atoi(optarg);
+            if (config->backlog <= 0) {
+                fprintf(stderr, "Invalid backlog: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            config->pool_size = atoi(optarg);
+            if (config->pool_size < 0) {
+                fprintf(stderr, "Invalid pool size: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            config->pool_low = atoi(optarg);
+            if (config->pool_low < 0) {
+                fprintf(stderr, "Invalid low-water mark: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            if (strcmp(optarg, "splice") == 0) {
+                config->copy_relay = 0;
+            } else if (strcmp(optarg, "copy") == 0) {
+                config->copy_relay = 1;
+            } else {
+                fprintf(stderr, "Invalid relay: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            config->pipe_size = atoi(optarg);
+            if (config->pipe_size < 0) {
+                fprintf(stderr, "Invalid pipe size: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'E':
+            if (strcmp(optarg, "epoll") == 0) {
+                config->uring = 0;
+            } else if (strcmp(optarg, "uring") == 0) {
+                config->uring = 1;
+            } else {
+                fprintf(stderr, "Invalid event loop: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'O':
+            if (strcmp(optarg, "adaptive") == 0) {
+                config->output = OUTPUT_ADAPTIVE;
+            } else if (strcmp(optarg, "nodelay") == 0) {
+                config->output = OUTPUT_NODELAY;
+            } else if (strcmp(optarg, "nagle") == 0) {
+                config->output = OUTPUT_NAGLE;
+            } else {
+                fprintf(stderr, "Invalid output policy: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
             break;
         case 'h':
         default:
@@ -149,15 +625,33 @@ static void parse_args(int argc, char *argv[], int *port, char *shell_path, size
 
 /* ====== Signal handling ====== */
 
+/*
+ * A worker's SIGCHLD: the loop reaps the shells (reap_shells), since
+ * a version 2 session needs its shell's status.
+ */
 static void sigchld_handler(int sig)
 {
     (void)sig;  /* unused */
-    /* Reap all dead children, non-blocking */
-    while (waitpid(-1, NULL, WNOHANG) > 0) {
-        /* nothing else to do */
-    }
+    got_sigchld = 1;
+}
+
+/*
+ * The supervisor only notes signals; supervise() acts on them.
+ */
+static void supervisor_signal_handler(int sig)
+{
+    if (sig == SIGCHLD)
+        got_sigchld = 1;
+    else if (sig == SIGUSR1)
+        got_sigusr1 = 1;
+    else
+        got_shutdown = 1;
 }
 
+/*
+ * install_signal_handlers:
+ *   The supervisor's handlers. Workers replace them in start_worker().
+ */
 static void install_signal_handlers(void)
 {
     struct sigaction sa;
@@ -165,27 +659,30 @@ static void install_signal_handlers(void)
     /* Ignore SIGPIPE so writes to closed sockets don't kill the server */
     signal(SIGPIPE, SIG_IGN);
 
-    /* Handle SIGCHLD to avoid zombie processes */
     memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sigchld_handler;
+    sa.sa_handler = supervisor_signal_handler;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART;  /* restart system calls when possible */
 
-    if (sigaction(SIGCHLD, &sa, NULL) < 0) {
-        perror("sigaction(SIGCHLD)");
+    if (sigaction(SIGCHLD, &sa, NULL) < 0 ||
+        sigaction(SIGUSR1, &sa, NULL) < 0 ||
+        sigaction(SIGTERM, &sa, NULL) < 0 ||
+        sigaction(SIGINT,  &sa, NULL) < 0) {
+        perror("sigaction");
         /* not fatal, but recommended */
     }
 }
 
-/* ====== Networking: create listening socket & main loop ====== */
+/* ====== Networking: create listening socket ====== */
 
-static int create_listening_socket(int port)
+static int create_listening_socket(int port, int backlog)
 {
     int fd;
     int optval = 1;
     struct sockaddr_in addr;
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    /* Non-blocking, so accepting stops cleanly when the queue is empty */
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd < 0) {
         perror("socket");
         return -1;
@@ -196,6 +693,13 @@ static int create_listening_socket(int port)
         /* continue anyway */
     }
 
+    /* Every worker binds its own socket to the same port */
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        close(fd);
+        return -1;
+    }
+
     memset(&addr, 0, sizeof(addr));
     addr.sin_family      = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_ANY);   /* listen on all interfaces */
@@ -207,7 +711,7 @@ static int create_listening_socket(int port)
         return -1;
     }
 
-    if (listen(fd, BACKLOG) < 0) {
+    if (listen(fd, backlog) < 0) {
         perror("listen");
         close(fd);
         return -1;
@@ -216,186 +720,662 @@ static int create_listening_socket(int port)
     return fd;
 }
 
-static void server_loop(int listen_fd, const char *shell_path)
+/* ====== Workers & supervisor ====== */
+
+/*
+ * default_worker_count:
+ *   One worker per CPU this process may run on.
+ */
+static int default_worker_count(void)
 {
-    for (;;) {
-        struct sockaddr_in client_addr;
-        socklen_t addrlen = sizeof(client_addr);
-        int client_fd;
-        pid_t pid;
+    cpu_set_t set;
+    int n;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return 1;
+    n = CPU_COUNT(&set);
+    if (n < 1)
+        return 1;
+    return n > MAX_WORKERS ? MAX_WORKERS : n;
+}
 
-        client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addrlen);
-        if (client_fd < 0) {
-            if (errno == EINTR) {
-                continue; /* interrupted by signal */
-            }
-            perror("accept");
-            continue;
-        }
+/*
+ * pin_to_cpu:
+ *   Pin the calling process to the index'th CPU it is allowed on,
+ *   wrapping around when there are more workers than CPUs.
+ *   Returns the CPU, or -1 if pinning failed.
+ */
+static int pin_to_cpu(int index)
+{
+    cpu_set_t allowed, one;
+    int cpu, count;
 
-        pid = fork();
-        if (pid < 0) {
-            perror("fork");
-            close(client_fd);
-            continue;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0)
+        return -1;
+    shell_cpus = allowed;
+    shell_cpus_saved = 1;
+
+    count = index % CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && count-- == 0)
+            break;
+    }
+
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (sched_setaffinity(0, sizeof(one), &one) < 0) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return cpu;
+}
+
+/*
+ * start_worker:
+ *   Fork worker index. It keeps only its own listening socket and runs
+ *   an event loop on it until it is killed.
+ */
+static pid_t start_worker(int index, const int *listen_fds, const struct server_config *config)
+{
+    struct sigaction sa;
+    pid_t pid = fork();
+    int i;
+
+    if (pid < 0) {
+        perror("fork(worker)");
+        return -1;
+    }
+    if (pid > 0)
+        return pid;
+
+    /* ---- Child: worker ---- */
+    for (i = 0; i < config->workers; i++) {
+        if (i != index)
+            close(listen_fds[i]);
+    }
+
+    /* Counters carry on from a worker this one replaces */
+    stats = &all_stats[index];
+    stats->pid = getpid();
+    stats->cpu = pin_to_cpu(index);
+
+    /* Reap shells as they exit; leave the supervisor's signals alone,
+     * which a restarted worker inherits blocked. SIGCHLD stays blocked
+     * but while the loop waits (epoll_pwait, io_uring's sigmask), so
+     * it only ever interrupts the wait */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT,  SIG_DFL);
+    sigemptyset(&wait_sigmask);
+    sigaddset(&sa.sa_mask, SIGCHLD);
+    sigprocmask(SIG_SETMASK, &sa.sa_mask, NULL);
+
+    if (!config->uring || uring_loop(listen_fds[index], config) < 0)
+        server_loop(listen_fds[index], config);
+    _exit(1);
+}
+
+/*
+ * supervise:
+ *   Wait for signals: print statistics on SIGUSR1, restart a worker
+ *   that died, and on SIGTERM or SIGINT stop the workers and print the
+ *   final statistics.
+ */
+static void supervise(const int *listen_fds, const struct server_config *config)
+{
+    sigset_t block, old;
+    int i;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigaddset(&block, SIGUSR1);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGINT);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    while (!got_shutdown) {
+        while (!got_sigchld && !got_sigusr1 && !got_shutdown)
+            sigsuspend(&old);
+
+        if (got_sigusr1) {
+            got_sigusr1 = 0;
+            print_stats(config);
         }
 
-        if (pid == 0) {
-            /* Child process: handle this client */
-            close(listen_fd);
-            handle_client(client_fd, &client_addr, shell_path);
-            close(client_fd);
-            _exit(0);
-        } else {
-            /* Parent process: no need for client fd */
-            close(client_fd);
+        if (got_sigchld && !got_shutdown) {
+            pid_t pid;
+            int status;
+
+            got_sigchld = 0;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (i = 0; i < config->workers; i++) {
+                    if (all_stats[i].pid != pid)
+                        continue;
+                    fprintf(stderr, "server: worker %d (pid %d) died, %s %d; restarting it\n",
+                            i, (int)pid,
+                            WIFSIGNALED(status) ? "signal" : "status",
+                            WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+                    /* Its sessions and warm shells are gone with it */
+                    all_stats[i].active = 0;
+                    all_stats[i].pool_idle = 0;
+                    all_stats[i].pid = start_worker(i, listen_fds, config);
+                }
+            }
         }
     }
+
+    for (i = 0; i < config->workers; i++) {
+        if (all_stats[i].pid > 0)
+            kill(all_stats[i].pid, SIGTERM);
+    }
+    while (wait(NULL) > 0) {
+        /* wait for every worker */
+    }
+    print_stats(config);
+}
+
+/*
+ * print_stats:
+ *   One line per worker and a total, so the spread of connections
+ *   over the workers shows at a glance.
+ */
+static void print_stats(const struct server_config *config)
+{
+    unsigned long accepted = 0, logins = 0, refused = 0, active = 0;
+    unsigned long hits = 0, misses = 0, idle = 0;
+    unsigned long out_spliced = 0, out_copied = 0, in_spliced = 0, in_copied = 0;
+    unsigned long segments = 0, corks = 0;
+    struct codec_stats zip = {0, 0, 0, 0}, unzip = {0, 0, 0, 0};
+    int i;
+
+    for (i = 0; i < config->workers; i++) {
+        const struct worker_stats *w = &all_stats[i];
+
+        printf("stats: worker %d pid %d cpu %d %s: accepted %lu, logins %lu, refused %lu, active %lu, "
+               "pool hits %lu, misses %lu, idle %lu\n",
+               i, (int)w->pid, w->cpu, w->uring ? "io_uring" : "epoll",
+               w->accepted, w->logins, w->refused, w->active,
+               w->pool_hits, w->pool_misses, w->pool_idle);
+        printf("stats: worker %d bytes: to client spliced %lu, copied %lu; to shell spliced %lu, copied %lu",
+               i, w->to_client_spliced, w->to_client_copied, w->to_shell_spliced, w->to_shell_copied);
+        if (w->uring)
+            printf("; buffer waits %lu", w->buffer_waits);
+        printf("\n");
+        printf("stats: worker %d output: segments %lu, corked %lu\n", i, w->segments, w->corks);
+        print_codec_stats("worker", i, &w->compressed, &w->decompressed);
+        accepted += w->accepted;
+        logins   += w->logins;
+        refused  += w->refused;
+        active   += w->active;
+        hits     += w->pool_hits;
+        misses   += w->pool_misses;
+        idle     += w->pool_idle;
+        out_spliced += w->to_client_spliced;
+        out_copied  += w->to_client_copied;
+        in_spliced  += w->to_shell_spliced;
+        in_copied   += w->to_shell_copied;
+        segments    += w->segments;
+        corks       += w->corks;
+        zip.in         += w->compressed.in;
+        zip.out        += w->compressed.out;
+        zip.bypassed   += w->compressed.bypassed;
+        zip.ns         += w->compressed.ns;
+        unzip.in       += w->decompressed.in;
+        unzip.out      += w->decompressed.out;
+        unzip.ns       += w->decompressed.ns;
+    }
+    printf("stats: total: accepted %lu, logins %lu, refused %lu, active %lu, "
+           "pool hits %lu, misses %lu, idle %lu\n",
+           accepted, logins, refused, active, hits, misses, idle);
+    printf("stats: total bytes: to client spliced %lu, copied %lu; to shell spliced %lu, copied %lu\n",
+           out_spliced, out_copied, in_spliced, in_copied);
+    printf("stats: total output: segments %lu, corked %lu\n", segments, corks);
+    print_codec_stats("total", -1, &zip, &unzip);
+    fflush(stdout);
+}
+
+/*
+ * print_codec_stats:
+ *   Compression, if any session used it: bytes before and after, the
+ *   ratio, and the CPU time per MB that bought it.
+ */
+static void print_codec_stats(const char *what, int worker, const struct codec_stats *zip,
+                              const struct codec_stats *unzip)
+{
+    char label[32];
+
+    if (zip->in + zip->bypassed + unzip->in == 0)
+        return;
+    if (worker >= 0)
+        snprintf(label, sizeof(label), "%s %d", what, worker);
+    else
+        snprintf(label, sizeof(label), "%s", what);
+
+    printf("stats: %s compression: output %lu -> %lu bytes (%.2f:1, %lu bypassed), %.1f ms, %.0f us/MB; "
+           "input %lu -> %lu bytes, %.1f ms\n",
+           label, zip->in, zip->out, zip->out > 0 ? (double)zip->in / (double)zip->out : 0.0,
+           zip->bypassed, zip->ns / 1e6, zip->in > 0 ? zip->ns / 1e3 / (zip->in / 1048576.0) : 0.0,
+           unzip->in, unzip->out, unzip->ns / 1e6);
 }
 
-/* ====== Utility: robust line I/O ====== */
+/* ====== Worker: event loop ====== */
 
 /*
- * read_line: reads up to maxlen-1 bytes or until '\n' (inclusive).
- * Appends '\0' at the end. Returns number of bytes read (excluding '\0'),
- * 0 on EOF, or -1 on error.
+ * server_loop:
+ *   One epoll instance watches the listening socket and, for every
+ *   session, the client socket and the shell's pipes. Events are
+ *   level-triggered; each handler does what it can without blocking
+ *   and then recomputes which events its session needs next.
  */
-static ssize_t read_line(int fd, char *buf, size_t maxlen)
+static void server_loop(int listen_fd, const struct server_config *config)
 {
-    size_t n = 0;
-    while (n < maxlen - 1) {
-        char c;
-        ssize_t rc = read(fd, &c, 1);
-        if (rc == 1) {
-            buf[n++] = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            /* EOF */
-            break;
-        } else {
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    int timeout;
+
+    settings = config;
+    if (pool_create() < 0)
+        return;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return;
+    }
+
+    /* The listener is the only entry without an endpoint */
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl(listen)");
+        close(epoll_fd);
+        return;
+    }
+
+    for (;;) {
+        int i, n;
+
+        if (got_sigchld)
+            reap_shells();
+
+        timeout = -1;
+        if (pool_wanted()) {
+            if (pool_idle == 0)
+                pool_refill();
+            timeout = POOL_IDLE_MS;
+        }
+
+        n = epoll_pwait(epoll_fd, events, MAX_EVENTS, output_timeout(timeout), &wait_sigmask);
+        turn_us = now_us();
+
+        if (n < 0) {
             if (errno == EINTR)
+                continue; /* interrupted by SIGCHLD */
+            perror("epoll_wait");
+            break;
+        }
+        if (n == 0) {
+            /* Quiet: time to start warm shells, and send corked output */
+            if (pool_filling)
+                pool_refill();
+            output_flush_idle();
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            struct endpoint *ep = events[i].data.ptr;
+            struct session *s;
+
+            if (ep == NULL) {
+                accept_clients(listen_fd);
+                continue;
+            }
+
+            s = ep->session;
+            if (s->closed)
                 continue;
-            return -1; /* error */
+
+            if (ep == &s->client)
+                session_client_event(s, events[i].events);
+            else if (ep == &s->shell_in)
+                session_shell_in_event(s);
+            else
+                session_shell_out_event(s, ep);
+
+            if (!s->closed)
+                session_update_events(s);
+        }
+
+        /* Nothing refers to these any more */
+        while (closed_sessions != NULL) {
+            struct session *s = closed_sessions;
+            closed_sessions = s->next_closed;
+            session_free(s);
         }
+        output_flush_idle();
     }
-    buf[n] = '\0';
-    return (ssize_t)n;
+
+    close(epoll_fd);
 }
 
 /*
- * writen: write exactly n bytes unless an error occurs.
- * Returns 0 on success, -1 on error.
+ * accept_clients:
+ *   Take every pending connection, greet it and start its login.
  */
-static ssize_t writen(int fd, const void *buf, size_t n)
+static void accept_clients(int listen_fd)
 {
-    const char *p = (const char *)buf;
-    size_t left = n;
+    for (;;) {
+        struct sockaddr_in client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        struct session *s;
+        int client_fd;
 
-    while (left > 0) {
-        ssize_t rc = write(fd, p, left);
-        if (rc <= 0) {
-            if (rc < 0 && errno == EINTR)
-                continue;
-            return -1;
+        client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &addrlen,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR)
+                continue; /* interrupted by signal */
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
         }
-        left -= (size_t)rc;
-        p    += rc;
+
+        s = session_open(client_fd, &client_addr);
+        if (s != NULL && !s->closed)
+            session_update_events(s);
     }
-    return 0;
 }
 
-/* ====== Core: handle a single client (protocol + shell) ====== */
-
-static void handle_client(int client_fd, const struct sockaddr_in *client_addr, const char *shell_path)
+/*
+ * session_open:
+ *   Start the session of a new connection: greet it and wait for its
+ *   login. client_addr may be NULL, then the socket is asked.
+ *   Returns NULL if the session could not be created, and a closed
+ *   session if the greeting failed.
+ */
+static struct session *session_open(int client_fd, const struct sockaddr_in *client_addr)
 {
+    struct sockaddr_in peer;
+    socklen_t addrlen = sizeof(peer);
     char addr_str[INET_ADDRSTRLEN];
-    char line[MAX_LINE];
-    char username[128] = {0};
-    char password[128] = {0};
+    struct session *s;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        perror("calloc(session)");
+        close(client_fd);
+        return NULL;
+    }
 
+    if (client_addr == NULL) {
+        memset(&peer, 0, sizeof(peer));
+        getpeername(client_fd, (struct sockaddr *)&peer, &addrlen);
+        client_addr = &peer;
+    }
     if (inet_ntop(AF_INET, &client_addr->sin_addr, addr_str, sizeof(addr_str)) == NULL) {
         strncpy(addr_str, "unknown", sizeof(addr_str));
         addr_str[sizeof(addr_str) - 1] = '\0';
     }
+    snprintf(s->addr, sizeof(s->addr), "%s:%d", addr_str, (int)ntohs(client_addr->sin_port));
 
-    printf("New connection from %s:%d\n",
-           addr_str,
-           (int)ntohs(client_addr->sin_port));
+    printf("New connection from %s\n", s->addr);
     fflush(stdout);
+    stats->accepted++;
+    stats->active++;
+
+    s->state             = SESSION_USER;
+    s->client.session    = s;
+    s->client.fd         = client_fd;
+    s->shell_in.session  = s;
+    s->shell_in.fd       = -1;
+    s->shell_out.session = s;
+    s->shell_out.fd      = -1;
+    s->shell_err.session = s;
+    s->shell_err.fd      = -1;
+    s->shell_pid         = -1;
+    line_reader_init(&s->login, client_fd);
+
+    /* Send greeting and login request; a new socket has room for them */
+    if (proto_send_line(client_fd, PROTO_WELCOME) < 0 ||
+        proto_send_line(client_fd, PROTO_LOGIN_REQUIRED) < 0)
+        session_close(s);
+    return s;
+}
+
+/* ====== Login: USER and PASS lines ====== */
 
-    /* Send greeting and login request */
-    proto_send_line(client_fd, PROTO_WELCOME);
-    proto_send_line(client_fd, PROTO_LOGIN_REQUIRED);
+/*
+ * session_login_input:
+ *   Read what the client sent during login and act on each complete
+ *   line. Bytes after the PASS line belong to the shell.
+ */
+static void session_login_input(struct session *s)
+{
+    ssize_t n = line_reader_fill(&s->login);
 
-    /* ---- Read USER line ---- */
-    ssize_t n = read_line(client_fd, line, sizeof(line));
-    if (n <= 0) {
-        /* client disconnected or error */
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            session_close(s);
         return;
     }
-
-    /* Expect: USER <username> */
-    if (!PARSE_USER(line, username)) {
-        proto_send_line(client_fd, "AUTH-FAIL PROTOCOL-ERROR\n");
-        proto_send_line(client_fd, "GOODBYE PROTOCOL-ERROR\n");
+    if (n == 0) {
+        /* client disconnected */
+        session_close(s);
         return;
     }
 
-    if (!auth_user_exists(username)) {
-        proto_send_line(client_fd, "AUTH-FAIL UNKNOWN-USER\n");
-        proto_send_line(client_fd, "GOODBYE UNKNOWN-USER\n");
+    session_login_lines(s);
+    if (!s->closed && relay_waiting(&s->to_shell))
+        session_shell_in_event(s);
+}
+
+/*
+ * session_login_lines:
+ *   Act on each complete login line read so far. Once the shell runs,
+ *   what follows the PASS line is left in to_shell for it.
+ */
+static void session_login_lines(struct session *s)
+{
+    char *line;
+
+    while (!s->closed && s->state != SESSION_RELAY &&
+           (line = line_reader_next(&s->login, NULL)) != NULL) {
+        session_login_line(s, line);
+    }
+
+    if (s->closed)
         return;
+
+    if (s->state == SESSION_RELAY && line_reader_pending(&s->login) > 0) {
+        /* Typed ahead of the shell: it reads these first (in frames
+         * for version 2) */
+        size_t n;
+
+        if (relay_buffer(&s->to_shell) == NULL) {
+            session_close(s);
+            return;
+        }
+        n = line_reader_take(&s->login, s->to_shell.buf, RELAY_BUF);
+        if (s->framed) {
+            s->to_shell.scan = 0;
+            s->to_shell.fill = n;
+        } else {
+            s->to_shell.start = 0;
+            s->to_shell.end   = n;
+        }
+    } else if (line_reader_full(&s->login)) {
+        /* No newline in a whole line's worth */
+        session_refuse(s, "PROTOCOL-ERROR");
     }
+}
 
-    /* ---- Read PASS line ---- */
-    n = read_line(client_fd, line, sizeof(line));
-    if (n <= 0) {
+/*
+ * session_login_line:
+ *   Handle one login line (without its newline).
+ */
+static void session_login_line(struct session *s, char *line)
+{
+    char password[128] = {0};
+    char ok_msg[256];
+    char dirs[8];
+    int version;
+
+    if (s->state == SESSION_USER) {
+        /* Optional, first: VERSION <n> */
+        if (!s->framed && PARSE_VERSION(line, version)) {
+            if (version != 1 && version != 2) {
+                session_refuse(s, "BAD-VERSION");
+                return;
+            }
+            s->framed = version == 2;
+            snprintf(ok_msg, sizeof(ok_msg), "%s %d\n", PROTO_VERSION_OK, version);
+            proto_send_line(s->client.fd, ok_msg);
+            return;
+        }
+
+        /* Optional, in version 2: COMPRESS <directions> */
+        if (PARSE_COMPRESS(line, dirs)) {
+            if (!s->framed)
+                version = 0;
+            else if (strcmp(dirs, "in") == 0)
+                version = COMPRESS_IN;
+            else if (strcmp(dirs, "out") == 0)
+                version = COMPRESS_OUT;
+            else if (strcmp(dirs, "both") == 0)
+                version = COMPRESS_IN | COMPRESS_OUT;
+            else
+                version = 0;
+            if (version == 0) {
+                session_refuse(s, "BAD-COMPRESS");
+                return;
+            }
+            s->compress |= version;
+            return;
+        }
+
+        /* Optional, in version 2: EXEC */
+        if (IS_EXEC(line)) {
+            if (!s->framed) {
+                session_refuse(s, "BAD-EXEC");
+                return;
+            }
+            s->exec = 1;
+            return;
+        }
+
+        /* Expect: USER <username> */
+        if (!PARSE_USER(line, s->username)) {
+            session_refuse(s, "PROTOCOL-ERROR");
+            return;
+        }
+        if (!auth_user_exists(s->username)) {
+            session_refuse(s, "UNKNOWN-USER");
+            return;
+        }
+        s->state = SESSION_PASS;
         return;
     }
 
     /* Expect: PASS <password> */
     if (!PARSE_PASS(line, password)) {
-        proto_send_line(client_fd, "AUTH-FAIL PROTOCOL-ERROR\n");
-        proto_send_line(client_fd, "GOODBYE PROTOCOL-ERROR\n");
+        session_refuse(s, "PROTOCOL-ERROR");
         return;
     }
-
-    if (!auth_check_password(username, password)) {
-        proto_send_line(client_fd, "AUTH-FAIL BAD-PASSWORD\n");
-        proto_send_line(client_fd, "GOODBYE BAD-PASSWORD\n");
+    if (!auth_check_password(s->username, password)) {
+        session_refuse(s, "BAD-PASSWORD");
         return;
     }
 
     /* Authentication successful */
-    {
-        char ok_msg[256];
-        snprintf(ok_msg, sizeof(ok_msg), "%s %s\n", PROTO_AUTH_OK, username);
-        proto_send_line(client_fd, ok_msg);
-    }
+    stats->logins++;
+    snprintf(ok_msg, sizeof(ok_msg), "%s %s\n", PROTO_AUTH_OK, s->username);
+    proto_send_line(s->client.fd, ok_msg);
 
     /* Start the remote shell session */
-    if (start_shell_session(client_fd, shell_path, username) != 0) {
-        proto_send_line(client_fd, "GOODBYE INTERNAL-ERROR\n");
+    if (start_shell_session(s, s->username) != 0) {
+        proto_send_line(s->client.fd, "GOODBYE INTERNAL-ERROR\n");
+        session_close(s);
     }
 }
 
-/* ====== Shell session: pipes + select relay ====== */
+/*
+ * session_refuse:
+ *   Tell the client why its login failed and drop it.
+ */
+static void session_refuse(struct session *s, const char *reason)
+{
+    char msg[128];
+
+    stats->refused++;
+    snprintf(msg, sizeof(msg), "%s %s\n", PROTO_AUTH_FAIL, reason);
+    proto_send_line(s->client.fd, msg);
+    snprintf(msg, sizeof(msg), "%s %s\n", PROTO_GOODBYE, reason);
+    proto_send_line(s->client.fd, msg);
+    session_close(s);
+}
+
+/* ====== Shell session: pipes + event-driven relay ====== */
 
-static int start_shell_session(int client_fd, const char *shell_path, const char *username)
+/*
+ * set_nonblocking:
+ *   The server's ends of the shell's pipes must never block the loop;
+ *   the shell's own ends stay blocking.
+ */
+static int set_nonblocking(int fd)
 {
-    int in_to_child[2];      /* server writes -> child stdin */
-    int out_from_child[2];   /* child stdout/stderr -> server reads */
-    pid_t pid;
+    int flags = fcntl(fd, F_GETFL);
 
-    if (pipe(in_to_child) < 0) {
-        perror("pipe(in_to_child)");
-        return -1;
-    }
-    if (pipe(out_from_child) < 0) {
-        perror("pipe(out_from_child)");
-        close(in_to_child[0]);
-        close(in_to_child[1]);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl(O_NONBLOCK)");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * spawn_shell:
+ *   Fork the shell with its stdin and stdout/stderr on pipes, leaving
+ *   the server's ends in sh, non-blocking for epoll; io_uring waits
+ *   for blocking descriptors itself. Every descriptor the server
+ *   holds is close-on-exec, so the shell only inherits its own.
+ *   With split_stderr, stderr gets a pipe of its own; with script,
+ *   the shell runs its stdin as a script (EXEC).
+ *
+ *   With username NULL the shell is started for the pool: it waits
+ *   for the handshake on its stdin (see pool_take) before it starts.
+ */
+static int spawn_shell(struct idle_shell *sh, const char *username, int split_stderr, int script)
+{
+    int in_to_child[2];      /* server writes -> child stdin */
+    int out_from_child[2];   /* child stdout (and stderr) -> server reads */
+    int err_from_child[2];   /* child stderr -> server reads, if split */
+    pid_t pid;
+
+    if (pipe2(in_to_child, O_CLOEXEC) < 0) {
+        perror("pipe(in_to_child)");
+        return -1;
+    }
+    if (pipe2(out_from_child, O_CLOEXEC) < 0) {
+        perror("pipe(out_from_child)");
+        close(in_to_child[0]);
+        close(in_to_child[1]);
+        return -1;
+    }
+    if (!split_stderr) {
+        err_from_child[0] = -1;
+        err_from_child[1] = out_from_child[1];
+    } else if (pipe2(err_from_child, O_CLOEXEC) < 0) {
+        perror("pipe(err_from_child)");
+        close(in_to_child[0]);
+        close(in_to_child[1]);
+        close(out_from_child[0]);
+        close(out_from_child[1]);
         return -1;
     }
 
@@ -406,6 +1386,10 @@ static int start_shell_session(int client_fd, const char *shell_path, const char
         close(in_to_child[1]);
         close(out_from_child[0]);
         close(out_from_child[1]);
+        if (split_stderr) {
+            close(err_from_child[0]);
+            close(err_from_child[1]);
+        }
         return -1;
     }
 
@@ -414,10 +1398,6 @@ static int start_shell_session(int client_fd, const char *shell_path, const char
         /* stdin: from in_to_child[0] */
         /* stdout/stderr: to out_from_child[1] */
 
-        /* Close unused ends */
-        close(in_to_child[1]);
-        close(out_from_child[0]);
-
         if (dup2(in_to_child[0], STDIN_FILENO) < 0) {
             perror("dup2 stdin");
             _exit(1);
@@ -426,107 +1406,1776 @@ static int start_shell_session(int client_fd, const char *shell_path, const char
             perror("dup2 stdout");
             _exit(1);
         }
-        if (dup2(out_from_child[1], STDERR_FILENO) < 0) {
+        if (dup2(err_from_child[1], STDERR_FILENO) < 0) {
             perror("dup2 stderr");
             _exit(1);
         }
 
-        close(in_to_child[0]);
-        close(out_from_child[1]);
+        /* The server ignores SIGPIPE and SIGUSR1 and blocks SIGCHLD;
+         * pipelines in the shell rely on SIGPIPE */
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &wait_sigmask, NULL);
+
+        /* Only the worker's loop is pinned, not what users run */
+        if (shell_cpus_saved)
+            sched_setaffinity(0, sizeof(shell_cpus), &shell_cpus);
 
         /* Optionally set some environment variables */
         if (username != NULL) {
             setenv("RSH_USER", username, 1);
+        } else {
+            setenv(SHELL_HANDSHAKE_ENV, "1", 1);
         }
 
-        /* Execute the shell */
-        execl(shell_path, shell_path, (char *)NULL);
+        /* Execute the shell, on its stdin as a script for EXEC */
+        if (script)
+            execl(settings->shell_path, settings->shell_path, SHELL_SCRIPT_ARG, (char *)NULL);
+        else
+            execl(settings->shell_path, settings->shell_path, (char *)NULL);
 
         /* If execl returns, it failed */
         perror("execl shell");
         _exit(1);
+    }
 
-    } else {
-        /* ---- Parent: session relay ---- */
-        fd_set rfds;
-        int maxfd;
-        char buf[4096];
-        int child_stdin  = in_to_child[1];
-        int child_stdout = out_from_child[0];
-        int done = 0;
-
-        /* Close unused ends */
-        close(in_to_child[0]);
-        close(out_from_child[1]);
+    /* ---- Parent ---- */
+    close(in_to_child[0]);
+    close(out_from_child[1]);
+    if (split_stderr)
+        close(err_from_child[1]);
+
+    /* Bulk output moves in fewer, larger splices through a bigger pipe */
+    if (settings->pipe_size > 0 && fcntl(out_from_child[0], F_SETPIPE_SZ, settings->pipe_size) < 0) {
+        static int warned;
+        if (!warned) {
+            perror("fcntl(F_SETPIPE_SZ), keeping the default pipe size");
+            warned = 1;
+        }
+    }
 
-        /*
-         * Relay loop:
-         *   - Read from client_fd, forward to child_stdin.
-         *   - Read from child_stdout, forward to client_fd.
-         */
-        while (!done) {
-            FD_ZERO(&rfds);
-            FD_SET(client_fd, &rfds);
-            FD_SET(child_stdout, &rfds);
-
-            maxfd = (client_fd > child_stdout ? client_fd : child_stdout) + 1;
-
-            int rc = select(maxfd, &rfds, NULL, NULL, NULL);
-            if (rc < 0) {
-                if (errno == EINTR)
-                    continue;
-                perror("select");
-                break;
+    sh->pid    = pid;
+    sh->in_fd  = in_to_child[1];
+    sh->out_fd = out_from_child[0];
+    sh->err_fd = err_from_child[0];
+
+    if (!using_uring && (set_nonblocking(sh->in_fd) < 0 || set_nonblocking(sh->out_fd) < 0 ||
+                         (sh->err_fd >= 0 && set_nonblocking(sh->err_fd) < 0))) {
+        close(sh->in_fd);
+        close(sh->out_fd);
+        if (sh->err_fd >= 0)
+            close(sh->err_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* ====== Warm shell pool ====== */
+
+/*
+ * Each worker keeps up to pool_size shells that have already been
+ * exec'd and initialised and are blocked reading the handshake. A
+ * login takes the oldest one, so it skips fork, exec and the shell's
+ * start-up. When the pool drops to its low-water mark it is
+ * refilled a few shells at a time once the loop has been idle for
+ * POOL_IDLE_MS, so starting shells does not compete with a login
+ * that just got one. Only an empty pool is refilled straight away.
+ *
+ * Warm shells have stderr on a pipe of their own, as a version 2
+ * session wants; for a version 1 session the handshake asks the shell
+ * to merge it into stdout.
+ */
+
+/*
+ * pool_create:
+ *   The worker's pool, empty; filled once the loop runs.
+ */
+static int pool_create(void)
+{
+    if (settings->pool_size > 0) {
+        pool = calloc((size_t)settings->pool_size, sizeof(*pool));
+        if (pool == NULL) {
+            perror("calloc(pool)");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * pool_wanted:
+ *   Whether the pool is being refilled, which starts at the low-water
+ *   mark and goes on until it is full.
+ */
+static int pool_wanted(void)
+{
+    if (pool == NULL)
+        return 0;
+    if (pool_idle <= settings->pool_low)
+        pool_filling = 1;
+    if (pool_idle >= settings->pool_size)
+        pool_filling = 0;
+    return pool_filling;
+}
+
+/*
+ * pool_refill:
+ *   Start up to POOL_SPAWN_STEP shells.
+ */
+static void pool_refill(void)
+{
+    int started = 0;
+
+    while (pool_idle < settings->pool_size && started < POOL_SPAWN_STEP) {
+        if (spawn_shell(&pool[pool_idle], NULL, 1, 0) < 0)
+            break;      /* try again on a later turn */
+        pool_idle++;
+        started++;
+    }
+    stats->pool_idle = (unsigned long)pool_idle;
+}
+
+/*
+ * pool_take:
+ *   Hand an idle shell to a user: send it the user's environment, how
+ *   to run, and the go-ahead. Shells that died while idle are skipped.
+ *   Returns -1 when the pool has nothing usable.
+ */
+static int pool_take(struct idle_shell *sh, const char *username, int merge_stderr, int script)
+{
+    char handshake[256];
+    int len = snprintf(handshake, sizeof(handshake), "%s RSH_USER=%s\n%s%s%s\n",
+                       SHELL_HANDSHAKE_SET, username,
+                       merge_stderr ? SHELL_HANDSHAKE_MERGE "\n" : "",
+                       script ? SHELL_HANDSHAKE_SCRIPT "\n" : "", SHELL_HANDSHAKE_START);
+
+    while (pool_idle > 0) {
+        /* Oldest first: it has had the most time to start up */
+        *sh = pool[0];
+        pool_idle--;
+        memmove(pool, pool + 1, (size_t)pool_idle * sizeof(*pool));
+        stats->pool_idle = (unsigned long)pool_idle;
+
+        /* A new pipe has room for this, unless the shell is gone */
+        if (write(sh->in_fd, handshake, (size_t)len) == len) {
+            if (merge_stderr) {
+                close(sh->err_fd);
+                sh->err_fd = -1;
             }
+            return 0;
+        }
 
-            /* Data from client -> shell stdin */
-            if (FD_ISSET(client_fd, &rfds)) {
-                ssize_t n = read(client_fd, buf, sizeof(buf));
-                if (n < 0) {
-                    if (errno == EINTR)
-                        continue;
-                    perror("read from client");
-                    break;
-                } else if (n == 0) {
-                    /* client closed connection */
-                    done = 1;
-                    /* Close shell stdin so it may terminate */
-                    close(child_stdin);
-                } else {
-                    if (writen(child_stdin, buf, (size_t)n) < 0) {
-                        perror("write to shell stdin");
-                        done = 1;
-                    }
+        close(sh->in_fd);
+        close(sh->out_fd);
+        close(sh->err_fd);
+    }
+    return -1;
+}
+
+/*
+ * start_shell_session:
+ *   Give the session a shell, warm from the pool if there is one, and
+ *   hand its pipes to the event loop.
+ */
+static int start_shell_session(struct session *s, const char *username)
+{
+    struct idle_shell sh;
+
+    if (settings->pool_size > 0 && pool_take(&sh, username, !s->framed, s->exec) == 0) {
+        stats->pool_hits++;
+    } else {
+        /* Started cold, with the environment given directly */
+        if (settings->pool_size > 0)
+            stats->pool_misses++;
+        if (spawn_shell(&sh, username, s->framed, s->exec) < 0)
+            return -1;
+    }
+
+    s->shell_in.fd  = sh.in_fd;
+    s->shell_out.fd = sh.out_fd;
+    s->shell_err.fd = sh.err_fd;
+    s->shell_pid    = sh.pid;
+    s->state        = SESSION_RELAY;
+
+    /* Frames are put together in buffers, so never spliced */
+    s->to_shell.copy     = settings->copy_relay || s->framed;
+    s->to_shell.spliced  = &stats->to_shell_spliced;
+    s->to_shell.copied   = &stats->to_shell_copied;
+    s->to_client.copy    = settings->copy_relay || s->framed;
+    s->to_client.spliced = &stats->to_client_spliced;
+    s->to_client.copied  = &stats->to_client_copied;
+    s->err_to_client.copy    = 1;
+    s->err_to_client.spliced = &stats->to_client_spliced;
+    s->err_to_client.copied  = &stats->to_client_copied;
+    if (s->framed) {
+        codec_init(&s->zip, 1, &stats->compressed);
+        codec_init(&s->unzip, 0, &stats->decompressed);
+        shell_watch(s);
+    }
+    output_start(s);
+    return 0;
+}
+
+/*
+ * relay_buffer:
+ *   The copy buffer of r, allocated the first time it is needed;
+ *   spliced directions never need one.
+ */
+static char *relay_buffer(struct relay *r)
+{
+    if (r->buf == NULL) {
+        r->buf = malloc(RELAY_BUF);
+        if (r->buf == NULL)
+            perror("malloc(relay)");
+    }
+    return r->buf;
+}
+
+/*
+ * relay_waiting:
+ *   Whether r has data that the destination has not taken yet, either
+ *   copied out or still in the source when splicing.
+ */
+static int relay_waiting(const struct relay *r)
+{
+    return r->start < r->end || r->head_sent < r->head_len || r->scan < r->fill || r->blocked;
+}
+
+/*
+ * source_has_data:
+ *   After a splice found nothing to do, tell a full destination from
+ *   an empty source.
+ */
+static int source_has_data(int fd)
+{
+    int avail = 0;
+
+    return ioctl(fd, FIONREAD, &avail) == 0 && avail > 0;
+}
+
+/*
+ * relay_iov:
+ *   What r has to write: the rest of its frame header, if any, and of
+ *   its buffer. Returns the number of iovecs filled in.
+ */
+static int relay_iov(struct relay *r, struct iovec *iov)
+{
+    int n = 0;
+
+    if (r->head_sent < r->head_len) {
+        iov[n].iov_base = r->head + r->head_sent;
+        iov[n].iov_len  = r->head_len - r->head_sent;
+        n++;
+    }
+    if (r->start < r->end) {
+        iov[n].iov_base = (r->out != NULL ? r->out : r->buf) + r->start;
+        iov[n].iov_len  = r->end - r->start;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * relay_advance:
+ *   n bytes of what relay_iov() gave were written.
+ */
+static void relay_advance(struct relay *r, size_t n)
+{
+    size_t head = r->head_len - r->head_sent;
+
+    if (n < head) {
+        r->head_sent += n;
+        return;
+    }
+    r->head_sent = r->head_len;
+    r->start += n - head;
+}
+
+/*
+ * relay_flush:
+ *   Write as much of r's copy buffer, behind its frame header if it
+ *   has one, as fd takes. Returns 0 when everything went or the rest
+ *   has to wait, -1 when fd is gone.
+ */
+static int relay_flush(struct relay *r, int fd)
+{
+    struct iovec iov[2];
+    int count;
+
+    while ((count = relay_iov(r, iov)) > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        relay_advance(r, (size_t)n);
+    }
+    r->start = r->end = 0;
+    r->head_sent = r->head_len = 0;
+    r->out = NULL;
+    return 0;
+}
+
+/*
+ * relay_splice:
+ *   Move what src has straight to dst inside the kernel. One of them
+ *   is always a pipe, which is all splice() needs. Returns as
+ *   relay_pump() does; splice not working on these descriptors
+ *   switches r to copying.
+ */
+static enum relay_result relay_splice(struct relay *r, int src, int dst)
+{
+    ssize_t n;
+
+    do {
+        n = splice(src, NULL, dst, NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) {
+        r->blocked = 0;
+        r->took = (size_t)n;
+        *r->spliced += (unsigned long)n;
+        return RELAY_MOVED;
+    }
+    if (n == 0) {
+        r->blocked = 0;
+        return RELAY_EOF;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* Either side may be the one that is not ready */
+        r->blocked = source_has_data(src);
+        return RELAY_IDLE;
+    }
+    if (errno == EINVAL || errno == ENOSYS) {
+        r->copy = 1;
+        return RELAY_IDLE;
+    }
+    return RELAY_ERROR;
+}
+
+/*
+ * relay_pump:
+ *   src is readable and r has nothing waiting: move what src has on
+ *   to dst, by splicing or through r's buffer. Whatever dst does not
+ *   take yet waits (relay_waiting) until relay_resume().
+ *   Returns RELAY_EOF at the end of src and RELAY_ERROR with errno
+ *   set when either side failed (EPIPE: dst stopped reading).
+ */
+static enum relay_result relay_pump(struct relay *r, int src, int dst)
+{
+    char *buf;
+    ssize_t n;
+
+    if (!r->copy) {
+        enum relay_result res = relay_splice(r, src, dst);
+        if (!r->copy)
+            return res;
+    }
+
+    if ((buf = relay_buffer(r)) == NULL)
+        return RELAY_ERROR;
+
+    do {
+        n = read(src, buf, RELAY_BUF);
+    } while (n < 0 && errno == EINTR);
+
+    if (n == 0)
+        return RELAY_EOF;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? RELAY_IDLE : RELAY_ERROR;
+
+    r->start = 0;
+    r->end   = (size_t)n;
+    r->took  = (size_t)n;
+    *r->copied += (unsigned long)n;
+    return relay_flush(r, dst) < 0 ? RELAY_ERROR : RELAY_MOVED;
+}
+
+/*
+ * relay_pack:
+ *   Version 2: make r's data, buf[start, end), a frame of the given
+ *   type, compressed by zip unless it is NULL or passes the data by.
+ */
+static int relay_pack(struct relay *r, int type, struct codec *zip)
+{
+    ssize_t n = 0;
+    int flags = 0;
+
+    if (zip != NULL && (n = codec_compress(zip, r->buf + r->start, r->end - r->start)) < 0)
+        return -1;
+    if (n > 0) {
+        r->out   = (char *)zip->buf;
+        r->start = 0;
+        r->end   = (size_t)n;
+        flags    = FRAME_DEFLATE;
+    }
+    frame_header(r->head, type, flags, r->end - r->start);
+    r->head_sent = 0;
+    r->head_len  = FRAME_HEADER;
+    return 0;
+}
+
+/*
+ * relay_frame:
+ *   Version 2: as relay_pump(), copying, but what src has goes to dst
+ *   as one frame of the given type.
+ */
+static enum relay_result relay_frame(struct relay *r, int src, int dst, int type,
+                                     struct codec *zip)
+{
+    char *buf;
+    ssize_t n;
+
+    if ((buf = relay_buffer(r)) == NULL)
+        return RELAY_ERROR;
+
+    do {
+        n = read(src, buf, RELAY_BUF);
+    } while (n < 0 && errno == EINTR);
+
+    if (n == 0)
+        return RELAY_EOF;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? RELAY_IDLE : RELAY_ERROR;
+
+    r->start = 0;
+    r->end   = (size_t)n;
+    r->took  = (size_t)n;
+    *r->copied += (unsigned long)n;
+    if (relay_pack(r, type, zip) < 0)
+        return RELAY_ERROR;
+    return relay_flush(r, dst) < 0 ? RELAY_ERROR : RELAY_MOVED;
+}
+
+/*
+ * relay_resume:
+ *   dst has room again for what r has waiting.
+ */
+static enum relay_result relay_resume(struct relay *r, int src, int dst)
+{
+    if (r->start < r->end || r->head_sent < r->head_len)
+        return relay_flush(r, dst) < 0 ? RELAY_ERROR : RELAY_MOVED;
+    if (r->blocked)
+        return relay_splice(r, src, dst);
+    return RELAY_IDLE;
+}
+
+/*
+ * close_endpoint:
+ *   Leave the epoll set before closing: a shell being forked may hold
+ *   a copy of the descriptor until it execs, and epoll only forgets a
+ *   descriptor when every copy is gone.
+ */
+static void close_endpoint(struct endpoint *ep)
+{
+    if (ep->fd >= 0) {
+        if (ep->events != 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ep->fd, NULL);
+        close(ep->fd);
+        ep->fd = -1;
+    }
+    ep->events = 0;
+}
+
+/*
+ * session_drop_input:
+ *   The shell closed its stdin: drop what the client sends from now
+ *   on but keep relaying the shell's output until it exits.
+ */
+static void session_drop_input(struct session *s)
+{
+    s->to_shell.start = s->to_shell.end = 0;
+    s->to_shell.blocked = 0;
+    close_endpoint(&s->shell_in);
+}
+
+/*
+ * session_input_done:
+ *   Client finished sending: close the shell's stdin so it exits, but
+ *   keep relaying what it still prints.
+ */
+static void session_input_done(struct session *s)
+{
+    s->input_done = 1;
+    close_endpoint(&s->shell_in);
+}
+
+/*
+ * session_inflate:
+ *   Version 2: the next piece of the compressed stdin fed to unzip
+ *   becomes to_shell's data to write. Returns 1 for a piece, 0 when
+ *   what was fed is used up, -1 for corrupt data.
+ */
+static int session_inflate(struct session *s)
+{
+    struct relay *r = &s->to_shell;
+    ssize_t n = codec_inflate(&s->unzip);
+
+    if (n <= 0)
+        return (int)n;
+    r->out   = (char *)s->unzip.buf;
+    r->start = 0;
+    r->end   = (size_t)n;
+    *r->copied += (unsigned long)n;
+    return 1;
+}
+
+/*
+ * session_next_input:
+ *   Version 2: walk the frames in to_shell's buffer, acting on the
+ *   others, up to a piece of stdin for the shell, which is left as
+ *   to_shell's data to write. Returns 1 for a piece, 0 when the buffer
+ *   is used up, or -1 when a bad frame closed the session.
+ */
+static int session_next_input(struct session *s)
+{
+    struct relay *r = &s->to_shell;
+    struct frame f;
+    int rc;
+
+    /* What is left of a compressed piece comes first */
+    if (s->shell_in.fd >= 0 && codec_pending(&s->unzip) && (rc = session_inflate(s)) != 0)
+        goto piece;
+
+    while ((rc = frame_reader_next(&s->frames, r->buf, &r->scan, r->fill, &f)) == 1) {
+        switch (f.type) {
+        case FRAME_STDIN:
+            if (f.len == 0) {
+                /* End of input: the shell sees end of file */
+                close_endpoint(&s->shell_in);
+            } else if (f.flags & FRAME_DEFLATE) {
+                if (!(s->compress & COMPRESS_IN)) {
+                    rc = -1;
+                    goto piece;
                 }
+                if (s->shell_in.fd >= 0 && (codec_feed(&s->unzip, f.data, f.len) < 0 ||
+                                            (rc = session_inflate(s)) != 0))
+                    goto piece;
+            } else if (s->shell_in.fd >= 0) {
+                r->out   = NULL;
+                r->start = (size_t)((const char *)f.data - r->buf);
+                r->end   = r->start + f.len;
+                *r->copied += (unsigned long)f.len;
+                return 1;
+            }
+            break;
+        case FRAME_WINSIZE:
+            if (f.len >= 4) {
+                s->rows = frame_get16(f.data);
+                s->cols = frame_get16(f.data + 2);
             }
+            break;
+        case FRAME_CONTROL:
+            /* Not once the shell is reaped: its pid may be reused */
+            if (f.len >= 2 && f.data[0] == CONTROL_SIGNAL && !s->exited &&
+                f.data[1] > 0 && f.data[1] < NSIG)
+                kill(s->shell_pid, f.data[1]);
+            break;
+        default:
+            /* Not meant for the server */
+            break;
+        }
+    }
 
-            /* Data from shell stdout/stderr -> client */
-            if (FD_ISSET(child_stdout, &rfds)) {
-                ssize_t n = read(child_stdout, buf, sizeof(buf));
-                if (n < 0) {
-                    if (errno == EINTR)
-                        continue;
-                    perror("read from shell stdout");
-                    break;
-                } else if (n == 0) {
-                    /* shell closed its stdout/stderr -> shell exited */
-                    done = 1;
-                } else {
-                    if (writen(client_fd, buf, (size_t)n) < 0) {
-                        /* client may have disconnected */
-                        done = 1;
-                    }
-                }
+    r->scan = r->fill = 0;
+piece:
+    if (rc < 0) {
+        fprintf(stderr, "server: %s sent a bad frame\n", s->addr);
+        session_close(s);
+        return -1;
+    }
+    return rc;
+}
+
+/*
+ * session_frames_in:
+ *   Version 2: write the pieces of stdin in to_shell's buffer to the
+ *   shell until it is used up or the shell's stdin is full.
+ */
+static void session_frames_in(struct session *s)
+{
+    struct relay *r = &s->to_shell;
+
+    do {
+        if (r->start < r->end && relay_flush(r, s->shell_in.fd) < 0) {
+            if (errno != EPIPE) {
+                session_close(s);
+                return;
             }
+            session_drop_input(s);
         }
+        if (r->start < r->end)
+            return;     /* the rest waits for room */
+    } while (session_next_input(s) > 0);
+}
+
+/*
+ * session_frames_read:
+ *   Version 2: read the client's frames and act on them.
+ */
+static void session_frames_read(struct session *s)
+{
+    struct relay *r = &s->to_shell;
+    ssize_t n;
 
-        /* Cleanup */
-        close(child_stdin);
-        close(child_stdout);
+    if (relay_buffer(r) == NULL) {
+        session_close(s);
+        return;
+    }
 
-        /* Wait for shell to exit (avoid zombie) */
-        waitpid(pid, NULL, 0);
+    do {
+        n = read(s->client.fd, r->buf, RELAY_BUF);
+    } while (n < 0 && errno == EINTR);
 
-        return 0;
+    if (n == 0) {
+        session_input_done(s);
+        return;
+    }
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            session_close(s);
+        return;
+    }
+    r->scan = 0;
+    r->fill = (size_t)n;
+    session_frames_in(s);
+}
+
+/*
+ * Client input, client writable, or the connection failing.
+ */
+static void session_client_event(struct session *s, uint32_t events)
+{
+    if (s->state != SESSION_RELAY) {
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            session_login_input(s);
+        return;
+    }
+
+    if (events & EPOLLERR) {
+        session_close(s);
+        return;
     }
+
+    /* Data from client -> shell stdin */
+    if ((events & (EPOLLIN | EPOLLHUP)) && !relay_waiting(&s->to_shell) && !s->input_done) {
+        if (s->framed) {
+            session_frames_read(s);
+            if (s->closed)
+                return;
+        } else if (s->shell_in.fd < 0) {
+            /* The shell no longer reads its input */
+            char discard[4096];
+            ssize_t n = read(s->client.fd, discard, sizeof(discard));
+
+            if (n == 0)
+                s->input_done = 1;
+            else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                session_close(s);
+                return;
+            }
+        } else {
+            switch (relay_pump(&s->to_shell, s->client.fd, s->shell_in.fd)) {
+            case RELAY_EOF:
+                session_input_done(s);
+                break;
+            case RELAY_ERROR:
+                if (errno != EPIPE) {
+                    session_close(s);
+                    return;
+                }
+                session_drop_input(s);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    /* Waiting shell output -> client; only one of the two waits */
+    if (events & EPOLLOUT) {
+        struct relay *r = relay_waiting(&s->err_to_client) ? &s->err_to_client : &s->to_client;
+
+        if (!relay_waiting(r))
+            return;
+        switch (relay_resume(r, s->shell_out.fd, s->client.fd)) {
+        case RELAY_MOVED:
+            output_sent(s, 0);
+            break;
+        case RELAY_ERROR:
+            /* client may have disconnected */
+            session_close(s);
+            return;
+        case RELAY_EOF:
+            close_endpoint(&s->shell_out);
+            break;
+        default:
+            break;
+        }
+        session_output_end(s);
+    }
+}
+
+/*
+ * Shell output ready on ep (stdout, or stderr in version 2), or the
+ * shell closed it (exited).
+ */
+static void session_shell_out_event(struct session *s, struct endpoint *ep)
+{
+    struct relay *r = ep == &s->shell_err ? &s->err_to_client : &s->to_client;
+    enum relay_result res;
+
+    if (s->framed)
+        res = relay_frame(r, ep->fd, s->client.fd, ep == &s->shell_err ? FRAME_STDERR : FRAME_STDOUT,
+                          s->compress & COMPRESS_OUT ? &s->zip : NULL);
+    else
+        res = relay_pump(r, ep->fd, s->client.fd);
+
+    switch (res) {
+    case RELAY_MOVED:
+        output_sent(s, r->took);
+        break;
+    case RELAY_ERROR:
+        session_close(s);
+        break;
+    case RELAY_EOF:
+        /* shell closed its output -> shell exited */
+        close_endpoint(ep);
+        session_output_end(s);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Room in the shell's stdin for waiting client input.
+ */
+static void session_shell_in_event(struct session *s)
+{
+    if (s->framed) {
+        session_frames_in(s);
+        return;
+    }
+
+    switch (relay_resume(&s->to_shell, s->client.fd, s->shell_in.fd)) {
+    case RELAY_ERROR:
+        if (errno == EPIPE)
+            session_drop_input(s);
+        else
+            session_close(s);
+        break;
+    case RELAY_EOF:
+        session_input_done(s);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * set_events:
+ *   Register exactly the events wanted for ep. Descriptors with
+ *   nothing to wait for leave the set altogether, since epoll would
+ *   otherwise keep reporting hang-ups on them.
+ */
+static void set_events(struct endpoint *ep, uint32_t wanted)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (ep->fd < 0 || ep->events == wanted)
+        return;
+
+    if (wanted == 0)
+        op = EPOLL_CTL_DEL;
+    else if (ep->events == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = wanted;
+    ev.data.ptr = ep;
+    if (epoll_ctl(epoll_fd, op, ep->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        session_close(ep->session);
+        return;
+    }
+    ep->events = wanted;
+}
+
+/*
+ * session_update_events:
+ *   Each side is read only while nothing of it waits for the other,
+ *   and the other is watched for room only while something does.
+ */
+static void session_update_events(struct session *s)
+{
+    int to_shell_pending  = relay_waiting(&s->to_shell);
+    int to_client_pending = relay_waiting(&s->to_client) || relay_waiting(&s->err_to_client);
+    uint32_t client = 0;
+
+    if (s->state != SESSION_RELAY) {
+        set_events(&s->client, EPOLLIN);
+        return;
+    }
+
+    if (!to_shell_pending && !s->input_done)
+        client |= EPOLLIN;
+    if (to_client_pending)
+        client |= EPOLLOUT;
+
+    set_events(&s->client, client);
+    if (!s->closed)
+        set_events(&s->shell_in, to_shell_pending ? EPOLLOUT : 0);
+    if (!s->closed)
+        set_events(&s->shell_out, to_client_pending ? 0 : EPOLLIN);
+    if (!s->closed)
+        set_events(&s->shell_err, to_client_pending ? 0 : EPOLLIN);
+}
+
+static int uring_write(struct relay *r, struct endpoint *dst);
+
+/*
+ * session_output_end:
+ *   Once the shell has closed its output and all of it has gone to
+ *   the client, the session ends. A version 2 client is sent the
+ *   shell's exit status first, when reap_shells() has it.
+ */
+static void session_output_end(struct session *s)
+{
+    struct relay *r = &s->to_client;
+
+    if (s->closed || s->shell_out.fd >= 0 || s->shell_err.fd >= 0 ||
+        relay_waiting(&s->to_client) || relay_waiting(&s->err_to_client))
+        return;
+    if (!s->framed || s->exit_sent) {
+        session_close(s);
+        return;
+    }
+    if (!s->exited)
+        return;
+
+    /* The EXIT frame fits in the relay's header space */
+    frame_header(r->head, FRAME_EXIT, 0, 4);
+    frame_put32(r->head + FRAME_HEADER, (unsigned long)s->exit_status);
+    r->head_sent = 0;
+    r->head_len  = FRAME_HEADER + 4;
+    s->exit_sent = 1;
+
+    if (using_uring) {
+        s->client_write = r;
+        if (uring_write(r, &s->client) < 0)
+            session_close(s);
+    } else if (relay_flush(r, s->client.fd) < 0 || !relay_waiting(r)) {
+        session_close(s);
+    }
+}
+
+static void uring_cancel(struct session *s);
+static void uring_release(struct session *s);
+static void relay_release(struct relay *r);
+
+/*
+ * session_close:
+ *   Close everything the session holds. The shell sees end of file on
+ *   its stdin and exits; SIGCHLD reaps it.
+ */
+static void session_close(struct session *s)
+{
+    if (s->closed)
+        return;
+
+    if (using_uring)
+        uring_cancel(s);
+    output_end(s);
+    shell_unwatch(s);
+    close_endpoint(&s->client);
+    close_endpoint(&s->shell_in);
+    close_endpoint(&s->shell_out);
+    close_endpoint(&s->shell_err);
+
+    /* A provided buffer is still being written; it goes back to the
+     * kernel when that write completes */
+    if (!s->to_shell.held) {
+        free(s->to_shell.buf);
+        s->to_shell.buf = NULL;
+    }
+    if (!s->to_client.held) {
+        free(s->to_client.buf);
+        s->to_client.buf = NULL;
+    }
+    if (!s->err_to_client.held) {
+        free(s->err_to_client.buf);
+        s->err_to_client.buf = NULL;
+    }
+
+    stats->active--;
+    s->closed = 1;
+
+    /* The io_uring loop frees it when its last request completes */
+    if (!using_uring) {
+        s->next_closed = closed_sessions;
+        closed_sessions = s;
+    }
+}
+
+/*
+ * session_free:
+ *   Nothing refers to the closed session any more.
+ */
+static void session_free(struct session *s)
+{
+    codec_end(&s->zip);
+    codec_end(&s->unzip);
+    free(s);
+}
+
+/* ====== Shell exit status ====== */
+
+/*
+ * Version 2 sessions wait in shell_table, hashed by the shell's pid,
+ * until the shell is reaped; the loop reaps shells itself when a
+ * SIGCHLD has interrupted its wait, so the status never races with
+ * the session it belongs to.
+ */
+
+static void shell_watch(struct session *s)
+{
+    struct session **bucket = &shell_table[s->shell_pid % SHELL_BUCKETS];
+
+    s->next_shell = *bucket;
+    *bucket = s;
+    s->watched = 1;
+}
+
+static void shell_unwatch(struct session *s)
+{
+    struct session **link = &shell_table[s->shell_pid % SHELL_BUCKETS];
+
+    if (!s->watched)
+        return;
+    while (*link != s)
+        link = &(*link)->next_shell;
+    *link = s->next_shell;
+    s->watched = 0;
+}
+
+/*
+ * reap_shells:
+ *   Collect every shell that exited, and hand its status to its
+ *   session, if one waits for it.
+ */
+static void reap_shells(void)
+{
+    pid_t pid;
+    int status;
+
+    got_sigchld = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct session *s = shell_table[pid % SHELL_BUCKETS];
+
+        while (s != NULL && s->shell_pid != pid)
+            s = s->next_shell;
+        if (s == NULL)
+            continue;   /* a warm shell, or a version 1 session's */
+
+        shell_unwatch(s);
+        s->exited = 1;
+        s->exit_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+        session_output_end(s);
+        if (using_uring)
+            uring_release(s);
+        else if (!s->closed)
+            session_update_events(s);
+    }
+}
+
+/* ====== Output policy: TCP_NODELAY and TCP_CORK ====== */
+
+/*
+ * The shell's output reaches the loop in whatever pieces the shell
+ * wrote. Interactive output, an echoed line or a prompt, is small and
+ * should leave at once: TCP_NODELAY stops Nagle's algorithm holding it
+ * back until the previous segment is acknowledged. Bulk output comes
+ * in large reads, and sent as it comes each one would end in a short
+ * segment. So once a read reaches BULK_OUTPUT the session corks its
+ * socket, and the kernel sends only full segments; when the output
+ * has been quiet for CORK_FLUSH_MS the cork comes out and the rest
+ * goes. Keystrokes never wait, and a burst ends in one short segment.
+ */
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void set_tcp_option(int fd, int option, int on)
+{
+    if (setsockopt(fd, IPPROTO_TCP, option, &on, sizeof(on)) < 0)
+        perror("setsockopt(TCP)");
+}
+
+/*
+ * output_start:
+ *   The session starts relaying: small writes go out at once.
+ */
+static void output_start(struct session *s)
+{
+    if (settings->output != OUTPUT_NAGLE)
+        set_tcp_option(s->client.fd, TCP_NODELAY, 1);
+}
+
+/*
+ * output_sent:
+ *   n bytes of the shell's output went to the client (0: the rest of
+ *   earlier output). A bulk read corks the socket.
+ */
+static void output_sent(struct session *s, size_t n)
+{
+    if (settings->output != OUTPUT_ADAPTIVE)
+        return;
+
+    s->output_us = turn_us;
+    if (!s->corked && n >= BULK_OUTPUT) {
+        set_tcp_option(s->client.fd, TCP_CORK, 1);
+        s->corked = 1;
+        s->next_corked = corked_sessions;
+        corked_sessions = s;
+        stats->corks++;
+    }
+}
+
+/*
+ * output_flush_idle:
+ *   Uncork the sessions whose output has gone quiet, which sends what
+ *   was held back for a full segment.
+ */
+static void output_flush_idle(void)
+{
+    struct session **link = &corked_sessions;
+
+    while (*link != NULL) {
+        struct session *s = *link;
+
+        if (turn_us - s->output_us < CORK_FLUSH_MS * 1000) {
+            link = &s->next_corked;
+            continue;
+        }
+        *link = s->next_corked;
+        s->corked = 0;
+        set_tcp_option(s->client.fd, TCP_CORK, 0);
+    }
+}
+
+/*
+ * output_timeout:
+ *   How long the loop may wait, given timeout, so corked output is
+ *   not held longer than CORK_FLUSH_MS.
+ */
+static int output_timeout(int timeout)
+{
+    if (corked_sessions != NULL && (timeout < 0 || timeout > CORK_FLUSH_MS))
+        return CORK_FLUSH_MS;
+    return timeout;
+}
+
+/*
+ * output_end:
+ *   The session is closing, which sends anything corked. Count the
+ *   segments its client was sent.
+ */
+static void output_end(struct session *s)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (s->corked) {
+        struct session **link = &corked_sessions;
+
+        while (*link != s)
+            link = &(*link)->next_corked;
+        *link = s->next_corked;
+        s->corked = 0;
+    }
+
+    memset(&info, 0, sizeof(info));
+    if (s->client.fd >= 0 && getsockopt(s->client.fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+        stats->segments += info.tcpi_data_segs_out;
+}
+
+/* ====== Worker: io_uring loop ====== */
+
+/*
+ * The io_uring loop runs the same sessions on completions instead of
+ * readiness. Every descriptor is blocking and the kernel does the
+ * waiting: a request on a pipe or socket that is not ready is parked
+ * on its poll queue, with no thread behind it.
+ *
+ *   - One multishot accept keeps delivering new connections.
+ *   - Relay reads select a buffer from the worker's provided buffer
+ *     ring only when data arrives, so idle sessions hold none.
+ *   - Each write of a buffer is linked to the next read of its
+ *     source, so a direction keeps moving without a trip through the
+ *     loop. A write that completes in full posts no completion
+ *     (IOSQE_CQE_SKIP_SUCCESS): the read linked to it only runs
+ *     after it, so the read's completion says the buffer is free. A
+ *     short or failed write does post one, and breaks the link: the
+ *     read is cancelled without a completion of its own, and the rest
+ *     is written before reading on.
+ *
+ * So each direction has at most one request in flight and holds at
+ * most one buffer, and a slow reader holds back only its writer, as
+ * in the epoll loop. splice() is not used: on io_uring it would block
+ * a kernel worker thread per waiting direction.
+ *
+ * Version 2 sessions write frames unlinked, each posting its own
+ * completion: whether to read on is decided between frames, stdout and
+ * stderr take turns at the client, and one read of the client may hold
+ * many pieces of stdin.
+ *
+ * Requests carry their endpoint in user_data, with the kind of request
+ * in the low bits (endpoints are pointer aligned). A session counts
+ * its requests in flight and is freed when the last one completes.
+ * Linked writes are not counted; a write's completion, when there is
+ * one, stands in for that of the read linked to it.
+ */
+#define UOP_ACCEPT  0           /* the listener, no endpoint */
+#define UOP_READ    1
+#define UOP_WRITE   2
+#define UOP_CANCEL  3           /* no endpoint either */
+#define UOP_MASK    3
+
+/*
+ * uring_queue:
+ *   A submission for ep (counted in flight unless a write), or NULL if
+ *   the ring is full.
+ */
+static struct io_uring_sqe *uring_queue(struct endpoint *ep, int op, int opcode, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+
+    if (sqe == NULL) {
+        fprintf(stderr, "server: io_uring submission queue full\n");
+        return NULL;
+    }
+    sqe->opcode    = (unsigned char)opcode;
+    sqe->fd        = fd;
+    sqe->off       = (unsigned long long)-1;  /* no position: pipes and sockets */
+    sqe->user_data = (unsigned long long)(uintptr_t)ep | (unsigned long long)op;
+    if (ep != NULL && op != UOP_WRITE)
+        ep->session->inflight++;
+    return sqe;
+}
+
+/*
+ * uring_accept:
+ *   Arm the multishot accept; it stays armed until a completion comes
+ *   without IORING_CQE_F_MORE.
+ */
+static int uring_accept(void)
+{
+    struct io_uring_sqe *sqe = uring_queue(NULL, UOP_ACCEPT, IORING_OP_ACCEPT, uring_listen_fd);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->off          = 0;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    return 0;
+}
+
+/*
+ * uring_read:
+ *   Read the next chunk of ep into whichever provided buffer the
+ *   kernel picks when data arrives.
+ */
+static int uring_read(struct endpoint *ep)
+{
+    struct io_uring_sqe *sqe = uring_queue(ep, UOP_READ, IORING_OP_READ, ep->fd);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers.group;
+    sqe->len       = buffers.size;
+    return 0;
+}
+
+/*
+ * uring_login_read:
+ *   Read login lines straight into the session's line reader; they
+ *   are few and small, so they take no provided buffer.
+ */
+static int uring_login_read(struct session *s)
+{
+    size_t room;
+    char *space = line_reader_space(&s->login, &room);
+    struct io_uring_sqe *sqe = uring_queue(&s->client, UOP_READ, IORING_OP_READ, s->client.fd);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->addr = (unsigned long long)(uintptr_t)space;
+    sqe->len  = (unsigned)room;
+    return 0;
+}
+
+/*
+ * uring_forward:
+ *   Write what r holds to dst, linked to the next read of src. Both
+ *   reach the kernel in the same submission, as links must.
+ */
+static int uring_forward(struct relay *r, struct endpoint *src, struct endpoint *dst)
+{
+    struct io_uring_sqe *sqe;
+
+    uring_reserve(&ring, 2);
+    sqe = uring_queue(dst, UOP_WRITE, IORING_OP_WRITE, dst->fd);
+    if (sqe == NULL)
+        return -1;
+    sqe->addr  = (unsigned long long)(uintptr_t)(r->buf + r->start);
+    sqe->len   = (unsigned)(r->end - r->start);
+    sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    r->writing = 1;
+    return uring_read(src);
+}
+
+/*
+ * uring_write:
+ *   Version 2: write what r has, frame header first, to dst on its
+ *   own; it posts a completion (uring_frame_written) and counts in
+ *   flight.
+ */
+static int uring_write(struct relay *r, struct endpoint *dst)
+{
+    struct io_uring_sqe *sqe = uring_queue(dst, UOP_WRITE, IORING_OP_WRITEV, dst->fd);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->addr = (unsigned long long)(uintptr_t)r->iov;
+    sqe->len  = (unsigned)relay_iov(r, r->iov);
+    dst->session->inflight++;
+    r->writing = 1;
+    return 0;
+}
+
+/*
+ * uring_cancel:
+ *   Cancel every request on the session's descriptors before they are
+ *   closed: a request keeps its file open, and a write still waiting
+ *   on the shell's stdin would keep the shell from seeing end of file.
+ */
+static void uring_cancel(struct session *s)
+{
+    struct relay *relays[3];
+    struct endpoint *eps[4];
+    int i;
+
+    /* Version 2 output waiting its turn holds a buffer nothing writes */
+    relays[0] = &s->to_shell;
+    relays[1] = &s->to_client;
+    relays[2] = &s->err_to_client;
+    for (i = 0; i < 3; i++) {
+        if (relays[i]->held && !relays[i]->writing)
+            relay_release(relays[i]);
+    }
+
+    if (s->inflight == 0)
+        return;
+
+    eps[0] = &s->client;
+    eps[1] = &s->shell_in;
+    eps[2] = &s->shell_out;
+    eps[3] = &s->shell_err;
+    for (i = 0; i < 4; i++) {
+        struct io_uring_sqe *sqe;
+
+        if (eps[i]->fd < 0 || (sqe = uring_queue(NULL, UOP_CANCEL, IORING_OP_ASYNC_CANCEL, eps[i]->fd)) == NULL)
+            continue;
+        sqe->off = 0;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    /* Cancellation resolves the descriptors now, before they close */
+    uring_submit(&ring, 0, -1, NULL);
+}
+
+/*
+ * uring_release:
+ *   Free a closed session once nothing in the kernel refers to it.
+ */
+static void uring_release(struct session *s)
+{
+    if (s->closed && s->inflight == 0)
+        session_free(s);
+}
+
+static void buffer_put(unsigned bid)
+{
+    uring_buffer_put(&buffers, bid);
+    buffers_free++;
+}
+
+/*
+ * relay_release:
+ *   r's data has been written: its buffer goes back to the kernel, or
+ *   is freed if it was the type-ahead of the login.
+ */
+static void relay_release(struct relay *r)
+{
+    if (r->held)
+        buffer_put(r->bid);
+    else
+        free(r->buf);
+    r->buf  = NULL;
+    r->held = 0;
+    r->start = r->end = 0;
+    r->head_sent = r->head_len = 0;
+    r->out = NULL;
+}
+
+/*
+ * uring_frames_in:
+ *   Version 2: write the next piece of stdin in to_shell's buffer to
+ *   the shell, or once the buffer is used up, read the client again.
+ */
+static void uring_frames_in(struct session *s)
+{
+    struct relay *r = &s->to_shell;
+    int rc = session_next_input(s);
+
+    if (rc < 0)
+        return;
+    if (rc > 0) {
+        rc = uring_write(r, &s->shell_in);
+    } else {
+        relay_release(r);
+        rc = s->input_done ? 0 : uring_read(&s->client);
+    }
+    if (rc < 0)
+        session_close(s);
+}
+
+/*
+ * uring_send_frame:
+ *   Version 2: r holds output; write it as a frame, or leave it for
+ *   when the client's current frame is done. It is only compressed
+ *   then, since both sources share the codec's stream and buffer.
+ */
+static void uring_send_frame(struct session *s, struct relay *r)
+{
+    if (s->client_write != NULL)
+        return;
+    s->client_write = r;
+    if (relay_pack(r, r == &s->err_to_client ? FRAME_STDERR : FRAME_STDOUT,
+                   s->compress & COMPRESS_OUT ? &s->zip : NULL) < 0 ||
+        uring_write(r, &s->client) < 0)
+        session_close(s);
+}
+
+/*
+ * uring_start_relay:
+ *   The shell runs: pass on the type-ahead, if any, and start reading
+ *   both sides.
+ */
+static void uring_start_relay(struct session *s)
+{
+    int rc = 0;
+
+    if (s->framed)
+        uring_frames_in(s);
+    else if (relay_waiting(&s->to_shell))
+        rc = uring_forward(&s->to_shell, &s->client, &s->shell_in);
+    else
+        rc = uring_read(&s->client);
+    if (s->closed)
+        return;
+    if (rc < 0 || uring_read(&s->shell_out) < 0 ||
+        (s->shell_err.fd >= 0 && uring_read(&s->shell_err) < 0))
+        session_close(s);
+}
+
+/*
+ * uring_login_done:
+ *   res bytes of login arrived in the line reader.
+ */
+static void uring_login_done(struct session *s, int res)
+{
+    if (res <= 0) {
+        /* client disconnected */
+        session_close(s);
+        return;
+    }
+
+    line_reader_added(&s->login, (size_t)res);
+    session_login_lines(s);
+    if (s->closed)
+        return;
+
+    if (s->state == SESSION_RELAY)
+        uring_start_relay(s);
+    else if (uring_login_read(s) < 0)
+        session_close(s);
+}
+
+/*
+ * uring_starve:
+ *   The buffer ring was empty when ep's read ran; read again when a
+ *   buffer comes back. The wait counts as a request in flight.
+ */
+static void uring_starve(struct endpoint *ep)
+{
+    ep->next_starved = starved;
+    starved = ep;
+    ep->session->inflight++;
+    stats->buffer_waits++;
+}
+
+static void uring_retry_starved(void)
+{
+    while (starved != NULL && buffers_free > 0) {
+        struct endpoint *ep = starved;
+        struct session *s = ep->session;
+
+        starved = ep->next_starved;
+        s->inflight--;
+        if (!s->closed && uring_read(ep) < 0)
+            session_close(s);
+        uring_release(s);
+    }
+}
+
+/*
+ * uring_read_done:
+ *   A read of ep completed, into provided buffer bid if has_buf.
+ */
+static void uring_read_done(struct endpoint *ep, int res, int has_buf, unsigned bid)
+{
+    struct session *s = ep->session;
+    int from_client = ep == &s->client;
+    struct relay *r = from_client ? &s->to_shell :
+                      ep == &s->shell_err ? &s->err_to_client : &s->to_client;
+
+    if (r->writing) {
+        /* The write linked before this read went through in full */
+        r->writing = 0;
+        relay_release(r);
+    }
+
+    if (has_buf)
+        buffers_free--;
+    if (s->closed || res <= 0 || (from_client && !s->framed && s->shell_in.fd < 0)) {
+        /* Nothing to pass on */
+        if (has_buf)
+            buffer_put(bid);
+    }
+    if (s->closed)
+        return;
+
+    if (s->state != SESSION_RELAY) {
+        uring_login_done(s, res);
+        return;
+    }
+
+    if (res == -ENOBUFS) {
+        uring_starve(ep);
+        return;
+    }
+    if (res < 0) {
+        session_close(s);
+        return;
+    }
+
+    if (res == 0) {
+        if (from_client) {
+            session_input_done(s);
+        } else {
+            /* shell closed its output -> shell exited */
+            close_endpoint(ep);
+            session_output_end(s);
+        }
+        return;
+    }
+
+    if (s->framed) {
+        r->buf  = uring_buffer(&buffers, bid);
+        r->held = 1;
+        r->bid  = (unsigned short)bid;
+        if (from_client) {
+            r->scan = 0;
+            r->fill = (size_t)res;
+            uring_frames_in(s);
+            return;
+        }
+        r->start = 0;
+        r->end   = (size_t)res;
+        *r->copied += (unsigned long)res;
+        output_sent(s, (size_t)res);
+        uring_send_frame(s, r);
+        return;
+    }
+
+    *r->copied += (unsigned long)res;
+    if (from_client && s->shell_in.fd < 0) {
+        /* The shell no longer reads its input: drop it, read on */
+        if (uring_read(ep) < 0)
+            session_close(s);
+        return;
+    }
+
+    if (!from_client)
+        output_sent(s, (size_t)res);
+    r->buf   = uring_buffer(&buffers, bid);
+    r->held  = 1;
+    r->bid   = (unsigned short)bid;
+    r->start = 0;
+    r->end   = (size_t)res;
+    if (uring_forward(r, ep, from_client ? &s->shell_in : &s->client) < 0)
+        session_close(s);
+}
+
+/*
+ * uring_write_done:
+ *   A write to ep fell short or failed, and the read linked to it was
+ *   cancelled.
+ */
+static void uring_write_done(struct endpoint *ep, int res)
+{
+    struct session *s = ep->session;
+    int to_shell = ep == &s->shell_in;
+    struct relay *r = to_shell ? &s->to_shell : &s->to_client;
+    struct endpoint *src = to_shell ? &s->client : &s->shell_out;
+
+    r->writing = 0;
+    s->inflight--;
+    if (!s->closed && res >= 0) {
+        /* Short: write the rest, then read on */
+        r->start += (size_t)res;
+        if (uring_forward(r, src, ep) < 0)
+            session_close(s);
+        return;
+    }
+
+    relay_release(r);
+    if (s->closed)
+        return;
+
+    if (to_shell && res == -EPIPE) {
+        /* The shell closed its stdin */
+        session_drop_input(s);
+        if (uring_read(src) < 0)
+            session_close(s);
+        return;
+    }
+    /* client may have disconnected */
+    session_close(s);
+}
+
+/*
+ * uring_frame_written:
+ *   Version 2: a write to ep completed.
+ */
+static void uring_frame_written(struct endpoint *ep, int res)
+{
+    struct session *s = ep->session;
+    int to_shell = ep == &s->shell_in;
+    struct relay *r = to_shell ? &s->to_shell : s->client_write;
+    struct relay *other;
+    struct endpoint *src;
+
+    r->writing = 0;
+    s->inflight--;
+    if (!s->closed && res >= 0) {
+        relay_advance(r, (size_t)res);
+        if (r->start < r->end || r->head_sent < r->head_len) {
+            /* Short: write the rest */
+            if (uring_write(r, ep) < 0)
+                session_close(s);
+            return;
+        }
+    }
+
+    if (to_shell) {
+        if (s->closed) {
+            relay_release(r);
+            return;
+        }
+        if (res < 0) {
+            if (res != -EPIPE) {
+                session_close(s);
+                return;
+            }
+            /* The shell closed its stdin: other frames still count */
+            session_drop_input(s);
+        }
+        r->start = r->end = 0;
+        uring_frames_in(s);
+        return;
+    }
+
+    /* A frame went to the client: its source reads on, and a frame
+     * the other source has waiting goes next */
+    s->client_write = NULL;
+    relay_release(r);
+    if (s->closed)
+        return;
+    if (res < 0) {
+        /* client may have disconnected */
+        session_close(s);
+        return;
+    }
+
+    src   = r == &s->err_to_client ? &s->shell_err : &s->shell_out;
+    other = r == &s->err_to_client ? &s->to_client : &s->err_to_client;
+    if (src->fd >= 0 && uring_read(src) < 0) {
+        session_close(s);
+        return;
+    }
+    if (relay_waiting(other))
+        uring_send_frame(s, other);
+    else
+        session_output_end(s);
+}
+
+/*
+ * uring_accepted:
+ *   The multishot accept delivered a connection, or stopped.
+ */
+static void uring_accepted(int res, unsigned flags)
+{
+    if (res >= 0) {
+        struct session *s = session_open(res, NULL);
+
+        if (s != NULL) {
+            if (!s->closed && uring_login_read(s) < 0)
+                session_close(s);
+            uring_release(s);
+        }
+    } else if (res != -ECANCELED) {
+        errno = -res;
+        perror("accept");
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+        uring_accept();
+}
+
+/*
+ * uring_completion:
+ *   Hand one completion to its endpoint's session.
+ */
+static void uring_completion(const struct io_uring_cqe *cqe)
+{
+    unsigned long long data = cqe->user_data;
+    struct endpoint *ep = (struct endpoint *)(uintptr_t)(data & ~(unsigned long long)UOP_MASK);
+    struct session *s;
+
+    switch (data & UOP_MASK) {
+    case UOP_ACCEPT:
+        uring_accepted(cqe->res, cqe->flags);
+        return;
+    case UOP_CANCEL:
+        return;
+    }
+
+    s = ep->session;
+    if ((data & UOP_MASK) == UOP_READ) {
+        s->inflight--;
+        uring_read_done(ep, cqe->res, (cqe->flags & IORING_CQE_F_BUFFER) != 0,
+                        cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    } else if (s->framed) {
+        uring_frame_written(ep, cqe->res);
+    } else {
+        uring_write_done(ep, cqe->res);
+    }
+    uring_release(s);
+}
+
+/*
+ * uring_loop:
+ *   The worker's loop on io_uring. Returns -1 at once if the kernel
+ *   cannot run it (no io_uring, or no provided buffer rings, which
+ *   came with multishot accept in Linux 5.19), so the worker runs
+ *   server_loop() instead; otherwise only on a fatal error.
+ */
+static int uring_loop(int listen_fd, const struct server_config *config)
+{
+    int flags;
+
+    settings = config;
+
+    if (uring_init(&ring, URING_ENTRIES) < 0) {
+        fprintf(stderr, "server: io_uring unavailable (%s), using epoll\n", strerror(errno));
+        return -1;
+    }
+    if (uring_buffers_init(&ring, &buffers, 0, URING_BUFFERS, RELAY_BUF) < 0) {
+        fprintf(stderr, "server: io_uring buffer rings unavailable (%s), using epoll\n",
+                strerror(errno));
+        uring_free(&ring);
+        return -1;
+    }
+    using_uring   = 1;
+    stats->uring  = 1;
+    buffers_free  = URING_BUFFERS;
+
+    /* Accepts wait in the kernel, so the listener blocks */
+    uring_listen_fd = listen_fd;
+    flags = fcntl(listen_fd, F_GETFL);
+    if (flags < 0 || fcntl(listen_fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        perror("fcntl(listener)");
+        return 0;
+    }
+
+    if (pool_create() < 0 || uring_accept() < 0)
+        return 0;
+
+    for (;;) {
+        struct io_uring_cqe *cqe;
+        int timeout = -1;
+        int rc;
+
+        if (got_sigchld)
+            reap_shells();
+
+        if (pool_wanted()) {
+            if (pool_idle == 0)
+                pool_refill();
+            timeout = POOL_IDLE_MS;
+        }
+
+        rc = uring_submit(&ring, 1, output_timeout(timeout), &wait_sigmask);
+        turn_us = now_us();
+        if (rc < 0) {
+            if (errno == ETIME) {
+                /* Quiet: time to start warm shells, and send corked output */
+                if (pool_filling)
+                    pool_refill();
+                output_flush_idle();
+                continue;
+            }
+            if (errno != EINTR) {
+                perror("io_uring_enter");
+                break;
+            }
+        }
+
+        while ((cqe = uring_peek(&ring)) != NULL) {
+            struct io_uring_cqe done = *cqe;
+
+            uring_seen(&ring);
+            uring_completion(&done);
+        }
+        uring_retry_starved();
+        output_flush_idle();
+    }
+
+    uring_buffers_free(&ring, &buffers);
+    uring_free(&ring);
+    return 0;
 }
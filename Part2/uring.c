@@ -0,0 +1,273 @@
+/*
+ * uring.c
+ *
+ * io_uring on the raw system calls, for the server's io_uring
+ * backend. See uring.h.
+ */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+/* The rings are shared with the kernel: read what it wrote with
+ * acquire, publish what we wrote with release */
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * setup:
+ *   Ask for the cheapest completion handling first: task work run
+ *   only when we wait (DEFER_TASKRUN, kernel 6.1), falling back to
+ *   what older kernels accept.
+ */
+static int setup(unsigned entries, struct io_uring_params *p)
+{
+    unsigned base = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    int fd;
+
+#if defined(IORING_SETUP_SINGLE_ISSUER) && defined(IORING_SETUP_DEFER_TASKRUN)
+    memset(p, 0, sizeof(*p));
+    p->flags = base | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p->cq_entries = entries * 2;
+    fd = sys_io_uring_setup(entries, p);
+    if (fd >= 0 || errno != EINVAL)
+        return fd;
+#endif
+    memset(p, 0, sizeof(*p));
+    p->flags = base;
+    p->cq_entries = entries * 2;
+    return sys_io_uring_setup(entries, p);
+}
+
+int uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    char *sq, *cq;
+
+    memset(u, 0, sizeof(*u));
+    u->fd = setup(entries, &p);
+    if (u->fd < 0)
+        return -1;
+    if ((p.features & needed) != needed) {
+        close(u->fd);
+        errno = EINVAL;
+        return -1;
+    }
+    u->features = p.features;
+
+    /* One mapping holds both rings (FEAT_SINGLE_MMAP) */
+    u->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > u->ring_size)
+        u->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    u->rings = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->rings == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->rings, u->ring_size);
+        close(u->fd);
+        return -1;
+    }
+
+    sq = u->rings;
+    u->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    u->sq_mask    = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_queued  = *u->sq_tail;
+
+    cq = u->rings;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes    = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_free(struct uring *u)
+{
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->rings, u->ring_size);
+    close(u->fd);
+    u->fd = -1;
+}
+
+/* Entries queued and not yet taken by the kernel */
+static unsigned sq_used(const struct uring *u)
+{
+    return u->sq_queued - load_acquire(u->sq_head);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (sq_used(u) >= u->sq_entries) {
+        uring_submit(u, 0, -1, NULL);
+        if (sq_used(u) >= u->sq_entries)
+            return NULL;
+    }
+
+    index = u->sq_queued & u->sq_mask;
+    sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->sq_queued++;
+    return sqe;
+}
+
+void uring_reserve(struct uring *u, unsigned n)
+{
+    if (u->sq_entries - sq_used(u) < n)
+        uring_submit(u, 0, -1, NULL);
+}
+
+int uring_submit(struct uring *u, unsigned wait_nr, int timeout_ms, const sigset_t *sigmask)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    unsigned to_submit;
+    int ret;
+
+    store_release(u->sq_tail, u->sq_queued);
+    to_submit = sq_used(u);
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            ts.tv_sec  = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (unsigned long long)(uintptr_t)&ts;
+        }
+        if (sigmask != NULL)
+            arg.sigmask = (unsigned long long)(uintptr_t)sigmask;
+    } else if (to_submit == 0) {
+        return 0;
+    }
+
+    ret = sys_io_uring_enter(u->fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG,
+                             &arg, sizeof(arg));
+    return ret < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek(struct uring *u)
+{
+    unsigned head = *u->cq_head;
+
+    if (head == load_acquire(u->cq_tail))
+        return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_seen(struct uring *u)
+{
+    store_release(u->cq_head, *u->cq_head + 1);
+}
+
+int uring_buffers_init(struct uring *u, struct uring_buffers *b,
+                       unsigned short group, unsigned count, unsigned size)
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    unsigned i;
+
+    memset(b, 0, sizeof(*b));
+    if (count == 0 || (count & (count - 1)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The ring must be page aligned; the buffers are only touched
+     * when the kernel first reads into them */
+    b->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED)
+        return -1;
+    b->base = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->base == MAP_FAILED) {
+        munmap(b->ring, ring_size);
+        return -1;
+    }
+    b->count = count;
+    b->size  = size;
+    b->group = group;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (unsigned long long)(uintptr_t)b->ring;
+    reg.ring_entries = count;
+    reg.bgid         = group;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int saved_errno = errno;
+        munmap(b->base, (size_t)count * size);
+        munmap(b->ring, ring_size);
+        errno = saved_errno;
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+        uring_buffer_put(b, i);
+    return 0;
+}
+
+void uring_buffers_free(struct uring *u, struct uring_buffers *b)
+{
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->group;
+    sys_io_uring_register(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(b->base, (size_t)b->count * b->size);
+    munmap(b->ring, b->count * sizeof(struct io_uring_buf));
+}
+
+char *uring_buffer(const struct uring_buffers *b, unsigned id)
+{
+    return b->base + (size_t)id * b->size;
+}
+
+void uring_buffer_put(struct uring_buffers *b, unsigned id)
+{
+    struct io_uring_buf *buf = &b->ring->bufs[b->tail & (b->count - 1)];
+
+    buf->addr = (unsigned long long)(uintptr_t)uring_buffer(b, id);
+    buf->len  = b->size;
+    buf->bid  = (unsigned short)id;
+    b->tail++;
+    store_release(&b->ring->tail, b->tail);
+}
@@ -0,0 +1,108 @@
+/*
+ * uring.h
+ *
+ * A small io_uring wrapper for the server's io_uring backend
+ * (ICT374 Remote Shell, Part 2), on the raw system calls rather than
+ * liburing, which is not installed everywhere.
+ *
+ * Requests are queued in the submission ring with uring_get_sqe() and
+ * handed to the kernel, together with the wait for completions, by
+ * one uring_submit(). Completions are read in place with uring_peek()
+ * and uring_seen().
+ *
+ * Reads can leave the choice of buffer to the kernel: a provided
+ * buffer ring (struct uring_buffers) holds buffers the application
+ * has lent it, and a read with IOSQE_BUFFER_SELECT takes one only
+ * when data arrives. Idle connections then hold no buffer at all.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int      fd;
+    unsigned features;          /* IORING_FEAT_* of the kernel */
+
+    /* Submission ring, shared with the kernel */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned  sq_mask;
+    unsigned  sq_entries;
+    unsigned  sq_queued;        /* our tail: entries filled, not yet published */
+    struct io_uring_sqe *sqes;
+
+    /* Completion ring */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned  cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void   *rings;              /* both rings, in one mapping */
+    size_t  ring_size, sqes_size;
+};
+
+struct uring_buffers {
+    struct io_uring_buf_ring *ring;
+    char    *base;              /* count buffers of size bytes each */
+    unsigned count;             /* a power of two */
+    unsigned size;
+    unsigned short group;       /* buffer group id, for sqe->buf_group */
+    unsigned short tail;
+};
+
+/*
+ * Set up a ring with room for entries submissions. Returns 0, or -1
+ * with errno set (ENOSYS: the kernel has no io_uring, EPERM: it is
+ * disabled, EINVAL: it lacks a feature this wrapper needs).
+ */
+int uring_init(struct uring *u, unsigned entries);
+void uring_free(struct uring *u);
+
+/*
+ * A zeroed submission entry to fill in, or NULL if the ring is full
+ * even after submitting what is queued.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+
+/*
+ * Make sure n entries can be queued back to back, submitting what is
+ * queued if needed; linked requests must reach the kernel together.
+ */
+void uring_reserve(struct uring *u, unsigned n);
+
+/*
+ * Submit what is queued and wait for at least wait_nr completions, at
+ * most timeout_ms (-1 for no limit). If sigmask is not NULL, it is the
+ * signal mask for the wait, as with epoll_pwait(). Returns 0, or -1
+ * with errno set (ETIME when the time ran out, EINTR for a signal).
+ */
+int uring_submit(struct uring *u, unsigned wait_nr, int timeout_ms, const sigset_t *sigmask);
+
+/*
+ * The oldest completion not yet seen, or NULL. uring_seen() hands its
+ * slot back to the kernel, after which it must not be used.
+ */
+struct io_uring_cqe *uring_peek(struct uring *u);
+void uring_seen(struct uring *u);
+
+/*
+ * Register count buffers of size bytes as buffer group group, and lend
+ * them all to the kernel. Returns 0, or -1 with errno set.
+ */
+int uring_buffers_init(struct uring *u, struct uring_buffers *b,
+                       unsigned short group, unsigned count, unsigned size);
+void uring_buffers_free(struct uring *u, struct uring_buffers *b);
+
+/*
+ * Buffer id, as reported in a completion's flags, and giving it back
+ * to the kernel once its data has been used.
+ */
+char *uring_buffer(const struct uring_buffers *b, unsigned id);
+void uring_buffer_put(struct uring_buffers *b, unsigned id);
+
+#endif /* URING_H */
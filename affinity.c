@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include "shell.h"
+#include <sched.h>
+#include <sys/resource.h>
+
+/* Placement of pipeline stages on CPUs, set with the pipesched builtin.
+ *
+ * With PLACE_CORES every stage of a job gets a core of its own: one
+ * hardware thread per physical core is used before any SMT sibling,
+ * and cores sharing a last level cache come next to each other so
+ * neighbouring stages still share it where possible. With PLACE_SHARED
+ * stages are packed onto CPUs that share caches: SMT siblings first,
+ * then the rest of the L2 group, then the L3 group. Successive jobs
+ * start where the last one ended so that they do not all pile onto the
+ * first CPUs. Stages may also get a nice value and SCHED_BATCH. */
+
+#define PLACE_OFF 0
+#define PLACE_CORES 1
+#define PLACE_SHARED 2
+
+static const char *place_names[] = { "off", "cores", "shared" };
+
+static int place_policy = PLACE_OFF;
+static int stage_nice = 0;
+static int stage_batch = 0;
+
+/* What is known about one CPU */
+struct CpuInfo {
+    int cpu;
+    int core;       /* first CPU of its SMT siblings */
+    int thread;     /* position among its siblings */
+    int l2;         /* first CPU sharing its L2, or its core */
+    int l3;         /* first CPU sharing its last level cache */
+};
+
+static struct CpuInfo *cpus = NULL;
+static int cpu_count = 0;
+static int *cpu_order[3];     /* CPUs in placement order for each policy */
+static int next_slot = 0;
+
+/* Read a small sysfs file, -1 if it is not there */
+static int readSysfs(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd < 0) {
+        return -1;
+    }
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return 0;
+}
+
+/* Parse a CPU list such as "0-3,8-11" into set */
+static void parseCpuList(const char *list, cpu_set_t *set) {
+    const char *p = list;
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+    while (*p) {
+        first = strtol(p, &end, 10);
+        if (end == p) break;
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+        p = end;
+        if (*p == ',') p++;
+        else break;
+    }
+}
+
+/* First CPU in a sysfs CPU list file, or dflt */
+static int firstInList(const char *path, int dflt) {
+    char buf[1024];
+    cpu_set_t set;
+    int i;
+
+    if (readSysfs(path, buf, sizeof(buf)) < 0) {
+        return dflt;
+    }
+    parseCpuList(buf, &set);
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &set)) return i;
+    }
+    return dflt;
+}
+
+/* The first CPU sharing each cache level of cpu */
+static void readCaches(struct CpuInfo *info) {
+    char path[128];
+    char buf[64];
+    int index;
+    int level;
+
+    info->l2 = info->core;
+    info->l3 = info->core;
+    for (index = 0; index < 8; index++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", info->cpu, index);
+        if (readSysfs(path, buf, sizeof(buf)) < 0) {
+            break;
+        }
+        level = atoi(buf);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", info->cpu, index);
+        if (level == 2) {
+            info->l2 = firstInList(path, info->core);
+        } else if (level >= 3) {
+            info->l3 = firstInList(path, info->l2);
+        }
+    }
+    if (info->l3 == info->core) {
+        info->l3 = info->l2;
+    }
+}
+
+static int compareCores(const void *a, const void *b) {
+    const struct CpuInfo *x = &cpus[*(const int *)a];
+    const struct CpuInfo *y = &cpus[*(const int *)b];
+
+    if (x->thread != y->thread) return x->thread - y->thread;
+    if (x->l3 != y->l3) return x->l3 - y->l3;
+    return x->cpu - y->cpu;
+}
+
+static int compareShared(const void *a, const void *b) {
+    const struct CpuInfo *x = &cpus[*(const int *)a];
+    const struct CpuInfo *y = &cpus[*(const int *)b];
+
+    if (x->l3 != y->l3) return x->l3 - y->l3;
+    if (x->l2 != y->l2) return x->l2 - y->l2;
+    if (x->core != y->core) return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/* Read the topology of the CPUs this shell may run on, once */
+static void loadTopology(void) {
+    cpu_set_t allowed;
+    char path[128];
+    int i, j;
+
+    if (cpus != NULL) {
+        return;
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+
+    cpus = calloc(CPU_COUNT(&allowed), sizeof(struct CpuInfo));
+    if (cpus == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        struct CpuInfo *info;
+
+        if (!CPU_ISSET(i, &allowed)) continue;
+        info = &cpus[cpu_count++];
+        info->cpu = i;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", i);
+        info->core = firstInList(path, i);
+        readCaches(info);
+    }
+
+    /* A sibling's position is the number of siblings below it */
+    for (i = 0; i < cpu_count; i++) {
+        for (j = 0; j < i; j++) {
+            if (cpus[j].core == cpus[i].core) cpus[i].thread++;
+        }
+    }
+
+    for (i = PLACE_CORES; i <= PLACE_SHARED; i++) {
+        cpu_order[i] = malloc(cpu_count * sizeof(int));
+        if (cpu_order[i] == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (j = 0; j < cpu_count; j++) {
+            cpu_order[i][j] = j;
+        }
+        qsort(cpu_order[i], cpu_count, sizeof(int), i == PLACE_CORES ? compareCores : compareShared);
+    }
+}
+
+/* Reserve placement slots for the count stages of a job. Returns the
+ * slot of the first stage, or -1 if stages are not scheduled. */
+int reserveStageSlots(int count) {
+    int slot;
+
+    if (place_policy == PLACE_OFF && stage_nice == 0 && !stage_batch) {
+        return -1;
+    }
+    if (place_policy != PLACE_OFF) {
+        loadTopology();
+    }
+    slot = next_slot;
+    next_slot = cpu_count > 0 ? (next_slot + count) % cpu_count : 0;
+    return slot;
+}
+
+/* Apply the scheduling settings to this process, stage slot of a job */
+void scheduleStage(int slot) {
+    if (place_policy != PLACE_OFF && cpu_count > 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpus[cpu_order[place_policy][slot % cpu_count]].cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("sched_setaffinity");
+        }
+    }
+    if (stage_batch) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        if (sched_setscheduler(0, SCHED_BATCH, &param) < 0) {
+            perror("sched_setscheduler");
+        }
+    }
+    if (stage_nice != 0 && setpriority(PRIO_PROCESS, 0, stage_nice) < 0) {
+        perror("setpriority");
+    }
+}
+
+/* Print the settings and the order CPUs are handed out in */
+static void printSchedule(void) {
+    int i;
+
+    loadTopology();
+    printf("placement: %s\n", place_names[place_policy]);
+    printf("nice: %d\n", stage_nice);
+    printf("batch: %s\n", stage_batch ? "on" : "off");
+    printf("%6s %6s %6s %6s %6s\n", "cpu", "core", "thread", "l2", "l3");
+    for (i = 0; i < cpu_count; i++) {
+        printf("%6d %6d %6d %6d %6d\n", cpus[i].cpu, cpus[i].core, cpus[i].thread, cpus[i].l2, cpus[i].l3);
+    }
+    if (place_policy != PLACE_OFF) {
+        printf("order:");
+        for (i = 0; i < cpu_count; i++) {
+            printf(" %d", cpus[cpu_order[place_policy][i]].cpu);
+        }
+        printf("\n");
+    }
+}
+
+/* pipesched [off | cores | shared] [-n nice] [-b | +b]
+ * Without arguments prints the settings and the CPU topology. */
+int builtInPipesched(struct Command_struct *cmd) {
+    int i;
+
+    if (cmd->argc == 1) {
+        printSchedule();
+        return 0;
+    }
+
+    for (i = 1; i < cmd->argc; i++) {
+        const char *arg = cmd->argv[i];
+
+        if (strcmp(arg, "off") == 0) {
+            place_policy = PLACE_OFF;
+        } else if (strcmp(arg, "cores") == 0) {
+            place_policy = PLACE_CORES;
+        } else if (strcmp(arg, "shared") == 0) {
+            place_policy = PLACE_SHARED;
+        } else if (strcmp(arg, "-b") == 0) {
+            stage_batch = 1;
+        } else if (strcmp(arg, "+b") == 0) {
+            stage_batch = 0;
+        } else if (strcmp(arg, "-n") == 0 && i + 1 < cmd->argc) {
+            char *end;
+            long n = strtol(cmd->argv[++i], &end, 10);
+            if (*end != '\0' || n < -20 || n > 19) {
+                fprintf(stderr, "pipesched: %s: invalid nice value\n", cmd->argv[i]);
+                return 1;
+            }
+            stage_nice = (int)n;
+        } else {
+            fprintf(stderr, "pipesched: usage: pipesched [off | cores | shared] [-n nice] [-b | +b]\n");
+            return 2;
+        }
+    }
+    next_slot = 0;
+    return 0;
+}
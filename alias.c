@@ -0,0 +1,130 @@
+#include "shell.h"
+#include <ctype.h>
+
+/* Defined aliases are in the shell context. The value of each is
+ * parsed once, when it is defined, and copied into the command line
+ * wherever it is used. */
+
+/* Check if name can be used as an alias name */
+static int isAliasName(const char *name) {
+    const char *p;
+
+    if (*name == '\0') return 0;
+    for (p = name; *p; p++) {
+        if (isspace((unsigned char)*p) || isSpecialChar(*p) ||
+            strchr("=$`\\/", *p) != NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Find an alias by name, NULL if there is none */
+struct Alias *findAlias(const char *name) {
+    int i;
+
+    for (i = 0; i < shell->alias_count; i++) {
+        if (strcmp(shell->aliases[i].name, name) == 0) {
+            return &shell->aliases[i];
+        }
+    }
+    return NULL;
+}
+
+/* Define or redefine an alias. Returns -1 if the name or the value
+ * are not valid. */
+int defineAlias(const char *name, const char *value) {
+    struct Alias *alias;
+    struct Node *tree;
+    char *text;
+    int rc;
+
+    if (!isAliasName(name)) {
+        fprintf(stderr, "alias: `%s': invalid alias name\n", name);
+        return -1;
+    }
+
+    text = strdup(value);
+    rc = parseAliasValue(text, &tree);
+    free(text);
+    if (rc < 0) {
+        fprintf(stderr, "alias: %s: invalid alias value\n", name);
+        return -1;
+    }
+
+    alias = findAlias(name);
+    if (alias == NULL) {
+        if (shell->alias_count == shell->alias_capacity) {
+            int new_capacity = shell->alias_capacity ? shell->alias_capacity * 2 : 16;
+            struct Alias *new_aliases = realloc(shell->aliases, new_capacity * sizeof(struct Alias));
+            if (new_aliases == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            shell->aliases = new_aliases;
+            shell->alias_capacity = new_capacity;
+        }
+        alias = &shell->aliases[shell->alias_count++];
+        alias->name = strdup(name);
+    } else {
+        free(alias->value);
+        freeNode(alias->tree);
+    }
+
+    alias->value = strdup(value);
+    alias->tree = tree;
+    return 0;
+}
+
+/* Remove an alias. Returns -1 if there is no such alias. */
+int removeAlias(const char *name) {
+    struct Alias *alias = findAlias(name);
+
+    if (alias == NULL) {
+        return -1;
+    }
+    free(alias->name);
+    free(alias->value);
+    freeNode(alias->tree);
+    *alias = shell->aliases[--shell->alias_count];
+    return 0;
+}
+
+/* Remove every alias */
+void removeAllAliases(void) {
+    while (shell->alias_count > 0) {
+        removeAlias(shell->aliases[0].name);
+    }
+}
+
+/* Remove every alias and free the table */
+void freeAliases(void) {
+    removeAllAliases();
+    free(shell->aliases);
+    shell->aliases = NULL;
+    shell->alias_capacity = 0;
+}
+
+/* Print an alias in a form that can be read back */
+void printAlias(struct Alias *alias) {
+    const char *p;
+
+    printf("alias %s='", alias->name);
+    for (p = alias->value; *p; p++) {
+        if (*p == '\'') {
+            printf("'\\''");
+        } else {
+            putchar(*p);
+        }
+    }
+    printf("'\n");
+}
+
+/* Print every alias */
+void printAliases(void) {
+    int i;
+
+    for (i = 0; i < shell->alias_count; i++) {
+        printAlias(&shell->aliases[i]);
+    }
+}
@@ -0,0 +1,411 @@
+/* Interactive latency benchmark: runs myshell under a pseudo-terminal,
+ * replays keystroke scripts and times how long each takes to show up:
+ *
+ *   latency.key_echo      a typed character until it is echoed
+ *   latency.enter_prompt  Enter until the next prompt is drawn
+ *   latency.backspace     a backspace until the character is rubbed out
+ *   latency.history_up    Up until the previous command is drawn
+ *   latency.history_down  Down until the line is cleared again
+ *   latency.paste         a long line written at once until fully echoed
+ *   latency.erase         as many backspaces at once until all are done
+ *
+ * Each result is a JSON line with the median and p99 in nanoseconds,
+ * and the write system calls per key byte sent of each process taken
+ * from syscw in /proc/<pid>/io.
+ *
+ * With -r port the keystrokes go through the remote pair instead: the
+ * server from Part2 is started on port with the shell, and the client
+ * runs on a raw pseudo-terminal so each key travels to the shell and
+ * its echo back through the server, as a user would see it.
+ *
+ * usage: bench/latency_bench [-n rounds] [-r port] [-s shell] [-p paste] */
+#define _GNU_SOURCE
+#include "../shell.h"
+#include <dirent.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define MARK "lat:"
+#define TIMEOUT_MS 5000
+#define MAX_PROCS 3
+
+static int master = -1;
+
+/* Output seen since the last key was sent */
+static char *seen;
+static size_t seen_len, seen_cap;
+
+/* Processes whose write calls are counted */
+static const char *proc_names[MAX_PROCS];
+static pid_t procs[MAX_PROCS];
+static int nprocs = 0;
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* syscw of pid, -1 if it cannot be read */
+static long long writeCalls(pid_t pid) {
+    char path[64], buf[512];
+    char *p;
+    int fd;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    p = strstr(buf, "syscw: ");
+    return p ? atoll(p + 7) : -1;
+}
+
+/* The child of parent that has written the most, or -1: the logged-in
+ * shell rather than the server's idle warm ones */
+static pid_t findChild(pid_t parent) {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    pid_t found = -1;
+    long long most = -2;
+
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        char path[300], buf[512];
+        char *p;
+        int fd;
+        ssize_t n;
+
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        if ((fd = open(path, O_RDONLY)) < 0) continue;
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0) continue;
+        buf[n] = '\0';
+        /* pid (comm) state ppid ...; comm may hold spaces */
+        if ((p = strrchr(buf, ')')) != NULL && atoi(p + 4) == parent &&
+            writeCalls(atoi(entry->d_name)) > most) {
+            found = atoi(entry->d_name);
+            most = writeCalls(found);
+        }
+    }
+    if (dir != NULL) closedir(dir);
+    return found;
+}
+
+/* Append what the terminal has to seen, waiting up to ms */
+static int readOutput(int ms) {
+    struct pollfd pfd = { master, POLLIN, 0 };
+    char buf[4096];
+    ssize_t n;
+
+    if (poll(&pfd, 1, ms) <= 0) return 0;
+    n = read(master, buf, sizeof(buf));
+    if (n <= 0) {
+        fprintf(stderr, "latency_bench: terminal closed\n");
+        exit(1);
+    }
+    if (seen_len + n + 1 > seen_cap) {
+        seen_cap = (seen_len + n + 1) * 2;
+        seen = realloc(seen, seen_cap);
+        if (seen == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(seen + seen_len, buf, n);
+    seen_len += n;
+    seen[seen_len] = '\0';
+    return 1;
+}
+
+/* Wait until expect has been output since seen was last emptied */
+static void awaitOutput(const char *expect, size_t expect_len, long long start) {
+    long long deadline = start + TIMEOUT_MS * 1000000LL;
+
+    while (seen == NULL || memmem(seen, seen_len, expect, expect_len) == NULL) {
+        if (nowNs() > deadline) {
+            fprintf(stderr, "latency_bench: timed out waiting for \"%.*s\", got \"%.*s\"\n",
+                    (int)(expect_len > 40 ? 40 : expect_len), expect, (int)(seen_len > 200 ? 200 : seen_len), seen ? seen : "");
+            exit(1);
+        }
+        readOutput(10);
+    }
+}
+
+/* Send keys and wait until expect has been output, returning the time
+ * taken in nanoseconds */
+static long long sendKeys(const char *keys, size_t len, const char *expect, size_t expect_len) {
+    long long start;
+    size_t done = 0;
+    ssize_t n;
+
+    /* Anything still arriving belongs to the previous key */
+    while (readOutput(0));
+    seen_len = 0;
+
+    start = nowNs();
+    while (done < len) {
+        n = write(master, keys + done, len - done);
+        if (n < 0 && errno != EINTR && errno != EAGAIN) {
+            perror("write");
+            exit(1);
+        }
+        if (n > 0) done += n;
+        /* A long paste only fits as the other side reads it */
+        if (done < len) readOutput(1);
+    }
+    awaitOutput(expect, expect_len, start);
+    return nowNs() - start;
+}
+
+/* Wait for quiet output, such as after login */
+static void settle(int ms) {
+    while (readOutput(ms));
+}
+
+/* Wait for text without sending anything, keeping what came before */
+static void waitFor(const char *text) {
+    awaitOutput(text, strlen(text), nowNs());
+}
+
+/* Samples of one measurement and the write calls it took */
+struct Result {
+    const char *name;
+    long long *samples;
+    int count, cap;
+    long long keys;
+    long long writes[MAX_PROCS];
+};
+
+static void addSample(struct Result *r, long long ns, size_t keys) {
+    if (r->count == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 64;
+        r->samples = realloc(r->samples, r->cap * sizeof(long long));
+        if (r->samples == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    r->samples[r->count++] = ns;
+    r->keys += keys;
+}
+
+/* Time one step, charging its write calls to r */
+static void step(struct Result *r, const char *keys, size_t len, const char *expect, size_t expect_len) {
+    long long before[MAX_PROCS];
+    long long ns;
+    int i;
+
+    for (i = 0; i < nprocs; i++) before[i] = writeCalls(procs[i]);
+    ns = sendKeys(keys, len, expect, expect_len);
+    /* Let the last writes land before counting */
+    settle(2);
+    for (i = 0; i < nprocs; i++) r->writes[i] += writeCalls(procs[i]) - before[i];
+    addSample(r, ns, len);
+}
+
+static int compareLongs(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(struct Result *r, const char *mode) {
+    int p99 = (int)(r->count * 0.99 + 0.99) - 1;
+    int i;
+
+    if (r->count == 0) return;
+    qsort(r->samples, r->count, sizeof(long long), compareLongs);
+    printf("{\"name\": \"%s\", \"kind\": \"latency\", \"mode\": \"%s\", \"unit\": \"ns\", \"samples\": %d, "
+           "\"median\": %lld, \"p99\": %lld, \"max\": %lld, \"writes_per_key\": {",
+           r->name, mode, r->count, r->samples[r->count / 2], r->samples[p99 < 0 ? 0 : p99],
+           r->samples[r->count - 1]);
+    for (i = 0; i < nprocs; i++) {
+        printf("%s\"%s\": %.3f", i ? ", " : "", proc_names[i], (double)r->writes[i] / r->keys);
+    }
+    printf("}}\n");
+    fflush(stdout);
+}
+
+/* Start prog under a new pseudo-terminal, raw if asked */
+static pid_t startOnPty(char **argv, int raw) {
+    struct winsize ws = { 40, 200, 0, 0 };
+    pid_t pid = forkpty(&master, NULL, NULL, &ws);
+
+    if (pid < 0) {
+        perror("forkpty");
+        exit(1);
+    }
+    if (pid == 0) {
+        if (raw) {
+            struct termios t;
+            tcgetattr(STDIN_FILENO, &t);
+            cfmakeraw(&t);
+            tcsetattr(STDIN_FILENO, TCSANOW, &t);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t startServer(const char *server, int port, const char *shell) {
+    char port_str[16];
+    struct sockaddr_in addr;
+    pid_t pid;
+    int tries, fd;
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(server, server, "-p", port_str, "-s", shell, (char *)NULL);
+        perror(server);
+        _exit(127);
+    }
+
+    /* Wait until it accepts connections */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (tries = 0; tries < 200; tries++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            close(fd);
+            return pid;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    fprintf(stderr, "latency_bench: server did not start on port %d\n", port);
+    kill(pid, SIGTERM);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *typed = "echo hello world";
+    char shell[PATH_MAX];
+    char server[PATH_MAX], client[PATH_MAX];
+    struct Result key_echo = { .name = "latency.key_echo" }, enter = { .name = "latency.enter_prompt" };
+    struct Result backspace = { .name = "latency.backspace" }, up = { .name = "latency.history_up" };
+    struct Result down = { .name = "latency.history_down" }, paste = { .name = "latency.paste" };
+    struct Result erase = { .name = "latency.erase" };
+    struct Result *results[] = { &key_echo, &enter, &backspace, &up, &down, &paste, &erase };
+    char *paste_keys, *erase_keys, *erase_echo;
+    int rounds = 50, port = 0, paste_len = 1000;
+    pid_t top, server_pid = -1;
+    int opt, i, j;
+
+    if (realpath("myshell", shell) == NULL) snprintf(shell, sizeof(shell), "./myshell");
+    snprintf(server, sizeof(server), "Part2/server");
+    snprintf(client, sizeof(client), "Part2/client");
+    while ((opt = getopt(argc, argv, "n:r:s:p:")) != -1) {
+        switch (opt) {
+        case 'n': rounds = atoi(optarg); break;
+        case 'r': port = atoi(optarg); break;
+        case 's': snprintf(shell, sizeof(shell), "%s", optarg); break;
+        case 'p': paste_len = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n rounds] [-r port] [-s shell] [-p paste]\n", argv[0]);
+            return 2;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (port == 0) {
+        char *args[] = { shell, NULL };
+        top = startOnPty(args, 0);
+        procs[nprocs] = top;
+        proc_names[nprocs++] = "shell";
+        waitFor("% ");
+    } else {
+        char port_str[16];
+        char *args[] = { client, "127.0.0.1", port_str, NULL };
+        pid_t relay, shell_pid;
+
+        snprintf(port_str, sizeof(port_str), "%d", port);
+        server_pid = startServer(server, port, shell);
+        top = startOnPty(args, 1);
+        waitFor("Username: ");
+        sendKeys("test\n", 5, "Password: ", 10);
+        sendKeys("test\n", 5, "% ", 2);
+
+        /* The shell is the last process down from the server and the
+         * relay is its parent, the server itself or one of its
+         * processes */
+        relay = server_pid;
+        while ((shell_pid = findChild(relay)) > 0 && findChild(shell_pid) > 0) {
+            relay = shell_pid;
+        }
+        procs[nprocs] = top;
+        proc_names[nprocs++] = "client";
+        procs[nprocs] = relay;
+        proc_names[nprocs++] = "relay";
+        if (shell_pid > 0) {
+            procs[nprocs] = shell_pid;
+            proc_names[nprocs++] = "shell";
+        }
+    }
+    settle(50);
+    sendKeys("prompt " MARK "\n", strlen("prompt " MARK "\n"), MARK " ", strlen(MARK " "));
+
+    paste_keys = malloc(paste_len);
+    erase_keys = malloc(paste_len);
+    erase_echo = malloc(paste_len * 3);
+    for (i = 0; i < paste_len; i++) {
+        paste_keys[i] = 'a' + i % 26;
+        erase_keys[i] = 127;
+        memcpy(erase_echo + i * 3, "\b \b", 3);
+    }
+
+    for (i = 0; i < rounds; i++) {
+        /* Type a command and run it */
+        for (j = 0; typed[j]; j++) {
+            step(&key_echo, typed + j, 1, typed + j, 1);
+        }
+        step(&enter, "\n", 1, MARK " ", strlen(MARK " "));
+
+        /* Type a word and rub it out */
+        for (j = 0; j < 8; j++) {
+            step(&key_echo, "abcdefgh" + j, 1, "abcdefgh" + j, 1);
+        }
+        for (j = 0; j < 8; j++) {
+            step(&backspace, "\177", 1, "\b \b", 3);
+        }
+
+        /* Recall the command and go back to an empty line */
+        step(&up, "\033[A", 3, typed, strlen(typed));
+        step(&down, "\033[B", 3, "\b \b", 3);
+
+        /* A long paste, then erase it all at once */
+        if (paste_len > 0 && paste_len < MAX_LINE_LENGTH && i % 5 == 0) {
+            step(&paste, paste_keys, paste_len, paste_keys + paste_len - 26, 26);
+            step(&erase, erase_keys, paste_len, erase_echo, paste_len * 3);
+        }
+    }
+
+    for (i = 0; i < (int)(sizeof(results) / sizeof(results[0])); i++) {
+        report(results[i], port ? "remote" : "local");
+    }
+
+    sendKeys("exit\n", 5, "exit", 4);
+    close(master);
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+    }
+    while (wait(NULL) > 0);
+    return 0;
+}
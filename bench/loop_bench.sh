@@ -0,0 +1,46 @@
+#!/bin/sh
+# Loop benchmark: runs a loop of builtin-only work (assignments and an
+# if) through myshell at two sizes and compares time and heap
+# allocations. The script is compiled once and the loop body runs from
+# bytecode, so the allocation counts of the two runs should differ only
+# by the few buffer doublings needed to hold the longer word list.
+#
+# usage: bench/loop_bench.sh [small] [large]
+
+MYSHELL=${MYSHELL:-./myshell}
+COUNTER=${COUNTER:-bench/malloc_count.so}
+SMALL=${1:-1000}
+LARGE=${2:-1000000}
+TMP=${TMPDIR:-/tmp}/loop_bench.$$
+
+trap 'rm -f $TMP.*' EXIT
+
+# run_loop n: prints "n nanoseconds allocations"
+run_loop() {
+    cat > $TMP.sh <<SCRIPT
+for i in \$(seq $1); do
+    x=\$i
+    if y=\$x; then
+        z=\$y
+    fi
+done
+SCRIPT
+    start=$(date +%s%N)
+    MALLOC_COUNT_FILE=$TMP.count LD_PRELOAD=$COUNTER $MYSHELL $TMP.sh || exit 1
+    end=$(date +%s%N)
+    echo "$1 $((end - start)) $(cat $TMP.count)"
+}
+
+small=$(run_loop $SMALL)
+large=$(run_loop $LARGE)
+
+echo "$small
+$large" | awk '
+    { n[NR] = $1; ns[NR] = $2; allocs[NR] = $3 }
+    END {
+        printf "%12s %12s %10s %12s\n", "iterations", "time (ms)", "ns/iter", "allocations"
+        for (i = 1; i <= 2; i++) {
+            printf "%12d %12.1f %10.1f %12d\n", n[i], ns[i] / 1e6, ns[i] / n[i], allocs[i]
+        }
+        printf "allocations per iteration: %.6f\n", (allocs[2] - allocs[1]) / (n[2] - n[1])
+    }'
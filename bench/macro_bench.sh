@@ -0,0 +1,58 @@
+#!/bin/sh
+# Whole-shell benchmarks, printed as one JSON object per line with the
+# median and 99th percentile of RUNS timed runs of myshell:
+#
+#   pipeline.bigbig  cat | grep | sort | uniq -c over tests/bigbig.txt
+#   script.10000_lines  a generated script of builtins and assignments
+#
+# With few runs the p99 is the slowest run.
+#
+# usage: bench/macro_bench.sh [runs]
+
+MYSHELL=${MYSHELL:-./myshell}
+INPUT=${INPUT:-tests/bigbig.txt}
+RUNS=${1:-10}
+LINES=10000
+TMP=${TMPDIR:-/tmp}/macro_bench.$$
+
+trap 'rm -f $TMP.*' EXIT
+
+sh bench/make_input.sh $INPUT || exit 1
+
+# time_runs script: prints the nanoseconds of each of RUNS runs
+time_runs() {
+    i=0
+    while [ $i -lt $RUNS ]; do
+        start=$(date +%s%N)
+        $MYSHELL $1 > /dev/null || exit 1
+        end=$(date +%s%N)
+        echo $((end - start))
+        i=$((i + 1))
+    done
+}
+
+# report name per work: reads run times and prints the result line,
+# with the work done per run in per so a rate can be given
+report() {
+    sort -n | awk -v name=$1 -v per=$2 -v work=$3 '{ t[NR] = $1 } END {
+        p99 = int(NR * 0.99 + 0.99)
+        median = t[int(NR / 2) + 1]
+        printf "{\"name\": \"%s\", \"kind\": \"macro\", \"unit\": \"ns\", \"samples\": %d, \"median\": %.1f, \"p99\": %.1f, \"%s\": %.1f}\n",
+               name, NR, median, t[p99], per, work / (median / 1e9)
+    }'
+}
+
+echo "cat $INPUT | grep e | sort | uniq -c" > $TMP.pipe
+time_runs $TMP.pipe | report pipeline.bigbig bytes_per_s $(wc -c < $INPUT)
+
+awk -v lines=$LINES 'BEGIN {
+    for (i = 0; i < lines; i++) {
+        k = i % 5
+        if (k == 0) print "x=" i
+        else if (k == 1) print "echo \"line $x\""
+        else if (k == 2) print "[ $x -gt 5 ] && y=$x"
+        else if (k == 3) print "printf \"%05d\\n\" $x"
+        else print "test -n \"$y\" || true"
+    }
+}' > $TMP.sh
+time_runs $TMP.sh | report script.10000_lines lines_per_s $LINES
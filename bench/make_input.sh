@@ -0,0 +1,19 @@
+#!/bin/sh
+# Writes about 40 MB of lines of random words to the file given, the
+# input the pipeline benchmarks read, unless it is already there.
+#
+# usage: bench/make_input.sh file
+
+INPUT=${1:-tests/bigbig.txt}
+
+[ -f $INPUT ] && exit 0
+awk 'BEGIN {
+    srand(1)
+    split("alpha beta gamma delta epsilon zeta eta theta iota kappa lambda mu nu xi omicron pi rho sigma tau upsilon phi chi psi omega", w, " ")
+    for (i = 0; i < 1000000; i++) {
+        line = ""
+        n = 3 + int(rand() * 6)
+        for (j = 0; j < n; j++) line = line w[1 + int(rand() * 24)] " "
+        print line int(rand() * 100000)
+    }
+}' > $INPUT.tmp && mv $INPUT.tmp $INPUT
@@ -0,0 +1,61 @@
+/* Allocation counter for the benchmarks.
+ *
+ * Preloaded into myshell (LD_PRELOAD=bench/malloc_count.so), it counts
+ * calls to malloc, calloc and realloc and writes the total to the file
+ * named by MALLOC_COUNT_FILE when the process exits. It removes itself
+ * from the environment at startup so the commands the shell runs are
+ * not counted. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations = 0;
+static char *report_path = NULL;
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+__attribute__((constructor))
+static void startCounting(void) {
+    char *path = getenv("MALLOC_COUNT_FILE");
+
+    if (path != NULL) {
+        report_path = __libc_malloc(strlen(path) + 1);
+        strcpy(report_path, path);
+    }
+    unsetenv("LD_PRELOAD");
+    unsetenv("MALLOC_COUNT_FILE");
+    allocations = 0;
+}
+
+__attribute__((destructor))
+static void report(void) {
+    unsigned long total = allocations;
+    FILE *f;
+
+    if (report_path == NULL) {
+        return;
+    }
+    f = fopen(report_path, "w");
+    if (f != NULL) {
+        fprintf(f, "%lu\n", total);
+        fclose(f);
+    }
+}
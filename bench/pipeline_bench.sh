@@ -0,0 +1,44 @@
+#!/bin/sh
+# Pipeline placement benchmark: times cat | grep | sort | uniq -c over
+# tests/bigbig.txt through myshell under each pipesched setting and
+# prints the median of RUNS runs with the throughput over the input.
+# tests/bigbig.txt is generated if it does not exist.
+#
+# usage: bench/pipeline_bench.sh [runs]
+
+MYSHELL=${MYSHELL:-./myshell}
+INPUT=${INPUT:-tests/bigbig.txt}
+RUNS=${1:-5}
+TMP=${TMPDIR:-/tmp}/pipeline_bench.$$
+
+trap 'rm -f $TMP.*' EXIT
+
+sh bench/make_input.sh $INPUT || exit 1
+bytes=$(wc -c < $INPUT)
+
+# run_setting settings...: prints the median time in nanoseconds
+run_setting() {
+    cat > $TMP.sh <<SCRIPT
+pipesched $*
+cat $INPUT | grep e | sort | uniq -c > /dev/null
+SCRIPT
+    i=0
+    while [ $i -lt $RUNS ]; do
+        start=$(date +%s%N)
+        $MYSHELL $TMP.sh || exit 1
+        end=$(date +%s%N)
+        echo $((end - start))
+        i=$((i + 1))
+    done | sort -n | awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }'
+}
+
+echo "cpus: $(getconf _NPROCESSORS_ONLN), input: $bytes bytes, median of $RUNS runs"
+printf "%-22s %12s %10s\n" "setting" "time (ms)" "MB/s"
+for setting in "off" "cores" "shared" "cores -n 10 -b" "shared -n 10 -b"; do
+    ns=$(run_setting $setting)
+    echo "$setting $ns $bytes" | awk '{
+        ns = $(NF - 1); bytes = $NF
+        $(NF - 1) = ""; $NF = ""
+        printf "%-22s %12.1f %10.1f\n", $0, ns / 1e6, bytes / 1e6 / (ns / 1e9)
+    }'
+done
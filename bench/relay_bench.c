@@ -0,0 +1,473 @@
+/* Relay benchmark for Part2's server: many sessions at once, each with
+ * a command streaming output, compared between the server's event
+ * loops (-E epoll and -E uring):
+ *
+ *   relay.stream  how long a record takes from the command's write to
+ *                 the client's read, through the shell's pipe, the
+ *                 server worker and the socket, with the median, p99
+ *                 and max in nanoseconds; and the system calls the
+ *                 worker makes per MB relayed
+ *
+ * The sessions run this program as the emitter (-e): it writes records
+ * of a fixed size at a fixed pace, each starting with the time it was
+ * written. The latencies are taken first; then the worker is traced
+ * with ptrace for as long again to count its system calls, since
+ * tracing slows it down. Requests io_uring completes in the kernel are
+ * not system calls and are not counted, which is the point.
+ *
+ * usage: bench/relay_bench [-n sessions] [-t seconds] [-i interval_ms]
+ *                          [-b record_bytes] [-r port] [-s shell] [-E loop] */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/ptrace.h>
+
+#define MARK "relay_bench:start\n"
+#define STAMP_LEN 19            /* digits of the time in a record */
+#define START_TIMEOUT_S 60
+
+struct Session {
+    int fd;
+    int started;                /* MARK seen, records follow */
+    char *buf;                  /* the record being received */
+    int len;
+};
+
+static int record_bytes = 2048;
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Emitter: every interval_us write a record stamped with the time,
+ * for seconds */
+static int emit(int interval_us, int seconds) {
+    char *rec = malloc(record_bytes);
+    struct timespec next;
+    long long end = nowNs() + seconds * 1000000000LL;
+
+    if (rec == NULL) return 1;
+    memset(rec, 'x', record_bytes);
+    rec[record_bytes - 1] = '\n';
+    if (write(STDOUT_FILENO, MARK, strlen(MARK)) < 0) return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (nowNs() < end) {
+        char stamp[STAMP_LEN + 1];
+        ssize_t done = 0;
+
+        next.tv_nsec += interval_us * 1000L;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        snprintf(stamp, sizeof(stamp), "%0*lld", STAMP_LEN, nowNs());
+        memcpy(rec, stamp, STAMP_LEN);
+        while (done < record_bytes) {
+            ssize_t n = write(STDOUT_FILENO, rec + done, record_bytes - done);
+            if (n < 0) return 1;
+            done += n;
+        }
+    }
+    return 0;
+}
+
+/* Latency samples */
+
+static long long *samples;
+static int nsamples, samples_cap;
+
+static void addSample(long long ns) {
+    if (nsamples == samples_cap) {
+        samples_cap = samples_cap ? samples_cap * 2 : 4096;
+        samples = realloc(samples, samples_cap * sizeof(long long));
+        if (samples == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    samples[nsamples++] = ns;
+}
+
+static int compareLongs(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Processes */
+
+static pid_t startServer(const char *server, int port, const char *shell, const char *loop) {
+    char port_str[16];
+    struct sockaddr_in addr;
+    pid_t pid;
+    int tries, fd;
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(server, server, "-p", port_str, "-s", shell, "-w", "1", "-E", loop, (char *)NULL);
+        perror(server);
+        _exit(127);
+    }
+
+    /* Wait until it accepts connections */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (tries = 0; tries < 200; tries++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            close(fd);
+            return pid;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    fprintf(stderr, "relay_bench: server did not start on port %d\n", port);
+    kill(pid, SIGTERM);
+    exit(1);
+}
+
+/* The first child of parent found, or -1: the server's only worker */
+static pid_t findChild(pid_t parent) {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    pid_t found = -1;
+
+    while (dir != NULL && found < 0 && (entry = readdir(dir)) != NULL) {
+        char path[300], buf[512];
+        char *p;
+        int fd, ppid;
+        ssize_t n;
+
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) continue;
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0) continue;
+        buf[n] = '\0';
+        /* pid (comm) state ppid ... */
+        p = strrchr(buf, ')');
+        if (p != NULL && sscanf(p + 1, " %*c %d", &ppid) == 1 && ppid == parent) {
+            found = atoi(entry->d_name);
+        }
+    }
+    if (dir != NULL) closedir(dir);
+    return found;
+}
+
+/* Counting system calls */
+
+static volatile sig_atomic_t time_up;
+
+static void onAlarm(int sig) {
+    (void)sig;
+    time_up = 1;
+}
+
+/* Tracer: count the system calls pid enters for seconds and write the
+ * count to out */
+static void countSyscalls(pid_t pid, int seconds, int out) {
+    struct sigaction sa;
+    long long count = 0;
+    int status;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onAlarm;
+    sigaction(SIGALRM, &sa, NULL);      /* no SA_RESTART: waitpid returns */
+
+    if (ptrace(PTRACE_SEIZE, pid, NULL, (void *)PTRACE_O_TRACESYSGOOD) < 0 ||
+        ptrace(PTRACE_INTERRUPT, pid, NULL, NULL) < 0) {
+        perror("ptrace");
+        count = -1;
+        if (write(out, &count, sizeof(count)) < 0) _exit(1);
+        _exit(1);
+    }
+    alarm(seconds);
+
+    while (!time_up) {
+        int sig = 0;
+
+        if (waitpid(pid, &status, __WALL) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) break;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct ptrace_syscall_info info;
+
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                count++;
+            }
+        } else if (status >> 16 == 0) {
+            /* A signal for the worker, pass it on */
+            sig = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig);
+    }
+
+    /* Stop it once more to let go */
+    ptrace(PTRACE_INTERRUPT, pid, NULL, NULL);
+    while (waitpid(pid, &status, __WALL) == pid && WIFSTOPPED(status)) {
+        if (ptrace(PTRACE_DETACH, pid, NULL, NULL) == 0) break;
+    }
+    if (write(out, &count, sizeof(count)) < 0) _exit(1);
+    _exit(0);
+}
+
+/* Receiving */
+
+static struct Session *sessions;
+static int nsessions;
+static long long received;      /* record bytes */
+
+/* Take in what session s sent; record latencies if sampling */
+static int receive(struct Session *s, int sampling) {
+    char buf[65536];
+    ssize_t n = read(s->fd, buf, sizeof(buf));
+    long long now = nowNs();
+    char *p = buf;
+
+    if (n <= 0) {
+        return n < 0 && errno == EAGAIN ? 0 : -1;
+    }
+    if (!s->started) {
+        /* Login replies and the prompt come first */
+        char *mark = memmem(buf, n, MARK, strlen(MARK));
+        if (mark == NULL) return 0;
+        s->started = 1;
+        p = mark + strlen(MARK);
+    }
+    while (p < buf + n) {
+        int take = record_bytes - s->len;
+
+        if (take > buf + n - p) take = buf + n - p;
+        memcpy(s->buf + s->len, p, take);
+        s->len += take;
+        p += take;
+        if (s->len == record_bytes) {
+            char stamp[STAMP_LEN + 1];
+
+            memcpy(stamp, s->buf, STAMP_LEN);
+            stamp[STAMP_LEN] = '\0';
+            if (sampling) addSample(now - atoll(stamp));
+            s->len = 0;
+            received += record_bytes;
+        }
+    }
+    return 0;
+}
+
+/* Read whatever arrives until the time given, at least what is there */
+static void drain(int ep, long long until, int sampling) {
+    struct epoll_event events[256];
+
+    do {
+        int n = epoll_wait(ep, events, 256, nowNs() < until ? 10 : 0);
+        int i;
+
+        for (i = 0; i < n; i++) {
+            struct Session *s = events[i].data.ptr;
+            if (receive(s, sampling) < 0) {
+                epoll_ctl(ep, EPOLL_CTL_DEL, s->fd, NULL);
+            }
+        }
+    } while (nowNs() < until);
+}
+
+static int startedCount(void) {
+    int i, count = 0;
+
+    for (i = 0; i < nsessions; i++) count += sessions[i].started;
+    return count;
+}
+
+/* One run against the server with loop */
+static void run(const char *loop, const char *server, int port, const char *shell,
+                const char *self, int interval_ms, int seconds) {
+    char command[PATH_MAX + 128];
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    pid_t server_pid, worker, tracer;
+    long long count = -1, start, bytes;
+    int ep, i, pipefd[2];
+    double window_s;
+
+    server_pid = startServer(server, port, shell, loop);
+    worker = findChild(server_pid);
+
+    /* The emitters run for the warm-up and both windows, and longer */
+    snprintf(command, sizeof(command), "USER test\nPASS test\n%s -e %d %d %d\nexit\n",
+             self, interval_ms * 1000, record_bytes, 3 * seconds + START_TIMEOUT_S);
+
+    ep = epoll_create1(0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    nsamples = 0;
+    received = 0;
+
+    for (i = 0; i < nsessions; i++) {
+        struct Session *s = &sessions[i];
+
+        s->fd = socket(AF_INET, SOCK_STREAM, 0);
+        s->started = 0;
+        s->len = 0;
+        if (connect(s->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            write(s->fd, command, strlen(command)) != (ssize_t)strlen(command)) {
+            perror("relay_bench: session");
+            exit(1);
+        }
+        fcntl(s->fd, F_SETFL, O_NONBLOCK);
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        epoll_ctl(ep, EPOLL_CTL_ADD, s->fd, &ev);
+        /* Keep up with those already streaming */
+        drain(ep, 0, 0);
+    }
+
+    /* Wait for every session to stream, then a second more */
+    start = nowNs();
+    while (startedCount() < nsessions && nowNs() - start < START_TIMEOUT_S * 1000000000LL) {
+        drain(ep, nowNs() + 100000000LL, 0);
+    }
+    if (startedCount() < nsessions) {
+        fprintf(stderr, "relay_bench: only %d of %d sessions started\n", startedCount(), nsessions);
+    }
+    drain(ep, nowNs() + 1000000000LL, 0);
+
+    /* Latency window */
+    bytes = received;
+    start = nowNs();
+    drain(ep, start + seconds * 1000000000LL, 1);
+    window_s = (nowNs() - start) / 1e9;
+    bytes = received - bytes;
+
+    /* System call window, traced */
+    if (pipe(pipefd) < 0 || (tracer = fork()) < 0) {
+        perror("relay_bench: tracer");
+        exit(1);
+    }
+    if (tracer == 0) {
+        close(pipefd[0]);
+        countSyscalls(worker, seconds, pipefd[1]);
+    }
+    close(pipefd[1]);
+    start = received;
+    drain(ep, nowNs() + seconds * 1000000000LL, 0);
+    waitpid(tracer, NULL, 0);
+    if (read(pipefd[0], &count, sizeof(count)) != sizeof(count)) count = -1;
+    close(pipefd[0]);
+
+    qsort(samples, nsamples, sizeof(long long), compareLongs);
+    printf("{\"name\": \"relay.stream\", \"kind\": \"latency\", \"mode\": \"%s\", \"sessions\": %d, "
+           "\"unit\": \"ns\", \"samples\": %d, \"median\": %lld, \"p99\": %lld, \"max\": %lld, "
+           "\"mb_per_s\": %.1f, \"syscalls_per_mb\": %.1f}\n",
+           loop, nsessions, nsamples,
+           nsamples ? samples[nsamples / 2] : 0,
+           nsamples ? samples[(int)(nsamples * 0.99 + 0.99) - 1] : 0,
+           nsamples ? samples[nsamples - 1] : 0,
+           bytes / 1e6 / window_s,
+           count < 0 || received == start ? -1.0 : count / ((received - start) / 1e6));
+    fflush(stdout);
+
+    for (i = 0; i < nsessions; i++) close(sessions[i].fd);
+    close(ep);
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+    char shell[PATH_MAX], self[PATH_MAX];
+    const char *server = "Part2/server";
+    const char *loops[] = { "epoll", "uring" };
+    const char *only = NULL;
+    int interval_ms = 50, seconds = 5, port = 50998;
+    struct rlimit rl;
+    int opt, i;
+
+    nsessions = 1000;
+    if (argc > 1 && strcmp(argv[1], "-e") == 0) {
+        if (argc < 5) return 2;
+        record_bytes = atoi(argv[3]);
+        return emit(atoi(argv[2]), atoi(argv[4]));
+    }
+
+    if (realpath("myshell", shell) == NULL) snprintf(shell, sizeof(shell), "./myshell");
+    if (realpath(argv[0], self) == NULL) snprintf(self, sizeof(self), "%s", argv[0]);
+    while ((opt = getopt(argc, argv, "n:t:i:b:r:s:E:")) != -1) {
+        switch (opt) {
+        case 'n': nsessions = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'i': interval_ms = atoi(optarg); break;
+        case 'b': record_bytes = atoi(optarg); break;
+        case 'r': port = atoi(optarg); break;
+        case 's': snprintf(shell, sizeof(shell), "%s", optarg); break;
+        case 'E': only = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n sessions] [-t seconds] [-i interval_ms] [-b record_bytes]\n"
+                    "          [-r port] [-s shell] [-E epoll|uring]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (record_bytes <= STAMP_LEN || nsessions <= 0 || seconds <= 0 || interval_ms <= 0) {
+        fprintf(stderr, "relay_bench: bad arguments\n");
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    /* A socket each here, a socket and two pipes each in the worker */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    sessions = calloc(nsessions, sizeof(struct Session));
+    if (sessions == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (i = 0; i < nsessions; i++) {
+        sessions[i].buf = malloc(record_bytes);
+        if (sessions[i].buf == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (only == NULL || strcmp(only, loops[i]) == 0) {
+            run(loops[i], server, port, shell, self, interval_ms, seconds);
+        }
+    }
+    return 0;
+}
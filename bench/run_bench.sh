@@ -0,0 +1,27 @@
+#!/bin/sh
+# Runs bench/shell_bench and bench/macro_bench.sh and writes their
+# results as one JSON document, with the commit they were measured at,
+# to bench/results.json (or the file given). Comparing the files of two
+# commits shows regressions.
+#
+# usage: bench/run_bench.sh [output]
+
+OUTPUT=${1:-bench/results.json}
+TMP=${TMPDIR:-/tmp}/run_bench.$$
+
+trap 'rm -f $TMP.*' EXIT
+
+bench/shell_bench > $TMP.lines || exit 1
+sh bench/macro_bench.sh >> $TMP.lines || exit 1
+
+{
+    echo "{"
+    echo "  \"commit\": \"$(git rev-parse --short HEAD 2> /dev/null || echo unknown)\","
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"cpus\": $(getconf _NPROCESSORS_ONLN),"
+    echo "  \"results\": ["
+    sed -e 's/^/    /' -e '$!s/$/,/' $TMP.lines
+    echo "  ]"
+    echo "}"
+} > $OUTPUT
+cat $OUTPUT
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Builtin utility benchmark: runs a generated script of LINES lines made
+# of echo, printf, test/[, true and false through myshell twice.
+# The "before" run names the external programs by path, which is what
+# every line cost before these were builtins: a fork and exec each. The
+# "after" run uses the builtins. Output goes to /dev/null.
+#
+# usage: bench/script_bench.sh [lines]
+
+MYSHELL=${MYSHELL:-./myshell}
+LINES=${1:-10000}
+TMP=${TMPDIR:-/tmp}/script_bench.$$
+
+trap 'rm -f $TMP.*' EXIT
+
+echo "input line" > $TMP.in
+
+# gen_script prefix: writes LINES lines using the utilities under prefix
+gen_script() {
+    awk -v lines=$LINES -v p="$1" -v input=$TMP.in 'BEGIN {
+        for (i = 0; i < lines; i++) {
+            k = i % 8
+            if (k == 0) print p "echo line " i
+            else if (k == 1) print p "printf \"%s %d\\n\" item " i
+            else if (k == 2) print p "[ " i " -gt 5 ] && " p "true"
+            else if (k == 3) print p "test -n \"$x\" || " p "false"
+            else if (k == 4) print "x=" i
+            else if (k == 5) print p "echo \"$x\" > /dev/null"
+            else if (k == 6) print p "[ -f " input " ]"
+            else print p "printf \"%05d\\n\" $x"
+        }
+    }'
+}
+
+# run_script file: prints nanoseconds taken
+run_script() {
+    start=$(date +%s%N)
+    $MYSHELL $1 > /dev/null || exit 1
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+# External programs live in /usr/bin or /bin depending on the system
+dir=$(dirname $(command -v printf 2>/dev/null || echo /usr/bin/printf))
+case $dir in
+    /*) ;;
+    *) dir=/usr/bin ;;
+esac
+[ -x $dir/printf ] || dir=/bin
+
+gen_script "$dir/" > $TMP.before.sh
+gen_script "" > $TMP.after.sh
+
+before=$(run_script $TMP.before.sh)
+after=$(run_script $TMP.after.sh)
+
+echo "$LINES $before $after" | awk '{
+    printf "%8s %12s %12s %14s\n", "run", "lines", "time (ms)", "lines/second"
+    printf "%8s %12d %12.1f %14.0f\n", "before", $1, $2 / 1e6, $1 / ($2 / 1e9)
+    printf "%8s %12d %12.1f %14.0f\n", "after", $1, $3 / 1e6, $1 / ($3 / 1e9)
+    printf "speedup: %.1fx\n", $2 / $3
+}'
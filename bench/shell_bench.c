@@ -0,0 +1,256 @@
+/* In-process benchmarks, printed as one JSON object per line with the
+ * median and 99th percentile of the samples:
+ *
+ *   parse.*     parseCommandLine on a short line, a long pipeline and
+ *               a generated script
+ *   glob.*      expandWildcards over generated directories
+ *   history.*   addToHistory and getHistoryCommand with the history full
+ *   spawn.true  running /bin/true through the compiled program, each of
+ *               SPAWNS runs timed on its own
+ *   embed.echo  shellExecute of a builtin in a second context, with its
+ *               output captured
+ *
+ * usage: bench/shell_bench [spawns] */
+#include "../shell.h"
+#include <sys/stat.h>
+#include <time.h>
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sort the samples and print them as a result line */
+static void report(const char *name, const char *kind, double *samples, int count) {
+    int p99 = (int)(count * 0.99 + 0.99) - 1;
+
+    qsort(samples, count, sizeof(double), compareDoubles);
+    printf("{\"name\": \"%s\", \"kind\": \"%s\", \"unit\": \"ns\", \"samples\": %d, "
+           "\"median\": %.1f, \"p99\": %.1f}\n",
+           name, kind, count, samples[count / 2], samples[p99 < 0 ? 0 : p99]);
+    fflush(stdout);
+}
+
+/* Time count samples of batch calls of op each, in ns per call */
+static void measure(const char *name, int count, int batch, void (*op)(void *, int), void *arg) {
+    double *samples = malloc(count * sizeof(double));
+    int i, j;
+
+    if (samples == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    /* One untimed batch to warm caches */
+    for (j = 0; j < batch; j++) op(arg, j);
+    for (i = 0; i < count; i++) {
+        long long start = nowNs();
+        for (j = 0; j < batch; j++) op(arg, i * batch + j);
+        samples[i] = (double)(nowNs() - start) / batch;
+    }
+    report(name, "micro", samples, count);
+    free(samples);
+}
+
+/* Parsing */
+
+static void parseOp(void *arg, int i) {
+    struct Node *tree;
+
+    (void)i;
+    if (parseCommandLine(arg, &tree) < 0) {
+        fprintf(stderr, "shell_bench: parse failed\n");
+        exit(1);
+    }
+    freeNode(tree);
+}
+
+/* A script of lines lines mixing the constructs the parser knows */
+static char *generateScript(int lines) {
+    struct StrBuf sb;
+    char line[256];
+    int i;
+
+    sbInit(&sb);
+    for (i = 0; i < lines; i++) {
+        switch (i % 6) {
+        case 0: snprintf(line, sizeof(line), "x%d=\"value $HOME/%d\"\n", i, i); break;
+        case 1: snprintf(line, sizeof(line), "echo \"$x\" 'literal' arg%d | grep -v foo > /dev/null\n", i); break;
+        case 2: snprintf(line, sizeof(line), "if [ $x -gt %d ]; then echo big; else echo small; fi\n", i); break;
+        case 3: snprintf(line, sizeof(line), "for f in a b c %d; do test -n \"$f\" && echo $f; done\n", i); break;
+        case 4: snprintf(line, sizeof(line), "while false; do break; done; cd /tmp || exit 1\n"); break;
+        default: snprintf(line, sizeof(line), "ls -l *.c 2> /dev/null | sort | uniq -c | head -n %d\n", i); break;
+        }
+        sbAppend(&sb, line, strlen(line));
+    }
+    sbAppendChar(&sb, '\0');
+    return sb.data;
+}
+
+/* Globbing */
+
+static char glob_dir[PATH_MAX];
+
+/* Make dir/name with count files named file_NNNNN.c and .h */
+static void makeGlobDir(const char *name, int count) {
+    char path[PATH_MAX + 64];
+    int i, fd;
+
+    snprintf(path, sizeof(path), "%s/%s", glob_dir, name);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        perror(path);
+        exit(1);
+    }
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s/file_%05d.%s", glob_dir, name, i / 2, i % 2 ? "h" : "c");
+        fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            perror(path);
+            exit(1);
+        }
+        close(fd);
+    }
+}
+
+static void removeGlobDir(void) {
+    char command[PATH_MAX + 16];
+
+    snprintf(command, sizeof(command), "rm -rf '%s'", glob_dir);
+    if (system(command) != 0) {
+        fprintf(stderr, "shell_bench: could not remove %s\n", glob_dir);
+    }
+}
+
+static void globOp(void *arg, int i) {
+    struct ExpandBuf *eb = getExpandBuf();
+    const char *pattern = arg;
+
+    (void)i;
+    eb->text.len = 0;
+    eb->nfields = 0;
+    sbAppend(&eb->text, pattern, strlen(pattern) + 1);
+    if (expandWildcards(eb, 0) == 0) {
+        fprintf(stderr, "shell_bench: %s matched nothing\n", pattern);
+        exit(1);
+    }
+}
+
+/* History */
+
+static void fillHistory(void) {
+    char line[64];
+    int i;
+
+    for (i = 0; i < MAX_HISTORY; i++) {
+        snprintf(line, sizeof(line), "command number %d --with args", i);
+        addToHistory(line);
+    }
+}
+
+static void historyAddOp(void *arg, int i) {
+    char line[64];
+
+    (void)arg;
+    /* Distinct lines, so each one evicts the oldest */
+    snprintf(line, sizeof(line), "later command %d --with args", i);
+    addToHistory(line);
+}
+
+static void historyLookupOp(void *arg, int i) {
+    (void)i;
+    getHistoryCommand(arg);
+}
+
+/* Spawning */
+
+static void measureSpawn(int spawns) {
+    struct Program *prog;
+    struct Node *tree;
+    char line[] = "/bin/true";
+    double *samples = malloc(spawns * sizeof(double));
+    int i;
+
+    if (samples == NULL || parseCommandLine(line, &tree) < 0 || (prog = compileTree(tree)) == NULL) {
+        fprintf(stderr, "shell_bench: cannot set up /bin/true\n");
+        exit(1);
+    }
+    freeNode(tree);
+    for (i = 0; i < spawns; i++) {
+        long long start = nowNs();
+        if (runProgram(prog, 0) != 0) {
+            fprintf(stderr, "shell_bench: /bin/true failed\n");
+            exit(1);
+        }
+        samples[i] = (double)(nowNs() - start);
+    }
+    freeProgram(prog);
+    report("spawn.true", "macro", samples, spawns);
+    free(samples);
+}
+
+/* Embedding */
+
+static void embedOp(void *arg, int i) {
+    struct ShellOutput output;
+
+    (void)i;
+    if (shellExecute(arg, "echo hello $HOME", &output) != 0) {
+        fprintf(stderr, "shell_bench: embedded echo failed\n");
+        exit(1);
+    }
+    shellFreeOutput(&output);
+}
+
+int main(int argc, char **argv) {
+    int spawns = argc > 1 ? atoi(argv[1]) : 10000;
+    char simple[] = "ls -l /tmp > out.txt";
+    char pipeline[] = "cat $FILE | grep -v '^#' | sed -e \"s/a/b/g\" | sort -n | uniq -c | head -n 20 > \"$OUT\" 2> /dev/null && echo done || echo failed";
+    char *script = generateScript(1000);
+    char pattern[PATH_MAX + 32];
+    struct ShellContext *ctx;
+
+    setupSignalHandler();
+    initVars();
+
+    measure("parse.simple", 1000, 100, parseOp, simple);
+    measure("parse.pipeline", 1000, 100, parseOp, pipeline);
+    measure("parse.script_1000_lines", 100, 1, parseOp, script);
+    free(script);
+
+    snprintf(glob_dir, sizeof(glob_dir), "%s/shell_bench.%d", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp", (int)getpid());
+    if (mkdir(glob_dir, 0755) < 0) {
+        perror(glob_dir);
+        return 1;
+    }
+    makeGlobDir("d100", 100);
+    makeGlobDir("d10000", 10000);
+    snprintf(pattern, sizeof(pattern), "%s/d100/*.c", glob_dir);
+    measure("glob.100_files", 200, 10, globOp, pattern);
+    snprintf(pattern, sizeof(pattern), "%s/d10000/*.c", glob_dir);
+    measure("glob.10000_files", 50, 1, globOp, pattern);
+    snprintf(pattern, sizeof(pattern), "%s/d10000/file_000[0-4]?.h", glob_dir);
+    measure("glob.10000_files_narrow", 50, 1, globOp, pattern);
+    removeGlobDir();
+
+    fillHistory();
+    measure("history.add_full", 1000, 100, historyAddOp, NULL);
+    measure("history.bang_bang", 1000, 1000, historyLookupOp, "!!");
+    measure("history.bang_number", 1000, 1000, historyLookupOp, "!500");
+    measure("history.bang_prefix_miss", 1000, 10, historyLookupOp, "!no-such-command");
+
+    measureSpawn(spawns);
+
+    ctx = shellCreate();
+    if (ctx == NULL) {
+        fprintf(stderr, "shell_bench: cannot create a context\n");
+        return 1;
+    }
+    measure("embed.echo", 1000, 10, embedOp, ctx);
+    shellDestroy(ctx);
+    return 0;
+}
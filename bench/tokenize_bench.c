@@ -0,0 +1,110 @@
+/* Tokenizer benchmark: parses multi-megabyte generated command lines
+ * with each scan level, from the byte at a time loop parseToken used
+ * to have up to AVX2, and prints the throughput of each.
+ *
+ * usage: bench/tokenize_bench [megabytes] [runs] */
+#include "../shell.h"
+#include <time.h>
+
+static const char *level_names[] = { "byte", "table", "sse2", "avx2" };
+
+/* A command line of about size bytes made of generated words */
+static char *fillLine(size_t size, const char *(*word)(int)) {
+    char *line = malloc(size + 8192);
+    size_t len = 0;
+    int i = 0;
+
+    if (line == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    len = sprintf(line, "cmd");
+    while (len < size) {
+        len += sprintf(line + len, " %s", word(i++));
+    }
+    return line;
+}
+
+/* Generated file names, as from a find or a glob */
+static const char *fileWord(int i) {
+    static char buf[64];
+    snprintf(buf, sizeof(buf), "src/module_%d/file_%06d.c", i % 97, i);
+    return buf;
+}
+
+/* Long quoted arguments, as in generated messages or JSON */
+static const char *quotedWord(int i) {
+    static char buf[256];
+    snprintf(buf, sizeof(buf), "\"record %d: the quick brown fox jumps over the lazy dog, "
+             "then \\\"quoted\\\" text and a ${VAR} follow in a fairly long string %d\"", i, i * 7);
+    return buf;
+}
+
+static const char *singleWord(int i) {
+    static char buf[256];
+    snprintf(buf, sizeof(buf), "'literal %d with $dollars, \"quotes\" and | pipes that are "
+             "all taken as they are until the closing single quote ends it'", i);
+    return buf;
+}
+
+/* Long unquoted words, such as encoded data passed as an argument */
+static const char *blobWord(int i) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static char buf[4097];
+    int j;
+
+    for (j = 0; j < 4096; j++) {
+        buf[j] = digits[(i * 31 + j * 7) & 63];
+    }
+    buf[j] = '\0';
+    return buf;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    const char *names[] = { "filenames", "double-quoted", "single-quoted", "long-words" };
+    const char *(*words[])(int) = { fileWord, quotedWord, singleWord, blobWord };
+    size_t size = (argc > 1 ? atoi(argv[1]) : 4) * 1024 * 1024;
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+    double *times = malloc(runs * sizeof(double));
+    struct Node *tree;
+    int kind, level, run;
+
+    for (kind = 0; kind < 4; kind++) {
+        char *line = fillLine(size, words[kind]);
+        double base = 0;
+
+        for (level = SCAN_BYTE; level <= SCAN_AVX2; level++) {
+            if (setScanLevel(level) != level) {
+                printf("%-14s %-6s not supported\n", names[kind], level_names[level]);
+                continue;
+            }
+            for (run = 0; run < runs; run++) {
+                double start = now();
+                if (parseCommandLine(line, &tree) != 1) {
+                    fprintf(stderr, "%s: parse failed\n", names[kind]);
+                    return 1;
+                }
+                freeNode(tree);
+                times[run] = now() - start;
+            }
+            qsort(times, runs, sizeof(double), compareDoubles);
+            if (level == SCAN_BYTE) base = times[runs / 2];
+            printf("%-14s %-6s %8.1f MB/s  %5.2fx\n", names[kind], level_names[level],
+                   strlen(line) / times[runs / 2] / 1e6, base / times[runs / 2]);
+        }
+        free(line);
+    }
+    free(times);
+    return 0;
+}
@@ -1,16 +1,24 @@
 #include "shell.h"
 
+/* Names of the built-in commands, also used for completion */
+const char *builtin_names[] = {
+    "prompt", "pwd", "cd", "history", "exit", "export", "unset",
+    "break", "continue", "alias", "unalias", "return", "shift",
+    "echo", "printf", "test", "[", "true", "false", ":", "read", "kill",
+    "pipesched", "j", NULL
+};
+
 /* Check if command is a built-in */
 int isBuiltIn(char *command) {
-    if (strcmp(command, "prompt") == 0) return 1;
-    if (strcmp(command, "pwd") == 0) return 1;
-    if (strcmp(command, "cd") == 0) return 1;
-    if (strcmp(command, "history") == 0) return 1;
-    if (strcmp(command, "exit") == 0) return 1;
+    int i;
+    
+    for (i = 0; builtin_names[i] != NULL; i++) {
+        if (strcmp(command, builtin_names[i]) == 0) return 1;
+    }
     return 0;
 }
 
-/* Execute built-in command */
+/* Execute built-in command and return its exit status */
 int executeBuiltIn(struct Command_struct *cmd) {
     char *command = cmd->com_pathname;
     
@@ -19,61 +27,140 @@ int executeBuiltIn(struct Command_struct *cmd) {
             builtInPrompt(cmd->argv[1]);
         } else {
             fprintf(stderr, "prompt: missing argument\n");
+            return 1;
         }
-        return 1;
+        return 0;
     }
     
     if (strcmp(command, "pwd") == 0) {
-        builtInPWD();
-        return 1;
+        return builtInPWD();
     }
     
     if (strcmp(command, "cd") == 0) {
         if (cmd->argc >= 2) {
-            builtInCD(cmd->argv[1]);
-        } else {
-            builtInCD(NULL);  /* Go to home directory */
+            return builtInCD(cmd->argv[1]);
         }
-        return 1;
+        return builtInCD(NULL);  /* Go to home directory */
     }
     
     if (strcmp(command, "history") == 0) {
         builtInHistory();
-        return 1;
+        return 0;
     }
     
     if (strcmp(command, "exit") == 0) {
-        builtInExit();
+        int status = cmd->argc >= 2 ? atoi(cmd->argv[1]) : shell->last_status;
+        /* Returns only in an embedded context */
+        builtInExit(status);
+        return status;
+    }
+    
+    if (strcmp(command, "export") == 0) {
+        return builtInExport(cmd);
+    }
+    
+    if (strcmp(command, "unset") == 0) {
+        return builtInUnset(cmd);
+    }
+    
+    if (strcmp(command, "alias") == 0) {
+        return builtInAlias(cmd);
+    }
+    
+    if (strcmp(command, "unalias") == 0) {
+        return builtInUnalias(cmd);
+    }
+    
+    if (strcmp(command, "return") == 0) {
+        return builtInReturn(cmd);
+    }
+    
+    if (strcmp(command, "shift") == 0) {
+        return builtInShift(cmd);
+    }
+    
+    /* Utilities, see utilities.c */
+    if (strcmp(command, "echo") == 0) {
+        return builtInEcho(cmd);
+    }
+    
+    if (strcmp(command, "printf") == 0) {
+        return builtInPrintf(cmd);
+    }
+    
+    if (strcmp(command, "test") == 0 || strcmp(command, "[") == 0) {
+        return builtInTest(cmd);
+    }
+    
+    if (strcmp(command, "true") == 0 || strcmp(command, ":") == 0) {
+        return 0;
+    }
+    
+    if (strcmp(command, "false") == 0) {
         return 1;
     }
     
-    return 0;
+    if (strcmp(command, "read") == 0) {
+        return builtInRead(cmd);
+    }
+    
+    if (strcmp(command, "kill") == 0) {
+        return builtInKill(cmd);
+    }
+    
+    if (strcmp(command, "pipesched") == 0) {
+        return builtInPipesched(cmd);
+    }
+    
+    if (strcmp(command, "j") == 0) {
+        return builtInJump(cmd);
+    }
+    
+    /* Inside a loop these compile to jumps and never get here */
+    if (strcmp(command, "break") == 0 || strcmp(command, "continue") == 0) {
+        fprintf(stderr, "%s: only meaningful in a `for', `while', or `until' loop\n", command);
+        return 0;
+    }
+    
+    return 1;
 }
 
-/* Change shell prompt */
+/* Change shell prompt; escapes such as \w are expanded when it is shown */
 void builtInPrompt(char *new_prompt) {
-    if (new_prompt != NULL && strlen(new_prompt) < sizeof(current_prompt)) {
-        strcpy(current_prompt, new_prompt);
+    if (new_prompt != NULL && strlen(new_prompt) < sizeof(shell->prompt)) {
+        strcpy(shell->prompt, new_prompt);
     }
 }
 
 /* Print working directory */
-void builtInPWD(void) {
+int builtInPWD(void) {
     char cwd[4096];
     if (getcwd(cwd, sizeof(cwd)) != NULL) {
         printf("%s\n", cwd);
     } else {
         perror("pwd");
+        return 1;
     }
+    return 0;
+}
+
+/* Whether cd runs at a terminal prompt. interactive alone is also set
+ * when commands are piped into the shell, which makes them a script. */
+static int atPrompt(void) {
+    return interactive && !in_subshell && isatty(STDIN_FILENO);
 }
 
 /* Change directory */
-void builtInCD(char *path) {
+int builtInCD(char *path) {
+    char cwd[PATH_MAX];
     char *target_path;
+    const char *jump;
+    int prompt = atPrompt();
+    int err;
     
     if (path == NULL) {
         /* No argument - go to home directory */
-        target_path = getenv("HOME");
+        target_path = (char *)getVar("HOME");
         if (target_path == NULL) {
             struct passwd *pw = getpwuid(getuid());
             target_path = pw->pw_dir;
@@ -83,27 +170,189 @@ void builtInCD(char *path) {
     }
     
     if (chdir(target_path) != 0) {
-        perror("cd");
+        /* A plain name that is not here may be a directory visited
+         * before; only at the prompt, where the user sees where cd went,
+         * never in a script that goes on to work in it */
+        err = errno;
+        if (err == ENOENT && prompt && path != NULL && strchr(path, '/') == NULL &&
+            (jump = findFrecentDir(&path, 1)) != NULL && chdir(jump) == 0) {
+            printf("%s\n", jump);
+        } else {
+            errno = err;
+            perror("cd");
+            return 1;
+        }
+    }
+    
+    /* Only directories chosen at the prompt count as visits */
+    if (prompt && getcwd(cwd, sizeof(cwd)) != NULL) {
+        recordDirVisit(cwd);
     }
+    return 0;
 }
 
 /* Display command history */
 void builtInHistory(void) {
     int i;
-    for (i = 0; i < history_count; i++) {
-        printf("%d  %s\n", i + 1, history[i]);
+    for (i = 0; i < shell->history_count; i++) {
+        printf("%d  %s\n", i + 1, shell->history[i]);
     }
 }
 
 /* Exit shell */
-void builtInExit(void) {
+void builtInExit(int status) {
     int i;
     
+    /* A subshell just ends; _exit leaves the shared stdin offset alone */
+    if (in_subshell) {
+        fflush(stdout);
+        _exit(status);
+    }
+    
+    /* Embedded, the process belongs to the caller: just stop running
+     * commands (see runProgram) */
+    if (shell->embedded) {
+        shell->exit_pending = 1;
+        return;
+    }
+    
     /* Free history */
-    for (i = 0; i < history_count; i++) {
-        free(history[i]);
+    for (i = 0; i < shell->history_count; i++) {
+        free(shell->history[i]);
+    }
+    
+    /* Only where a user typed it, as other shells do */
+    if (interactive) {
+        printf("exit\n");
+    }
+    exit(status);
+}
+
+/* Export variables, optionally assigning them; no arguments lists them */
+int builtInExport(struct Command_struct *cmd) {
+    int status = 0;
+    int i;
+    
+    if (cmd->argc < 2) {
+        printExports();
+        return 0;
+    }
+    
+    for (i = 1; i < cmd->argc; i++) {
+        char *eq = strchr(cmd->argv[i], '=');
+        size_t len = eq ? (size_t)(eq - cmd->argv[i]) : strlen(cmd->argv[i]);
+        
+        if (!isValidName(cmd->argv[i], len)) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", cmd->argv[i]);
+            status = 1;
+        } else if (eq != NULL) {
+            assignVar(cmd->argv[i], VAR_EXPORT);
+        } else {
+            exportVar(cmd->argv[i], 1);
+        }
+    }
+    return status;
+}
+
+/* Remove variables, or functions with -f */
+int builtInUnset(struct Command_struct *cmd) {
+    int status = 0;
+    int i = 1;
+    
+    if (cmd->argc > 1 && strcmp(cmd->argv[1], "-f") == 0) {
+        for (i = 2; i < cmd->argc; i++) {
+            removeFunction(cmd->argv[i]);
+        }
+        return 0;
+    }
+    if (cmd->argc > 1 && strcmp(cmd->argv[1], "-v") == 0) {
+        i = 2;
     }
     
-    printf("exit\n");
-    exit(0);
+    for (; i < cmd->argc; i++) {
+        if (!isValidName(cmd->argv[i], strlen(cmd->argv[i]))) {
+            fprintf(stderr, "unset: %s: not a valid identifier\n", cmd->argv[i]);
+            status = 1;
+        } else {
+            unsetVar(cmd->argv[i]);
+        }
+    }
+    return status;
+}
+
+/* Define aliases with name=value; list them with no arguments or
+ * print the ones named */
+int builtInAlias(struct Command_struct *cmd) {
+    int status = 0;
+    int i;
+    
+    if (cmd->argc < 2) {
+        printAliases();
+        return 0;
+    }
+    
+    for (i = 1; i < cmd->argc; i++) {
+        char *eq = strchr(cmd->argv[i], '=');
+        
+        if (eq != NULL) {
+            *eq = '\0';
+            if (defineAlias(cmd->argv[i], eq + 1) < 0) {
+                status = 1;
+            }
+            *eq = '=';
+        } else {
+            struct Alias *alias = findAlias(cmd->argv[i]);
+            if (alias == NULL) {
+                fprintf(stderr, "alias: %s: not found\n", cmd->argv[i]);
+                status = 1;
+            } else {
+                printAlias(alias);
+            }
+        }
+    }
+    return status;
+}
+
+/* Remove aliases; -a removes all of them */
+int builtInUnalias(struct Command_struct *cmd) {
+    int status = 0;
+    int i;
+    
+    if (cmd->argc < 2) {
+        fprintf(stderr, "unalias: usage: unalias [-a] name ...\n");
+        return 2;
+    }
+    if (strcmp(cmd->argv[1], "-a") == 0) {
+        removeAllAliases();
+        return 0;
+    }
+    
+    for (i = 1; i < cmd->argc; i++) {
+        if (removeAlias(cmd->argv[i]) < 0) {
+            fprintf(stderr, "unalias: %s: not found\n", cmd->argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* Return from a function with the given status, or the last one */
+int builtInReturn(struct Command_struct *cmd) {
+    if (!inFunction()) {
+        fprintf(stderr, "return: can only `return' from a function\n");
+        return 1;
+    }
+    return_pending = 1;
+    return cmd->argc >= 2 ? atoi(cmd->argv[1]) & 0xff : shell->last_status;
+}
+
+/* Drop positional parameters, one by default */
+int builtInShift(struct Command_struct *cmd) {
+    int n = cmd->argc >= 2 ? atoi(cmd->argv[1]) : 1;
+    
+    if (shiftPositional(n) < 0) {
+        fprintf(stderr, "shift: %d: shift count out of range\n", n);
+        return 1;
+    }
+    return 0;
 }
@@ -0,0 +1,711 @@
+#include "shell.h"
+#include <ctype.h>
+
+/* A loop being compiled, for break and continue */
+struct Loop {
+    struct Loop *outer;
+    int is_for;          /* break must drop the for loop's word list */
+    int redirects;       /* redirections open when the loop started */
+    int continue_pc;     /* where continue jumps to */
+    int *breaks;         /* jumps to patch with the end of the loop */
+    int nbreaks;
+    int break_cap;
+};
+
+/* Compiler state for one program */
+struct Compiler {
+    struct Program *prog;
+    struct Loop *loop;   /* innermost enclosing loop */
+    int redirects;       /* OP_REDIRECTs not yet restored */
+    int error;
+};
+
+static int compileNode(struct Compiler *c, struct Node *node);
+static struct Program *compileSub(struct Node *node);
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+
+    if (p == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return p;
+}
+
+static struct Program *newProgram(void) {
+    struct Program *prog = xcalloc(1, sizeof(struct Program));
+
+    prog->refs = 1;
+    return prog;
+}
+
+/* Append an instruction, returning its address for later patching */
+static int emit(struct Compiler *c, int op, int arg, void *data) {
+    struct Program *prog = c->prog;
+
+    if (prog->len == prog->cap) {
+        int new_cap = prog->cap ? prog->cap * 2 : 16;
+        struct Instr *new_code = realloc(prog->code, new_cap * sizeof(struct Instr));
+        if (new_code == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        prog->code = new_code;
+        prog->cap = new_cap;
+    }
+
+    prog->code[prog->len].op = op;
+    prog->code[prog->len].arg = arg;
+    prog->code[prog->len].data = data;
+    return prog->len++;
+}
+
+/* Point the jump at pc to the next instruction */
+static void patch(struct Compiler *c, int pc) {
+    c->prog->code[pc].arg = c->prog->len;
+}
+
+/* Check if character is special to glob() */
+static int isGlobChar(char c) {
+    return (c == '*' || c == '?' || c == '[');
+}
+
+/* Start a new part of a word */
+static struct WordPart *addPart(struct Word *word, int type, int quoted) {
+    struct WordPart *parts = realloc(word->parts, (word->nparts + 1) * sizeof(struct WordPart));
+    struct WordPart *part;
+
+    if (parts == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    word->parts = parts;
+    part = &parts[word->nparts++];
+    memset(part, 0, sizeof(*part));
+    part->type = type;
+    part->quoted = quoted;
+    part->slot = -1;
+    return part;
+}
+
+/* Add literal text to a word, joining it to the last part if that is
+ * literal text quoted the same way */
+static void addText(struct Word *word, const char *s, size_t len, int quoted) {
+    struct WordPart *part = NULL;
+    size_t i;
+
+    if (word->nparts > 0) {
+        part = &word->parts[word->nparts - 1];
+        if (part->type != PART_TEXT || part->quoted != quoted) {
+            part = NULL;
+        }
+    }
+    if (part == NULL) {
+        part = addPart(word, PART_TEXT, quoted);
+        part->plain = 1;
+    }
+
+    part->text = realloc(part->text, part->len + len + 1);
+    if (part->text == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    memcpy(part->text + part->len, s, len);
+    part->len += len;
+    part->text[part->len] = '\0';
+
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\\' || isGlobChar(s[i])) {
+            part->plain = 0;
+        }
+    }
+}
+
+/* Check if name[0..len) is a positional parameter number */
+static int isNumber(const char *name, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)name[i])) return 0;
+    }
+    return len > 0;
+}
+
+/* Compile $NAME, ${NAME}, $1, ${10}, $#, $@, $* or $?; p points at the
+ * '$'. Returns the position after the reference, NULL on a bad ${...}. */
+static const char *compileVariable(struct Word *word, const char *p, int quoted) {
+    const char *name = p + 1;
+    const char *end;
+    struct WordPart *part;
+    int braced = (*name == '{');
+    int special = 0;
+
+    /* Special parameters, $? or ${?} */
+    if (*name && strchr("?#@*", *name)) {
+        special = *name;
+        end = name + 1;
+    } else if (braced && name[1] && strchr("?#@*", name[1]) && name[2] == '}') {
+        special = name[1];
+        end = name + 3;
+    }
+    if (special == '?') {
+        /* Exit status of the last command */
+        addPart(word, PART_STATUS, quoted);
+        return end;
+    }
+    if (special == '#') {
+        addPart(word, PART_COUNT, quoted);
+        return end;
+    }
+    if (special) {
+        part = addPart(word, PART_ALL, quoted);
+        part->slot = (special == '*');
+        return end;
+    }
+    if (isdigit((unsigned char)*name)) {
+        /* Unbraced, only a single digit is a parameter number */
+        part = addPart(word, PART_PARAM, quoted);
+        part->slot = *name - '0';
+        return p + 2;
+    }
+
+    if (braced) {
+        name++;
+        end = strchr(name, '}');
+        if (end != NULL && isNumber(name, end - name)) {
+            part = addPart(word, PART_PARAM, quoted);
+            part->slot = atoi(name);
+            return end + 1;
+        }
+        if (end == NULL || !isValidName(name, end - name)) {
+            fprintf(stderr, "%s: bad substitution\n", word->source);
+            return NULL;
+        }
+    } else {
+        end = name;
+        while (isalnum((unsigned char)*end) || *end == '_') end++;
+        if (end == name) {
+            /* Not a reference, the '$' is literal */
+            addText(word, "$", 1, quoted);
+            return p + 1;
+        }
+    }
+
+    /* Bound to the slot now, so running the word needs no lookup */
+    part = addPart(word, PART_VAR, quoted);
+    part->slot = findVar(name, end - name, 1);
+
+    return braced ? end + 1 : end;
+}
+
+/* Compile one word as written into its parts: quote removal happens
+ * here, substitutions are left for expandWord */
+static int compileWord(struct Word *word, const char *src) {
+    const char *p = src;
+    int in_double_quote = 0;
+    int quote_start = 0;
+
+    memset(word, 0, sizeof(*word));
+    word->source = strdup(src);
+    word->assign_slot = -1;
+
+    if (isAssignment(src)) {
+        /* The NAME= part is taken as is */
+        const char *eq = strchr(src, '=');
+        word->assign_slot = findVar(src, eq - src, 1);
+        addText(word, src, eq + 1 - src, 0);
+        p = eq + 1;
+    }
+
+    while (*p) {
+        if (*p == '\\' && !in_double_quote) {
+            /* Escaped character */
+            if (*(p + 1)) p++;
+            addText(word, p, 1, 1);
+            p++;
+        } else if (*p == '\\' && in_double_quote) {
+            /* Inside double quotes only a few characters are escapable */
+            if (*(p + 1) && strchr("$`\"\\", *(p + 1))) p++;
+            addText(word, p, 1, 1);
+            p++;
+        } else if (*p == '\'' && !in_double_quote) {
+            const char *start = ++p;
+            while (*p && *p != '\'') p++;
+            addText(word, start, p - start, 1);
+            if (*p) p++;
+        } else if (*p == '"') {
+            /* Even "" makes a field, so it gets an empty part. "$@"
+             * does not, it makes no field when there are no parameters. */
+            if (!in_double_quote) {
+                quote_start = word->nparts;
+            } else if (word->nparts == quote_start) {
+                addText(word, "", 0, 1);
+            }
+            in_double_quote = !in_double_quote;
+            p++;
+        } else if (*p == '$' && *(p + 1) == '(') {
+            const char *end = skipSubstitution(p + 2);
+            struct WordPart *part;
+            char *inner;
+
+            if (end == NULL) {
+                fprintf(stderr, "syntax error: missing ')'\n");
+                return -1;
+            }
+            inner = strndup(p + 2, end - (p + 2));
+            part = addPart(word, PART_COMMAND, in_double_quote);
+            part->prog = compileString(inner);
+            free(inner);
+            if (part->prog == NULL) {
+                return -1;
+            }
+            p = end + 1;
+        } else if (*p == '$') {
+            p = compileVariable(word, p, in_double_quote);
+            if (p == NULL) {
+                return -1;
+            }
+        } else {
+            addText(word, p, 1, in_double_quote);
+            p++;
+        }
+    }
+
+    return 0;
+}
+
+static void freeWord(struct Word *word) {
+    int i;
+
+    for (i = 0; i < word->nparts; i++) {
+        free(word->parts[i].text);
+        freeProgram(word->parts[i].prog);
+    }
+    free(word->parts);
+    free(word->source);
+}
+
+static void freeCommandTmpl(struct CommandTmpl *tmpl) {
+    int i;
+
+    if (tmpl == NULL) return;
+
+    for (i = 0; i < tmpl->argc; i++) {
+        freeWord(&tmpl->argv[i]);
+    }
+    free(tmpl->argv);
+    for (i = 0; i < 3; i++) {
+        if (tmpl->redirect[i] != NULL) {
+            freeWord(tmpl->redirect[i]);
+            free(tmpl->redirect[i]);
+        }
+    }
+    free(tmpl);
+}
+
+/* Compile the words and redirections of a parsed command */
+static struct CommandTmpl *compileCommand(struct Compiler *c, struct Command_struct *cmd) {
+    struct CommandTmpl *tmpl = xcalloc(1, sizeof(struct CommandTmpl));
+    char *targets[3];
+    int i;
+
+    targets[0] = cmd->redirect_in;
+    targets[1] = cmd->redirect_out;
+    targets[2] = cmd->redirect_err;
+
+    tmpl->argv = xcalloc(cmd->argc + 1, sizeof(struct Word));
+    for (i = 0; i < cmd->argc; i++) {
+        tmpl->argc++;
+        if (compileWord(&tmpl->argv[i], cmd->argv[i]) < 0) {
+            c->error = 1;
+        }
+    }
+
+    /* Leading NAME=value words are assignments, not arguments */
+    while (tmpl->nassign < tmpl->argc && tmpl->argv[tmpl->nassign].assign_slot >= 0) {
+        tmpl->nassign++;
+    }
+
+    /* export takes assignments as arguments, expanded the same way */
+    tmpl->decl = (tmpl->nassign < cmd->argc &&
+                  strcmp(cmd->argv[tmpl->nassign], "export") == 0);
+
+    for (i = 0; i < 3; i++) {
+        if (targets[i] != NULL) {
+            tmpl->redirect[i] = xcalloc(1, sizeof(struct Word));
+            if (compileWord(tmpl->redirect[i], targets[i]) < 0) {
+                c->error = 1;
+            }
+        }
+    }
+
+    return tmpl;
+}
+
+/* Check if a compound command has redirections of its own */
+static int hasRedirects(struct Node *node) {
+    return node->cmd != NULL && (node->cmd->redirect_in != NULL ||
+                                 node->cmd->redirect_out != NULL ||
+                                 node->cmd->redirect_err != NULL);
+}
+
+/* Compile break [n] or continue [n] as jumps out of the enclosing
+ * loops. Returns 0 if cmd is not one that can be compiled that way. */
+static int compileLoopControl(struct Compiler *c, struct Command_struct *cmd) {
+    int is_break;
+    struct Loop *loop;
+    int levels = 1;
+    int i;
+
+    if (c->loop == NULL || cmd->argc > 2 || cmd->redirect_in != NULL ||
+        cmd->redirect_out != NULL || cmd->redirect_err != NULL) {
+        return 0;
+    }
+    if (strcmp(cmd->argv[0], "break") == 0) {
+        is_break = 1;
+    } else if (strcmp(cmd->argv[0], "continue") == 0) {
+        is_break = 0;
+    } else {
+        return 0;
+    }
+
+    if (cmd->argc == 2) {
+        for (i = 0; cmd->argv[1][i]; i++) {
+            if (!isdigit((unsigned char)cmd->argv[1][i])) return 0;
+        }
+        levels = atoi(cmd->argv[1]);
+        if (levels < 1) return 0;
+    }
+
+    /* Leave every loop on the way out, undoing what each one opened */
+    loop = c->loop;
+    for (i = 1; i < levels && loop->outer != NULL; i++) {
+        if (loop->is_for) {
+            emit(c, OP_LOOP_POP, 0, NULL);
+        }
+        loop = loop->outer;
+    }
+    for (i = c->redirects; i > loop->redirects; i--) {
+        emit(c, OP_RESTORE, 0, NULL);
+    }
+    emit(c, OP_STATUS, 0, NULL);
+
+    if (is_break) {
+        if (loop->is_for) {
+            emit(c, OP_LOOP_POP, 0, NULL);
+        }
+        if (loop->nbreaks == loop->break_cap) {
+            loop->break_cap = loop->break_cap ? loop->break_cap * 2 : 4;
+            loop->breaks = realloc(loop->breaks, loop->break_cap * sizeof(int));
+            if (loop->breaks == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        loop->breaks[loop->nbreaks++] = emit(c, OP_JUMP, 0, NULL);
+    } else {
+        emit(c, OP_JUMP, loop->continue_pc, NULL);
+    }
+    return 1;
+}
+
+/* Compile a loop body with loop as its innermost loop */
+static void compileLoopBody(struct Compiler *c, struct Loop *loop, struct Node *body) {
+    loop->outer = c->loop;
+    loop->redirects = c->redirects;
+    c->loop = loop;
+    compileNode(c, body);
+    c->loop = loop->outer;
+}
+
+/* Point the breaks out of loop at the next instruction */
+static void endLoop(struct Compiler *c, struct Loop *loop) {
+    int i;
+
+    for (i = 0; i < loop->nbreaks; i++) {
+        patch(c, loop->breaks[i]);
+    }
+    free(loop->breaks);
+}
+
+/* Collect the stages of a pipeline, left to right */
+static int collectStages(struct Node *node, struct Node *stages[], int count) {
+    if (node->type == NODE_PIPE) {
+        count = collectStages(node->left, stages, count);
+        if (count < 0) return -1;
+        return collectStages(node->right, stages, count);
+    }
+    if (count >= MAX_COMMANDS) {
+        return -1;
+    }
+    stages[count] = node;
+    return count + 1;
+}
+
+/* Compile a compound command body, without its redirections */
+static void compileCompound(struct Compiler *c, struct Node *node) {
+    struct Loop loop;
+    int top, exit_jump, else_jump;
+
+    memset(&loop, 0, sizeof(loop));
+
+    switch (node->type) {
+    case NODE_GROUP:
+        compileNode(c, node->left);
+        break;
+
+    case NODE_IF:
+        compileNode(c, node->left);
+        else_jump = emit(c, OP_JUMP_FALSE, 0, NULL);
+        compileNode(c, node->right);
+        exit_jump = emit(c, OP_JUMP, 0, NULL);
+        patch(c, else_jump);
+        if (node->else_part != NULL) {
+            compileNode(c, node->else_part);
+        } else {
+            /* No branch taken is success */
+            emit(c, OP_STATUS, 0, NULL);
+        }
+        patch(c, exit_jump);
+        break;
+
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        /* The loop's status is its body's last, 0 if it never ran */
+        emit(c, OP_STATUS, 0, NULL);
+        emit(c, OP_KEEP, 0, NULL);
+        top = c->prog->len;
+        compileNode(c, node->left);
+        exit_jump = emit(c, node->type == NODE_WHILE ? OP_JUMP_FALSE : OP_JUMP_TRUE, 0, NULL);
+        loop.continue_pc = top;
+        compileLoopBody(c, &loop, node->right);
+        emit(c, OP_KEEP, 0, NULL);
+        emit(c, OP_JUMP, top, NULL);
+        patch(c, exit_jump);
+        emit(c, OP_RESULT, 0, NULL);
+        endLoop(c, &loop);
+        break;
+
+    case NODE_FOR: {
+        /* The variable name is not a word, only the list is compiled */
+        struct Command_struct list;
+
+        memset(&list, 0, sizeof(list));
+        list.argc = node->cmd->argc - 1;
+        memcpy(list.argv, node->cmd->argv + 1, list.argc * sizeof(char *));
+        list.argv[list.argc] = NULL;
+
+        emit(c, OP_FOR_INIT, findVar(node->cmd->argv[0], strlen(node->cmd->argv[0]), 1),
+             compileCommand(c, &list));
+        top = emit(c, OP_FOR_NEXT, 0, NULL);
+        loop.is_for = 1;
+        loop.continue_pc = top;
+        compileLoopBody(c, &loop, node->right);
+        emit(c, OP_JUMP, top, NULL);
+        patch(c, top);
+        endLoop(c, &loop);
+        break;
+    }
+    }
+}
+
+/* Compile a syntax tree node into c->prog */
+static int compileNode(struct Compiler *c, struct Node *node) {
+    struct Node *stages[MAX_COMMANDS];
+    struct Program **progs;
+    struct Program *sub;
+    int count, jump, i;
+
+    switch (node->type) {
+    case NODE_FUNCTION: {
+        /* The body is compiled here, once; the definition only
+         * takes a reference to it when it runs */
+        struct Function *func = xcalloc(1, sizeof(struct Function));
+
+        func->name = strdup(node->cmd->argv[0]);
+        func->body = compileTree(node->left);
+        if (func->body == NULL) {
+            free(func->name);
+            free(func);
+            c->error = 1;
+            break;
+        }
+        emit(c, OP_DEFUN, 0, func);
+        break;
+    }
+
+    case NODE_COMMAND:
+        if (node->cmd->argc > 0 && compileLoopControl(c, node->cmd)) {
+            break;
+        }
+        emit(c, OP_COMMAND, 0, compileCommand(c, node->cmd));
+        break;
+
+    case NODE_PIPE:
+        /* Each stage is a program of its own, run in its own process */
+        count = collectStages(node, stages, 0);
+        if (count < 0) {
+            fprintf(stderr, "pipeline too long\n");
+            c->error = 1;
+            break;
+        }
+        progs = xcalloc(count, sizeof(struct Program *));
+        for (i = 0; i < count; i++) {
+            progs[i] = compileSub(stages[i]);
+            if (progs[i] == NULL) {
+                c->error = 1;
+            }
+        }
+        emit(c, OP_PIPELINE, count, progs);
+        break;
+
+    case NODE_AND:
+    case NODE_OR:
+        /* The right side is only reached, and only spawned, if needed */
+        compileNode(c, node->left);
+        jump = emit(c, node->type == NODE_AND ? OP_JUMP_FALSE : OP_JUMP_TRUE, 0, NULL);
+        compileNode(c, node->right);
+        patch(c, jump);
+        break;
+
+    case NODE_SEQ:
+        /* Lists are chained to the right, see parseList */
+        while (node->type == NODE_SEQ) {
+            compileNode(c, node->left);
+            node = node->right;
+        }
+        compileNode(c, node);
+        break;
+
+    case NODE_BACKGROUND:
+    case NODE_SUBSHELL:
+        /* Both run in a child process, as programs of their own */
+        sub = compileSub(node->type == NODE_BACKGROUND ? node->left : node);
+        if (sub == NULL) {
+            c->error = 1;
+            break;
+        }
+        emit(c, node->type == NODE_BACKGROUND ? OP_BACKGROUND : OP_SUBSHELL, 0, sub);
+        break;
+
+    default:
+        if (hasRedirects(node)) {
+            /* A failed redirection skips the body but still restores */
+            jump = emit(c, OP_REDIRECT, 0, compileCommand(c, node->cmd));
+            c->redirects++;
+            compileCompound(c, node);
+            c->redirects--;
+            patch(c, jump);
+            emit(c, OP_RESTORE, 0, NULL);
+        } else {
+            compileCompound(c, node);
+        }
+        break;
+    }
+
+    return c->error ? -1 : 0;
+}
+
+/* Compile node into a program of its own, for a child process. A
+ * subshell's parentheses are dropped: the child is the subshell. */
+static struct Program *compileSub(struct Node *node) {
+    struct Node group;
+
+    if (node == NULL) {
+        return NULL;
+    }
+    if (node->type == NODE_SUBSHELL) {
+        group = *node;
+        group.type = NODE_GROUP;
+        return compileTree(&group);
+    }
+    return compileTree(node);
+}
+
+/* Compile a syntax tree into a program. Returns NULL on an error. */
+struct Program *compileTree(struct Node *tree) {
+    struct Compiler c;
+
+    memset(&c, 0, sizeof(c));
+    c.prog = newProgram();
+
+    if (tree != NULL) {
+        compileNode(&c, tree);
+    }
+    emit(&c, OP_END, 0, NULL);
+
+    if (c.error) {
+        freeProgram(c.prog);
+        return NULL;
+    }
+    return c.prog;
+}
+
+/* Parse and compile a command string, such as the inside of $( ... ) */
+struct Program *compileString(const char *src) {
+    struct Program *prog;
+    struct Node *tree;
+    char *line = strdup(src);
+    int rc;
+
+    if (line == NULL) {
+        perror("strdup");
+        return NULL;
+    }
+
+    rc = parseCommandLine(line, &tree);
+    free(line);
+    if (rc == PARSE_INCOMPLETE) {
+        fprintf(stderr, "syntax error: unexpected end of file\n");
+    }
+    if (rc < 0) {
+        return NULL;
+    }
+
+    prog = compileTree(tree);
+    freeNode(tree);
+    return prog;
+}
+
+/* Drop a reference to a program, freeing it and everything compiled
+ * into it with the last one */
+void freeProgram(struct Program *prog) {
+    struct Program **stages;
+    struct Function *func;
+    int i, j;
+
+    if (prog == NULL || --prog->refs > 0) return;
+
+    for (i = 0; i < prog->len; i++) {
+        struct Instr *in = &prog->code[i];
+
+        switch (in->op) {
+        case OP_COMMAND:
+        case OP_REDIRECT:
+        case OP_FOR_INIT:
+            freeCommandTmpl(in->data);
+            break;
+        case OP_PIPELINE:
+            stages = in->data;
+            for (j = 0; j < in->arg; j++) {
+                freeProgram(stages[j]);
+            }
+            free(stages);
+            break;
+        case OP_SUBSHELL:
+        case OP_BACKGROUND:
+            freeProgram(in->data);
+            break;
+        case OP_DEFUN:
+            func = in->data;
+            freeProgram(func->body);
+            free(func->name);
+            free(func);
+            break;
+        }
+    }
+
+    free(prog->code);
+    free(prog);
+}
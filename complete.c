@@ -0,0 +1,512 @@
+#include "shell.h"
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+/* Tab completion for readLineWithHistory.
+ *
+ * Command names come from a prefix trie of the builtins and of the
+ * executables in the PATH directories. It is built on the first Tab and
+ * rebuilt when PATH changes or one of its directories has a new mtime,
+ * which is what adding or removing a file does. File names come from
+ * sorted listings of the directories completed in, kept for the last
+ * few directories and reread when a directory's mtime changes, so a
+ * prefix in a huge directory is a binary search rather than a scan. */
+
+#define DIR_CACHE_SIZE 8
+#define MAX_SHOWN 200
+
+/* Trie of command names. Children are a sorted sibling list, so a walk
+ * visits names in order. Node 0 is the root. */
+struct TrieNode {
+    int child;
+    int sibling;
+    char c;
+    char terminal;
+};
+
+static struct TrieNode *trie = NULL;
+static int trie_len = 0;
+static int trie_cap = 0;
+
+/* The PATH the trie was built from, with the mtimes of its directories */
+static char *trie_path = NULL;
+static struct timespec *path_mtimes = NULL;
+static int path_dirs = 0;
+
+/* A sorted directory listing */
+struct DirCache {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char **names;             /* sorted; the byte before each is its type */
+    int count;
+    struct StrBuf text;       /* the names, NUL separated */
+    unsigned long used;       /* for replacing the least recently used */
+};
+
+static struct DirCache dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_clock = 0;
+
+/* Matches of one completion */
+struct Matches {
+    struct StrBuf text;       /* NUL separated */
+    int count;                /* all matches, even those not kept */
+    int kept;
+    int unique_dir;           /* the only match is a directory */
+};
+
+static int newTrieNode(char c) {
+    if (trie_len == trie_cap) {
+        int new_cap = trie_cap ? trie_cap * 2 : 4096;
+        struct TrieNode *new_trie = realloc(trie, new_cap * sizeof(struct TrieNode));
+        if (new_trie == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        trie = new_trie;
+        trie_cap = new_cap;
+    }
+    trie[trie_len].child = -1;
+    trie[trie_len].sibling = -1;
+    trie[trie_len].c = c;
+    trie[trie_len].terminal = 0;
+    return trie_len++;
+}
+
+static void trieInsert(const char *name) {
+    int node = 0;
+    int *link;
+
+    for (; *name; name++) {
+        /* Find the child for *name, or where it goes in order */
+        link = &trie[node].child;
+        while (*link >= 0 && (unsigned char)trie[*link].c < (unsigned char)*name) {
+            link = &trie[*link].sibling;
+        }
+        if (*link < 0 || trie[*link].c != *name) {
+            int next = newTrieNode(*name);
+            /* trie may have moved, so find the link again */
+            link = &trie[node].child;
+            while (*link >= 0 && (unsigned char)trie[*link].c < (unsigned char)*name) {
+                link = &trie[*link].sibling;
+            }
+            trie[next].sibling = *link;
+            *link = next;
+        }
+        node = *link;
+    }
+    trie[node].terminal = 1;
+}
+
+/* Node reached by prefix, or -1 */
+static int trieFind(const char *prefix) {
+    int node = 0;
+    int child;
+
+    for (; *prefix; prefix++) {
+        for (child = trie[node].child; child >= 0; child = trie[child].sibling) {
+            if (trie[child].c == *prefix) break;
+        }
+        if (child < 0) return -1;
+        node = child;
+    }
+    return node;
+}
+
+/* Add the names below node to m; name holds the prefix so far */
+static void trieCollect(int node, struct StrBuf *name, struct Matches *m) {
+    int child;
+
+    if (trie[node].terminal) {
+        m->count++;
+        if (m->kept < MAX_SHOWN) {
+            sbAppend(&m->text, name->data, name->len);
+            sbAppendChar(&m->text, '\0');
+            m->kept++;
+        }
+    }
+    for (child = trie[node].child; child >= 0; child = trie[child].sibling) {
+        sbAppendChar(name, trie[child].c);
+        trieCollect(child, name, m);
+        name->len--;
+    }
+}
+
+/* Check if the trie is out of date with PATH */
+static int pathChanged(const char *path) {
+    const char *p = path;
+    struct stat st;
+    char dir[PATH_MAX];
+    int i = 0;
+
+    if (trie == NULL || trie_path == NULL || strcmp(trie_path, path) != 0) {
+        return 1;
+    }
+    while (*p) {
+        size_t len = strcspn(p, ":");
+        snprintf(dir, sizeof(dir), "%.*s", (int)len, len ? p : ".");
+        if (stat(dir, &st) == 0 &&
+            (st.st_mtim.tv_sec != path_mtimes[i].tv_sec || st.st_mtim.tv_nsec != path_mtimes[i].tv_nsec)) {
+            return 1;
+        }
+        i++;
+        p += len;
+        if (*p == ':') p++;
+    }
+    return 0;
+}
+
+/* Rebuild the trie from the builtins and the executables on PATH */
+static void buildTrie(const char *path) {
+    const char *p = path;
+    char dir[PATH_MAX];
+    struct dirent *ent;
+    struct stat st;
+    DIR *d;
+    int fd;
+    int i;
+
+    trie_len = 0;
+    newTrieNode('\0');
+    for (i = 0; builtin_names[i] != NULL; i++) {
+        trieInsert(builtin_names[i]);
+    }
+
+    free(trie_path);
+    trie_path = strdup(path);
+    free(path_mtimes);
+    path_dirs = 1;
+    for (i = 0; path[i]; i++) {
+        if (path[i] == ':') path_dirs++;
+    }
+    path_mtimes = calloc(path_dirs, sizeof(struct timespec));
+    if (path_mtimes == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (i = 0; *p; i++) {
+        size_t len = strcspn(p, ":");
+        snprintf(dir, sizeof(dir), "%.*s", (int)len, len ? p : ".");
+        p += len;
+        if (*p == ':') p++;
+
+        d = opendir(dir);
+        if (d == NULL) continue;
+        fd = dirfd(d);
+        if (fstat(fd, &st) == 0) {
+            path_mtimes[i] = st.st_mtim;
+        }
+        while ((ent = readdir(d)) != NULL) {
+            if (ent->d_name[0] == '.') continue;
+            if (ent->d_type == DT_DIR) continue;
+            if (faccessat(fd, ent->d_name, X_OK, 0) == 0 &&
+                fstatat(fd, ent->d_name, &st, 0) == 0 && !S_ISDIR(st.st_mode)) {
+                trieInsert(ent->d_name);
+            }
+        }
+        closedir(d);
+    }
+}
+
+static int compareNames(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Read a directory listing into entry. Each name is stored after a
+ * byte saying if it is a directory: 1, 0, or -1 when d_type does not
+ * tell and it is looked up only if needed. */
+static int readListing(struct DirCache *entry, const char *path, struct stat *st) {
+    struct dirent *ent;
+    size_t *offsets = NULL;
+    int cap = 0;
+    int i;
+    DIR *d = opendir(path);
+
+    if (d == NULL) {
+        return -1;
+    }
+
+    free(entry->path);
+    free(entry->names);
+    sbReset(&entry->text);
+    entry->count = 0;
+
+    /* Offsets first: the text buffer moves while it grows */
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (entry->count == cap) {
+            cap = cap ? cap * 2 : 256;
+            offsets = realloc(offsets, cap * sizeof(size_t));
+            if (offsets == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        sbAppendChar(&entry->text, ent->d_type == DT_DIR ? 1 :
+                     (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) ? -1 : 0);
+        offsets[entry->count++] = entry->text.len;
+        sbAppend(&entry->text, ent->d_name, strlen(ent->d_name) + 1);
+    }
+    closedir(d);
+
+    entry->names = malloc((entry->count + 1) * sizeof(char *));
+    if (entry->names == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < entry->count; i++) {
+        entry->names[i] = entry->text.data + offsets[i];
+    }
+    free(offsets);
+    qsort(entry->names, entry->count, sizeof(char *), compareNames);
+
+    entry->path = strdup(path);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtim;
+    return 0;
+}
+
+/* Get the sorted listing of a directory, from the cache if it is fresh */
+static struct DirCache *getListing(const char *path) {
+    struct DirCache *entry = NULL;
+    struct stat st;
+    int i;
+
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].path != NULL && strcmp(dir_cache[i].path, path) == 0) {
+            entry = &dir_cache[i];
+            break;
+        }
+    }
+    if (entry != NULL && entry->dev == st.st_dev && entry->ino == st.st_ino &&
+        entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        entry->used = ++dir_clock;
+        return entry;
+    }
+
+    if (entry == NULL) {
+        /* Replace the least recently used */
+        entry = &dir_cache[0];
+        for (i = 1; i < DIR_CACHE_SIZE; i++) {
+            if (dir_cache[i].used < entry->used) entry = &dir_cache[i];
+        }
+    }
+    if (readListing(entry, path, &st) < 0) {
+        return NULL;
+    }
+    entry->used = ++dir_clock;
+    return entry;
+}
+
+/* Add the names in dir starting with prefix to m */
+static void matchFiles(const char *dir, const char *prefix, struct Matches *m) {
+    struct DirCache *entry = getListing(*dir ? dir : ".");
+    size_t len = strlen(prefix);
+    int lo, hi;
+
+    if (entry == NULL) {
+        return;
+    }
+
+    /* First name not below the prefix */
+    lo = 0;
+    hi = entry->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(entry->names[mid], prefix) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    for (; lo < entry->count && strncmp(entry->names[lo], prefix, len) == 0; lo++) {
+        char *name = entry->names[lo];
+        int is_dir = (signed char)name[-1];
+
+        /* Hidden files only when asked for */
+        if (name[0] == '.' && prefix[0] != '.') continue;
+
+        if (is_dir < 0) {
+            /* Symbolic link or unknown type: look it up */
+            char full[PATH_MAX];
+            struct stat st;
+            snprintf(full, sizeof(full), "%s%s", *dir ? dir : "", name);
+            is_dir = stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+            name[-1] = is_dir;
+        }
+
+        m->count++;
+        m->unique_dir = m->count == 1 && is_dir;
+        if (m->kept < MAX_SHOWN) {
+            sbAppend(&m->text, name, strlen(name));
+            if (is_dir) sbAppendChar(&m->text, '/');
+            sbAppendChar(&m->text, '\0');
+            m->kept++;
+        }
+    }
+}
+
+/* Characters that must be escaped in a completed word */
+static int needsEscape(char c) {
+    return isSpecialChar(c) || strchr(" \t\\'\"$`*?[#~=", c) != NULL;
+}
+
+/* Insert len bytes of s at the end of line, escaped, and echo them */
+static int insertText(char *line, int pos, int max, const char *s, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len && pos < max - 2; i++) {
+        if (needsEscape(s[i])) {
+            line[pos++] = '\\';
+            putchar('\\');
+        }
+        line[pos++] = s[i];
+        putchar(s[i]);
+    }
+    line[pos] = '\0';
+    return pos;
+}
+
+/* Print matches in columns under the line, then the prompt and line again */
+static void showMatches(struct Matches *m, const char *prompt, const char *line) {
+    struct winsize ws;
+    const char *p;
+    size_t width = 0;
+    int columns, col = 0;
+    int i;
+
+    for (p = m->text.data, i = 0; i < m->kept; i++, p += strlen(p) + 1) {
+        if (strlen(p) > width) width = strlen(p);
+    }
+    width += 2;
+    columns = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        columns = ws.ws_col;
+    }
+    columns = (int)(columns / width);
+    if (columns < 1) columns = 1;
+
+    putchar('\n');
+    for (p = m->text.data, i = 0; i < m->kept; i++, p += strlen(p) + 1) {
+        printf("%-*s", (int)width, p);
+        if (++col == columns) {
+            putchar('\n');
+            col = 0;
+        }
+    }
+    if (col != 0) putchar('\n');
+    if (m->count > m->kept) {
+        printf("... and %d more\n", m->count - m->kept);
+    }
+    printf("%s %s", prompt, line);
+}
+
+/* Complete the word before the cursor at the end of line, pos bytes
+ * long, updating the display. Returns the new length. */
+int completeLine(char *line, int pos, int max, const char *prompt) {
+    struct Matches m;
+    struct StrBuf word;        /* the word with backslashes removed */
+    struct StrBuf name;
+    const char *prefix;
+    const char *slash;
+    size_t common;
+    int start = pos;
+    int command;
+    int i;
+
+    /* The word starts after the last unescaped blank or operator */
+    while (start > 0) {
+        char c = line[start - 1];
+        if ((c == ' ' || c == '\t' || isSpecialChar(c)) &&
+            !(start > 1 && line[start - 2] == '\\')) {
+            break;
+        }
+        start--;
+    }
+
+    /* A command name is expected at the start or after an operator */
+    i = start;
+    while (i > 0 && (line[i - 1] == ' ' || line[i - 1] == '\t')) i--;
+    command = (i == 0 || strchr(";|&(", line[i - 1]) != NULL);
+
+    sbInit(&word);
+    for (i = start; i < pos; i++) {
+        if (line[i] == '\\' && i + 1 < pos) i++;
+        sbAppendChar(&word, line[i]);
+    }
+    sbAppendChar(&word, '\0');
+
+    memset(&m, 0, sizeof(m));
+    sbInit(&m.text);
+    slash = strrchr(word.data, '/');
+
+    if (command && slash == NULL) {
+        const char *path = getVar("PATH");
+        int node;
+
+        if (path == NULL) path = "";
+        if (pathChanged(path)) {
+            buildTrie(path);
+        }
+        prefix = word.data;
+        node = trieFind(prefix);
+        if (node >= 0) {
+            sbInit(&name);
+            sbAppend(&name, prefix, strlen(prefix));
+            trieCollect(node, &name, &m);
+            sbFree(&name);
+        }
+    } else {
+        char dir[PATH_MAX];
+
+        if (slash == NULL) {
+            dir[0] = '\0';
+            prefix = word.data;
+        } else {
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word.data + 1), word.data);
+            prefix = slash + 1;
+        }
+        matchFiles(dir, prefix, &m);
+    }
+
+    if (m.count == 0) {
+        putchar('\a');
+    } else {
+        /* Longest common prefix; with matches left out it is unknown */
+        const char *first = m.text.data;
+        const char *p = first;
+        common = m.count > m.kept ? strlen(prefix) : strlen(first);
+        for (i = 1; i < m.kept; i++) {
+            size_t j = 0;
+            p += strlen(p) + 1;
+            while (j < common && first[j] == p[j]) j++;
+            common = j;
+        }
+
+        if (m.count == 1) {
+            /* Directories keep their slash and are not finished */
+            pos = insertText(line, pos, max, first + strlen(prefix), common - strlen(prefix));
+            if (!m.unique_dir && pos < max - 1) {
+                line[pos++] = ' ';
+                line[pos] = '\0';
+                putchar(' ');
+            }
+        } else if (common > strlen(prefix)) {
+            pos = insertText(line, pos, max, first + strlen(prefix), common - strlen(prefix));
+        } else {
+            line[pos] = '\0';
+            showMatches(&m, prompt, line);
+        }
+    }
+
+    fflush(stdout);
+    sbFree(&m.text);
+    sbFree(&word);
+    return pos;
+}
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include "shell.h"
+#include <sys/mman.h>
+
+/* Shell contexts and the embedding API of libmyshell (see myshell.h) */
+
+/* The context of myshell itself, and of programs that never make one */
+static struct ShellContext main_context = {
+    .prompt = DEFAULT_PROMPT,
+    .history_index = -1,
+    .env_dirty = 1,
+};
+
+struct ShellContext *shell = &main_context;
+
+/* Process state, shared by every context */
+int in_subshell = 0;
+int stdin_piped = 0;
+int interactive = 0;
+
+/* What to go back to when a call on a context returns */
+struct Saved {
+    struct ShellContext *context;
+    char cwd[PATH_MAX];
+    int have_cwd;
+    int fds[3];
+};
+
+/* Make ctx current, in its working directory */
+static void enterContext(struct ShellContext *ctx, struct Saved *saved) {
+    saved->context = shell;
+    saved->have_cwd = getcwd(saved->cwd, sizeof(saved->cwd)) != NULL;
+    if (ctx->cwd != NULL && chdir(ctx->cwd) < 0) {
+        perror(ctx->cwd);
+    }
+    shell = ctx;
+}
+
+/* Remember the working directory of the current context and go back */
+static void leaveContext(struct Saved *saved) {
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        free(shell->cwd);
+        shell->cwd = strdup(cwd);
+    }
+    shell = saved->context;
+    if (saved->have_cwd && chdir(saved->cwd) < 0) {
+        perror(saved->cwd);
+    }
+}
+
+struct ShellContext *shellCreate(void) {
+    struct ShellContext *ctx = calloc(1, sizeof(struct ShellContext));
+    char *argv[] = { "myshell", NULL };
+    struct Saved saved;
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+    strcpy(ctx->prompt, DEFAULT_PROMPT);
+    ctx->history_index = -1;
+    ctx->env_dirty = 1;
+    ctx->embedded = 1;
+
+    enterContext(ctx, &saved);
+    initVars();
+    setPositional(1, argv);
+    leaveContext(&saved);
+    return ctx;
+}
+
+void shellDestroy(struct ShellContext *ctx) {
+    struct Saved saved;
+    int i;
+
+    if (ctx == NULL) {
+        return;
+    }
+    enterContext(ctx, &saved);
+    for (i = 0; i < ctx->history_count; i++) {
+        free(ctx->history[i]);
+    }
+    freeVars();
+    removeAllFunctions();
+    freeAliases();
+    leaveContext(&saved);
+    free(ctx->cwd);
+    free(ctx);
+}
+
+int shellParse(struct ShellContext *ctx, const char *text) {
+    struct Saved saved;
+    struct Node *tree;
+    char *copy = strdup(text);
+    int rc;
+
+    if (copy == NULL) {
+        return -1;
+    }
+    enterContext(ctx, &saved);
+    rc = parseCommandLine(copy, &tree);
+    freeNode(tree);
+    leaveContext(&saved);
+    free(copy);
+    return rc;
+}
+
+/* Point fds 0, 1 and 2 at /dev/null and the capture files, saving the
+ * old ones. Returns -1 if they could not be set up. */
+static int redirectOutput(int out_fd, int err_fd, struct Saved *saved) {
+    int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int i;
+
+    if (null < 0) {
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < 3; i++) {
+        saved->fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    }
+    dup2(null, STDIN_FILENO);
+    close(null);
+    if (out_fd >= 0) {
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+    }
+    return 0;
+}
+
+static void restoreOutput(struct Saved *saved) {
+    int i;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < 3; i++) {
+        if (saved->fds[i] >= 0) {
+            dup2(saved->fds[i], i);
+            close(saved->fds[i]);
+        } else {
+            close(i);
+        }
+    }
+}
+
+/* Read a capture file back into a string */
+static char *readCapture(int fd, size_t *len) {
+    struct StrBuf sb;
+
+    sbInit(&sb);
+    if (lseek(fd, 0, SEEK_SET) < 0 || sbReadFd(&sb, fd) < 0) {
+        perror("capture");
+    }
+    sbAppendChar(&sb, '\0');
+    *len = sb.len - 1;
+    return sb.data;
+}
+
+int shellExecute(struct ShellContext *ctx, const char *text, struct ShellOutput *output) {
+    struct Saved saved;
+    struct Node *tree;
+    char *copy = strdup(text);
+    int out_fd = -1, err_fd = -1;
+    int rc;
+
+    if (copy == NULL) {
+        return 1;
+    }
+    if (output != NULL) {
+        memset(output, 0, sizeof(*output));
+        out_fd = memfd_create("myshell-out", MFD_CLOEXEC);
+        err_fd = memfd_create("myshell-err", MFD_CLOEXEC);
+        if (out_fd < 0 || err_fd < 0) {
+            perror("memfd_create");
+            if (out_fd >= 0) close(out_fd);
+            if (err_fd >= 0) close(err_fd);
+            free(copy);
+            return 1;
+        }
+    }
+
+    enterContext(ctx, &saved);
+    if (redirectOutput(out_fd, err_fd, &saved) < 0) {
+        perror("/dev/null");
+        leaveContext(&saved);
+        free(copy);
+        return 1;
+    }
+
+    ctx->exit_pending = 0;
+    addToHistory(copy);
+    rc = parseCommandLine(copy, &tree);
+    if (rc == PARSE_INCOMPLETE) {
+        fprintf(stderr, "syntax error: unexpected end of file\n");
+    } else if (rc < 0) {
+        fprintf(stderr, "Error parsing command line\n");
+    }
+    if (rc < 0) {
+        ctx->last_status = 2;
+    } else if (tree != NULL) {
+        ctx->last_status = executeCommands(tree);
+        freeNode(tree);
+    }
+
+    restoreOutput(&saved);
+    leaveContext(&saved);
+    free(copy);
+
+    if (output != NULL) {
+        output->out = readCapture(out_fd, &output->out_len);
+        output->err = readCapture(err_fd, &output->err_len);
+        close(out_fd);
+        close(err_fd);
+    }
+    return ctx->last_status;
+}
+
+void shellFreeOutput(struct ShellOutput *output) {
+    free(output->out);
+    free(output->err);
+    output->out = output->err = NULL;
+    output->out_len = output->err_len = 0;
+}
+
+int shellStatus(struct ShellContext *ctx) {
+    return ctx->last_status;
+}
+
+int shellExited(struct ShellContext *ctx) {
+    return ctx->exit_pending;
+}
@@ -1,271 +1,675 @@
 #include "shell.h"
 
-/* Execute array of commands */
-void executeCommands(struct Command_struct commands[], int num_commands) {
-    int i = 0;
-    
-    while (i < num_commands) {
-        /* Find the end of the current job (pipeline) */
-        int job_start = i;
-        int job_count = 1;
-        
-        while (i < num_commands && commands[i].com_suffix == '|') {
-            i++;
-            job_count++;
-        }
-        i++;  /* Move past the last command in the job */
-        
-        /* Check if this is a built-in command */
-        if (job_count == 1 && isBuiltIn(commands[job_start].com_pathname)) {
-            executeBuiltIn(&commands[job_start]);
-            continue;
+extern char **environ;
+
+/* Word lists of the for loops being run, innermost last. The
+ * entries are kept for reuse, so entering a loop allocates nothing
+ * once the shell has warmed up. */
+static struct ExpandBuf *for_words[MAX_LOOP_DEPTH];
+static int for_next[MAX_LOOP_DEPTH];
+static int for_slot[MAX_LOOP_DEPTH];
+static int for_depth = 0;
+
+/* Descriptors saved by OP_REDIRECT, innermost last */
+static int redirect_saved[MAX_REDIRECT_DEPTH][3];
+static int redirect_depth = 0;
+
+/* Expanded simple commands being run, innermost last. A function
+ * call runs its body while the caller's command is still in use, so
+ * each level of nesting needs its own; they are kept off the stack,
+ * which would otherwise run out long before MAX_FUNCTION_DEPTH. */
+static struct Command_struct **command_bufs;
+static int command_depth = 0;
+static int command_cap = 0;
+
+/* Open a redirection target onto target_fd */
+static int redirectFd(const char *path, int open_flags, int target_fd) {
+    int fd = open(path, open_flags, 0644);
+    
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fd != target_fd) {
+        dup2(fd, target_fd);
+        close(fd);
+    }
+    return 0;
+}
+
+/* Apply the redirections of an expanded command to this process.
+ * If saved is not NULL the descriptors being replaced are kept there
+ * for restoreRedirects, which must be called even if this fails. */
+static int applyRedirects(struct Command_struct *cmd, int saved[3]) {
+    char *targets[3];
+    int i;
+    
+    targets[0] = cmd->redirect_in;
+    targets[1] = cmd->redirect_out;
+    targets[2] = cmd->redirect_err;
+    
+    if (saved != NULL) {
+        for (i = 0; i < 3; i++) {
+            saved[i] = -1;
+            if (targets[i] != NULL) {
+                /* Output buffered for the old target goes there */
+                if (i > 0) fflush(i == 1 ? stdout : stderr);
+                saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+            }
         }
-        
-        /* Determine if this is a background job */
-        int is_background = (commands[job_start + job_count - 1].com_suffix == '&');
-        
-        /* Execute the job (single command or pipeline) */
-        if (job_count == 1) {
-            executeSingleCommand(&commands[job_start]);
-        } else {
-            executePipeline(commands, job_start, job_count);
+    }
+    
+    /* Handle input redirection */
+    if (targets[0] != NULL &&
+        redirectFd(targets[0], O_RDONLY, STDIN_FILENO) < 0) {
+        return -1;
+    }
+    
+    /* Handle output redirection */
+    if (targets[1] != NULL &&
+        redirectFd(targets[1], O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO) < 0) {
+        return -1;
+    }
+    
+    /* Handle error redirection */
+    if (targets[2] != NULL &&
+        redirectFd(targets[2], O_WRONLY | O_CREAT | O_TRUNC, STDERR_FILENO) < 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Put back the descriptors saved by applyRedirects */
+static void restoreRedirects(int saved[3]) {
+    int i;
+    
+    for (i = 0; i < 3; i++) {
+        if (saved[i] >= 0) {
+            if (i > 0) fflush(i == 1 ? stdout : stderr);
+            dup2(saved[i], i);
+            close(saved[i]);
         }
-        
-        /* Wait for foreground jobs */
-        if (!is_background) {
-            int status;
-            while (wait(&status) > 0);
+    }
+}
+
+/* Convert a wait() status to a shell exit status */
+static int exitStatus(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+/* Wait for the processes of a foreground job; its status is the last one's */
+static int waitPids(pid_t pids[], int count) {
+    int i;
+    int status = 0;
+    int result = 0;
+    
+    for (i = 0; i < count; i++) {
+        while (waitpid(pids[i], &status, 0) < 0) {
+            if (errno != EINTR) {
+                status = 0;
+                break;
+            }
         }
+        result = exitStatus(status);
     }
+    return result;
 }
 
-/* Execute a single command */
-void executeSingleCommand(struct Command_struct *cmd) {
+/* Replace this process with an expanded external command.
+ * Assignments in front of the command go into its environment only. */
+static void execCommand(struct Command_struct *cmd, struct ExpandBuf *eb, char **envp) {
+    int i;
+    
+    if (applyRedirects(cmd, NULL) < 0) {
+        _exit(1);
+    }
+    
+    environ = envp;
+    for (i = 0; i < eb->nassign; i++) {
+        putenv(getAssignment(eb, i));
+    }
+    
+    /* Execute the command */
+    execvp(cmd->com_pathname, cmd->argv);
+    
+    /* If execvp returns, there was an error */
+    if (errno == ENOENT) {
+        fprintf(stderr, "%s: command not found\n", cmd->com_pathname);
+        _exit(127);
+    }
+    perror(cmd->com_pathname);
+    _exit(126);
+}
+
+/* Start a child process that runs prog and exits. in_fd/out_fd become
+ * its stdin/stdout if not -1; close_fd is a pipe end it must not keep.
+ * slot is its placement slot as a pipeline stage, or -1. */
+static pid_t forkProgram(struct Program *prog, int in_fd, int out_fd, int close_fd, int slot) {
     pid_t pid;
     int status;
     
-    /* Expand wildcards */
-    expandWildcards(cmd);
-    
+    fflush(stdout);
     pid = fork();
     
     if (pid < 0) {
         perror("fork");
-        return;
+        return -1;
     }
     
     if (pid == 0) {
         /* Child process */
-        
-        /* Handle input redirection */
-        if (cmd->redirect_in != NULL) {
-            int fd = open(cmd->redirect_in, O_RDONLY);
-            if (fd < 0) {
-                perror(cmd->redirect_in);
-                exit(1);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
+        in_subshell = 1;
+        blockChildSignal(0);
+        if (slot >= 0) {
+            scheduleStage(slot);
         }
         
-        /* Handle output redirection */
-        if (cmd->redirect_out != NULL) {
-            int fd = open(cmd->redirect_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror(cmd->redirect_out);
-                exit(1);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
+        if (close_fd >= 0) {
+            close(close_fd);
         }
-        
-        /* Handle error redirection */
-        if (cmd->redirect_err != NULL) {
-            int fd = open(cmd->redirect_err, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror(cmd->redirect_err);
-                exit(1);
-            }
-            dup2(fd, STDERR_FILENO);
-            close(fd);
+        if (in_fd >= 0) {
+            dup2(in_fd, STDIN_FILENO);
+            close(in_fd);
+            stdin_piped = 1;
+        }
+        if (out_fd >= 0) {
+            dup2(out_fd, STDOUT_FILENO);
+            close(out_fd);
         }
         
-        /* Execute the command */
-        execvp(cmd->com_pathname, cmd->argv);
+        /* The child has nothing else to do, so the last command in it
+         * replaces it instead of forking again */
+        status = runProgram(prog, EXEC_NOFORK);
         
-        /* If execvp returns, there was an error */
-        fprintf(stderr, "%s: command not found\n", cmd->com_pathname);
-        exit(127);
+        /* _exit: exit() would rewind the stdin we share with the shell */
+        fflush(stdout);
+        _exit(status);
     }
     
-    /* Parent process */
-    if (cmd->com_suffix != '&') {
-        /* Foreground job - wait for completion */
-        waitpid(pid, &status, 0);
-    }
+    return pid;
 }
 
-/* Execute a pipeline of commands */
-void executePipeline(struct Command_struct commands[], int start, int count) {
+/* Start the stages of a pipeline without waiting for them.
+ * The last stage writes to out_fd when it is not -1.
+ * Returns the number of processes started, their pids in pids[]. */
+static int spawnPipeline(struct Program **stages, int count, pid_t pids[], int out_fd) {
+    int prev_read = -1;
+    int started = 0;
+    int slot = reserveStageSlots(count);
+    int fds[2];
     int i;
-    int pipes[MAX_COMMANDS - 1][2];
-    pid_t pids[MAX_COMMANDS];
-    int status;
     
-    /* Create all pipes */
-    for (i = 0; i < count - 1; i++) {
-        if (pipe(pipes[i]) < 0) {
+    for (i = 0; i < count; i++) {
+        int last = (i == count - 1);
+        pid_t pid;
+        
+        /* Each pipe is created just before the command that writes it,
+         * so no child inherits more than its own two ends */
+        fds[0] = fds[1] = -1;
+        if (!last && pipe(fds) < 0) {
             perror("pipe");
-            return;
+            break;
+        }
+        
+        /* Words are expanded in the child, each stage is a subshell */
+        pid = forkProgram(stages[i], prev_read, last ? out_fd : fds[1], fds[0],
+                          slot < 0 ? -1 : slot + i);
+        if (pid > 0) {
+            pids[started++] = pid;
+        }
+        
+        /* Parent process - close the ends now owned by the children */
+        if (prev_read >= 0) {
+            close(prev_read);
+        }
+        if (!last) {
+            close(fds[1]);
         }
+        prev_read = fds[0];
     }
     
-    /* Fork and execute each command in the pipeline */
-    for (i = 0; i < count; i++) {
-        struct Command_struct *cmd = &commands[start + i];
-        
-        /* Expand wildcards */
-        expandWildcards(cmd);
+    if (prev_read >= 0) {
+        close(prev_read);
+    }
+    
+    return started;
+}
+
+/* Run a builtin, or a function if func is set; assignments in front of
+ * it last only for the call */
+static int runBuiltIn(struct Command_struct *cmd, struct CommandTmpl *tmpl, struct ExpandBuf *eb,
+                      struct Function *func, int flags) {
+    int nassign = eb->nassign;   /* a function body reuses eb */
+    char **saved = NULL;
+    int status;
+    int i;
+    
+    if (nassign > 0) {
+        saved = malloc(nassign * sizeof(char *));
+        if (saved == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    for (i = 0; i < nassign; i++) {
+        int slot = tmpl->argv[i].assign_slot;
+        const char *old = getVarSlot(slot);
+        char *value = strchr(getAssignment(eb, i), '=') + 1;
         
-        pids[i] = fork();
+        saved[i] = old ? strdup(old) : NULL;
+        setVarSlot(slot, value, strlen(value));
+    }
+    
+    if (func != NULL) {
+        status = callFunction(func, cmd, flags);
+    } else {
+        status = executeBuiltIn(cmd);
+    }
+    
+    /* Put the old values back, last assignment first */
+    for (i = nassign - 1; i >= 0; i--) {
+        int slot = tmpl->argv[i].assign_slot;
         
-        if (pids[i] < 0) {
-            perror("fork");
-            return;
+        if (saved[i] != NULL) {
+            setVarSlot(slot, saved[i], strlen(saved[i]));
+            free(saved[i]);
+        } else {
+            unsetVarSlot(slot);
+        }
+    }
+    free(saved);
+    
+    return status;
+}
+
+/* Check if the instruction at pc is the last thing prog does, so that
+ * with EXEC_NOFORK it may take over the process */
+static int isLast(struct Program *prog, int pc) {
+    pc++;
+    for (;;) {
+        switch (prog->code[pc].op) {
+        case OP_END:
+            return 1;
+        case OP_JUMP:
+            pc = prog->code[pc].arg;
+            break;
+        case OP_RESTORE:
+            /* The process ends, nothing needs restoring */
+            pc++;
+            break;
+        default:
+            return 0;
         }
+    }
+}
+
+/* Apply the redirections of a compound command for OP_REDIRECT */
+static int pushRedirects(struct CommandTmpl *tmpl) {
+    struct Command_struct expanded;
+    int *saved;
+    
+    if (redirect_depth == MAX_REDIRECT_DEPTH) {
+        fprintf(stderr, "redirections nested too deeply\n");
+        return -1;
+    }
+    saved = redirect_saved[redirect_depth++];
+    saved[0] = saved[1] = saved[2] = -1;
+    
+    if (expandCommand(tmpl, &expanded, getExpandBuf()) < 0) {
+        return -1;
+    }
+    return applyRedirects(&expanded, saved);
+}
+
+/* Start a for loop over variable slot: expand its words into a list
+ * of its own */
+static int pushForLoop(struct CommandTmpl *tmpl, int slot) {
+    struct ExpandBuf *words;
+    
+    if (for_depth == MAX_LOOP_DEPTH) {
+        fprintf(stderr, "loops nested too deeply\n");
+        exit(1);
+    }
+    if (for_words[for_depth] == NULL) {
+        for_words[for_depth] = calloc(1, sizeof(struct ExpandBuf));
+        if (for_words[for_depth] == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    words = for_words[for_depth];
+    for_next[for_depth] = 0;
+    for_slot[for_depth] = slot;
+    for_depth++;
+    
+    if (expandWords(tmpl->argv, tmpl->argc, words) < 0) {
+        words->nfields = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Run a compiled program and return its exit status. With EXEC_NOFORK
+ * the last command may replace the calling process. */
+int runProgram(struct Program *prog, int flags) {
+    struct Instr *code = prog->code;
+    int loop_base = for_depth;
+    int redirect_base = redirect_depth;
+    int status = 0;
+    int kept = 0;
+    int pc = 0;
+    pid_t pid;
+    
+    for (;;) {
+        struct Instr *in = &code[pc++];
         
-        if (pids[i] == 0) {
-            /* Child process */
+        switch (in->op) {
+        case OP_END:
+            goto done;
+            
+        case OP_COMMAND:
+            status = executeSingleCommand(in->data,
+                (flags & EXEC_NOFORK) && isLast(prog, pc - 1) ? EXEC_NOFORK : 0);
+            if (return_pending || shell->exit_pending) {
+                /* return: the rest of the function body is skipped;
+                 * exit in an embedded context: everything is */
+                goto done;
+            }
+            break;
+            
+        case OP_PIPELINE:
+            status = executePipeline(in->data, in->arg);
+            break;
             
-            /* Set up input */
-            if (i > 0) {
-                /* Not the first command - read from previous pipe */
-                dup2(pipes[i - 1][0], STDIN_FILENO);
-            } else if (cmd->redirect_in != NULL) {
-                /* First command with input redirection */
-                int fd = open(cmd->redirect_in, O_RDONLY);
-                if (fd < 0) {
-                    perror(cmd->redirect_in);
-                    exit(1);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
+        case OP_SUBSHELL:
+            if ((flags & EXEC_NOFORK) && isLast(prog, pc - 1)) {
+                /* Already in a process of its own */
+                status = runProgram(in->data, EXEC_NOFORK);
+            } else {
+                pid = forkProgram(in->data, -1, -1, -1, -1);
+                status = (pid > 0) ? waitPids(&pid, 1) : 1;
+            }
+            break;
+            
+        case OP_BACKGROUND:
+            /* Registered before SIGCHLD can report it */
+            blockChildSignal(1);
+            pid = forkProgram(in->data, -1, -1, -1, -1);
+            if (pid > 0) {
+                addBackgroundJob(pid);
             }
+            blockChildSignal(0);
+            status = (pid > 0) ? 0 : 1;
+            break;
             
-            /* Set up output */
-            if (i < count - 1) {
-                /* Not the last command - write to next pipe */
-                dup2(pipes[i][1], STDOUT_FILENO);
-            } else if (cmd->redirect_out != NULL) {
-                /* Last command with output redirection */
-                int fd = open(cmd->redirect_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd < 0) {
-                    perror(cmd->redirect_out);
-                    exit(1);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
+        case OP_REDIRECT:
+            if (pushRedirects(in->data) < 0) {
+                status = 1;
+                pc = in->arg;
             }
+            break;
             
-            /* Handle error redirection */
-            if (cmd->redirect_err != NULL) {
-                int fd = open(cmd->redirect_err, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd < 0) {
-                    perror(cmd->redirect_err);
-                    exit(1);
-                }
-                dup2(fd, STDERR_FILENO);
-                close(fd);
+        case OP_RESTORE:
+            if (redirect_depth > redirect_base) {
+                restoreRedirects(redirect_saved[--redirect_depth]);
             }
+            break;
+            
+        case OP_JUMP:
+            pc = in->arg;
+            break;
+            
+        case OP_JUMP_TRUE:
+            if (status == 0) pc = in->arg;
+            break;
+            
+        case OP_JUMP_FALSE:
+            if (status != 0) pc = in->arg;
+            break;
             
-            /* Close all pipe file descriptors */
-            for (int j = 0; j < count - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+        case OP_STATUS:
+            status = in->arg;
+            break;
+            
+        case OP_KEEP:
+            kept = status;
+            break;
+            
+        case OP_RESULT:
+            status = kept;
+            break;
+            
+        case OP_FOR_INIT:
+            status = pushForLoop(in->data, in->arg);
+            break;
+            
+        case OP_FOR_NEXT: {
+            struct ExpandBuf *words = for_words[for_depth - 1];
+            int i = for_next[for_depth - 1]++;
+            
+            if (i < words->nfields) {
+                /* Set in place: no allocation once the value fits */
+                const char *word = words->text.data + words->field[i];
+                setVarSlot(for_slot[for_depth - 1], word, strlen(word));
+            } else {
+                for_depth--;
+                pc = in->arg;
             }
+            break;
+        }
             
-            /* Execute the command */
-            execvp(cmd->com_pathname, cmd->argv);
+        case OP_LOOP_POP:
+            for_depth--;
+            break;
             
-            /* If execvp returns, there was an error */
-            fprintf(stderr, "%s: command not found\n", cmd->com_pathname);
-            exit(127);
+        case OP_DEFUN:
+            defineFunction(in->data);
+            status = 0;
+            break;
         }
+        
+        shell->last_status = status;
     }
     
-    /* Parent process - close all pipes */
-    for (i = 0; i < count - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+done:
+    /* Leave nothing behind if the program ended early */
+    while (redirect_depth > redirect_base) {
+        restoreRedirects(redirect_saved[--redirect_depth]);
     }
+    for_depth = loop_base;
     
-    /* Wait for all child processes if foreground */
-    if (commands[start + count - 1].com_suffix != '&') {
-        for (i = 0; i < count; i++) {
-            waitpid(pids[i], &status, 0);
-        }
+    shell->last_status = status;
+    return status;
+}
+
+/* Execute a parsed command line */
+int executeCommands(struct Node *tree) {
+    struct Program *prog = compileTree(tree);
+    int status;
+    
+    if (prog == NULL) {
+        shell->last_status = 2;
+        return 2;
     }
+    status = runProgram(prog, 0);
+    freeProgram(prog);
+    return status;
 }
 
-/* Expand wildcards in command arguments */
-int expandWildcards(struct Command_struct *cmd) {
-   
-    int i, j;
-    int new_argc = 0;
-    char *new_argv[MAX_ARGS];
-    int has_wildcards;
-    
-    for (i = 0; i < cmd->argc; i++) {
-        has_wildcards = 0;
+/* Get the expanded command for the current level of nesting */
+static struct Command_struct *getCommandBuf(void) {
+    if (command_depth == command_cap) {
+        int cap = command_cap ? command_cap * 2 : 16;
+        struct Command_struct **bufs = realloc(command_bufs, cap * sizeof(*bufs));
         
-        /* Check if argument contains wildcards */
-        for (j = 0; cmd->argv[i][j]; j++) {
-            if (cmd->argv[i][j] == '*' || cmd->argv[i][j] == '?') {
-                has_wildcards = 1;
-                break;
-            }
+        if (bufs == NULL) {
+            perror("realloc");
+            exit(1);
         }
-        glob_t globbuf;
-        memset(&globbuf, 0, sizeof(globbuf));
-        
-        if (has_wildcards) {
-            /* Perform glob expansion */
-            int flags = (i == 0) ? 0 : GLOB_APPEND;
-            if (glob(cmd->argv[i], flags | GLOB_NOCHECK, NULL, &globbuf) == 0) {
-                /* Add expanded filenames */
-                for (size_t j = 0; j < globbuf.gl_pathc; j++) {
-                    if (new_argc < MAX_ARGS - 1) {
-                        new_argv[new_argc++] = strdup(globbuf.gl_pathv[j]);
-                    }
-                }
-                
-            } else {
-                /* Expansion failed, keep original */
-                if (new_argc < MAX_ARGS - 1) {
-                    new_argv[new_argc++] = strdup(cmd->argv[i]);
-                }
-            }
-        } else {
-            /* No wildcards, keep original */
-            if (new_argc < MAX_ARGS - 1) {
-                new_argv[new_argc++] = strdup(cmd->argv[i]);
-            }
+        memset(bufs + command_cap, 0, (cap - command_cap) * sizeof(*bufs));
+        command_bufs = bufs;
+        command_cap = cap;
+    }
+    if (command_bufs[command_depth] == NULL) {
+        command_bufs[command_depth] = malloc(sizeof(struct Command_struct));
+        if (command_bufs[command_depth] == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    return command_bufs[command_depth];
+}
+
+/* executeSingleCommand() with the command expanded into expanded */
+static int runSingleCommand(struct CommandTmpl *cmd, struct Command_struct *expanded, int flags) {
+    struct ExpandBuf *eb = getExpandBuf();
+    int saved[3] = { -1, -1, -1 };
+    int status;
+    int i;
+    
+    if (expandCommand(cmd, expanded, eb) < 0) {
+        return 1;
+    }
+    
+    /* Only assignments and redirections: set shell variables */
+    if (expanded->argc == 0) {
+        for (i = 0; i < eb->nassign; i++) {
+            char *value = strchr(getAssignment(eb, i), '=') + 1;
+            setVarSlot(cmd->argv[i].assign_slot, value, strlen(value));
         }
-        globfree(&globbuf);
+        status = (applyRedirects(expanded, saved) < 0) ? 1 : 0;
+        restoreRedirects(saved);
+        return status;
     }
     
-    /* Replace old argv with expanded argv */
-    if (new_argc > 0) {
-        for (i = 0; i < cmd->argc; i++) {
-            free(cmd->argv[i]);
+    /* memo runs the rest of the line through its cache, see memo.c */
+    if (strcmp(expanded->com_pathname, "memo") == 0 && findFunction("memo") == NULL) {
+        if (applyRedirects(expanded, saved) < 0) {
+            status = 1;
+        } else {
+            status = memoCommand(expanded, cmd, eb);
         }
-        for (i = 0; i < new_argc; i++) {
-            cmd->argv[i] = new_argv[i];
+        restoreRedirects(saved);
+        return status;
+    }
+    
+    return runExpandedCommand(expanded, cmd, eb, flags);
+}
+
+/* Execute a single command. With EXEC_NOFORK an external command
+ * replaces the calling process instead of running in a child. */
+int executeSingleCommand(struct CommandTmpl *cmd, int flags) {
+    struct Command_struct *expanded = getCommandBuf();
+    int status;
+    
+    command_depth++;
+    status = runSingleCommand(cmd, expanded, flags);
+    command_depth--;
+    return status;
+}
+
+/* Run an expanded command: a function, a builtin or a program. tmpl
+ * is the command it came from, for the slots of its assignments. */
+int runExpandedCommand(struct Command_struct *expanded, struct CommandTmpl *tmpl,
+                       struct ExpandBuf *eb, int flags) {
+    int saved[3] = { -1, -1, -1 };
+    struct Function *func;
+    char **envp;
+    int status;
+    pid_t pid;
+    
+    /* Functions come first, then built-in commands */
+    func = findFunction(expanded->com_pathname);
+    if (func != NULL || isBuiltIn(expanded->com_pathname)) {
+        if (applyRedirects(expanded, saved) < 0) {
+            status = 1;
+        } else {
+            status = runBuiltIn(expanded, tmpl, eb, func, flags);
         }
-        cmd->argv[new_argc] = NULL;
-        cmd->argc = new_argc;
-        cmd->com_pathname = cmd->argv[0];
+        restoreRedirects(saved);
+        return status;
+    }
+    
+    /* Built in the parent so the cached array is reused by every child */
+    envp = shellEnviron();
+    
+    if (flags & EXEC_NOFORK) {
+        execCommand(expanded, eb, envp);
+    }
+    
+    fflush(stdout);
+    pid = fork();
+    
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    
+    if (pid == 0) {
+        /* Child process */
+        blockChildSignal(0);
+        execCommand(expanded, eb, envp);
+    }
+    
+    /* Foreground job - wait for completion */
+    return waitPids(&pid, 1);
+}
+
+/* Execute a pipeline of commands */
+int executePipeline(struct Program **stages, int count) {
+    pid_t pids[MAX_COMMANDS];
+    int started;
+    
+    started = spawnPipeline(stages, count, pids, -1);
+    if (started == 0) {
+        return 1;
     }
     
+    /* Wait for all child processes */
+    return waitPids(pids, started);
+}
+
+/* Run a compiled command and collect its standard output in out.
+ * A pipeline writes straight into the pipe and a simple command is
+ * exec'd in the forked child, so neither needs an extra shell process;
+ * anything else runs in a subshell. */
+int captureCommand(struct Program *prog, struct StrBuf *out) {
+    pid_t pids[MAX_COMMANDS];
+    int started = 0;
+    int fds[2];
+    
+    if (prog->code[0].op == OP_END) {
+        return 0;
+    }
+    
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    
+    /* Only the dup2()ed copy of the write end may survive exec */
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    
+    if (prog->code[0].op == OP_PIPELINE && prog->code[1].op == OP_END) {
+        started = spawnPipeline(prog->code[0].data, prog->code[0].arg, pids, fds[1]);
+    } else {
+        pids[0] = forkProgram(prog, -1, fds[1], fds[0], -1);
+        started = (pids[0] > 0);
+    }
+    
+    /* Drain the pipe while the children run so they never block on it */
+    close(fds[1]);
+    sbReadFd(out, fds[0]);
+    close(fds[0]);
+    
+    shell->last_status = waitPids(pids, started);
     return 0;
 }
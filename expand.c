@@ -0,0 +1,402 @@
+#include "shell.h"
+#include <ctype.h>
+
+/* One workspace per level of command substitution nesting */
+static struct ExpandBuf *expand_bufs[MAX_SUBST_DEPTH];
+static int expand_depth = 0;
+
+/* State of the field currently being assembled */
+struct FieldState {
+    struct ExpandBuf *eb;
+    size_t start;    /* offset of the field in eb->text */
+    int open;        /* a field has been started */
+    int glob;        /* field contains an unquoted glob character */
+    int escaped;     /* field contains backslash escapes for glob() */
+    int assignment;  /* NAME=value word: no splitting, no globbing */
+};
+
+/* Get the workspace for the current nesting level */
+struct ExpandBuf *getExpandBuf(void) {
+    if (expand_bufs[expand_depth] == NULL) {
+        expand_bufs[expand_depth] = calloc(1, sizeof(struct ExpandBuf));
+        if (expand_bufs[expand_depth] == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    return expand_bufs[expand_depth];
+}
+
+/* Record a field starting at offset start of eb->text */
+static void addField(struct ExpandBuf *eb, size_t start) {
+    if (eb->nfields == eb->field_cap) {
+        int new_cap = eb->field_cap ? eb->field_cap * 2 : 64;
+        size_t *new_field = realloc(eb->field, new_cap * sizeof(size_t));
+        if (new_field == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        eb->field = new_field;
+        eb->field_cap = new_cap;
+    }
+    eb->field[eb->nfields++] = start;
+}
+
+/* Check if character is special to glob() */
+static int isGlobChar(char c) {
+    return (c == '*' || c == '?' || c == '[');
+}
+
+/* Check if character separates fields after an unquoted substitution */
+static int isIFS(const char *ifs, char c) {
+    return c != '\0' && strchr(ifs, c) != NULL;
+}
+
+static void fieldOpen(struct FieldState *fs) {
+    if (!fs->open) {
+        fs->start = fs->eb->text.len;
+        fs->open = 1;
+    }
+}
+
+/* Add one character of the result to the current field.
+ * Quoted glob characters and backslashes are escaped so glob() takes
+ * them literally; the escapes are dropped again if no glob happens. */
+static void fieldAddChar(struct FieldState *fs, char c, int quoted) {
+    if (c == '\0') return;
+
+    fieldOpen(fs);
+    if (c == '\\' || (quoted && isGlobChar(c))) {
+        sbAppendChar(&fs->eb->text, '\\');
+        fs->escaped = 1;
+    } else if (!quoted && isGlobChar(c)) {
+        fs->glob = 1;
+    }
+    sbAppendChar(&fs->eb->text, c);
+}
+
+/* Remove the glob escapes from the field starting at start */
+static void unescapeField(struct StrBuf *text, size_t start) {
+    char *src = text->data + start;
+    char *dst = src;
+
+    while (*src) {
+        if (*src == '\\' && *(src + 1)) src++;
+        *dst++ = *src++;
+    }
+    *dst = '\0';
+    text->len = dst - text->data;
+}
+
+/* Finish the current field, globbing it if needed */
+static void fieldEnd(struct FieldState *fs) {
+    struct ExpandBuf *eb = fs->eb;
+
+    if (!fs->open) return;
+
+    sbAppendChar(&eb->text, '\0');
+    if (fs->glob && !fs->assignment) {
+        expandWildcards(eb, fs->start);
+    } else {
+        if (fs->escaped) {
+            unescapeField(&eb->text, fs->start);
+            sbAppendChar(&eb->text, '\0');
+        }
+        addField(eb, fs->start);
+    }
+
+    fs->open = 0;
+    fs->glob = 0;
+    fs->escaped = 0;
+}
+
+/* Add the result of an expansion, splitting it into fields unless quoted */
+static void addExpansion(struct FieldState *fs, const char *s, size_t len, int quoted) {
+    const char *ifs;
+    int just_closed = 0;
+    size_t i;
+
+    if (quoted || fs->assignment) {
+        fieldOpen(fs);
+        for (i = 0; i < len; i++) {
+            fieldAddChar(fs, s[i], 1);
+        }
+        return;
+    }
+
+    ifs = getVar("IFS");
+    if (ifs == NULL) ifs = " \t\n";
+
+    for (i = 0; i < len; i++) {
+        char c = s[i];
+
+        if (!isIFS(ifs, c)) {
+            fieldAddChar(fs, c, 0);
+            just_closed = 0;
+        } else if (isspace((unsigned char)c)) {
+            /* Runs of IFS white space are a single separator */
+            if (fs->open) {
+                fieldEnd(fs);
+                just_closed = 1;
+            }
+        } else {
+            /* Other IFS characters each end a field, possibly empty */
+            if (!fs->open && !just_closed) {
+                fieldOpen(fs);
+            }
+            fieldEnd(fs);
+            just_closed = 0;
+        }
+    }
+}
+
+/* Run a compiled $( ... ) and add its output */
+static int substituteCommand(struct FieldState *fs, struct Program *prog, int quoted) {
+    struct StrBuf out;
+    int rc;
+
+    if (expand_depth + 1 >= MAX_SUBST_DEPTH) {
+        fprintf(stderr, "command substitution nested too deeply\n");
+        return -1;
+    }
+
+    sbInit(&out);
+
+    /* Nested commands expand into the next workspace */
+    expand_depth++;
+    rc = captureCommand(prog, &out);
+    expand_depth--;
+
+    /* Trailing newlines are removed */
+    while (out.len > 0 && out.data[out.len - 1] == '\n') {
+        out.len--;
+    }
+
+    if (rc == 0) {
+        addExpansion(fs, out.data, out.len, quoted);
+    }
+
+    sbFree(&out);
+    return rc;
+}
+
+/* Expand $@ or $*. "$@" makes one field per parameter and "$*" joins
+ * them with the first character of IFS; unquoted, both split each one. */
+static void expandParameters(struct FieldState *fs, struct WordPart *part) {
+    int count = getPositionalCount();
+    const char *ifs;
+    const char *arg;
+    int k;
+
+    for (k = 1; k <= count; k++) {
+        arg = getPositional(k);
+        if (k > 1) {
+            if (part->quoted && part->slot == 1) {
+                ifs = getVar("IFS");
+                if (ifs == NULL) ifs = " ";
+                if (*ifs) fieldAddChar(fs, *ifs, 1);
+            } else {
+                fieldEnd(fs);
+            }
+        }
+        if (part->quoted) {
+            fieldOpen(fs);
+        }
+        addExpansion(fs, arg, strlen(arg), part->quoted);
+    }
+}
+
+/* Expand one compiled word into zero or more fields: variable and
+ * command substitution, field splitting and pathname expansion */
+static int expandWord(struct Word *word, struct ExpandBuf *eb, int assignment) {
+    struct FieldState fs;
+    struct WordPart *part;
+    const char *value;
+    char number[16];
+    int i;
+    size_t j;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.eb = eb;
+    fs.assignment = assignment;
+
+    for (i = 0; i < word->nparts; i++) {
+        part = &word->parts[i];
+        if (part->quoted && part->type != PART_ALL) {
+            fieldOpen(&fs);
+        }
+
+        switch (part->type) {
+        case PART_TEXT:
+            if (part->plain) {
+                /* Nothing to escape or glob, copy it in one go */
+                fieldOpen(&fs);
+                sbAppend(&eb->text, part->text, part->len);
+            } else {
+                for (j = 0; j < part->len; j++) {
+                    fieldAddChar(&fs, part->text[j], part->quoted);
+                }
+            }
+            break;
+
+        case PART_VAR:
+            value = getVarSlot(part->slot);
+            if (value != NULL) {
+                addExpansion(&fs, value, strlen(value), part->quoted);
+            }
+            break;
+
+        case PART_STATUS:
+            snprintf(number, sizeof(number), "%d", shell->last_status);
+            addExpansion(&fs, number, strlen(number), part->quoted);
+            break;
+
+        case PART_PARAM:
+            value = getPositional(part->slot);
+            if (value != NULL) {
+                addExpansion(&fs, value, strlen(value), part->quoted);
+            }
+            break;
+
+        case PART_COUNT:
+            snprintf(number, sizeof(number), "%d", getPositionalCount());
+            addExpansion(&fs, number, strlen(number), part->quoted);
+            break;
+
+        case PART_ALL:
+            expandParameters(&fs, part);
+            break;
+
+        case PART_COMMAND:
+            if (substituteCommand(&fs, part->prog, part->quoted) < 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+
+    fieldEnd(&fs);
+    return 0;
+}
+
+/* Expand a redirection target, which must be exactly one field */
+static int expandRedirect(struct Word *word, struct ExpandBuf *eb, int *field) {
+    int before = eb->nfields;
+
+    if (word == NULL) {
+        *field = -1;
+        return 0;
+    }
+    if (expandWord(word, eb, 0) < 0) {
+        return -1;
+    }
+    if (eb->nfields != before + 1) {
+        fprintf(stderr, "%s: ambiguous redirect\n", word->source);
+        return -1;
+    }
+    *field = before;
+    return 0;
+}
+
+/* Expand a list of words, such as the words of a for loop, into eb */
+int expandWords(struct Word *words, int count, struct ExpandBuf *eb) {
+    int i;
+
+    sbReset(&eb->text);
+    eb->nfields = 0;
+    eb->nassign = 0;
+
+    for (i = 0; i < count; i++) {
+        if (expandWord(&words[i], eb, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Expand all words of cmd into out; the strings in out live in eb
+ * and stay valid until eb is used for the next command. Leading
+ * assignments are left in eb (see getAssignment). */
+int expandCommand(struct CommandTmpl *cmd, struct Command_struct *out, struct ExpandBuf *eb) {
+    int i;
+    int in, outf, err;
+
+    sbReset(&eb->text);
+    eb->nfields = 0;
+    eb->nassign = 0;
+
+    /* Leading NAME=value words are assignments, not arguments */
+    for (i = 0; i < cmd->nassign; i++) {
+        if (expandWord(&cmd->argv[i], eb, 1) < 0) {
+            return -1;
+        }
+    }
+    eb->nassign = eb->nfields;
+
+    /* export takes assignments as arguments, expanded the same way */
+    for (; i < cmd->argc; i++) {
+        if (expandWord(&cmd->argv[i], eb, cmd->decl && cmd->argv[i].assign_slot >= 0) < 0) {
+            return -1;
+        }
+    }
+    out->argc = eb->nfields - eb->nassign;
+    if (out->argc > MAX_ARGS - 1) {
+        fprintf(stderr, "%s: too many arguments\n", cmd->argv[cmd->nassign].source);
+        return -1;
+    }
+
+    if (expandRedirect(cmd->redirect[0], eb, &in) < 0 ||
+        expandRedirect(cmd->redirect[1], eb, &outf) < 0 ||
+        expandRedirect(cmd->redirect[2], eb, &err) < 0) {
+        return -1;
+    }
+
+    /* The text buffer may have moved while growing, so resolve
+     * offsets to pointers only now */
+    for (i = 0; i < out->argc; i++) {
+        out->argv[i] = eb->text.data + eb->field[eb->nassign + i];
+    }
+    out->argv[out->argc] = NULL;
+    out->com_pathname = out->argc > 0 ? out->argv[0] : NULL;
+    out->redirect_in = in < 0 ? NULL : eb->text.data + eb->field[in];
+    out->redirect_out = outf < 0 ? NULL : eb->text.data + eb->field[outf];
+    out->redirect_err = err < 0 ? NULL : eb->text.data + eb->field[err];
+    out->com_suffix = ' ';
+
+    return 0;
+}
+
+/* Get the i'th expanded assignment of the last command */
+char *getAssignment(struct ExpandBuf *eb, int i) {
+    return eb->text.data + eb->field[i];
+}
+
+/* Expand the glob pattern stored at start in eb, replacing it with the
+ * matching file names, or with the literal word if nothing matches */
+int expandWildcards(struct ExpandBuf *eb, size_t start) {
+    glob_t globbuf;
+    size_t i;
+    int count;
+
+    memset(&globbuf, 0, sizeof(globbuf));
+
+    if (glob(eb->text.data + start, 0, NULL, &globbuf) != 0 || globbuf.gl_pathc == 0) {
+        /* Expansion failed, keep original */
+        globfree(&globbuf);
+        unescapeField(&eb->text, start);
+        sbAppendChar(&eb->text, '\0');
+        addField(eb, start);
+        return 0;
+    }
+
+    /* Replace the pattern with the expanded filenames */
+    eb->text.len = start;
+    for (i = 0; i < globbuf.gl_pathc; i++) {
+        addField(eb, eb->text.len);
+        sbAppend(&eb->text, globbuf.gl_pathv[i], strlen(globbuf.gl_pathv[i]) + 1);
+    }
+
+    count = (int)globbuf.gl_pathc;
+    globfree(&globbuf);
+    return count;
+}
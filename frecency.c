@@ -0,0 +1,558 @@
+#include "shell.h"
+#include <ctype.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* Directory jumping by frecency.
+ *
+ * Every cd at the prompt adds a visit to the directory it lands in.
+ * A directory's score is its visit count weighted by how recently it
+ * was last visited, and j or a failed cd picks the best scoring one
+ * whose path contains the words given, in order, the last one in its
+ * final component if any does.
+ *
+ * The database, $HOME/.myshell_dirs unless $DIRDB is set, has lines
+ * "visits<TAB>time<TAB>path". A visit appends a line, so shells running
+ * at the same time do not overwrite each other; loading adds the lines
+ * of each path up. The file is rewritten with one line per path when it
+ * holds many more lines than paths, and then the counts are aged if
+ * their total is too high, so old directories drop out over time.
+ *
+ * Once loaded, lookups use an index of the three character sequences
+ * of each lowercased path: the words are checked only against paths
+ * holding the rarest sequence of the longest word. */
+
+#define MAX_TOTAL_RANK 10000.0
+#define AGE_FACTOR 0.9
+#define MAX_LISTED 10
+
+struct DirEntry {
+    char *path;
+    char *lower;              /* path in lowercase, for matching */
+    double rank;
+    time_t time;
+};
+
+/* Posting list of one trigram */
+struct Posting {
+    unsigned int trigram;     /* 0 for an empty slot */
+    int *ids;
+    int len;
+    int cap;
+};
+
+static struct DirEntry *entries = NULL;
+static int entry_count = 0;
+static int entry_cap = 0;
+static double total_rank = 0;
+static int file_lines = 0;
+static int loaded = 0;
+
+/* path -> entry + 1, open addressing; 0 is an empty slot */
+static int *path_table = NULL;
+static size_t path_table_size = 0;
+
+/* trigram -> entries containing it, open addressing */
+static struct Posting *tri_table = NULL;
+static size_t tri_table_size = 0;
+static size_t tri_count = 0;
+
+static unsigned long hashString(const char *s) {
+    unsigned long h = 5381;
+
+    while (*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+static const char *dbPath(void) {
+    static char path[PATH_MAX];
+    const char *file = getVar("DIRDB");
+    const char *home;
+
+    if (file != NULL && *file) {
+        return file;
+    }
+    home = getVar("HOME");
+    if (home == NULL) {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/.myshell_dirs", home);
+    return path;
+}
+
+/* Find the entry of a path, -1 if there is none */
+static int findEntry(const char *path) {
+    size_t i;
+
+    if (path_table_size == 0) {
+        return -1;
+    }
+    for (i = hashString(path) & (path_table_size - 1); path_table[i] != 0;
+         i = (i + 1) & (path_table_size - 1)) {
+        if (strcmp(entries[path_table[i] - 1].path, path) == 0) {
+            return path_table[i] - 1;
+        }
+    }
+    return -1;
+}
+
+static void putPath(int id) {
+    size_t i = hashString(entries[id].path) & (path_table_size - 1);
+
+    while (path_table[i] != 0) {
+        i = (i + 1) & (path_table_size - 1);
+    }
+    path_table[i] = id + 1;
+}
+
+/* Keep the path table at most half full */
+static void growPathTable(void) {
+    int i;
+
+    if ((size_t)(entry_count + 1) * 2 <= path_table_size) {
+        return;
+    }
+    free(path_table);
+    path_table_size = path_table_size ? path_table_size * 2 : 1024;
+    path_table = calloc(path_table_size, sizeof(int));
+    if (path_table == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < entry_count; i++) {
+        putPath(i);
+    }
+}
+
+static struct Posting *findPosting(unsigned int trigram, int create);
+
+static void growTriTable(void) {
+    struct Posting *old = tri_table;
+    size_t old_size = tri_table_size;
+    size_t i;
+
+    tri_table_size = tri_table_size ? tri_table_size * 2 : 4096;
+    tri_table = calloc(tri_table_size, sizeof(struct Posting));
+    if (tri_table == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < old_size; i++) {
+        if (old[i].trigram != 0) {
+            *findPosting(old[i].trigram, 1) = old[i];
+        }
+    }
+    free(old);
+}
+
+/* Find the posting list of a trigram, making an empty one if asked */
+static struct Posting *findPosting(unsigned int trigram, int create) {
+    size_t i;
+
+    if (tri_table_size == 0) {
+        if (!create) return NULL;
+        growTriTable();
+    }
+    for (i = (trigram * 2654435761u) & (tri_table_size - 1); tri_table[i].trigram != 0;
+         i = (i + 1) & (tri_table_size - 1)) {
+        if (tri_table[i].trigram == trigram) {
+            return &tri_table[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if ((tri_count + 1) * 2 > tri_table_size) {
+        growTriTable();
+        return findPosting(trigram, 1);
+    }
+    tri_table[i].trigram = trigram;
+    tri_count++;
+    return &tri_table[i];
+}
+
+static unsigned int trigramAt(const char *s) {
+    return ((unsigned int)(unsigned char)s[0] << 16) |
+           ((unsigned int)(unsigned char)s[1] << 8) | (unsigned char)s[2];
+}
+
+/* Add an entry to the posting lists of its trigrams */
+static void indexEntry(int id) {
+    const char *s = entries[id].lower;
+    size_t len = strlen(s);
+    size_t i;
+
+    for (i = 0; i + 3 <= len; i++) {
+        struct Posting *p = findPosting(trigramAt(s + i), 1);
+
+        /* A trigram seen twice in one path is listed once */
+        if (p->len > 0 && p->ids[p->len - 1] == id) {
+            continue;
+        }
+        if (p->len == p->cap) {
+            p->cap = p->cap ? p->cap * 2 : 4;
+            p->ids = realloc(p->ids, p->cap * sizeof(int));
+            if (p->ids == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        p->ids[p->len++] = id;
+    }
+}
+
+/* Add visits to a path, making an entry for it if needed */
+static void addVisits(const char *path, double rank, time_t when) {
+    int id = findEntry(path);
+    char *p;
+
+    if (id < 0) {
+        if (entry_count == entry_cap) {
+            entry_cap = entry_cap ? entry_cap * 2 : 256;
+            entries = realloc(entries, entry_cap * sizeof(struct DirEntry));
+            if (entries == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        growPathTable();
+        id = entry_count++;
+        entries[id].path = strdup(path);
+        entries[id].lower = strdup(path);
+        for (p = entries[id].lower; *p; p++) {
+            *p = tolower((unsigned char)*p);
+        }
+        entries[id].rank = 0;
+        entries[id].time = 0;
+        putPath(id);
+        indexEntry(id);
+    }
+    entries[id].rank += rank;
+    total_rank += rank;
+    if (when > entries[id].time) {
+        entries[id].time = when;
+    }
+}
+
+/* Drop everything loaded */
+static void clearEntries(void) {
+    size_t i;
+    int j;
+
+    for (j = 0; j < entry_count; j++) {
+        free(entries[j].path);
+        free(entries[j].lower);
+    }
+    entry_count = 0;
+    for (i = 0; i < tri_table_size; i++) {
+        free(tri_table[i].ids);
+    }
+    memset(tri_table, 0, tri_table_size * sizeof(struct Posting));
+    tri_count = 0;
+    memset(path_table, 0, path_table_size * sizeof(int));
+    total_rank = 0;
+    file_lines = 0;
+}
+
+/* Read the database into memory */
+static void loadDb(void) {
+    const char *path = dbPath();
+    struct StrBuf text;
+    char *line, *next, *end;
+    double rank;
+    long when;
+    int fd;
+
+    loaded = 1;
+    if (path == NULL || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return;
+    }
+    sbInit(&text);
+    sbReadFd(&text, fd);
+    close(fd);
+
+    for (line = text.data; line != NULL && *line; line = next) {
+        next = strchr(line, '\n');
+        if (next != NULL) *next++ = '\0';
+
+        rank = strtod(line, &end);
+        if (*end != '\t') continue;
+        when = strtol(end + 1, &end, 10);
+        if (*end != '\t' || end[1] != '/') continue;
+        addVisits(end + 1, rank, (time_t)when);
+        file_lines++;
+    }
+    sbFree(&text);
+}
+
+/* Rewrite the database with one line per path, ageing the counts if
+ * they add up to too much */
+static void compactDb(void) {
+    const char *path = dbPath();
+    char tmp[PATH_MAX];
+    FILE *fp;
+    double scale = 1;
+    int fd;
+    int i;
+
+    if (path == NULL) {
+        return;
+    }
+
+    /* Pick up what other shells added since we loaded */
+    clearEntries();
+    loadDb();
+    if (total_rank > MAX_TOTAL_RANK) {
+        scale = AGE_FACTOR * MAX_TOTAL_RANK / total_rank;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    file_lines = 0;
+    for (i = 0; i < entry_count; i++) {
+        /* Directories visited too little to matter are dropped */
+        if (entries[i].rank * scale >= 1) {
+            fprintf(fp, "%g\t%ld\t%s\n", entries[i].rank * scale, (long)entries[i].time, entries[i].path);
+            file_lines++;
+        }
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return;
+    }
+    if (scale < 1) {
+        clearEntries();
+        loadDb();
+    }
+}
+
+/* Record a visit to dir */
+void recordDirVisit(const char *dir) {
+    const char *path = dbPath();
+    char line[PATH_MAX + 64];
+    time_t now = time(NULL);
+    int fd;
+    int len;
+
+    if (path == NULL || dir[0] != '/') {
+        return;
+    }
+    if (!loaded) {
+        loadDb();
+    }
+    addVisits(dir, 1, now);
+
+    /* One write with O_APPEND, so lines from other shells do not mix */
+    len = snprintf(line, sizeof(line), "1\t%ld\t%s\n", (long)now, dir);
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    if (write(fd, line, len) == len) {
+        file_lines++;
+    }
+    close(fd);
+
+    if (file_lines > 2 * entry_count + 1000 || total_rank > MAX_TOTAL_RANK) {
+        compactDb();
+    }
+}
+
+/* Score of an entry: visits weighted by how recent the last one is */
+static double frecency(struct DirEntry *e, time_t now) {
+    time_t age = now - e->time;
+
+    if (age < 3600) return e->rank * 4;
+    if (age < 86400) return e->rank * 2;
+    if (age < 604800) return e->rank / 2;
+    return e->rank / 4;
+}
+
+/* Check that the words occur in path in order. Returns 2 if the last
+ * one is in the final component, 1 if it is elsewhere, 0 if no match. */
+static int matchWords(const char *lower, char **words, int nwords) {
+    const char *p = lower;
+    const char *last = strrchr(lower, '/');
+    const char *found = NULL;
+    int i;
+
+    for (i = 0; i < nwords; i++) {
+        found = strstr(p, words[i]);
+        if (found == NULL) return 0;
+        p = found + strlen(words[i]);
+    }
+    if (found == NULL) return 1;
+
+    /* Prefer the last word in the final component, even if it also
+     * occurs earlier */
+    if (last != NULL && strstr(last, words[nwords - 1]) != NULL) {
+        return 2;
+    }
+    return 1;
+}
+
+struct Candidate {
+    int id;
+    double score;
+};
+
+static int compareCandidates(const void *a, const void *b) {
+    const struct Candidate *x = a;
+    const struct Candidate *y = b;
+
+    if (x->score != y->score) return x->score < y->score ? 1 : -1;
+    return strcmp(entries[x->id].path, entries[y->id].path);
+}
+
+/* Find the entries matching words, best first. Returns the count;
+ * *out must be freed. */
+static int findMatches(char **words, int nwords, struct Candidate **out) {
+    struct Candidate *found;
+    struct Posting *best = NULL;
+    time_t now = time(NULL);
+    int count = 0;
+    int in_last = 0;
+    int i, n;
+
+    if (!loaded) {
+        loadDb();
+    }
+
+    /* The rarest trigram of any word limits the paths to check */
+    for (i = 0; i < nwords; i++) {
+        size_t len = strlen(words[i]);
+        size_t j;
+        for (j = 0; j + 3 <= len; j++) {
+            struct Posting *p = findPosting(trigramAt(words[i] + j), 0);
+            if (p == NULL) {
+                *out = NULL;
+                return 0;
+            }
+            if (best == NULL || p->len < best->len) best = p;
+        }
+    }
+
+    n = best != NULL ? best->len : entry_count;
+    found = malloc((n + 1) * sizeof(struct Candidate));
+    if (found == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        int id = best != NULL ? best->ids[i] : i;
+        int m = nwords > 0 ? matchWords(entries[id].lower, words, nwords) : 2;
+        if (m == 0) continue;
+        if (m == 2 && !in_last) {
+            /* Matches in the final component beat the others */
+            in_last = 1;
+            count = 0;
+        }
+        if (m == 2 || !in_last) {
+            found[count].id = id;
+            found[count].score = frecency(&entries[id], now);
+            count++;
+        }
+    }
+    qsort(found, count, sizeof(struct Candidate), compareCandidates);
+    *out = found;
+    return count;
+}
+
+/* Lowercase copies of the query words; the array must be freed */
+static char **lowerWords(char **args, int nargs) {
+    char **words = malloc((nargs + 1) * sizeof(char *));
+    char *p;
+    int i;
+
+    if (words == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < nargs; i++) {
+        words[i] = strdup(args[i]);
+        for (p = words[i]; *p; p++) {
+            *p = tolower((unsigned char)*p);
+        }
+    }
+    words[nargs] = NULL;
+    return words;
+}
+
+static void freeWords(char **words) {
+    int i;
+
+    for (i = 0; words[i] != NULL; i++) {
+        free(words[i]);
+    }
+    free(words);
+}
+
+/* Find the best existing directory for the query words. Returns a
+ * pointer into the database, or NULL. */
+const char *findFrecentDir(char **args, int nargs) {
+    struct Candidate *found;
+    const char *result = NULL;
+    struct stat st;
+    char **words = lowerWords(args, nargs);
+    int count = findMatches(words, nargs, &found);
+    int i;
+
+    /* Directories that are gone are passed over */
+    for (i = 0; i < count; i++) {
+        if (stat(entries[found[i].id].path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            result = entries[found[i].id].path;
+            break;
+        }
+    }
+    free(found);
+    freeWords(words);
+    return result;
+}
+
+/* j [-l] [word ...]
+ * Changes to the best directory matching the words. With -l, or with
+ * no words, lists the best matches with their scores instead. */
+int builtInJump(struct Command_struct *cmd) {
+    struct Candidate *found;
+    const char *dir;
+    char **words;
+    int list = 0;
+    int first = 1;
+    int count;
+    int i;
+
+    if (cmd->argc > 1 && strcmp(cmd->argv[1], "-l") == 0) {
+        list = 1;
+        first = 2;
+    }
+    if (cmd->argc == 1) {
+        list = 1;
+    }
+
+    if (list) {
+        words = lowerWords(cmd->argv + first, cmd->argc - first);
+        count = findMatches(words, cmd->argc - first, &found);
+        for (i = 0; i < count && i < MAX_LISTED; i++) {
+            printf("%10.1f  %s\n", found[i].score, entries[found[i].id].path);
+        }
+        free(found);
+        freeWords(words);
+        return count > 0 ? 0 : 1;
+    }
+
+    dir = findFrecentDir(cmd->argv + first, cmd->argc - first);
+    if (dir == NULL) {
+        fprintf(stderr, "j: no match for");
+        for (i = first; i < cmd->argc; i++) fprintf(stderr, " %s", cmd->argv[i]);
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    printf("%s\n", dir);
+    return builtInCD((char *)dir);
+}
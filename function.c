@@ -0,0 +1,184 @@
+#include "shell.h"
+
+/* Set by the return builtin; the running function body stops at the
+ * next command and callFunction clears it */
+int return_pending = 0;
+
+/* Defined functions are in the shell context. Each body is compiled
+ * once, when its definition runs, and shared with every call through
+ * its reference count. Positional parameters are there too, with
+ * shell->positional[0] as $0. */
+static int function_depth = 0;
+
+/* Find a function by name, NULL if there is none */
+struct Function *findFunction(const char *name) {
+    int i;
+
+    for (i = 0; i < shell->function_count; i++) {
+        if (strcmp(shell->functions[i]->name, name) == 0) {
+            return shell->functions[i];
+        }
+    }
+    return NULL;
+}
+
+/* Define or redefine a function from a compiled definition */
+void defineFunction(struct Function *func) {
+    struct Function *f = findFunction(func->name);
+
+    if (f == NULL) {
+        if (shell->function_count == shell->function_capacity) {
+            int new_capacity = shell->function_capacity ? shell->function_capacity * 2 : 16;
+            struct Function **new_functions = realloc(shell->functions, new_capacity * sizeof(struct Function *));
+            if (new_functions == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            shell->functions = new_functions;
+            shell->function_capacity = new_capacity;
+        }
+        f = calloc(1, sizeof(struct Function));
+        if (f == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        f->name = strdup(func->name);
+        shell->functions[shell->function_count++] = f;
+    } else {
+        freeProgram(f->body);
+    }
+
+    f->body = func->body;
+    f->body->refs++;
+}
+
+/* Remove a function. Returns -1 if there is no such function. */
+int removeFunction(const char *name) {
+    int i;
+
+    for (i = 0; i < shell->function_count; i++) {
+        if (strcmp(shell->functions[i]->name, name) == 0) {
+            /* A call in progress holds its own reference to the body */
+            freeProgram(shell->functions[i]->body);
+            free(shell->functions[i]->name);
+            free(shell->functions[i]);
+            shell->functions[i] = shell->functions[--shell->function_count];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Check if a function is running, for return */
+int inFunction(void) {
+    return function_depth > 0;
+}
+
+/* Copy argv into a new positional parameter array */
+static char **copyArgs(int argc, char *argv[]) {
+    char **copy = malloc((argc + 1) * sizeof(char *));
+    int i;
+
+    if (copy == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < argc; i++) {
+        copy[i] = strdup(argv[i]);
+    }
+    copy[argc] = NULL;
+    return copy;
+}
+
+static void freeArgs(char **args) {
+    int i;
+
+    if (args == NULL) return;
+    for (i = 0; args[i] != NULL; i++) {
+        free(args[i]);
+    }
+    free(args);
+}
+
+/* Set $0 to argv[0] and $1... to the rest */
+void setPositional(int argc, char *argv[]) {
+    freeArgs(shell->positional);
+    shell->positional = copyArgs(argc, argv);
+    shell->positional_count = argc - 1;
+}
+
+/* Get $i, NULL if it is not set */
+const char *getPositional(int i) {
+    if (shell->positional == NULL || i < 0 || i > shell->positional_count) {
+        return NULL;
+    }
+    return shell->positional[i];
+}
+
+/* Get $# */
+int getPositionalCount(void) {
+    return shell->positional_count;
+}
+
+/* Drop the first n positional parameters. Returns -1 if there are
+ * fewer than n. */
+int shiftPositional(int n) {
+    int i;
+
+    if (n < 0 || n > shell->positional_count) {
+        return -1;
+    }
+    for (i = 1; i <= n; i++) {
+        free(shell->positional[i]);
+    }
+    memmove(shell->positional + 1, shell->positional + 1 + n, (shell->positional_count - n + 1) * sizeof(char *));
+    shell->positional_count -= n;
+    return 0;
+}
+
+/* Call a function with the arguments of an expanded command. The
+ * arguments are copied first: they live in the expansion workspace,
+ * which the commands of the body reuse. */
+int callFunction(struct Function *func, struct Command_struct *cmd, int flags) {
+    struct Program *body = func->body;
+    char **saved = shell->positional;
+    int saved_count = shell->positional_count;
+    int status;
+
+    if (function_depth >= MAX_FUNCTION_DEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", func->name);
+        return 1;
+    }
+
+    /* $0 stays the shell's name */
+    shell->positional = copyArgs(cmd->argc, cmd->argv);
+    free(shell->positional[0]);
+    shell->positional[0] = strdup(saved ? saved[0] : "myshell");
+    shell->positional_count = cmd->argc - 1;
+
+    /* Held so the function may redefine or unset itself */
+    body->refs++;
+    function_depth++;
+    status = runProgram(body, flags);
+    function_depth--;
+    return_pending = 0;
+    freeProgram(body);
+
+    freeArgs(shell->positional);
+    shell->positional = saved;
+    shell->positional_count = saved_count;
+    return status;
+}
+
+/* Remove every function and the positional parameters */
+void removeAllFunctions(void) {
+    while (shell->function_count > 0) {
+        removeFunction(shell->functions[0]->name);
+    }
+    free(shell->functions);
+    shell->functions = NULL;
+    shell->function_capacity = 0;
+    freeArgs(shell->positional);
+    shell->positional = NULL;
+    shell->positional_count = 0;
+}
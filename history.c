@@ -1,5 +1,6 @@
 #include "shell.h"
 #include <ctype.h>
+#include <poll.h>
 
 /* Current position in history for arrow key navigation */
 static int current_history_pos = -1;
@@ -11,26 +12,26 @@ void addToHistory(char *line) {
     }
     
     /* Avoid duplicate consecutive entries */
-    if (history_count > 0 && strcmp(history[history_count - 1], line) == 0) {
+    if (shell->history_count > 0 && strcmp(shell->history[shell->history_count - 1], line) == 0) {
         return;
     }
     
-    if (history_count < MAX_HISTORY) {
-        history[history_count] = strdup(line);
-        history_count++;
+    if (shell->history_count < MAX_HISTORY) {
+        shell->history[shell->history_count] = strdup(line);
+        shell->history_count++;
     } else {
         /* History is full, remove oldest entry */
-        free(history[0]);
+        free(shell->history[0]);
         
         /* Shift all entries */
         for (int i = 0; i < MAX_HISTORY - 1; i++) {
-            history[i] = history[i + 1];
+            shell->history[i] = shell->history[i + 1];
         }
         
-        history[MAX_HISTORY - 1] = strdup(line);
+        shell->history[MAX_HISTORY - 1] = strdup(line);
     }
     
-    history_index = history_count;
+    shell->history_index = shell->history_count;
 }
 
 /* Get history command based on special syntax */
@@ -41,8 +42,8 @@ char *getHistoryCommand(char *input) {
     
     /* !! - repeat last command */
     if (input[1] == '!' && input[2] == '\0') {
-        if (history_count > 0) {
-            return history[history_count - 1];
+        if (shell->history_count > 0) {
+            return shell->history[shell->history_count - 1];
         }
         return NULL;
     }
@@ -50,8 +51,8 @@ char *getHistoryCommand(char *input) {
     /* !n - repeat command number n */
     if (isdigit(input[1])) {
         int num = atoi(&input[1]);
-        if (num > 0 && num <= history_count) {
-            return history[num - 1];
+        if (num > 0 && num <= shell->history_count) {
+            return shell->history[num - 1];
         }
         return NULL;
     }
@@ -61,18 +62,65 @@ char *getHistoryCommand(char *input) {
     int search_len = strlen(search_str);
     
     /* Search backwards through history */
-    for (int i = history_count - 1; i >= 0; i--) {
-        if (strncmp(history[i], search_str, search_len) == 0) {
-            return history[i];
+    for (int i = shell->history_count - 1; i >= 0; i--) {
+        if (strncmp(shell->history[i], search_str, search_len) == 0) {
+            return shell->history[i];
         }
     }
     
     return NULL;
 }
 
+/* Keys read from a terminal but not handled yet */
+static char key_buf[256];
+static int key_len = 0;
+static int key_pos = 0;
+
+/* Read one key. From a terminal the prompt is redrawn whenever the
+ * prompt thread has new values while waiting; other input goes through
+ * stdio as before. */
+static int readKey(const char *format, char *shown, size_t size, const char *line, int pos) {
+    struct pollfd pfd[2];
+    ssize_t n;
+    
+    if (!isatty(STDIN_FILENO)) {
+        return getchar();
+    }
+    
+    while (key_pos == key_len) {
+        pfd[0].fd = STDIN_FILENO;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = promptNotifyFd();
+        pfd[1].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = 0;
+        if (poll(pfd, pfd[1].fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return EOF;
+        }
+        
+        if (pfd[1].revents & POLLIN) {
+            /* Redraw the line in place with the new prompt */
+            promptDrainNotify();
+            expandPrompt(format, shown, size);
+            printf("\r%s %.*s\033[K", shown, pos, line);
+            fflush(stdout);
+        }
+        
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            n = read(STDIN_FILENO, key_buf, sizeof(key_buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return EOF;
+            key_len = n;
+            key_pos = 0;
+        }
+    }
+    return (unsigned char)key_buf[key_pos++];
+}
+
 /* Read line with arrow key support for history navigation */
 char *readLineWithHistory(const char *prompt_str) {
     static char line_buffer[MAX_LINE_LENGTH];
+    char shown[1024];
     static int init_done = 0;
     static struct termios old_termios, new_termios;
     int pos = 0;
@@ -90,17 +138,20 @@ char *readLineWithHistory(const char *prompt_str) {
     /* Set raw mode */
     tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
     
-    /* Print prompt */
-    printf("%s ", prompt_str);
+    /* Print prompt; slow parts are brought up to date in the background */
+    promptDrainNotify();
+    promptRefresh(prompt_str);
+    expandPrompt(prompt_str, shown, sizeof(shown));
+    printf("%s ", shown);
     fflush(stdout);
     
     /* Reset history position */
-    temp_history_pos = history_count;
+    temp_history_pos = shell->history_count;
     line_buffer[0] = '\0';
     pos = 0;
     
     while (1) {
-        ch = getchar();
+        ch = readKey(prompt_str, shown, sizeof(shown), line_buffer, pos);
         
         if (ch == '\n') {
             /* Enter pressed */
@@ -109,6 +160,10 @@ char *readLineWithHistory(const char *prompt_str) {
             tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
             current_history_pos = -1;
             return strdup(line_buffer);
+        } else if (ch == '\t') {
+            /* Tab: complete the word before the cursor */
+            line_buffer[pos] = '\0';
+            pos = completeLine(line_buffer, pos, MAX_LINE_LENGTH, shown);
         } else if (ch == 127 || ch == 8) {
             /* Backspace */
             if (pos > 0) {
@@ -116,17 +171,23 @@ char *readLineWithHistory(const char *prompt_str) {
                 printf("\b \b");
                 fflush(stdout);
             }
-        } else if (ch == 4) {
-            /* Ctrl-D (EOF) */
+        } else if (ch == 4 || ch == EOF) {
+            /* Ctrl-D or end of input */
             if (pos == 0) {
                 tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
                 return NULL;
             }
+            if (ch == EOF) {
+                /* Last line without a newline */
+                line_buffer[pos] = '\0';
+                tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
+                return strdup(line_buffer);
+            }
         } else if (ch == 27) {
             /* Escape sequence */
-            ch = getchar();
+            ch = readKey(prompt_str, shown, sizeof(shown), line_buffer, pos);
             if (ch == '[') {
-                ch = getchar();
+                ch = readKey(prompt_str, shown, sizeof(shown), line_buffer, pos);
                 if (ch == 'A') {
                     /* Up arrow */
                     if (temp_history_pos > 0) {
@@ -138,7 +199,7 @@ char *readLineWithHistory(const char *prompt_str) {
                         
                         /* Get previous command from history */
                         temp_history_pos--;
-                        strcpy(line_buffer, history[temp_history_pos]);
+                        strcpy(line_buffer, shell->history[temp_history_pos]);
                         pos = strlen(line_buffer);
                         
                         /* Display it */
@@ -147,7 +208,7 @@ char *readLineWithHistory(const char *prompt_str) {
                     }
                 } else if (ch == 'B') {
                     /* Down arrow */
-                    if (temp_history_pos < history_count) {
+                    if (temp_history_pos < shell->history_count) {
                         /* Clear current line */
                         while (pos > 0) {
                             printf("\b \b");
@@ -155,9 +216,9 @@ char *readLineWithHistory(const char *prompt_str) {
                         }
                         
                         temp_history_pos++;
-                        if (temp_history_pos < history_count) {
+                        if (temp_history_pos < shell->history_count) {
                             /* Get next command from history */
-                            strcpy(line_buffer, history[temp_history_pos]);
+                            strcpy(line_buffer, shell->history[temp_history_pos]);
                             pos = strlen(line_buffer);
                             
                             /* Display it */
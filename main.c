@@ -1,28 +1,157 @@
 #include "shell.h"
 
-/* Global variables */
-char current_prompt[256] = DEFAULT_PROMPT;
-char *history[MAX_HISTORY];
-int history_count = 0;
-int history_index = -1;
+/* Run a script's text, which is freed: it is parsed and compiled as
+ * a whole, once, and then run from the compiled program */
+static int runScriptText(const char *name, struct StrBuf *text) {
+    struct Program *prog;
+    struct Node *tree;
+    int status;
+    int rc;
+    
+    if (text->data == NULL) {
+        return 0;
+    }
+    rc = parseCommandLine(text->data, &tree);
+    sbFree(text);
+    if (rc == PARSE_INCOMPLETE) {
+        fprintf(stderr, "%s: syntax error: unexpected end of file\n", name);
+    }
+    if (rc < 0) {
+        return 2;
+    }
+    
+    prog = compileTree(tree);
+    freeNode(tree);
+    if (prog == NULL) {
+        return 2;
+    }
+    
+    status = runProgram(prog, 0);
+    freeProgram(prog);
+    return status;
+}
+
+/* Run a script file */
+static int runScript(const char *path) {
+    struct StrBuf text;
+    int fd;
+    int rc;
+    
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return 127;
+    }
+    sbInit(&text);
+    rc = sbReadFd(&text, fd);
+    close(fd);
+    if (rc < 0) {
+        perror(path);
+        sbFree(&text);
+        return 126;
+    }
+    return runScriptText(path, &text);
+}
+
+/* Run the rest of stdin as a script; stdio may already hold the
+ * start of it */
+static int runScriptStdin(void) {
+    struct StrBuf text;
+    char buf[4096];
+    size_t n;
+    
+    sbInit(&text);
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+        sbAppend(&text, buf, n);
+    }
+    if (ferror(stdin)) {
+        perror("stdin");
+        sbFree(&text);
+        return 126;
+    }
+    return runScriptText("stdin", &text);
+}
 
-int main() {
+/* Append a continuation line to line, which is replaced */
+static char *joinLines(char *line, const char *more) {
+    size_t len = strlen(line);
+    char *joined = realloc(line, len + strlen(more) + 2);
+    
+    if (joined == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    joined[len] = '\n';
+    strcpy(joined + len + 1, more);
+    return joined;
+}
+
+/* Started ahead of time by the remote shell server (RSH_HANDSHAKE is
+ * set): wait until it hands this shell to a user. It sends
+ * "RSH-ENV name=value" lines to export, "RSH-MERGE-STDERR" if stderr
+ * should go where stdout goes, "RSH-SCRIPT" if the rest of stdin is a
+ * script to run rather than commands to read, and then "RSH-START";
+ * end of file means the shell is not needed. Returns whether to run
+ * a script. See Part2/protocol.h. */
+static int waitForHandshake(void) {
+    char line[1024];
+    char *eq;
+    size_t len;
+    int script = 0;
+    
+    unsetVar("RSH_HANDSHAKE");
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        if (strcmp(line, "RSH-START") == 0) return script;
+        if (strcmp(line, "RSH-SCRIPT") == 0) script = 1;
+        if (strcmp(line, "RSH-MERGE-STDERR") == 0 && dup2(STDOUT_FILENO, STDERR_FILENO) < 0) {
+            perror("dup2");
+        }
+        if (strncmp(line, "RSH-ENV ", 8) == 0 && (eq = strchr(line + 8, '=')) != NULL &&
+            isValidName(line + 8, eq - (line + 8))) {
+            assignVar(line + 8, VAR_EXPORT);
+        }
+    }
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
     char *line;
-    struct Command_struct commands[MAX_COMMANDS];
+    char *more;
+    struct Node *tree;
     int num_commands;
     
     /* Setup signal handlers */
     setupSignalHandler();
     
+    /* Shell variables start out as a copy of the environment */
+    initVars();
+    
+    /* myshell script [args]: run the script instead of reading
+     * commands, with $0 the script and $1... its arguments */
+    if (argc > 1) {
+        setPositional(argc - 1, argv + 1);
+        exit(runScript(argv[1]));
+    }
+    setPositional(1, argv);
+    if (getVar("RSH_HANDSHAKE") != NULL && waitForHandshake()) {
+        exit(runScriptStdin());
+    }
+    interactive = 1;
+    
     /* Main shell loop */
     while (1) {
+        /* Collect background jobs the handler could not track */
+        reapBackgroundJobs();
+        
         /* Read command line with arrow key support */
-        line = readLineWithHistory(current_prompt);
+        line = readLineWithHistory(shell->prompt);
         
         if (line == NULL) {
             /* EOF or error */
             printf("\n");
-            builtInExit();
+            builtInExit(shell->last_status);
         }
         
         /* Skip empty lines */
@@ -44,27 +173,41 @@ int main() {
             printf("%s\n", line);
         }
         
+        /* Parse command line, reading more lines while a command
+         * such as an if or a loop is still open */
+        num_commands = parseCommandLine(line, &tree);
+        while (num_commands == PARSE_INCOMPLETE) {
+            more = readLineWithHistory("> ");
+            if (more == NULL) {
+                fprintf(stderr, "syntax error: unexpected end of file\n");
+                break;
+            }
+            line = joinLines(line, more);
+            free(more);
+            num_commands = parseCommandLine(line, &tree);
+        }
+        
         /* Add to history */
         addToHistory(line);
         
-        /* Parse command line */
-        num_commands = parseCommandLine(line, commands);
         if (num_commands < 0) {
             fprintf(stderr, "Error parsing command line\n");
             free(line);
             continue;
         }
         
-        if (num_commands == 0) {
+        if (tree == NULL) {
             free(line);
             continue;
         }
         
-        /* Execute commands */
-        executeCommands(commands, num_commands);
+        /* Execute commands, timing them for the prompt */
+        markCommandStart();
+        executeCommands(tree);
+        markCommandEnd();
         
         /* Free allocated memory */
-        freeCommands(commands, num_commands);
+        freeNode(tree);
         free(line);
     }
     
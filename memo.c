@@ -0,0 +1,558 @@
+#include "shell.h"
+#include <poll.h>
+#include <sys/stat.h>
+
+/* memo [-f] command [args ...]
+ *
+ * Runs a command through a result cache. The key is the expanded
+ * command line together with the working directory, the assignments in
+ * front of it and the device, inode, size and mtime of its input file
+ * and of every argument that names a file, so editing an input makes a
+ * new entry. On a hit the saved output and exit status are replayed
+ * without running anything; on a miss the output goes to the real
+ * stdout and stderr and into the cache as it is produced.
+ *
+ * The cache lives in $MEMO_DIR, or ~/.myshell_memo. Output is stored
+ * once per distinct content in objects/, named by its hash and length
+ * (and a number if different output has the same hash and length);
+ * keys/ maps the hash of each key to a small entry naming the objects.
+ * The entry holds the whole key, so a hash collision is a miss. */
+
+#define MEMO_VERSION "memo 1"
+
+/* Objects tried under one hash and length before giving up on storing */
+#define MEMO_MAX_COLLISIONS 16
+
+/* 64 bit FNV-1a */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned long long fnvHash(unsigned long long h, const char *data, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/* Find the cache directory and create it and its subdirectories */
+static int memoDir(char *dir, size_t size) {
+    const char *base = getVar("MEMO_DIR");
+    char path[PATH_MAX];
+
+    if (base != NULL && *base) {
+        snprintf(dir, size, "%s", base);
+    } else {
+        base = getVar("HOME");
+        if (base == NULL) {
+            fprintf(stderr, "memo: HOME not set\n");
+            return -1;
+        }
+        snprintf(dir, size, "%s/.myshell_memo", base);
+    }
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/keys", dir);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        perror(path);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/objects", dir);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Add the identity of a file to the key */
+static void addFingerprint(struct StrBuf *key, const char *tag, const struct stat *st) {
+    char text[160];
+    int n = snprintf(text, sizeof(text), "%s %llu %llu %lld %lld.%09ld",
+                     tag, (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+                     (long long)st->st_size, (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+    sbAppend(key, text, n + 1);
+}
+
+/* Build the cache key of an expanded command. Returns -1 if the result
+ * cannot be cached because stdin comes from an earlier pipeline stage.
+ * Any other stdin that is not a file, such as a terminal, is taken to
+ * be unused, as it could not be fingerprinted anyway. */
+static int buildKey(struct StrBuf *key, struct Command_struct *cmd, struct ExpandBuf *eb) {
+    char cwd[PATH_MAX];
+    struct stat st;
+    int i;
+
+    /* Redirections are in place, so fd 0 is the input file if there
+     * is one */
+    if (fstat(STDIN_FILENO, &st) < 0) {
+        st.st_mode = 0;
+    }
+    if (stdin_piped && !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+
+    sbAppend(key, MEMO_VERSION, sizeof(MEMO_VERSION));
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+    sbAppend(key, cwd, strlen(cwd) + 1);
+
+    for (i = 0; i < eb->nassign; i++) {
+        const char *assign = getAssignment(eb, i);
+        sbAppend(key, assign, strlen(assign) + 1);
+    }
+    sbAppend(key, "--", 3);
+
+    for (i = 0; i < cmd->argc; i++) {
+        sbAppend(key, cmd->argv[i], strlen(cmd->argv[i]) + 1);
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        addFingerprint(key, "<", &st);
+    }
+
+    /* Arguments that name files or directories */
+    for (i = 1; i < cmd->argc; i++) {
+        if (stat(cmd->argv[i], &st) == 0) {
+            char tag[16];
+            snprintf(tag, sizeof(tag), "%d", i);
+            addFingerprint(key, tag, &st);
+        }
+    }
+    return 0;
+}
+
+/* Write all of buf to fd */
+static int writeAll(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read up to len bytes from fd, stopping early only at end of file.
+ * Returns the number read, or -1 on error. */
+static ssize_t readAll(int fd, char *buf, size_t len) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = read(fd, buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+/* Check that a cached object exists; "-" stands for no output */
+static int haveObject(const char *dir, const char *name) {
+    char path[PATH_MAX];
+
+    if (strcmp(name, "-") == 0) {
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, name);
+    return access(path, R_OK) == 0;
+}
+
+/* Copy a cached object to fd */
+static int replayObject(const char *dir, const char *name, int fd) {
+    char path[PATH_MAX];
+    char buf[65536];
+    ssize_t n;
+    int in;
+
+    if (strcmp(name, "-") == 0) {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, name);
+    in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return -1;
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (writeAll(fd, buf, n) < 0) break;
+    }
+    close(in);
+    return 0;
+}
+
+/* Look the key up and replay the entry. Returns its exit status, or -1
+ * on a miss. */
+static int replayEntry(const char *dir, const char *entry_path, struct StrBuf *key) {
+    struct StrBuf entry;
+    char out_name[64], err_name[64];
+    size_t key_len;
+    char *p;
+    int status;
+    int fd;
+
+    fd = open(entry_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    sbInit(&entry);
+    sbReadFd(&entry, fd);
+    close(fd);
+    sbAppendChar(&entry, '\0');
+
+    /* "<key length>\n<key>\n<status> <stdout object> <stderr object>\n" */
+    p = entry.data;
+    key_len = strtoul(p, &p, 10);
+    if (*p != '\n' || key_len != key->len ||
+        (size_t)(entry.len - (p + 1 - entry.data)) < key_len ||
+        memcmp(p + 1, key->data, key_len) != 0 ||
+        sscanf(p + 1 + key_len, "\n%d %63s %63s", &status, out_name, err_name) != 3) {
+        sbFree(&entry);
+        return -1;
+    }
+    sbFree(&entry);
+
+    /* Both objects must still be there before anything is written */
+    if (!haveObject(dir, out_name) || !haveObject(dir, err_name)) {
+        return -1;
+    }
+
+    replayObject(dir, out_name, STDOUT_FILENO);
+    replayObject(dir, err_name, STDERR_FILENO);
+    return status;
+}
+
+/* One output stream of a command being recorded */
+struct Recording {
+    int pipe_fd;                 /* read end, -1 at end of output */
+    int out_fd;                  /* where the output really goes */
+    int tmp_fd;                  /* temporary object file, -1 after an error */
+    char tmp_path[PATH_MAX];
+    unsigned long long hash;
+    unsigned long long len;
+};
+
+static int startRecording(struct Recording *rec, const char *dir, int out_fd, int pipe_fd) {
+    rec->pipe_fd = pipe_fd;
+    rec->out_fd = out_fd;
+    rec->hash = FNV_OFFSET;
+    rec->len = 0;
+    snprintf(rec->tmp_path, sizeof(rec->tmp_path), "%s/objects/tmp.XXXXXX", dir);
+    rec->tmp_fd = mkstemp(rec->tmp_path);
+    if (rec->tmp_fd < 0) {
+        perror("memo");
+        return -1;
+    }
+    fcntl(rec->tmp_fd, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/* Pass on what the command wrote, keeping a copy */
+static void recordChunk(struct Recording *rec) {
+    char buf[65536];
+    ssize_t n = read(rec->pipe_fd, buf, sizeof(buf));
+
+    if (n < 0 && errno == EINTR) {
+        return;
+    }
+    if (n <= 0) {
+        close(rec->pipe_fd);
+        rec->pipe_fd = -1;
+        return;
+    }
+    writeAll(rec->out_fd, buf, n);
+    if (rec->tmp_fd >= 0) {
+        if (writeAll(rec->tmp_fd, buf, n) < 0) {
+            close(rec->tmp_fd);
+            rec->tmp_fd = -1;
+        }
+        rec->hash = fnvHash(rec->hash, buf, n);
+        rec->len += n;
+    }
+}
+
+/* Check that two files have the same contents. Returns 1 if they do,
+ * 0 if not and -1 if either cannot be read. */
+static int sameContents(const char *path_a, const char *path_b) {
+    char buf_a[16384], buf_b[16384];
+    ssize_t n, m;
+    int a, b;
+    int same = -1;
+
+    a = open(path_a, O_RDONLY | O_CLOEXEC);
+    if (a < 0) {
+        return -1;
+    }
+    b = open(path_b, O_RDONLY | O_CLOEXEC);
+    if (b < 0) {
+        close(a);
+        return -1;
+    }
+    for (;;) {
+        n = readAll(a, buf_a, sizeof(buf_a));
+        m = readAll(b, buf_b, sizeof(buf_b));
+        if (n < 0 || m < 0) {
+            break;
+        }
+        if (n != m || memcmp(buf_a, buf_b, n) != 0) {
+            same = 0;
+            break;
+        }
+        if (n == 0) {
+            same = 1;
+            break;
+        }
+    }
+    close(a);
+    close(b);
+    return same;
+}
+
+/* Move a finished recording into the object store and put its name in
+ * name, or "-" if there was no output. Returns -1 on failure. */
+static int storeRecording(struct Recording *rec, const char *dir, char *name, size_t size) {
+    char path[PATH_MAX];
+    int fd = rec->tmp_fd;
+    int same;
+    int i;
+
+    rec->tmp_fd = -1;
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    if (rec->len == 0) {
+        unlink(rec->tmp_path);
+        snprintf(name, size, "-");
+        return 0;
+    }
+
+    /* The hash is not strong enough to trust on its own: an object of
+     * the same name is reused only if it holds the same output, and a
+     * different one moves this one on to the next free number */
+    for (i = 0; i < MEMO_MAX_COLLISIONS; i++) {
+        if (i == 0) {
+            snprintf(name, size, "%016llx-%llu", rec->hash, rec->len);
+        } else {
+            snprintf(name, size, "%016llx-%llu.%d", rec->hash, rec->len, i);
+        }
+        snprintf(path, sizeof(path), "%s/objects/%s", dir, name);
+        if (link(rec->tmp_path, path) == 0) {
+            unlink(rec->tmp_path);
+            return 0;
+        }
+        if (errno != EEXIST) {
+            break;
+        }
+        same = sameContents(rec->tmp_path, path);
+        if (same != 0) {
+            /* Same output seen before, or the store cannot be read */
+            unlink(rec->tmp_path);
+            return same > 0 ? 0 : -1;
+        }
+    }
+    unlink(rec->tmp_path);
+    return -1;
+}
+
+static void dropRecording(struct Recording *rec) {
+    if (rec->tmp_fd >= 0) {
+        close(rec->tmp_fd);
+        rec->tmp_fd = -1;
+    }
+    unlink(rec->tmp_path);
+}
+
+/* Write the entry for key atomically */
+static void saveEntry(const char *dir, const char *entry_path, struct StrBuf *key,
+                      int status, const char *out_name, const char *err_name) {
+    char tmp_path[PATH_MAX];
+    char header[32];
+    char trailer[160];
+    int fd;
+    int n, m;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s/keys/tmp.XXXXXX", dir);
+    fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return;
+    }
+    n = snprintf(header, sizeof(header), "%zu\n", key->len);
+    m = snprintf(trailer, sizeof(trailer), "\n%d %s %s\n", status, out_name, err_name);
+    if (writeAll(fd, header, n) < 0 || writeAll(fd, key->data, key->len) < 0 ||
+        writeAll(fd, trailer, m) < 0 || close(fd) < 0 || rename(tmp_path, entry_path) < 0) {
+        unlink(tmp_path);
+    }
+}
+
+/* Run the command with its output going through pipes, and record it */
+static int recordCommand(const char *dir, const char *entry_path, struct StrBuf *key,
+                         struct Command_struct *cmd, struct CommandTmpl *tmpl, struct ExpandBuf *eb) {
+    struct Recording rec[2];
+    struct pollfd pfd[2];
+    int out_pipe[2], err_pipe[2];
+    char out_name[64], err_name[64];
+    int wstatus;
+    int status;
+    pid_t pid;
+    int i, n;
+
+    if (pipe(out_pipe) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    if (pipe(err_pipe) < 0) {
+        perror("pipe");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return 1;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(out_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(err_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        return 1;
+    }
+
+    if (pid == 0) {
+        /* Child process */
+        in_subshell = 1;
+        blockChildSignal(0);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        status = runExpandedCommand(cmd, tmpl, eb, EXEC_NOFORK);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    if (startRecording(&rec[0], dir, STDOUT_FILENO, out_pipe[0]) < 0) {
+        rec[0].tmp_fd = -1;
+    }
+    if (startRecording(&rec[1], dir, STDERR_FILENO, err_pipe[0]) < 0) {
+        rec[1].tmp_fd = -1;
+    }
+
+    /* Tee both streams as they come, until the command closes them */
+    while (rec[0].pipe_fd >= 0 || rec[1].pipe_fd >= 0) {
+        for (i = 0; i < 2; i++) {
+            pfd[i].fd = rec[i].pipe_fd;
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+        n = poll(pfd, 2, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        for (i = 0; i < 2; i++) {
+            if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                recordChunk(&rec[i]);
+            }
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if (rec[i].pipe_fd >= 0) close(rec[i].pipe_fd);
+    }
+
+    while (waitpid(pid, &wstatus, 0) < 0) {
+        if (errno != EINTR) {
+            wstatus = 0;
+            break;
+        }
+    }
+
+    /* A command killed by a signal may not have finished its output */
+    if (!WIFEXITED(wstatus) ||
+        storeRecording(&rec[0], dir, out_name, sizeof(out_name)) < 0 ||
+        storeRecording(&rec[1], dir, err_name, sizeof(err_name)) < 0) {
+        dropRecording(&rec[0]);
+        dropRecording(&rec[1]);
+    } else {
+        saveEntry(dir, entry_path, key, WEXITSTATUS(wstatus), out_name, err_name);
+    }
+
+    if (WIFEXITED(wstatus)) {
+        return WEXITSTATUS(wstatus);
+    }
+    return WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : 1;
+}
+
+/* Run the expanded command line "memo [-f] command ..." whose
+ * redirections are already in place. -f runs the command even if its
+ * result is cached and replaces the entry. */
+int memoCommand(struct Command_struct *cmd, struct CommandTmpl *tmpl, struct ExpandBuf *eb) {
+    char dir[PATH_MAX];
+    char entry_path[PATH_MAX + 32];
+    struct StrBuf key;
+    int force = 0;
+    int shift = 1;
+    int status;
+
+    if (cmd->argc > 1 && strcmp(cmd->argv[1], "-f") == 0) {
+        force = 1;
+        shift = 2;
+    }
+    if (cmd->argc <= shift) {
+        fprintf(stderr, "memo: usage: memo [-f] command [args ...]\n");
+        return 2;
+    }
+
+    /* What follows memo is the command */
+    memmove(cmd->argv, cmd->argv + shift, (cmd->argc - shift + 1) * sizeof(char *));
+    cmd->argc -= shift;
+    cmd->com_pathname = cmd->argv[0];
+
+    /* The redirections are in place already and the output must go
+     * through memo, not straight to them again */
+    cmd->redirect_in = NULL;
+    cmd->redirect_out = NULL;
+    cmd->redirect_err = NULL;
+
+    sbInit(&key);
+    if (memoDir(dir, sizeof(dir)) < 0 || buildKey(&key, cmd, eb) < 0) {
+        /* Not cacheable: just run it */
+        sbFree(&key);
+        fflush(stdout);
+        return runExpandedCommand(cmd, tmpl, eb, 0);
+    }
+
+    snprintf(entry_path, sizeof(entry_path), "%s/keys/%016llx", dir,
+             fnvHash(FNV_OFFSET, key.data, key.len));
+
+    fflush(stdout);
+    fflush(stderr);
+    status = force ? -1 : replayEntry(dir, entry_path, &key);
+    if (status < 0) {
+        status = recordCommand(dir, entry_path, &key, cmd, tmpl, eb);
+    }
+
+    sbFree(&key);
+    return status;
+}
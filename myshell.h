@@ -0,0 +1,50 @@
+#ifndef MYSHELL_H
+#define MYSHELL_H
+
+#include <stddef.h>
+
+/* Embedding API of libmyshell.
+ *
+ * A shell context holds everything one shell session keeps between
+ * commands: variables, functions, aliases, history, the last status
+ * and its working directory. Commands run in the calling process, so
+ * calls on contexts must not overlap; each call switches to its
+ * context and back, including the working directory. Commands read
+ * /dev/null as their input. External commands are forked and waited
+ * for by pid, so the caller must not reap children it did not start. */
+
+struct ShellContext;
+
+/* Output of a command run by shellExecute, each NUL terminated */
+struct ShellOutput {
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+};
+
+/* shellParse result for text that ends inside a command */
+#define SHELL_INCOMPLETE -2
+
+/* Make a context, with variables imported from the environment.
+ * Returns NULL if out of memory. */
+struct ShellContext *shellCreate(void);
+void shellDestroy(struct ShellContext *ctx);
+
+/* Check the syntax of text in ctx, whose aliases apply. Returns the
+ * number of simple commands, -1 on a syntax error or SHELL_INCOMPLETE. */
+int shellParse(struct ShellContext *ctx, const char *text);
+
+/* Run text in ctx and return its exit status. The output is captured
+ * into output if it is not NULL, and free it with shellFreeOutput;
+ * otherwise it goes to the caller's stdout and stderr. */
+int shellExecute(struct ShellContext *ctx, const char *text, struct ShellOutput *output);
+void shellFreeOutput(struct ShellOutput *output);
+
+/* Exit status of the last command run in ctx */
+int shellStatus(struct ShellContext *ctx);
+
+/* Check if the exit builtin ran in ctx; commands after it were skipped */
+int shellExited(struct ShellContext *ctx);
+
+#endif
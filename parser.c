@@ -5,7 +5,7 @@
 int isSpecialChar(char c) {
     return (c == '&' || c == ';' || c == '|' || 
             c == '<' || c == '>' || c == '\'' || 
-            c == '"' || c == '!');
+            c == '"' || c == '(' || c == ')');
 }
 
 /* Trim leading and trailing whitespace */
@@ -25,17 +25,66 @@ char *trimWhitespace(char *str) {
     return str;
 }
 
-/* Parse a single token from the command line */
+/* Set by parseToken when the line is malformed */
+static int parse_error = 0;
+
+/* Set when the input ends in the middle of a command, so that more
+ * input could still complete it */
+static int parse_incomplete = 0;
+
+/* Cleared while an alias value is parsed, so aliases in it are taken
+ * literally and an alias can never expand into itself */
+static int expand_aliases = 1;
+
+/* Find the ')' closing a $( ... ) substitution, p points just after "$(" */
+const char *skipSubstitution(const char *p) {
+    int depth = 1;
+    int in_single_quote = 0;
+    int in_double_quote = 0;
+    
+    while (*p) {
+        if (*p == '\\' && *(p + 1) && !in_single_quote) {
+            p += 2;
+            continue;
+        }
+        if (*p == '\'' && !in_double_quote) {
+            in_single_quote = !in_single_quote;
+        } else if (*p == '"' && !in_single_quote) {
+            in_double_quote = !in_double_quote;
+        } else if (*p == '$' && *(p + 1) == '(' && !in_single_quote) {
+            /* Nested substitution, even inside double quotes */
+            p = skipSubstitution(p + 2);
+            if (p == NULL) return NULL;
+        } else if (!in_single_quote && !in_double_quote) {
+            if (*p == '(') {
+                depth++;
+            } else if (*p == ')' && --depth == 0) {
+                return p;
+            }
+        }
+        p++;
+    }
+    
+    return NULL;
+}
+
+/* Parse a single token from the command line.
+ * Words are returned as written, quotes and substitutions included;
+ * they are expanded just before the command runs (see expand.c). */
 static char *parseToken(char **line_ptr) {
     char *start = *line_ptr;
     char *token;
-    int len = 0;
     int in_single_quote = 0;
     int in_double_quote = 0;
-    char buffer[MAX_LINE_LENGTH];
+    char buffer[3];
     
-    /* Skip leading whitespace */
-    while (*start && isspace(*start)) start++;
+    /* Skip leading whitespace; newlines are tokens of their own */
+    while (*start && isspace(*start) && *start != '\n') start++;
+    
+    /* Comments run to the end of the line */
+    if (*start == '#') {
+        while (*start && *start != '\n') start++;
+    }
     
     if (*start == '\0') {
         *line_ptr = start;
@@ -54,8 +103,19 @@ static char *parseToken(char **line_ptr) {
             return token;
         }
         
+        /* Check for && and || */
+        if ((*start == '&' || *start == '|') && *(start + 1) == *start) {
+            buffer[0] = *start;
+            buffer[1] = *start;
+            buffer[2] = '\0';
+            *line_ptr = start + 2;
+            token = strdup(buffer);
+            return token;
+        }
+        
         /* Check for other special single-character tokens */
-        if (*start == '&' || *start == ';' || *start == '|') {
+        if (*start == '&' || *start == ';' || *start == '|' ||
+            *start == '(' || *start == ')' || *start == '\n') {
             buffer[0] = *start;
             buffer[1] = '\0';
             *line_ptr = start + 1;
@@ -74,9 +134,13 @@ static char *parseToken(char **line_ptr) {
     /* Parse regular token */
     char *p = start;
     while (*p) {
-        if (*p == '\\' && *(p + 1)) {
+        /* Skip the bytes that cannot end the word or change its state */
+        p = (char *)scanToSpecial(p, in_single_quote ? SCAN_SQUOTE :
+                                     in_double_quote ? SCAN_DQUOTE : SCAN_WORD);
+        if (*p == '\0') break;
+        
+        if (*p == '\\' && *(p + 1) && !in_single_quote) {
             /* Escaped character */
-            buffer[len++] = *(p + 1);
             p += 2;
         } else if (*p == '\'' && !in_double_quote) {
             in_single_quote = !in_single_quote;
@@ -84,104 +148,710 @@ static char *parseToken(char **line_ptr) {
         } else if (*p == '"' && !in_single_quote) {
             in_double_quote = !in_double_quote;
             p++;
+        } else if (*p == '$' && *(p + 1) == '(' && !in_single_quote) {
+            /* Command substitution is part of the word */
+            const char *end = skipSubstitution(p + 2);
+            if (end == NULL) {
+                parse_error = 1;
+                parse_incomplete = 1;
+                p += strlen(p);
+                break;
+            }
+            p = (char *)end + 1;
+        } else if (*p == '$' && *(p + 1) == '{' && !in_single_quote) {
+            /* ${NAME} is part of the word */
+            char *end = strchr(p + 2, '}');
+            p = end ? end + 1 : p + strlen(p);
         } else if (!in_single_quote && !in_double_quote && 
                    (isspace(*p) || isSpecialChar(*p))) {
             break;
         } else {
-            buffer[len++] = *p;
             p++;
         }
     }
     
-    buffer[len] = '\0';
+    /* A quote left open may be closed on a following line */
+    if (in_single_quote || in_double_quote) {
+        parse_error = 1;
+        parse_incomplete = 1;
+    }
+    
     *line_ptr = p;
     
-    if (len == 0) return NULL;
+    if (p == start) return NULL;
     
-    token = strdup(buffer);
+    token = strndup(start, p - start);
+    return token;
+}
+
+/* Parser state for one command line */
+struct Parser {
+    char *p;          /* current position in the line */
+    char *token;      /* lookahead token */
+    int have_token;   /* token holds a lookahead (it may be NULL at the end) */
+    int count;        /* simple commands parsed so far */
+};
+
+/* Look at the next token without consuming it */
+static char *peekToken(struct Parser *ps) {
+    if (!ps->have_token) {
+        ps->token = parseToken(&ps->p);
+        ps->have_token = 1;
+    }
+    return ps->token;
+}
+
+/* Consume the next token; the caller owns it */
+static char *nextToken(struct Parser *ps) {
+    char *token = peekToken(ps);
+    ps->have_token = 0;
     return token;
 }
 
-/* Parse command line into array of command structures */
-int parseCommandLine(char *line, struct Command_struct commands[]) {
-    char *p = line;
+/* Check if token is the given operator or reserved word */
+static int isToken(const char *token, const char *op) {
+    return token != NULL && strcmp(token, op) == 0;
+}
+
+/* Check if token ends a simple command */
+static int isOperator(const char *token) {
+    return isToken(token, ";") || isToken(token, "&") || isToken(token, "|") ||
+           isToken(token, "&&") || isToken(token, "||") ||
+           isToken(token, "(") || isToken(token, ")") || isToken(token, "\n");
+}
+
+/* Check if token is a reserved word that ends a list */
+static int isListEnd(const char *token) {
+    return isToken(token, ")") || isToken(token, "}") ||
+           isToken(token, "then") || isToken(token, "elif") ||
+           isToken(token, "else") || isToken(token, "fi") ||
+           isToken(token, "do") || isToken(token, "done");
+}
+
+/* Report a syntax error at the next token. Running out of input is
+ * not reported, the caller may read more and try again. */
+static void syntaxError(struct Parser *ps) {
+    char *token = peekToken(ps);
+    
+    if (token == NULL) {
+        parse_incomplete = 1;
+    } else if (!parse_error) {
+        fprintf(stderr, "syntax error near unexpected token `%s'\n",
+                isToken(token, "\n") ? "newline" : token);
+    }
+    parse_error = 1;
+}
+
+/* Consume the reserved word word, which must come next */
+static int expectToken(struct Parser *ps, const char *word) {
+    if (!isToken(peekToken(ps), word)) {
+        syntaxError(ps);
+        return 0;
+    }
+    free(nextToken(ps));
+    return 1;
+}
+
+/* Skip empty lines */
+static void skipNewlines(struct Parser *ps) {
+    while (isToken(peekToken(ps), "\n")) {
+        free(nextToken(ps));
+    }
+}
+
+static struct Node *newNode(int type, struct Node *left, struct Node *right) {
+    struct Node *node = calloc(1, sizeof(struct Node));
+    
+    if (node == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+/* Parse a <, > or 2> redirection if one is next. Returns 1 if one was
+ * parsed, 0 if not, -1 on error. */
+static int parseRedirect(struct Parser *ps, struct Command_struct *cmd) {
+    char *token = peekToken(ps);
+    char **target;
+    
+    if (isToken(token, "<")) {
+        target = &cmd->redirect_in;
+    } else if (isToken(token, ">")) {
+        target = &cmd->redirect_out;
+    } else if (isToken(token, "2>")) {
+        /* Handle stderr redirection */
+        target = &cmd->redirect_err;
+    } else {
+        return 0;
+    }
+    
+    free(nextToken(ps));
+    token = peekToken(ps);
+    if (token == NULL || isOperator(token) || isToken(token, "<") ||
+        isToken(token, ">") || isToken(token, "2>")) {
+        syntaxError(ps);
+        return -1;
+    }
+    free(*target);
+    *target = nextToken(ps);
+    return 1;
+}
+
+static struct Command_struct *newCommand(void) {
+    struct Command_struct *cmd = calloc(1, sizeof(struct Command_struct));
+    
+    if (cmd == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    cmd->com_suffix = ' ';
+    return cmd;
+}
+
+static struct Node *parseCommand(struct Parser *ps);
+
+/* function_definition: name '(' ')' newline* compound_command
+ * The name has been parsed as a simple command already. */
+static struct Node *parseFunction(struct Parser *ps, struct Command_struct *cmd) {
+    struct Node *node;
+    char *token;
+    
+    free(nextToken(ps));
+    if (!expectToken(ps, ")")) {
+        freeCommands(cmd, 1);
+        free(cmd);
+        return NULL;
+    }
+    skipNewlines(ps);
+    
+    node = newNode(NODE_FUNCTION, NULL, NULL);
+    node->cmd = cmd;
+    
+    /* The body must be a compound command */
+    token = peekToken(ps);
+    if (!isToken(token, "{") && !isToken(token, "(") && !isToken(token, "if") &&
+        !isToken(token, "while") && !isToken(token, "until") && !isToken(token, "for")) {
+        syntaxError(ps);
+        freeNode(node);
+        return NULL;
+    }
+    node->left = parseCommand(ps);
+    if (node->left == NULL) {
+        freeNode(node);
+        return NULL;
+    }
+    return node;
+}
+
+/* Replace a command starting with an alias by a copy of the alias's
+ * parsed value. The rest of the command's words and its redirections
+ * go to the last simple command of the copy. */
+static struct Node *expandAlias(struct Parser *ps, struct Command_struct *cmd, struct Alias *alias) {
+    struct Node *tree;
+    struct Node *last;
+    char **targets[3];
+    char **from[3];
+    int i;
+    
+    if (alias->tree == NULL) {
+        /* An empty alias leaves just the rest of the command, which
+         * may be nothing at all and then does nothing */
+        free(cmd->argv[0]);
+        memmove(cmd->argv, cmd->argv + 1, cmd->argc * sizeof(char *));
+        cmd->argc--;
+        cmd->com_pathname = cmd->argc > 0 ? cmd->argv[0] : NULL;
+        tree = newNode(NODE_COMMAND, NULL, NULL);
+        tree->cmd = cmd;
+        return tree;
+    }
+    
+    tree = cloneNode(alias->tree);
+    last = tree;
+    while (last->type == NODE_SEQ || last->type == NODE_AND ||
+           last->type == NODE_OR || last->type == NODE_PIPE) {
+        last = last->right;
+    }
+    if (last->type == NODE_BACKGROUND) {
+        last = last->left;
+    }
+    if (last->cmd == NULL || (last->type != NODE_COMMAND && cmd->argc > 1)) {
+        /* Words cannot follow a compound command */
+        syntaxError(ps);
+        freeNode(tree);
+        freeCommands(cmd, 1);
+        free(cmd);
+        return NULL;
+    }
+    
+    for (i = 1; i < cmd->argc; i++) {
+        if (last->cmd->argc < MAX_ARGS - 1) {
+            last->cmd->argv[last->cmd->argc++] = cmd->argv[i];
+        } else {
+            free(cmd->argv[i]);
+        }
+    }
+    last->cmd->argv[last->cmd->argc] = NULL;
+    cmd->argc = 1;
+    
+    targets[0] = &last->cmd->redirect_in;
+    targets[1] = &last->cmd->redirect_out;
+    targets[2] = &last->cmd->redirect_err;
+    from[0] = &cmd->redirect_in;
+    from[1] = &cmd->redirect_out;
+    from[2] = &cmd->redirect_err;
+    for (i = 0; i < 3; i++) {
+        if (*from[i] != NULL) {
+            free(*targets[i]);
+            *targets[i] = *from[i];
+            *from[i] = NULL;
+        }
+    }
+    
+    freeCommands(cmd, 1);
+    free(cmd);
+    return tree;
+}
+
+/* simple_command: words and redirections up to an operator */
+static struct Node *parseSimpleCommand(struct Parser *ps) {
+    struct Command_struct *cmd = newCommand();
+    struct Alias *alias;
+    struct Node *node;
     char *token;
-    int cmd_index = 0;
-    int arg_index;
-    char last_suffix = ' ';
-    
-    /* Initialize commands array */
-    memset(commands, 0, sizeof(struct Command_struct) * MAX_COMMANDS);
-    
-    while (*p && cmd_index < MAX_COMMANDS) {
-        /* Initialize current command */
-        commands[cmd_index].com_pathname = NULL;
-        commands[cmd_index].argc = 0;
-        commands[cmd_index].redirect_in = NULL;
-        commands[cmd_index].redirect_out = NULL;
-        commands[cmd_index].redirect_err = NULL;
-        commands[cmd_index].com_suffix = ' ';
-        arg_index = 0;
+    int rc;
+    
+    for (;;) {
+        rc = parseRedirect(ps, cmd);
+        if (rc < 0) {
+            freeCommands(cmd, 1);
+            free(cmd);
+            return NULL;
+        }
+        if (rc > 0) continue;
         
-        /* Parse tokens for this command */
-        while ((token = parseToken(&p)) != NULL) {
-            /* Check for special tokens */
-            if (strcmp(token, "&") == 0 || strcmp(token, ";") == 0 || 
-                strcmp(token, "|") == 0) {
-                commands[cmd_index].com_suffix = token[0];
-                free(token);
-                break;
-            } else if (strcmp(token, "<") == 0) {
-                free(token);
-                token = parseToken(&p);
-                if (token) {
-                    commands[cmd_index].redirect_in = token;
-                }
-            } else if (strcmp(token, ">") == 0) {
-                free(token);
-                token = parseToken(&p);
-                if (token) {
-                    commands[cmd_index].redirect_out = token;
-                }
-            } else if (strcmp(token, "2>") == 0) {
-                /* Handle stderr redirection */
-                free(token);
-                token = parseToken(&p);
-                if (token) {
-                    commands[cmd_index].redirect_err = token;
-                }
+        token = peekToken(ps);
+        if (token == NULL || isOperator(token)) break;
+        
+        /* Regular argument */
+        token = nextToken(ps);
+        if (cmd->argc < MAX_ARGS - 1) {
+            cmd->argv[cmd->argc++] = token;
+            if (cmd->com_pathname == NULL) {
+                cmd->com_pathname = token;
+            }
+        } else {
+            free(token);
+        }
+    }
+    
+    /* Null-terminate argv */
+    cmd->argv[cmd->argc] = NULL;
+    
+    if (cmd->argc == 0 && cmd->redirect_in == NULL &&
+        cmd->redirect_out == NULL && cmd->redirect_err == NULL) {
+        syntaxError(ps);
+        free(cmd);
+        return NULL;
+    }
+    
+    token = peekToken(ps);
+    if (token != NULL) {
+        cmd->com_suffix = token[0];
+    }
+    
+    ps->count++;
+    
+    /* name() starts a function definition */
+    if (isToken(token, "(") && cmd->argc == 1 && cmd->redirect_in == NULL &&
+        cmd->redirect_out == NULL && cmd->redirect_err == NULL &&
+        isValidName(cmd->argv[0], strlen(cmd->argv[0]))) {
+        return parseFunction(ps, cmd);
+    }
+    
+    if (expand_aliases && cmd->argc > 0 && (alias = findAlias(cmd->argv[0])) != NULL) {
+        return expandAlias(ps, cmd, alias);
+    }
+    
+    node = newNode(NODE_COMMAND, NULL, NULL);
+    node->cmd = cmd;
+    return node;
+}
+
+static struct Node *parseList(struct Parser *ps);
+
+/* Parse a list that must not be empty, as in a compound command */
+static struct Node *parseBody(struct Parser *ps) {
+    struct Node *list = parseList(ps);
+    
+    if (list == NULL && !parse_error) {
+        syntaxError(ps);
+    }
+    return list;
+}
+
+/* if_clause: 'if' list 'then' list ('elif' list 'then' list)* ['else' list] 'fi'
+ * An elif is parsed as an if nested in the else part. */
+static struct Node *parseIf(struct Parser *ps) {
+    struct Node *node;
+    
+    free(nextToken(ps));
+    node = newNode(NODE_IF, parseBody(ps), NULL);
+    if (node->left == NULL || !expectToken(ps, "then")) {
+        freeNode(node);
+        return NULL;
+    }
+    
+    node->right = parseBody(ps);
+    if (node->right == NULL) {
+        freeNode(node);
+        return NULL;
+    }
+    
+    if (isToken(peekToken(ps), "elif")) {
+        /* The nested if consumes the closing fi */
+        node->else_part = parseIf(ps);
+        if (node->else_part == NULL) {
+            freeNode(node);
+            return NULL;
+        }
+        return node;
+    }
+    
+    if (isToken(peekToken(ps), "else")) {
+        free(nextToken(ps));
+        node->else_part = parseBody(ps);
+        if (node->else_part == NULL) {
+            freeNode(node);
+            return NULL;
+        }
+    }
+    
+    if (!expectToken(ps, "fi")) {
+        freeNode(node);
+        return NULL;
+    }
+    return node;
+}
+
+/* while_clause: ('while' | 'until') list 'do' list 'done' */
+static struct Node *parseWhile(struct Parser *ps, int type) {
+    struct Node *node;
+    
+    free(nextToken(ps));
+    node = newNode(type, parseBody(ps), NULL);
+    if (node->left == NULL || !expectToken(ps, "do")) {
+        freeNode(node);
+        return NULL;
+    }
+    
+    node->right = parseBody(ps);
+    if (node->right == NULL || !expectToken(ps, "done")) {
+        freeNode(node);
+        return NULL;
+    }
+    return node;
+}
+
+/* for_clause: 'for' name ['in' word*] (';' | newline) 'do' list 'done'
+ * The name and the words are kept in cmd->argv; without 'in' the
+ * loop goes over "$@". */
+static struct Node *parseFor(struct Parser *ps) {
+    struct Command_struct *cmd;
+    struct Node *node;
+    char *token;
+    
+    free(nextToken(ps));
+    token = peekToken(ps);
+    if (token == NULL || isOperator(token) ||
+        !isValidName(token, strlen(token))) {
+        syntaxError(ps);
+        return NULL;
+    }
+    
+    node = newNode(NODE_FOR, NULL, NULL);
+    node->cmd = cmd = newCommand();
+    cmd->argv[cmd->argc++] = nextToken(ps);
+    
+    skipNewlines(ps);
+    if (isToken(peekToken(ps), "in")) {
+        free(nextToken(ps));
+        for (;;) {
+            token = peekToken(ps);
+            if (token == NULL || isOperator(token)) break;
+            token = nextToken(ps);
+            if (cmd->argc < MAX_ARGS - 1) {
+                cmd->argv[cmd->argc++] = token;
             } else {
-                /* Regular argument */
-                if (arg_index < MAX_ARGS - 1) {
-                    commands[cmd_index].argv[arg_index++] = token;
-                    commands[cmd_index].argc++;
-                    if (commands[cmd_index].com_pathname == NULL) {
-                        commands[cmd_index].com_pathname = token;
-                    }
-                }
+                free(token);
             }
         }
+        if (!isToken(token, ";") && !isToken(token, "\n")) {
+            syntaxError(ps);
+            freeNode(node);
+            return NULL;
+        }
+        free(nextToken(ps));
+    } else {
+        cmd->argv[cmd->argc++] = strdup("\"$@\"");
+        if (isToken(peekToken(ps), ";")) {
+            free(nextToken(ps));
+        }
+    }
+    cmd->argv[cmd->argc] = NULL;
+    
+    skipNewlines(ps);
+    if (!expectToken(ps, "do")) {
+        freeNode(node);
+        return NULL;
+    }
+    node->right = parseBody(ps);
+    if (node->right == NULL || !expectToken(ps, "done")) {
+        freeNode(node);
+        return NULL;
+    }
+    return node;
+}
+
+/* Parse '{' list '}' or '(' list ')' */
+static struct Node *parseGroup(struct Parser *ps, int type, const char *close) {
+    struct Node *node;
+    
+    free(nextToken(ps));
+    node = newNode(type, parseBody(ps), NULL);
+    if (node->left == NULL || !expectToken(ps, close)) {
+        freeNode(node);
+        return NULL;
+    }
+    return node;
+}
+
+/* command: simple_command | compound_command redirection*
+ * compound_command: '{' list '}' | '(' list ')' | if_clause |
+ *                   while_clause | for_clause */
+static struct Node *parseCommand(struct Parser *ps) {
+    char *token = peekToken(ps);
+    struct Node *node;
+    int rc;
+    
+    if (isToken(token, "(")) {
+        node = parseGroup(ps, NODE_SUBSHELL, ")");
+    } else if (isToken(token, "{")) {
+        node = parseGroup(ps, NODE_GROUP, "}");
+    } else if (isToken(token, "if")) {
+        node = parseIf(ps);
+    } else if (isToken(token, "while")) {
+        node = parseWhile(ps, NODE_WHILE);
+    } else if (isToken(token, "until")) {
+        node = parseWhile(ps, NODE_UNTIL);
+    } else if (isToken(token, "for")) {
+        node = parseFor(ps);
+    } else {
+        return parseSimpleCommand(ps);
+    }
+    
+    if (node == NULL) {
+        return NULL;
+    }
+    
+    /* Redirections apply to the whole compound command */
+    if (node->cmd == NULL) {
+        node->cmd = newCommand();
+    }
+    while ((rc = parseRedirect(ps, node->cmd)) > 0);
+    if (rc < 0) {
+        freeNode(node);
+        return NULL;
+    }
+    
+    return node;
+}
+
+/* pipeline: command ('|' command)* */
+static struct Node *parsePipeline(struct Parser *ps) {
+    struct Node *left = parseCommand(ps);
+    struct Node *right;
+    
+    while (left != NULL && isToken(peekToken(ps), "|")) {
+        free(nextToken(ps));
+        right = parseCommand(ps);
+        if (right == NULL) {
+            freeNode(left);
+            return NULL;
+        }
+        left = newNode(NODE_PIPE, left, right);
+    }
+    
+    return left;
+}
+
+/* and_or: pipeline (('&&' | '||') pipeline)* */
+static struct Node *parseAndOr(struct Parser *ps) {
+    struct Node *left = parsePipeline(ps);
+    struct Node *right;
+    int type;
+    
+    while (left != NULL) {
+        if (isToken(peekToken(ps), "&&")) {
+            type = NODE_AND;
+        } else if (isToken(peekToken(ps), "||")) {
+            type = NODE_OR;
+        } else {
+            break;
+        }
+        free(nextToken(ps));
+        right = parsePipeline(ps);
+        if (right == NULL) {
+            freeNode(left);
+            return NULL;
+        }
+        left = newNode(type, left, right);
+    }
+    
+    return left;
+}
+
+/* list: and_or ((';' | '&' | newline) and_or)* [';' | '&' | newline]
+ * Stops at the end of the input or at a reserved word that closes the
+ * enclosing compound command, for the caller. */
+static struct Node *parseList(struct Parser *ps) {
+    struct Node *list = NULL;
+    struct Node **tail = &list;    /* the last command of the list */
+    struct Node *node;
+    char *token;
+    
+    skipNewlines(ps);
+    for (;;) {
+        token = peekToken(ps);
+        if (token == NULL || isListEnd(token)) {
+            break;
+        }
         
-        /* Null-terminate argv */
-        commands[cmd_index].argv[arg_index] = NULL;
+        node = parseAndOr(ps);
+        if (node == NULL) {
+            freeNode(list);
+            return NULL;
+        }
         
-        /* Check if we have a valid command */
-        if (commands[cmd_index].argc > 0) {
-            cmd_index++;
+        token = peekToken(ps);
+        if (isToken(token, "&")) {
+            free(nextToken(ps));
+            node = newNode(NODE_BACKGROUND, node, NULL);
+        } else if (isToken(token, ";") || isToken(token, "\n")) {
+            free(nextToken(ps));
+        } else if (token != NULL && !isListEnd(token)) {
+            syntaxError(ps);
+            freeNode(list);
+            freeNode(node);
+            return NULL;
         }
+        skipNewlines(ps);
         
-        /* Check if we're done */
-        if (last_suffix != '|' && commands[cmd_index - 1].com_suffix != '|') {
-            if (commands[cmd_index - 1].com_suffix == '&' || 
-                commands[cmd_index - 1].com_suffix == ';') {
-                last_suffix = commands[cmd_index - 1].com_suffix;
-            } else {
-                break;
-            }
+        /* Lists are chained to the right so a long script can be
+         * compiled and freed in a loop instead of by recursion */
+        if (list == NULL) {
+            list = node;
+        } else {
+            *tail = newNode(NODE_SEQ, *tail, node);
+            tail = &(*tail)->right;
         }
     }
     
-    return cmd_index;
+    return list;
+}
+
+/* Parse command line, or a whole script, into a syntax tree.
+ * Returns the number of simple commands, -1 on a syntax error, or
+ * PARSE_INCOMPLETE if the input ends inside a command. */
+int parseCommandLine(char *line, struct Node **tree) {
+    struct Parser ps;
+    
+    memset(&ps, 0, sizeof(ps));
+    ps.p = line;
+    parse_error = 0;
+    parse_incomplete = 0;
+    
+    *tree = parseList(&ps);
+    
+    /* Anything left over, such as a stray ')', is an error */
+    if (!parse_error && peekToken(&ps) != NULL) {
+        syntaxError(&ps);
+    }
+    if (ps.have_token) {
+        free(ps.token);
+    }
+    
+    if (parse_error) {
+        freeNode(*tree);
+        *tree = NULL;
+        return parse_incomplete ? PARSE_INCOMPLETE : -1;
+    }
+    
+    return ps.count;
+}
+
+/* Parse the value of an alias being defined */
+int parseAliasValue(char *value, struct Node **tree) {
+    int rc;
+    
+    expand_aliases = 0;
+    rc = parseCommandLine(value, tree);
+    expand_aliases = 1;
+    return rc;
+}
+
+/* Copy a parsed command */
+static struct Command_struct *cloneCommand(struct Command_struct *cmd) {
+    struct Command_struct *copy = newCommand();
+    int i;
+    
+    for (i = 0; i < cmd->argc; i++) {
+        copy->argv[i] = strdup(cmd->argv[i]);
+    }
+    copy->argc = cmd->argc;
+    copy->argv[copy->argc] = NULL;
+    if (cmd->com_pathname != NULL) {
+        copy->com_pathname = copy->argv[0];
+    }
+    copy->redirect_in = cmd->redirect_in ? strdup(cmd->redirect_in) : NULL;
+    copy->redirect_out = cmd->redirect_out ? strdup(cmd->redirect_out) : NULL;
+    copy->redirect_err = cmd->redirect_err ? strdup(cmd->redirect_err) : NULL;
+    copy->com_suffix = cmd->com_suffix;
+    return copy;
+}
+
+/* Copy a syntax tree */
+struct Node *cloneNode(struct Node *node) {
+    struct Node *copy;
+    
+    if (node == NULL) return NULL;
+    
+    copy = newNode(node->type, cloneNode(node->left), cloneNode(node->right));
+    copy->else_part = cloneNode(node->else_part);
+    if (node->cmd != NULL) {
+        copy->cmd = cloneCommand(node->cmd);
+    }
+    return copy;
+}
+
+/* Free a syntax tree */
+void freeNode(struct Node *node) {
+    struct Node *right;
+    
+    while (node != NULL) {
+        freeNode(node->left);
+        freeNode(node->else_part);
+        if (node->cmd != NULL) {
+            freeCommands(node->cmd, 1);
+            free(node->cmd);
+        }
+        right = node->right;
+        free(node);
+        node = right;
+    }
 }
 
 /* Free allocated memory in commands array */
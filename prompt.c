@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include "shell.h"
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* Prompt escapes, expanded each time the prompt is shown:
+ *
+ *   \u user    \h host up to the first dot    \H full host name
+ *   \w working directory, ~ for $HOME          \W its last component
+ *   \? status of the last command   \T how long the last command took
+ *   \$ # for root, $ otherwise      \\ a backslash
+ *   \g git branch                   \G * if the work tree has changes
+ *
+ * The git segments can take seconds in a big repository, so they are
+ * worked out by a background thread and cached per directory. The
+ * prompt is drawn at once with what the cache has for the directory,
+ * possibly stale or empty, and readLineWithHistory redraws it in place
+ * when the thread has fresh values (see promptNotifyFd). */
+
+#define GIT_CACHE_SIZE 16
+
+struct GitInfo {
+    char dir[PATH_MAX];
+    char branch[128];
+    int dirty;
+    unsigned long used;
+};
+
+static struct GitInfo git_cache[GIT_CACHE_SIZE];
+static unsigned long git_clock = 0;
+
+/* Directory the thread should look at next, empty if none */
+static char git_request[PATH_MAX];
+static pthread_mutex_t git_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t git_wakeup = PTHREAD_COND_INITIALIZER;
+static int git_thread_started = 0;
+
+/* The thread writes a byte here when it has updated the cache */
+static int notify_pipe[2] = { -1, -1 };
+
+/* Timing of the last command */
+static struct timespec command_start;
+static double last_elapsed = -1;
+
+void markCommandStart(void) {
+    clock_gettime(CLOCK_MONOTONIC, &command_start);
+}
+
+void markCommandEnd(void) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    last_elapsed = (end.tv_sec - command_start.tv_sec) +
+                   (end.tv_nsec - command_start.tv_nsec) / 1e9;
+}
+
+/* Cache entry for dir, or NULL. Call with git_lock held. */
+static struct GitInfo *findGitInfo(const char *dir) {
+    int i;
+
+    for (i = 0; i < GIT_CACHE_SIZE; i++) {
+        if (git_cache[i].used != 0 && strcmp(git_cache[i].dir, dir) == 0) {
+            return &git_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* Check if dir is inside a git work tree, without running git */
+static int inGitTree(const char *dir) {
+    char path[PATH_MAX + 8];
+    struct stat st;
+    char *slash;
+
+    snprintf(path, sizeof(path), "%s", dir);
+    for (;;) {
+        size_t len = strlen(path);
+        snprintf(path + len, sizeof(path) - len, "/.git");
+        if (stat(path, &st) == 0) {
+            return 1;
+        }
+        path[len] = '\0';
+        slash = strrchr(path, '/');
+        if (slash == NULL || slash == path) {
+            return 0;
+        }
+        *slash = '\0';
+    }
+}
+
+/* Run git status in dir and read the branch and whether anything is
+ * changed. Returns -1 if it is not a git work tree. */
+static int readGitStatus(const char *dir, char *branch, size_t size, int *dirty) {
+    char *argv[] = { "git", "-C", (char *)dir, "status", "--porcelain", "-b",
+                     "--untracked-files=no", NULL };
+    posix_spawn_file_actions_t actions;
+    struct StrBuf out;
+    char *line, *end;
+    int fds[2];
+    pid_t pid;
+    int rc;
+
+    /* Close-on-exec from the start: a command the shell forks meanwhile
+     * must not keep the write end open */
+    if (!inGitTree(dir) || pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    rc = posix_spawnp(&pid, "git", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (rc != 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    sbInit(&out);
+    sbReadFd(&out, fds[0]);
+    close(fds[0]);
+    /* The shell may reap it first at the next prompt, that is fine */
+    waitpid(pid, NULL, 0);
+
+    /* "## branch...upstream [ahead 1]", then one line per change */
+    if (out.data == NULL || strncmp(out.data, "## ", 3) != 0) {
+        sbFree(&out);
+        return -1;
+    }
+    line = out.data + 3;
+    end = strchr(line, '\n');
+    if (end != NULL) *end = '\0';
+
+    /* Any line after the first is a change */
+    *dirty = end != NULL && end[1] != '\0';
+
+    if (strncmp(line, "No commits yet on ", 18) == 0) line += 18;
+    if (strncmp(line, "HEAD (no branch)", 16) == 0) line = "HEAD";
+    if ((end = strstr(line, "...")) != NULL) *end = '\0';
+    if ((end = strchr(line, ' ')) != NULL) *end = '\0';
+    snprintf(branch, size, "%s", line);
+    sbFree(&out);
+    return 0;
+}
+
+/* The background thread: take a directory, run git there, store the
+ * result and tell the line editor */
+static void *gitThread(void *arg) {
+    char dir[PATH_MAX];
+    char branch[128];
+    struct GitInfo *info;
+    int dirty;
+    int i;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&git_lock);
+        while (git_request[0] == '\0') {
+            pthread_cond_wait(&git_wakeup, &git_lock);
+        }
+        snprintf(dir, sizeof(dir), "%s", git_request);
+        git_request[0] = '\0';
+        pthread_mutex_unlock(&git_lock);
+
+        branch[0] = '\0';
+        dirty = 0;
+        if (readGitStatus(dir, branch, sizeof(branch), &dirty) < 0) {
+            branch[0] = '\0';
+            dirty = 0;
+        }
+
+        pthread_mutex_lock(&git_lock);
+        info = findGitInfo(dir);
+        if (info == NULL) {
+            /* Replace the least recently used entry */
+            info = &git_cache[0];
+            for (i = 1; i < GIT_CACHE_SIZE; i++) {
+                if (git_cache[i].used < info->used) info = &git_cache[i];
+            }
+            snprintf(info->dir, sizeof(info->dir), "%s", dir);
+            info->branch[0] = '\0';
+            info->dirty = 0;
+        }
+        info->used = ++git_clock;
+        if (strcmp(info->branch, branch) != 0 || info->dirty != dirty) {
+            snprintf(info->branch, sizeof(info->branch), "%s", branch);
+            info->dirty = dirty;
+            pthread_mutex_unlock(&git_lock);
+            if (write(notify_pipe[1], "", 1) < 0) {
+                /* Pipe full: a redraw is pending anyway */
+            }
+        } else {
+            pthread_mutex_unlock(&git_lock);
+        }
+    }
+    return NULL;
+}
+
+/* Start the background thread, with every signal blocked in it so
+ * they keep going to the shell */
+static int startGitThread(void) {
+    sigset_t all, old;
+    pthread_t thread;
+
+    if (git_thread_started) {
+        return 0;
+    }
+    if (pipe2(notify_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        return -1;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, gitThread, NULL) != 0) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        return -1;
+    }
+    pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    git_thread_started = 1;
+    return 0;
+}
+
+/* Descriptor that becomes readable when the prompt should be redrawn,
+ * -1 if there is nothing that updates it */
+int promptNotifyFd(void) {
+    return notify_pipe[0];
+}
+
+/* Empty the notification pipe */
+void promptDrainNotify(void) {
+    char buf[64];
+
+    if (notify_pipe[0] >= 0) {
+        while (read(notify_pipe[0], buf, sizeof(buf)) > 0);
+    }
+}
+
+/* Ask for fresh git values for the working directory, if the prompt
+ * shows them. Called once for each new prompt, not on redraws. */
+void promptRefresh(const char *format) {
+    char cwd[PATH_MAX];
+
+    if (strstr(format, "\\g") == NULL && strstr(format, "\\G") == NULL) {
+        return;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL || startGitThread() < 0) {
+        return;
+    }
+    pthread_mutex_lock(&git_lock);
+    snprintf(git_request, sizeof(git_request), "%s", cwd);
+    pthread_cond_signal(&git_wakeup);
+    pthread_mutex_unlock(&git_lock);
+}
+
+static void appendString(char *out, size_t size, size_t *len, const char *s) {
+    while (*s && *len + 1 < size) {
+        out[(*len)++] = *s++;
+    }
+    out[*len] = '\0';
+}
+
+/* Expand the escapes of a prompt format into out */
+void expandPrompt(const char *format, char *out, size_t size) {
+    static char user[64];
+    static char host[256];
+    char cwd[PATH_MAX];
+    char text[64];
+    struct GitInfo *info;
+    const char *home;
+    const char *p;
+    size_t len = 0;
+
+    out[0] = '\0';
+    for (p = format; *p; p++) {
+        if (*p != '\\' || p[1] == '\0') {
+            text[0] = *p;
+            text[1] = '\0';
+            appendString(out, size, &len, text);
+            continue;
+        }
+
+        switch (*++p) {
+        case 'u':
+            if (user[0] == '\0') {
+                struct passwd *pw = getpwuid(geteuid());
+                snprintf(user, sizeof(user), "%s", pw ? pw->pw_name : "?");
+            }
+            appendString(out, size, &len, user);
+            break;
+
+        case 'h':
+        case 'H':
+            if (host[0] == '\0' && gethostname(host, sizeof(host) - 1) < 0) {
+                snprintf(host, sizeof(host), "?");
+            }
+            if (*p == 'h') {
+                snprintf(text, sizeof(text), "%.*s", (int)strcspn(host, "."), host);
+                appendString(out, size, &len, text);
+            } else {
+                appendString(out, size, &len, host);
+            }
+            break;
+
+        case 'w':
+        case 'W':
+            if (getcwd(cwd, sizeof(cwd)) == NULL) {
+                snprintf(cwd, sizeof(cwd), "?");
+            }
+            home = getVar("HOME");
+            if (*p == 'W') {
+                const char *base = strrchr(cwd, '/');
+                appendString(out, size, &len, base && base[1] ? base + 1 : cwd);
+            } else if (home != NULL && *home && strncmp(cwd, home, strlen(home)) == 0 &&
+                       (cwd[strlen(home)] == '/' || cwd[strlen(home)] == '\0')) {
+                appendString(out, size, &len, "~");
+                appendString(out, size, &len, cwd + strlen(home));
+            } else {
+                appendString(out, size, &len, cwd);
+            }
+            break;
+
+        case '?':
+            snprintf(text, sizeof(text), "%d", shell->last_status);
+            appendString(out, size, &len, text);
+            break;
+
+        case 'T':
+            if (last_elapsed < 0) {
+                text[0] = '\0';
+            } else if (last_elapsed < 1) {
+                snprintf(text, sizeof(text), "%dms", (int)(last_elapsed * 1000));
+            } else if (last_elapsed < 60) {
+                snprintf(text, sizeof(text), "%.1fs", last_elapsed);
+            } else {
+                snprintf(text, sizeof(text), "%dm%ds", (int)last_elapsed / 60, (int)last_elapsed % 60);
+            }
+            appendString(out, size, &len, text);
+            break;
+
+        case '$':
+            appendString(out, size, &len, geteuid() == 0 ? "#" : "$");
+            break;
+
+        case 'g':
+        case 'G':
+            /* Whatever the cache has now; the thread updates it */
+            if (getcwd(cwd, sizeof(cwd)) == NULL) break;
+            pthread_mutex_lock(&git_lock);
+            info = findGitInfo(cwd);
+            if (info != NULL) {
+                if (*p == 'g') {
+                    appendString(out, size, &len, info->branch);
+                } else if (info->dirty) {
+                    appendString(out, size, &len, "*");
+                }
+            }
+            pthread_mutex_unlock(&git_lock);
+            break;
+
+        case '\\':
+            appendString(out, size, &len, "\\");
+            break;
+
+        default:
+            text[0] = '\\';
+            text[1] = *p;
+            text[2] = '\0';
+            appendString(out, size, &len, text);
+            break;
+        }
+    }
+}
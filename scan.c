@@ -0,0 +1,171 @@
+#include "shell.h"
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+/* Fast scanning for the tokenizer. parseToken only has to look at a
+ * few bytes of a word: whitespace and operators that end it, quotes,
+ * backslashes and $ that change how the rest is read, and the end of
+ * the line. scanToSpecial skips everything else, 16 or 32 bytes at a
+ * time where the CPU has SSE2 or AVX2.
+ *
+ * The vector loops load aligned blocks, so they may read past the
+ * terminating NUL but never into the next page. AddressSanitizer
+ * cannot tell, so they are not instrumented. */
+
+/* Bit per scan mode in scan_table */
+#define IN_WORD   (1 << SCAN_WORD)
+#define IN_SQUOTE (1 << SCAN_SQUOTE)
+#define IN_DQUOTE (1 << SCAN_DQUOTE)
+
+static unsigned char scan_table[256];
+static int scan_level = -1;
+static int scan_best = SCAN_TABLE;
+
+/* The bytes that stop a scan in each mode */
+static const char word_stops[] = " \t\n\v\f\r&;|<>'\"()\\$";
+static const char squote_stops[] = "'";
+static const char dquote_stops[] = "\"\\$";
+
+static void initScan(void) {
+    const char *s;
+
+    for (s = word_stops; *s; s++) scan_table[(unsigned char)*s] |= IN_WORD;
+    for (s = squote_stops; *s; s++) scan_table[(unsigned char)*s] |= IN_SQUOTE;
+    for (s = dquote_stops; *s; s++) scan_table[(unsigned char)*s] |= IN_DQUOTE;
+    scan_table[0] = IN_WORD | IN_SQUOTE | IN_DQUOTE;
+
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) scan_best = SCAN_SSE2;
+    if (__builtin_cpu_supports("avx2")) scan_best = SCAN_AVX2;
+#endif
+    scan_level = scan_best;
+}
+
+/* Choose how to scan, SCAN_BYTE to SCAN_AVX2; a level the CPU lacks
+ * falls back to the best it has. Returns the level chosen. */
+int setScanLevel(int level) {
+    if (scan_level < 0) initScan();
+    scan_level = level < SCAN_BYTE ? SCAN_BYTE : level > scan_best ? scan_best : level;
+    return scan_level;
+}
+
+#ifdef HAVE_X86
+/* Mask of the bytes in block that stop a scan in mode */
+__attribute__((target("sse2")))
+static inline unsigned stopMask16(__m128i block, int mode) {
+    __m128i m = _mm_cmpeq_epi8(block, _mm_setzero_si128());
+
+    if (mode == SCAN_WORD) {
+        /* Signed compares, so bytes from 0x80 up are not whitespace */
+        m = _mm_or_si128(m, _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('\t' - 1)),
+                                          _mm_cmplt_epi8(block, _mm_set1_epi8('\r' + 1))));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('&')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8(';')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('|')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('<')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('>')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('(')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8(')')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('\'')));
+    }
+    if (mode == SCAN_SQUOTE) {
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('\'')));
+    } else {
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('\\')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(block, _mm_set1_epi8('$')));
+    }
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2"), no_sanitize_address))
+static const char *scanSse2(const char *p, int mode) {
+    uintptr_t skip = (uintptr_t)p & 15;
+    const __m128i *block = (const __m128i *)(p - skip);
+    unsigned mask;
+
+    /* The first block may start before p */
+    mask = stopMask16(_mm_load_si128(block), mode) >> skip << skip;
+    while (mask == 0) {
+        block++;
+        mask = stopMask16(_mm_load_si128(block), mode);
+    }
+    return (const char *)block + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned stopMask32(__m256i block, int mode) {
+    __m256i m = _mm256_cmpeq_epi8(block, _mm256_setzero_si256());
+
+    if (mode == SCAN_WORD) {
+        m = _mm256_or_si256(m, _mm256_and_si256(_mm256_cmpgt_epi8(block, _mm256_set1_epi8('\t' - 1)),
+                                                _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), block)));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('&')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(';')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('|')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('<')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('>')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('(')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(')')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\'')));
+    }
+    if (mode == SCAN_SQUOTE) {
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\'')));
+    } else {
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('$')));
+    }
+    return (unsigned)_mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static const char *scanAvx2(const char *p, int mode) {
+    uintptr_t skip = (uintptr_t)p & 31;
+    const __m256i *block = (const __m256i *)(p - skip);
+    unsigned mask;
+
+    mask = stopMask32(_mm256_load_si256(block), mode) >> skip << skip;
+    while (mask == 0) {
+        block++;
+        mask = stopMask32(_mm256_load_si256(block), mode);
+    }
+    return (const char *)block + __builtin_ctz(mask);
+}
+#endif
+
+/* First byte from p on that parseToken has to look at when reading in
+ * mode (SCAN_WORD, SCAN_SQUOTE or SCAN_DQUOTE); at worst the NUL */
+const char *scanToSpecial(const char *p, int mode) {
+    int bit = 1 << mode;
+
+    if (scan_level < 0) initScan();
+
+    /* Most words are short: look at a few bytes before going wide.
+     * p[1] is there since p[0] was not the NUL. */
+    if (scan_level >= SCAN_TABLE) {
+        if (scan_table[(unsigned char)p[0]] & bit) return p;
+        if (scan_table[(unsigned char)p[1]] & bit) return p + 1;
+    }
+
+    switch (scan_level) {
+    case SCAN_BYTE:
+        /* The tokenizer steps through every byte itself */
+        return p;
+#ifdef HAVE_X86
+    case SCAN_SSE2:
+        return scanSse2(p, mode);
+    case SCAN_AVX2:
+        return scanAvx2(p, mode);
+#endif
+    default:
+        while (!(scan_table[(unsigned char)*p] & bit)) p++;
+        return p;
+    }
+}
@@ -13,13 +13,32 @@
 #include <glob.h>
 #include <pwd.h>
 #include <termios.h>
+#include <limits.h>
+#include "myshell.h"
 
 /* Constants */
 #define MAX_COMMANDS 100
 #define MAX_ARGS 1000
 #define MAX_LINE_LENGTH 10000
 #define MAX_HISTORY 1000
+#define MAX_BACKGROUND 256
 #define DEFAULT_PROMPT "%"
+#define MAX_SUBST_DEPTH 32
+#define MAX_LOOP_DEPTH 256
+#define MAX_REDIRECT_DEPTH 256
+#define MAX_FUNCTION_DEPTH 1000
+#define PARSE_INCOMPLETE SHELL_INCOMPLETE
+
+/* Variable flags */
+#define VAR_SET    1
+#define VAR_EXPORT 2
+
+/* Growable byte buffer, always NUL terminated once allocated */
+struct StrBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
 
 /* Command structure */
 struct Command_struct {
@@ -32,16 +51,181 @@ struct Command_struct {
     char com_suffix;         // ' ' (none), '&' (background), ';' (sequential), '|' (pipe)
 };
 
+/* Syntax tree node types */
+#define NODE_COMMAND    0   // simple command in cmd
+#define NODE_PIPE       1   // left | right
+#define NODE_AND        2   // left && right
+#define NODE_OR         3   // left || right
+#define NODE_SEQ        4   // left ; right
+#define NODE_BACKGROUND 5   // left &
+#define NODE_GROUP      6   // { left; }, redirections in cmd
+#define NODE_SUBSHELL   7   // ( left ), redirections in cmd
+#define NODE_IF         8   // if left; then right; else else_part; fi
+#define NODE_WHILE      9   // while left; do right; done
+#define NODE_UNTIL      10  // until left; do right; done
+#define NODE_FOR        11  // for cmd->argv[0] in cmd->argv[1..]; do right; done
+#define NODE_FUNCTION   12  // cmd->argv[0]() left
+
+/* Syntax tree node */
+struct Node {
+    int type;
+    struct Node *left;
+    struct Node *right;
+    struct Node *else_part;
+    struct Command_struct *cmd;
+};
+
+/* Parts of a compiled word */
+#define PART_TEXT    0      // literal text
+#define PART_VAR     1      // value of the variable in slot
+#define PART_STATUS  2      // $?
+#define PART_COMMAND 3      // output of the program in prog
+#define PART_PARAM   4      // positional parameter number slot, $0 $1 ...
+#define PART_COUNT   5      // $#
+#define PART_ALL     6      // all positional parameters, $@ (slot 0) or $* (slot 1)
+
+struct Program;
+
+struct WordPart {
+    int type;
+    int quoted;              // inside quotes: no field splitting or globbing
+    int plain;               // PART_TEXT without glob characters or backslashes
+    int slot;
+    char *text;
+    size_t len;
+    struct Program *prog;
+};
+
+/* A word compiled once from its source: quotes are resolved and
+ * variables bound to their slots, so running it needs no rescanning */
+struct Word {
+    char *source;            // the word as written, for messages
+    int nparts;
+    struct WordPart *parts;
+    int assign_slot;         // variable slot if the word is NAME=value, else -1
+};
+
+/* A compiled simple command, or the redirections of a compound one */
+struct CommandTmpl {
+    int argc;                // words, assignments included
+    struct Word *argv;
+    int nassign;             // leading words that are assignments
+    int decl;                // export: assignment arguments are not split
+    struct Word *redirect[3];  // stdin, stdout, stderr targets or NULL
+};
+
+/* Bytecode operations */
+#define OP_END        0     // end of program
+#define OP_COMMAND    1     // run simple command data
+#define OP_PIPELINE   2     // run the arg stage programs in data as a pipeline
+#define OP_SUBSHELL   3     // run program data in a child process
+#define OP_BACKGROUND 4     // start program data in a child, don't wait
+#define OP_REDIRECT   5     // apply redirections data; on failure jump to arg
+#define OP_RESTORE    6     // undo the last OP_REDIRECT
+#define OP_JUMP       7     // jump to arg
+#define OP_JUMP_TRUE  8     // jump to arg if the status is 0
+#define OP_JUMP_FALSE 9     // jump to arg if the status is not 0
+#define OP_STATUS     10    // set the status to arg
+#define OP_KEEP       11    // remember the status as the loop's result
+#define OP_RESULT     12    // set the status to the loop's result
+#define OP_FOR_INIT   13    // start a for loop over the words of data, variable slot arg
+#define OP_FOR_NEXT   14    // assign the next word, or end the loop and jump to arg
+#define OP_LOOP_POP   15    // drop the innermost for loop (break)
+#define OP_DEFUN      16    // define function data
+
+struct Instr {
+    int op;
+    int arg;
+    void *data;
+};
+
+/* A compiled command line or script */
+struct Program {
+    struct Instr *code;
+    int len;
+    int cap;
+    int refs;                // function bodies outlive the line that defined them
+};
+
+/* A shell function: its body is compiled once, when it is defined */
+struct Function {
+    char *name;
+    struct Program *body;
+};
+
+/* An alias and the command it was parsed into when it was defined */
+struct Alias {
+    char *name;
+    char *value;
+    struct Node *tree;       // NULL for an empty alias
+};
+
+/* Execution flags */
+#define EXEC_NOFORK 1       // last command of a child process: exec in place
+
+/* Word expansion workspace: the fields of one command, back to back */
+struct ExpandBuf {
+    struct StrBuf text;      // expanded fields, each NUL terminated
+    size_t *field;           // offset of each field in text
+    int nfields;
+    int field_cap;
+    int nassign;             // leading fields that are NAME=value assignments
+};
+
+/* The state of one shell session. myshell itself has one; programs
+ * embedding the shell through the library may have several (see
+ * myshell.h), and shell points at the one commands run in. */
+struct Var;
+struct ShellContext {
+    char prompt[256];
+    char *history[MAX_HISTORY];
+    int history_count;
+    int history_index;
+    int last_status;
+    
+    /* Shell variables and their index, see vars.c */
+    struct Var *vars;
+    int var_count;
+    int var_capacity;
+    int *var_table;
+    size_t table_size;
+    char **env_array;        // exported environment, rebuilt when dirty
+    int env_capacity;
+    int env_dirty;
+    
+    /* Functions and positional parameters, see function.c */
+    struct Function **functions;
+    int function_count;
+    int function_capacity;
+    char **positional;
+    int positional_count;    // $#, $0 not included
+    
+    /* Aliases, see alias.c */
+    struct Alias *aliases;
+    int alias_count;
+    int alias_capacity;
+    
+    /* Embedding */
+    int embedded;            // exit ends the command, not the process
+    int exit_pending;        // exit was run; the rest is skipped
+    char *cwd;               // working directory between calls
+};
+
 /* Global variables */
-extern char current_prompt[256];
-extern char *history[MAX_HISTORY];
-extern int history_count;
-extern int history_index;
+extern struct ShellContext *shell;
+extern int in_subshell;
+extern int interactive;       // reading commands from the user, not a script
+extern int stdin_piped;      // stdin is a pipe from an earlier pipeline stage
+extern int return_pending;
+extern const char *builtin_names[];
 
 /* Function prototypes */
 
 /* Parser functions */
-int parseCommandLine(char *line, struct Command_struct commands[]);
+int parseCommandLine(char *line, struct Node **tree);
+int parseAliasValue(char *value, struct Node **tree);
+struct Node *cloneNode(struct Node *node);
+void freeNode(struct Node *node);
 void freeCommands(struct Command_struct commands[], int num_commands);
 void printComStruct(struct Command_struct *com);
 
@@ -49,18 +233,102 @@ void printComStruct(struct Command_struct *com);
 int isBuiltIn(char *command);
 int executeBuiltIn(struct Command_struct *cmd);
 void builtInPrompt(char *new_prompt);
-void builtInPWD(void);
-void builtInCD(char *path);
+int builtInPWD(void);
+int builtInCD(char *path);
 void builtInHistory(void);
-void builtInExit(void);
+void builtInExit(int status);
+int builtInExport(struct Command_struct *cmd);
+int builtInUnset(struct Command_struct *cmd);
+int builtInAlias(struct Command_struct *cmd);
+int builtInUnalias(struct Command_struct *cmd);
+int builtInReturn(struct Command_struct *cmd);
+int builtInShift(struct Command_struct *cmd);
+int builtInEcho(struct Command_struct *cmd);
+int builtInPrintf(struct Command_struct *cmd);
+int builtInTest(struct Command_struct *cmd);
+int builtInRead(struct Command_struct *cmd);
+int builtInKill(struct Command_struct *cmd);
+
+/* Compiler */
+struct Program *compileTree(struct Node *tree);
+struct Program *compileString(const char *src);
+void freeProgram(struct Program *prog);
 
 /* Execution functions */
-void executeCommands(struct Command_struct commands[], int num_commands);
-void executeSingleCommand(struct Command_struct *cmd);
-void executePipeline(struct Command_struct commands[], int start, int count);
+int executeCommands(struct Node *tree);
+int runProgram(struct Program *prog, int flags);
+int executeSingleCommand(struct CommandTmpl *cmd, int flags);
+int runExpandedCommand(struct Command_struct *expanded, struct CommandTmpl *tmpl,
+                       struct ExpandBuf *eb, int flags);
+int executePipeline(struct Program **stages, int count);
+int captureCommand(struct Program *prog, struct StrBuf *out);
+
+/* Word expansion */
+struct ExpandBuf *getExpandBuf(void);
+int expandCommand(struct CommandTmpl *cmd, struct Command_struct *out, struct ExpandBuf *eb);
+int expandWords(struct Word *words, int count, struct ExpandBuf *eb);
+int expandWildcards(struct ExpandBuf *eb, size_t start);
+char *getAssignment(struct ExpandBuf *eb, int i);
+
+/* Shell variables */
+void initVars(void);
+int isValidName(const char *name, size_t len);
+int isAssignment(const char *word);
+int findVar(const char *name, size_t len, int create);
+const char *getVarSlot(int slot);
+void setVarSlot(int slot, const char *value, size_t len);
+void unsetVarSlot(int slot);
+const char *getVar(const char *name);
+void setVar(const char *name, const char *value, int flags);
+void assignVar(const char *assignment, int flags);
+void exportVar(const char *name, int export);
+void unsetVar(const char *name);
+char **shellEnviron(void);
+void freeVars(void);
+void printExports(void);
 
-/* Wildcard expansion */
-int expandWildcards(struct Command_struct *cmd);
+/* Aliases */
+struct Alias *findAlias(const char *name);
+int defineAlias(const char *name, const char *value);
+int removeAlias(const char *name);
+void removeAllAliases(void);
+void freeAliases(void);
+void printAlias(struct Alias *alias);
+void printAliases(void);
+
+/* Shell functions and positional parameters */
+struct Function *findFunction(const char *name);
+void defineFunction(struct Function *func);
+int removeFunction(const char *name);
+int callFunction(struct Function *func, struct Command_struct *cmd, int flags);
+int inFunction(void);
+void removeAllFunctions(void);
+void setPositional(int argc, char *argv[]);
+const char *getPositional(int i);
+int getPositionalCount(void);
+int shiftPositional(int n);
+
+/* Pipeline stage scheduling */
+int builtInPipesched(struct Command_struct *cmd);
+int reserveStageSlots(int count);
+void scheduleStage(int slot);
+
+/* Directory jumping */
+void recordDirVisit(const char *dir);
+const char *findFrecentDir(char **args, int nargs);
+int builtInJump(struct Command_struct *cmd);
+
+/* Result cache */
+int memoCommand(struct Command_struct *cmd, struct CommandTmpl *tmpl, struct ExpandBuf *eb);
+
+/* Growable buffers */
+void sbInit(struct StrBuf *sb);
+void sbReserve(struct StrBuf *sb, size_t extra);
+void sbAppend(struct StrBuf *sb, const char *s, size_t n);
+void sbAppendChar(struct StrBuf *sb, char c);
+int sbReadFd(struct StrBuf *sb, int fd);
+void sbReset(struct StrBuf *sb);
+void sbFree(struct StrBuf *sb);
 
 /* History management */
 void addToHistory(char *line);
@@ -69,12 +337,40 @@ char *getHistoryCommand(char *input);
 /* Line editing with arrow key support */
 char *readLineWithHistory(const char *prompt_str);
 
+/* Tokenizer scanning */
+#define SCAN_WORD 0
+#define SCAN_SQUOTE 1
+#define SCAN_DQUOTE 2
+
+#define SCAN_BYTE 0
+#define SCAN_TABLE 1
+#define SCAN_SSE2 2
+#define SCAN_AVX2 3
+
+const char *scanToSpecial(const char *p, int mode);
+int setScanLevel(int level);
+
+/* Prompt */
+void expandPrompt(const char *format, char *out, size_t size);
+void promptRefresh(const char *format);
+int promptNotifyFd(void);
+void promptDrainNotify(void);
+void markCommandStart(void);
+void markCommandEnd(void);
+
+/* Tab completion */
+int completeLine(char *line, int pos, int max, const char *prompt);
+
 /* Signal handlers */
 void setupSignalHandler(void);
 void sigchildHandler();
+void blockChildSignal(int block);
+void addBackgroundJob(pid_t pid);
+void reapBackgroundJobs(void);
 
 /* Utility functions */
 char *trimWhitespace(char *str);
 int isSpecialChar(char c);
+const char *skipSubstitution(const char *p);
 
 #endif /* SHELL_H */
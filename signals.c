@@ -1,5 +1,9 @@
 #include "shell.h"
 
+/* Background jobs for the SIGCHLD handler to reap. Foreground jobs
+ * are waited for by pid, so the handler must not reap those. */
+static volatile pid_t background_jobs[MAX_BACKGROUND];
+
 /* Setup signal handlers */
 void setupSignalHandler(void) {
     struct sigaction sa_chld, sa_int, sa_quit, sa_tstp;
@@ -37,22 +41,49 @@ void setupSignalHandler(void) {
     }
 }
 
-/* SIGCHLD handler - reap zombie processes */
+/* SIGCHLD handler - reap finished background jobs */
 void sigchildHandler() {
-    int more = 1;
     pid_t pid;
     int status;
+    int i;
     int saved_errno = errno;
     
-    /* Reap all zombie children */
-    while (more) {
-        pid = waitpid(-1, &status, WNOHANG);
-        if (pid <= 0) {
-            more = 0;
+    for (i = 0; i < MAX_BACKGROUND; i++) {
+        if (background_jobs[i] > 0) {
+            pid = waitpid(background_jobs[i], &status, WNOHANG);
+            if (pid != 0) {
+                /* Reaped, or not ours any more */
+                background_jobs[i] = 0;
+            }
         }
     }
     
     errno = saved_errno;
 }
 
+/* Block or unblock SIGCHLD */
+void blockChildSignal(int block) {
+    sigset_t set;
+    
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
 
+/* Remember a background job; call with SIGCHLD blocked */
+void addBackgroundJob(pid_t pid) {
+    int i;
+    
+    for (i = 0; i < MAX_BACKGROUND; i++) {
+        if (background_jobs[i] == 0) {
+            background_jobs[i] = pid;
+            return;
+        }
+    }
+    /* Table full: reapBackgroundJobs picks it up at the next prompt */
+}
+
+/* Reap every finished child; only safe when no foreground job runs */
+void reapBackgroundJobs(void) {
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+}
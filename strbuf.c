@@ -0,0 +1,84 @@
+#include "shell.h"
+
+/* Initialise an empty buffer */
+void sbInit(struct StrBuf *sb) {
+    sb->data = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+}
+
+/* Make room for at least extra more bytes (plus a terminating NUL) */
+void sbReserve(struct StrBuf *sb, size_t extra) {
+    size_t need = sb->len + extra + 1;
+    size_t new_cap;
+    char *new_data;
+
+    if (need <= sb->cap) {
+        return;
+    }
+
+    /* Grow geometrically so appends stay linear overall */
+    new_cap = sb->cap ? sb->cap : 64;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+
+    new_data = realloc(sb->data, new_cap);
+    if (new_data == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    sb->data = new_data;
+    sb->cap = new_cap;
+}
+
+/* Append n bytes */
+void sbAppend(struct StrBuf *sb, const char *s, size_t n) {
+    sbReserve(sb, n);
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+/* Append a single byte */
+void sbAppendChar(struct StrBuf *sb, char c) {
+    sbReserve(sb, 1);
+    sb->data[sb->len++] = c;
+    sb->data[sb->len] = '\0';
+}
+
+/* Append everything that can be read from fd until EOF */
+int sbReadFd(struct StrBuf *sb, int fd) {
+    ssize_t n;
+
+    for (;;) {
+        /* Read straight into the spare capacity, no bounce buffer */
+        sbReserve(sb, 65536);
+        n = read(fd, sb->data + sb->len, sb->cap - sb->len - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        sb->len += n;
+    }
+
+    if (sb->data != NULL) {
+        sb->data[sb->len] = '\0';
+    }
+    return 0;
+}
+
+/* Forget the contents but keep the allocation for reuse */
+void sbReset(struct StrBuf *sb) {
+    sb->len = 0;
+    if (sb->data != NULL) {
+        sb->data[0] = '\0';
+    }
+}
+
+/* Release the buffer */
+void sbFree(struct StrBuf *sb) {
+    free(sb->data);
+    sbInit(sb);
+}
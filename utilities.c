@@ -0,0 +1,740 @@
+#include "shell.h"
+#include <ctype.h>
+#include <sys/stat.h>
+
+/* Built-in versions of small utilities that scripts run all the time.
+ * Running them in the shell saves a fork and exec per use; they write
+ * through stdio like the other builtins, so redirections and pipelines
+ * work the same as for the external commands. */
+
+/* Write the character for the escape sequence after a backslash and
+ * return the position after it. In echo -e and %b an octal escape is
+ * \0 and up to three digits, in a printf format up to three digits.
+ * *stop is set on \c, which ends all output. */
+static const char *putEscape(const char *p, int echo_octal, int *stop) {
+    int value = 0;
+    int digits = 0;
+
+    switch (*p) {
+    case 'a': putchar('\a'); return p + 1;
+    case 'b': putchar('\b'); return p + 1;
+    case 'e': putchar(27); return p + 1;
+    case 'f': putchar('\f'); return p + 1;
+    case 'n': putchar('\n'); return p + 1;
+    case 'r': putchar('\r'); return p + 1;
+    case 't': putchar('\t'); return p + 1;
+    case 'v': putchar('\v'); return p + 1;
+    case '\\': putchar('\\'); return p + 1;
+    case 'c':
+        *stop = 1;
+        return p + 1;
+    case 'x':
+        p++;
+        while (digits < 2 && isxdigit((unsigned char)*p)) {
+            value = value * 16 + (isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10);
+            p++;
+            digits++;
+        }
+        if (digits == 0) {
+            fputs("\\x", stdout);
+        } else {
+            putchar(value);
+        }
+        return p;
+    case '\0':
+        putchar('\\');
+        return p;
+    }
+
+    if (*p >= '0' && *p <= '7') {
+        if (echo_octal) {
+            if (*p != '0') {
+                putchar('\\');
+                return p;
+            }
+            p++;
+        }
+        while (digits < 3 && *p >= '0' && *p <= '7') {
+            value = value * 8 + (*p - '0');
+            p++;
+            digits++;
+        }
+        putchar(value & 0xff);
+        return p;
+    }
+
+    /* Not an escape, both characters are kept */
+    putchar('\\');
+    putchar(*p);
+    return p + 1;
+}
+
+/* Print s with its escape sequences interpreted. Returns 1 on \c. */
+static int putEscaped(const char *s, int echo_octal) {
+    int stop = 0;
+
+    while (*s && !stop) {
+        if (*s == '\\') {
+            s = putEscape(s + 1, echo_octal, &stop);
+        } else {
+            putchar(*s++);
+        }
+    }
+    return stop;
+}
+
+/* echo [-neE] [arg ...] */
+int builtInEcho(struct Command_struct *cmd) {
+    int newline = 1;
+    int escapes = 0;
+    int first;
+    int i = 1;
+
+    /* An argument is taken as options only if every letter is one */
+    while (i < cmd->argc && cmd->argv[i][0] == '-' && cmd->argv[i][1] != '\0' &&
+           strspn(cmd->argv[i] + 1, "neE") == strlen(cmd->argv[i] + 1)) {
+        const char *opt;
+        for (opt = cmd->argv[i] + 1; *opt; opt++) {
+            if (*opt == 'n') newline = 0;
+            else if (*opt == 'e') escapes = 1;
+            else escapes = 0;
+        }
+        i++;
+    }
+
+    for (first = i; i < cmd->argc; i++) {
+        if (i > first) putchar(' ');
+        if (escapes) {
+            if (putEscaped(cmd->argv[i], 1)) return 0;
+        } else {
+            fputs(cmd->argv[i], stdout);
+        }
+    }
+    if (newline) putchar('\n');
+
+    return ferror(stdout) ? 1 : 0;
+}
+
+/* Convert a printf argument to a number. A leading quote gives the
+ * code of the character after it. Sets *status on a bad number. */
+static long long printfInteger(const char *arg, int *status) {
+    char *end;
+    long long value;
+
+    if (arg == NULL || *arg == '\0') return 0;
+    if (*arg == '\'' || *arg == '"') return (unsigned char)arg[1];
+
+    errno = 0;
+    value = strtoll(arg, &end, 0);
+    if (*end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+static double printfDouble(const char *arg, int *status) {
+    char *end;
+    double value;
+
+    if (arg == NULL || *arg == '\0') return 0;
+    if (*arg == '\'' || *arg == '"') return (unsigned char)arg[1];
+
+    value = strtod(arg, &end);
+    if (*end != '\0') {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+/* printf format [arg ...]
+ * The format is reused as long as arguments are left. */
+int builtInPrintf(struct Command_struct *cmd) {
+    const char *format;
+    char **args;
+    int nargs;
+    int next = 0;
+    int status = 0;
+    int stop = 0;
+
+    if (cmd->argc < 2) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    format = cmd->argv[1];
+    args = cmd->argv + 2;
+    nargs = cmd->argc - 2;
+
+    do {
+        const char *p = format;
+        int used = next;
+
+        while (*p && !stop) {
+            char spec[64];
+            size_t len = 0;
+            const char *arg;
+
+            if (*p == '\\') {
+                p = putEscape(p + 1, 0, &stop);
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p++);
+                continue;
+            }
+            p++;
+            if (*p == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            /* Copy flags, width and precision into a format for printf(3),
+             * taking * from the arguments */
+            spec[len++] = '%';
+            while (*p && strchr("-+ #0", *p) && len < 20) spec[len++] = *p++;
+            if (*p == '*') {
+                len += snprintf(spec + len, sizeof(spec) - len, "%d",
+                                (int)printfInteger(next < nargs ? args[next++] : NULL, &status));
+                p++;
+            } else {
+                while (isdigit((unsigned char)*p) && len < 40) spec[len++] = *p++;
+            }
+            if (*p == '.') {
+                spec[len++] = *p++;
+                if (*p == '*') {
+                    len += snprintf(spec + len, sizeof(spec) - len, "%d",
+                                    (int)printfInteger(next < nargs ? args[next++] : NULL, &status));
+                    p++;
+                } else {
+                    while (isdigit((unsigned char)*p) && len < 60) spec[len++] = *p++;
+                }
+            }
+
+            arg = next < nargs ? args[next++] : NULL;
+
+            switch (*p) {
+            case 'd':
+            case 'i':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = *p;
+                spec[len] = '\0';
+                printf(spec, printfInteger(arg, &status));
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = *p;
+                spec[len] = '\0';
+                printf(spec, (unsigned long long)printfInteger(arg, &status));
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                spec[len++] = *p;
+                spec[len] = '\0';
+                printf(spec, printfDouble(arg, &status));
+                break;
+            case 'c':
+                spec[len++] = 'c';
+                spec[len] = '\0';
+                printf(spec, arg ? arg[0] : '\0');
+                break;
+            case 's':
+                spec[len++] = 's';
+                spec[len] = '\0';
+                printf(spec, arg ? arg : "");
+                break;
+            case 'b':
+                /* Escapes in the argument are interpreted, like echo -e */
+                if (arg != NULL && putEscaped(arg, 1)) stop = 1;
+                break;
+            default:
+                fprintf(stderr, "printf: %%%c: invalid format character\n", *p ? *p : ' ');
+                return 1;
+            }
+            p++;
+        }
+
+        /* A format that takes no arguments is not repeated */
+        if (next == used) break;
+    } while (next < nargs && !stop);
+
+    if (ferror(stdout)) status = 1;
+    return status;
+}
+
+/* State of a test expression being evaluated */
+struct TestState {
+    char **argv;
+    int argc;
+    int pos;
+    int error;
+    const char *name;
+};
+
+static int isUnaryTest(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+           strchr("bcdefghknprsStuwxzLOG", op[1]) != NULL;
+}
+
+static int isBinaryTest(const char *op) {
+    static const char *ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef", NULL
+    };
+    int i;
+
+    for (i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Convert an integer operand of test */
+static long long testInteger(struct TestState *ts, const char *s) {
+    char *end;
+    long long value;
+
+    while (isspace((unsigned char)*s)) s++;
+    errno = 0;
+    value = strtoll(s, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (*s == '\0' || *end != '\0' || errno != 0) {
+        fprintf(stderr, "%s: %s: integer expression expected\n", ts->name, s);
+        ts->error = 1;
+        return 0;
+    }
+    return value;
+}
+
+static int testUnary(char op, const char *arg) {
+    struct stat st;
+
+    switch (op) {
+    case 'z': return arg[0] == '\0';
+    case 'n': return arg[0] != '\0';
+    case 't': return isatty(atoi(arg));
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+
+    if (stat(arg, &st) != 0) {
+        return 0;
+    }
+    switch (op) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'e': return 1;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+    }
+    return 0;
+}
+
+static int testBinary(struct TestState *ts, const char *a, const char *op, const char *b) {
+    struct stat sa, sb;
+    int ra, rb;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+
+    if (op[1] == 'e' && op[2] == 'q') return testInteger(ts, a) == testInteger(ts, b);
+    if (op[1] == 'n' && op[2] == 'e') return testInteger(ts, a) != testInteger(ts, b);
+    if (op[1] == 'l' && op[2] == 't') return testInteger(ts, a) < testInteger(ts, b);
+    if (op[1] == 'l' && op[2] == 'e') return testInteger(ts, a) <= testInteger(ts, b);
+    if (op[1] == 'g' && op[2] == 't') return testInteger(ts, a) > testInteger(ts, b);
+    if (op[1] == 'g' && op[2] == 'e') return testInteger(ts, a) >= testInteger(ts, b);
+
+    /* -nt, -ot, -ef */
+    ra = stat(a, &sa);
+    rb = stat(b, &sb);
+    if (op[1] == 'e') {
+        return ra == 0 && rb == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+    if (op[1] == 'n') {
+        return ra == 0 && (rb != 0 || sa.st_mtime > sb.st_mtime);
+    }
+    return rb == 0 && (ra != 0 || sa.st_mtime < sb.st_mtime);
+}
+
+static int testOr(struct TestState *ts);
+
+/* primary: '(' expr ')' | arg binop arg | unop arg | arg */
+static int testPrimary(struct TestState *ts) {
+    char **argv = ts->argv;
+    int left = ts->argc - ts->pos;
+    int result;
+
+    if (left <= 0) {
+        fprintf(stderr, "%s: argument expected\n", ts->name);
+        ts->error = 1;
+        return 0;
+    }
+
+    /* A binary operator in second place wins, so [ "$x" = -n ] works */
+    if (left >= 3 && isBinaryTest(argv[ts->pos + 1])) {
+        result = testBinary(ts, argv[ts->pos], argv[ts->pos + 1], argv[ts->pos + 2]);
+        ts->pos += 3;
+        return result;
+    }
+    if (left >= 2 && isUnaryTest(argv[ts->pos])) {
+        result = testUnary(argv[ts->pos][1], argv[ts->pos + 1]);
+        ts->pos += 2;
+        return result;
+    }
+    if (left >= 3 && strcmp(argv[ts->pos], "(") == 0) {
+        ts->pos++;
+        result = testOr(ts);
+        if (ts->pos >= ts->argc || strcmp(argv[ts->pos], ")") != 0) {
+            fprintf(stderr, "%s: `)' expected\n", ts->name);
+            ts->error = 1;
+            return 0;
+        }
+        ts->pos++;
+        return result;
+    }
+
+    /* A lone string is true if it is not empty */
+    return argv[ts->pos++][0] != '\0';
+}
+
+/* not: '!' not | primary */
+static int testNot(struct TestState *ts) {
+    if (ts->pos < ts->argc - 1 && strcmp(ts->argv[ts->pos], "!") == 0 &&
+        !(ts->argc - ts->pos == 3 && isBinaryTest(ts->argv[ts->pos + 1]))) {
+        ts->pos++;
+        return !testNot(ts);
+    }
+    return testPrimary(ts);
+}
+
+/* and: not ('-a' not)* */
+static int testAnd(struct TestState *ts) {
+    int result = testNot(ts);
+
+    while (ts->pos < ts->argc && strcmp(ts->argv[ts->pos], "-a") == 0) {
+        ts->pos++;
+        result = testNot(ts) && result;
+    }
+    return result;
+}
+
+/* expr: and ('-o' and)* */
+static int testOr(struct TestState *ts) {
+    int result = testAnd(ts);
+
+    while (ts->pos < ts->argc && strcmp(ts->argv[ts->pos], "-o") == 0) {
+        ts->pos++;
+        result = testAnd(ts) || result;
+    }
+    return result;
+}
+
+/* test expr, or [ expr ]. Returns 0 for true, 1 for false and 2 on
+ * an error in the expression. */
+int builtInTest(struct Command_struct *cmd) {
+    struct TestState ts;
+    int result;
+
+    ts.argv = cmd->argv;
+    ts.argc = cmd->argc;
+    ts.pos = 1;
+    ts.error = 0;
+    ts.name = cmd->argv[0];
+
+    if (strcmp(cmd->argv[0], "[") == 0) {
+        if (strcmp(cmd->argv[cmd->argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        ts.argc--;
+    }
+
+    /* No expression is false */
+    if (ts.argc <= 1) {
+        return 1;
+    }
+
+    result = testOr(&ts);
+    if (!ts.error && ts.pos < ts.argc) {
+        fprintf(stderr, "%s: %s: unexpected argument\n", ts.name, ts.argv[ts.pos]);
+        ts.error = 1;
+    }
+    if (ts.error) {
+        return 2;
+    }
+    return result ? 0 : 1;
+}
+
+/* Read one line from standard input, without the newline, and without
+ * reading past it so that the next command gets the rest of the input.
+ * Returns 0 at end of input. */
+static int readInputLine(struct StrBuf *line) {
+    char buf[4096];
+    off_t pos = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    ssize_t n;
+    char *nl;
+    char c;
+
+    if (pos >= 0) {
+        /* A file: read a block, then seek back to just after the line */
+        for (;;) {
+            n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return 0;
+            nl = memchr(buf, '\n', n);
+            if (nl != NULL) {
+                sbAppend(line, buf, nl - buf);
+                lseek(STDIN_FILENO, pos + (nl - buf) + 1, SEEK_SET);
+                return 1;
+            }
+            sbAppend(line, buf, n);
+            pos += n;
+        }
+    }
+
+    /* Pipes and terminals cannot be rewound, so one byte at a time */
+    for (;;) {
+        n = read(STDIN_FILENO, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        if (c == '\n') return 1;
+        sbAppendChar(line, c);
+    }
+}
+
+/* read [-r] [-p prompt] [name ...]
+ * Splits a line of input on IFS into the variables; the last one gets
+ * the rest of the line. Without names the line goes into REPLY. */
+int builtInRead(struct Command_struct *cmd) {
+    static char *reply[] = { "REPLY", NULL };
+    struct StrBuf line;
+    struct StrBuf quoted;    /* 1 for each character escaped with a backslash */
+    const char *ifs;
+    char **names;
+    int raw = 0;
+    int got_line;
+    size_t pos, start, end;
+    int i = 1;
+
+    while (i < cmd->argc && cmd->argv[i][0] == '-' && cmd->argv[i][1] != '\0') {
+        if (strcmp(cmd->argv[i], "-r") == 0) {
+            raw = 1;
+        } else if (strcmp(cmd->argv[i], "-p") == 0 && i + 1 < cmd->argc) {
+            fputs(cmd->argv[++i], stderr);
+        } else if (strcmp(cmd->argv[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            fprintf(stderr, "read: %s: invalid option\n", cmd->argv[i]);
+            return 2;
+        }
+        i++;
+    }
+    names = i < cmd->argc ? cmd->argv + i : reply;
+    for (i = 0; names[i] != NULL; i++) {
+        if (!isValidName(names[i], strlen(names[i]))) {
+            fprintf(stderr, "read: `%s': not a valid identifier\n", names[i]);
+            return 1;
+        }
+    }
+
+    sbInit(&line);
+    sbInit(&quoted);
+    sbAppend(&line, "", 0);
+    sbAppend(&quoted, "", 0);
+
+    /* Without -r a backslash quotes the next character and a backslash
+     * at the end of a line continues it on the next */
+    for (;;) {
+        struct StrBuf part;
+        size_t j;
+
+        sbInit(&part);
+        got_line = readInputLine(&part);
+        for (j = 0; j < part.len; j++) {
+            if (!raw && part.data[j] == '\\') {
+                if (j + 1 == part.len) break;
+                sbAppendChar(&line, part.data[++j]);
+                sbAppendChar(&quoted, 1);
+            } else {
+                sbAppendChar(&line, part.data[j]);
+                sbAppendChar(&quoted, 0);
+            }
+        }
+        if (raw || !got_line || part.len == 0 || j == part.len) {
+            sbFree(&part);
+            break;
+        }
+        sbFree(&part);
+    }
+
+    ifs = getVar("IFS");
+    if (ifs == NULL) ifs = " \t\n";
+#define IS_IFS(k) (!quoted.data[k] && line.data[k] != '\0' && strchr(ifs, line.data[k]) != NULL)
+#define IS_IFS_SPACE(k) (IS_IFS(k) && isspace((unsigned char)line.data[k]))
+
+    pos = 0;
+    for (i = 0; names[i] != NULL; i++) {
+        /* Leading IFS white space is skipped */
+        while (pos < line.len && IS_IFS_SPACE(pos)) pos++;
+        start = pos;
+
+        if (names[i + 1] == NULL) {
+            /* The last variable gets the rest, less trailing white space */
+            end = line.len;
+            while (end > start && IS_IFS_SPACE(end - 1)) end--;
+        } else {
+            while (pos < line.len && !IS_IFS(pos)) pos++;
+            end = pos;
+            /* One non-white-space separator ends the field as well */
+            while (pos < line.len && IS_IFS_SPACE(pos)) pos++;
+            if (pos < line.len && IS_IFS(pos) && !IS_IFS_SPACE(pos)) pos++;
+        }
+
+        line.data[end] = '\0';
+        setVar(names[i], line.data + start, 0);
+        pos = end + 1 > pos ? end + 1 : pos;
+        if (pos > line.len) pos = line.len;
+    }
+#undef IS_IFS
+#undef IS_IFS_SPACE
+
+    sbFree(&line);
+    sbFree(&quoted);
+
+    /* End of input is failure even if part of a line was read */
+    return got_line ? 0 : 1;
+}
+
+/* Signal names for kill */
+static const struct {
+    const char *name;
+    int number;
+} signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "ILL", SIGILL },
+    { "TRAP", SIGTRAP }, { "ABRT", SIGABRT }, { "BUS", SIGBUS }, { "FPE", SIGFPE },
+    { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 },
+    { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "CHLD", SIGCHLD },
+    { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN },
+    { "TTOU", SIGTTOU }, { "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ },
+    { "VTALRM", SIGVTALRM }, { "PROF", SIGPROF }, { "WINCH", SIGWINCH }, { "IO", SIGIO },
+    { "SYS", SIGSYS }, { NULL, 0 }
+};
+
+/* Convert a signal name, with or without SIG, or number; -1 if unknown */
+static int signalNumber(const char *s) {
+    char *end;
+    long n;
+    int i;
+
+    if (isdigit((unsigned char)*s)) {
+        n = strtol(s, &end, 10);
+        return (*end == '\0' && n < NSIG) ? (int)n : -1;
+    }
+    if (strncasecmp(s, "SIG", 3) == 0) {
+        s += 3;
+    }
+    for (i = 0; signal_names[i].name != NULL; i++) {
+        if (strcasecmp(s, signal_names[i].name) == 0) {
+            return signal_names[i].number;
+        }
+    }
+    return -1;
+}
+
+/* kill [-s sig | -sig] pid ..., or kill -l [status] */
+int builtInKill(struct Command_struct *cmd) {
+    int sig = SIGTERM;
+    int status = 0;
+    int i = 1;
+
+    if (cmd->argc < 2) {
+        fprintf(stderr, "kill: usage: kill [-s sigspec | -sigspec] pid ... or kill -l [sigspec]\n");
+        return 2;
+    }
+
+    if (strcmp(cmd->argv[1], "-l") == 0) {
+        if (cmd->argc > 2) {
+            int n = atoi(cmd->argv[2]);
+            int j;
+            if (n > 128) n -= 128;
+            for (j = 0; signal_names[j].name != NULL; j++) {
+                if (signal_names[j].number == n) {
+                    printf("%s\n", signal_names[j].name);
+                    return 0;
+                }
+            }
+            fprintf(stderr, "kill: %s: invalid signal specification\n", cmd->argv[2]);
+            return 1;
+        }
+        for (i = 0; signal_names[i].name != NULL; i++) {
+            printf("%2d) SIG%s\n", signal_names[i].number, signal_names[i].name);
+        }
+        return 0;
+    }
+
+    if (strcmp(cmd->argv[1], "-s") == 0 || strcmp(cmd->argv[1], "-n") == 0) {
+        if (cmd->argc < 3 || (sig = signalNumber(cmd->argv[2])) < 0) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n",
+                    cmd->argc < 3 ? "" : cmd->argv[2]);
+            return 1;
+        }
+        i = 3;
+    } else if (cmd->argv[1][0] == '-' && cmd->argv[1][1] != '-' &&
+               !isdigit((unsigned char)cmd->argv[1][1])) {
+        if ((sig = signalNumber(cmd->argv[1] + 1)) < 0) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n", cmd->argv[1] + 1);
+            return 1;
+        }
+        i = 2;
+    } else if (cmd->argv[1][0] == '-' && isdigit((unsigned char)cmd->argv[1][1])) {
+        sig = signalNumber(cmd->argv[1] + 1);
+        if (sig < 0) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n", cmd->argv[1] + 1);
+            return 1;
+        }
+        i = 2;
+    }
+    if (i < cmd->argc && strcmp(cmd->argv[i], "--") == 0) {
+        i++;
+    }
+
+    for (; i < cmd->argc; i++) {
+        char *end;
+        long pid = strtol(cmd->argv[i], &end, 10);
+
+        if (*cmd->argv[i] == '\0' || *end != '\0') {
+            fprintf(stderr, "kill: %s: arguments must be process IDs\n", cmd->argv[i]);
+            status = 1;
+        } else if (kill((pid_t)pid, sig) < 0) {
+            fprintf(stderr, "kill: (%ld) - %s\n", pid, strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,327 @@
+#include "shell.h"
+#include <ctype.h>
+
+extern char **environ;
+
+/* A shell variable. The whole "NAME=value" string is kept in one
+ * allocation so exported variables can go into envp as they are. */
+struct Var {
+    char *entry;       /* "NAME=value"; the value starts after the '=' */
+    size_t name_len;
+    size_t cap;        /* bytes allocated for entry */
+    int flags;         /* VAR_SET, VAR_EXPORT */
+};
+
+/* Variables live in slots that never move or get reused, so a slot
+ * number stays valid for the life of the shell context. The table and
+ * its index are in the context (shell->vars and shell->var_table); the
+ * exported environment built from it is cached there too. */
+
+/* FNV-1a hash of a name */
+static size_t hashName(const char *name, size_t len) {
+    size_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Check if name[0..len) is a valid variable name */
+int isValidName(const char *name, size_t len) {
+    size_t i;
+
+    if (len == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if (!(isalnum((unsigned char)name[i]) || name[i] == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Check if a word as written is an assignment, NAME=... */
+int isAssignment(const char *word) {
+    const char *eq = strchr(word, '=');
+    return eq != NULL && isValidName(word, eq - word);
+}
+
+/* Double the index and re-insert every slot */
+static void growTable(void) {
+    size_t new_size = shell->table_size ? shell->table_size * 2 : 64;
+    int *new_table = calloc(new_size, sizeof(int));
+    int i;
+
+    if (new_table == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (i = 0; i < shell->var_count; i++) {
+        size_t h = hashName(shell->vars[i].entry, shell->vars[i].name_len) & (new_size - 1);
+        while (new_table[h] != 0) {
+            h = (h + 1) & (new_size - 1);
+        }
+        new_table[h] = i + 1;
+    }
+
+    free(shell->var_table);
+    shell->var_table = new_table;
+    shell->table_size = new_size;
+}
+
+/* Find the slot of a variable, creating an unset one if create is set.
+ * Returns -1 if the variable does not exist and create is 0. */
+int findVar(const char *name, size_t len, int create) {
+    size_t h;
+    struct Var *v;
+
+    if (shell->table_size == 0) {
+        if (!create) return -1;
+        growTable();
+    }
+
+    h = hashName(name, len) & (shell->table_size - 1);
+    while (shell->var_table[h] != 0) {
+        v = &shell->vars[shell->var_table[h] - 1];
+        if (v->name_len == len && memcmp(v->entry, name, len) == 0) {
+            return shell->var_table[h] - 1;
+        }
+        h = (h + 1) & (shell->table_size - 1);
+    }
+
+    if (!create) return -1;
+
+    /* Keep the load factor at or below one half */
+    if ((size_t)(shell->var_count + 1) * 2 > shell->table_size) {
+        growTable();
+        return findVar(name, len, create);
+    }
+
+    if (shell->var_count == shell->var_capacity) {
+        int new_capacity = shell->var_capacity ? shell->var_capacity * 2 : 64;
+        struct Var *new_vars = realloc(shell->vars, new_capacity * sizeof(struct Var));
+        if (new_vars == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        shell->vars = new_vars;
+        shell->var_capacity = new_capacity;
+    }
+
+    v = &shell->vars[shell->var_count];
+    v->cap = len + 2;
+    v->entry = malloc(v->cap);
+    if (v->entry == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(v->entry, name, len);
+    v->entry[len] = '=';
+    v->entry[len + 1] = '\0';
+    v->name_len = len;
+    v->flags = 0;
+
+    shell->var_table[h] = shell->var_count + 1;
+    return shell->var_count++;
+}
+
+/* Get the value in a slot, NULL if unset */
+const char *getVarSlot(int slot) {
+    if (slot < 0 || !(shell->vars[slot].flags & VAR_SET)) {
+        return NULL;
+    }
+    return shell->vars[slot].entry + shell->vars[slot].name_len + 1;
+}
+
+/* Set the value in a slot. The entry is rewritten in place when it
+ * fits, which leaves the exported environment valid as it is. */
+void setVarSlot(int slot, const char *value, size_t len) {
+    struct Var *v = &shell->vars[slot];
+    char *old_value = v->entry + v->name_len + 1;
+    size_t need = v->name_len + len + 2;
+
+    /* Unchanged values do not touch the environment */
+    if ((v->flags & VAR_SET) && strlen(old_value) == len &&
+        memcmp(old_value, value, len) == 0) {
+        return;
+    }
+
+    if (need > v->cap) {
+        size_t new_cap = v->cap * 2 > need ? v->cap * 2 : need;
+        char *new_entry = realloc(v->entry, new_cap);
+        if (new_entry == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        v->entry = new_entry;
+        v->cap = new_cap;
+
+        /* envp holds the old pointer */
+        if (v->flags & VAR_EXPORT) {
+            shell->env_dirty = 1;
+        }
+    }
+
+    memcpy(v->entry + v->name_len + 1, value, len);
+    v->entry[v->name_len + 1 + len] = '\0';
+
+    if (!(v->flags & VAR_SET) && (v->flags & VAR_EXPORT)) {
+        shell->env_dirty = 1;
+    }
+    v->flags |= VAR_SET;
+}
+
+/* Get the value of a variable, NULL if unset */
+const char *getVar(const char *name) {
+    return getVarSlot(findVar(name, strlen(name), 0));
+}
+
+/* Set a variable, adding flags to it */
+void setVar(const char *name, const char *value, int flags) {
+    int slot = findVar(name, strlen(name), 1);
+
+    setVarSlot(slot, value, strlen(value));
+    exportVar(name, flags & VAR_EXPORT);
+}
+
+/* Set a variable from a "NAME=value" assignment */
+void assignVar(const char *assignment, int flags) {
+    const char *eq = strchr(assignment, '=');
+    int slot;
+
+    if (eq == NULL) return;
+    slot = findVar(assignment, eq - assignment, 1);
+    setVarSlot(slot, eq + 1, strlen(eq + 1));
+    if (flags & VAR_EXPORT) {
+        exportVar(assignment, 1);
+    }
+}
+
+/* Mark a variable for export; name may be followed by "=value" */
+void exportVar(const char *name, int export) {
+    const char *eq = strchr(name, '=');
+    size_t len = eq ? (size_t)(eq - name) : strlen(name);
+    int slot;
+
+    if (!export) return;
+
+    slot = findVar(name, len, 1);
+    if (!(shell->vars[slot].flags & VAR_EXPORT)) {
+        shell->vars[slot].flags |= VAR_EXPORT;
+        if (shell->vars[slot].flags & VAR_SET) {
+            shell->env_dirty = 1;
+        }
+    }
+}
+
+/* Remove the value in a slot. The slot itself stays. */
+void unsetVarSlot(int slot) {
+    if ((shell->vars[slot].flags & VAR_EXPORT) && (shell->vars[slot].flags & VAR_SET)) {
+        shell->env_dirty = 1;
+    }
+    shell->vars[slot].flags = 0;
+    shell->vars[slot].entry[shell->vars[slot].name_len + 1] = '\0';
+}
+
+/* Remove a variable */
+void unsetVar(const char *name) {
+    int slot = findVar(name, strlen(name), 0);
+
+    if (slot >= 0) {
+        unsetVarSlot(slot);
+    }
+}
+
+/* Get the environment for a new process. The array is shared by every
+ * spawn and only rebuilt after an exported variable was added, removed
+ * or moved. */
+char **shellEnviron(void) {
+    int i, n = 0;
+
+    if (!shell->env_dirty) {
+        return shell->env_array;
+    }
+
+    for (i = 0; i < shell->var_count; i++) {
+        if ((shell->vars[i].flags & VAR_EXPORT) && (shell->vars[i].flags & VAR_SET)) {
+            n++;
+        }
+    }
+
+    if (n + 1 > shell->env_capacity) {
+        char **new_array = realloc(shell->env_array, (n + 1) * sizeof(char *));
+        if (new_array == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        shell->env_array = new_array;
+        shell->env_capacity = n + 1;
+    }
+
+    n = 0;
+    for (i = 0; i < shell->var_count; i++) {
+        if ((shell->vars[i].flags & VAR_EXPORT) && (shell->vars[i].flags & VAR_SET)) {
+            shell->env_array[n++] = shell->vars[i].entry;
+        }
+    }
+    shell->env_array[n] = NULL;
+
+    shell->env_dirty = 0;
+    return shell->env_array;
+}
+
+/* Print exported variables in a form that can be read back: values in
+ * single quotes, where nothing is special but the quote itself */
+void printExports(void) {
+    const char *p;
+    int i;
+
+    for (i = 0; i < shell->var_count; i++) {
+        if ((shell->vars[i].flags & VAR_EXPORT) && (shell->vars[i].flags & VAR_SET)) {
+            printf("export %.*s='", (int)shell->vars[i].name_len, shell->vars[i].entry);
+            for (p = shell->vars[i].entry + shell->vars[i].name_len + 1; *p; p++) {
+                if (*p == '\'') {
+                    fputs("'\\''", stdout);
+                } else {
+                    putchar(*p);
+                }
+            }
+            fputs("'\n", stdout);
+        }
+    }
+}
+
+/* Import the process environment into the variable table */
+void initVars(void) {
+    char **e;
+
+    for (e = environ; *e != NULL; e++) {
+        const char *eq = strchr(*e, '=');
+        if (eq != NULL && isValidName(*e, eq - *e)) {
+            assignVar(*e, VAR_EXPORT);
+        }
+    }
+}
+
+/* Free every variable of the current context */
+void freeVars(void) {
+    int i;
+
+    for (i = 0; i < shell->var_count; i++) {
+        free(shell->vars[i].entry);
+    }
+    free(shell->vars);
+    free(shell->var_table);
+    free(shell->env_array);
+    shell->vars = NULL;
+    shell->var_table = NULL;
+    shell->env_array = NULL;
+    shell->var_count = shell->var_capacity = shell->env_capacity = 0;
+    shell->table_size = 0;
+    shell->env_dirty = 1;
+}